@@ -18,43 +18,19 @@
 #include <sys/sem.h>
 #include <sys/shm.h>
 #include <time.h>
+#include <cerrno>
+#include "p3pack.hpp"
+#include "p3msg.hpp"
+#include "p3lock.hpp"
 
 using namespace std;
 
 #define SERVER -1L
-#define BSIZE 10
-#define LOGSIZE 256
 #define SERVER_ADDR "156.12.127.18"
 //#define SERVER_ADDR "127.0.0.1"
 #define PORT 15003
 #define MAX_CLI 30
-
-/** 
- * message struct used for cli/ser communication
- */
-typedef struct {
-  /** type of msg */
-  long msg_type;
-  /** sender pid */
-  pid_t sender;
-  /** request id */
-  int request;
-  /** data buffer */
-  int buffer[BSIZE]; 
-  
-} MESSAGE;
-
-/**
- * used for sending log file info to client
- */
-typedef struct {
-  /** type of msg */
-  long msg_type;
-  /** sender pid */
-  pid_t sender;
-  /** log msg buffer */
-  char buffer[LOGSIZE];
-} LOGMSG;
+#define MAX_WORKERS 64
 
 /**
  * contains info about 1 client 
@@ -83,34 +59,107 @@ typedef struct {
   //FILE *logfile;
 } CLI_DAT;
 
+/**
+ * one prefork worker process of the server
+ */
+typedef struct {
+  /** worker's PID, 0 while it is being restarted */
+  pid_t pid;
+  /** clients this worker is serving right now */
+  int active;
+  /** clients served since the worker started */
+  long served;
+  /** times this slot's worker has been restarted */
+  int restarts;
+  /** when the current worker started */
+  time_t started;
+} WORKER;
+
+/**
+ * in shared memory, stores the server's prefork worker pool
+ */
+typedef struct {
+  /** number of workers */
+  int num_workers;
+  /** array of workers */
+  WORKER worker[MAX_WORKERS];
+} POOL;
+
 // documented in respective cli / ser files
 void removeQueue(int);
-int getNumRecords();
+long long getNumRecords();
 void sendMessage(MESSAGE *);
 void sendMessage(LOGMSG);
 void displayRecord(MESSAGE);
 void createRecord(MESSAGE);
 void modifyRecord(MESSAGE);
+void deleteRecord(MESSAGE);
 void showLog(MESSAGE);
 void closeHandler(int);
 MESSAGE clearMsg();
 
-// wait()
+/**
+ * @brief reads exactly len bytes from a socket
+ * @return false on error or if the peer closed the connection
+ */
+bool readFull(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  while(len > 0) {
+	ssize_t n = read(fd, p, len);
+	if(n < 0 && errno == EINTR) continue;
+	if(n <= 0) return false;
+	p += n;
+	len -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief writes exactly len bytes to a socket
+ * @return false on error
+ */
+bool writeFull(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  while(len > 0) {
+	ssize_t n = write(fd, p, len);
+	if(n < 0 && errno == EINTR) continue;
+	if(n <= 0) return false;
+	p += n;
+	len -= n;
+  }
+  return true;
+}
+
+/** set by the server while it traces a request (see p3trace.hpp): P()
+ * passes when it began waiting, V() passes NULL */
+void (*semTrace)(key_t, int, const struct timespec *) = NULL;
+
+// wait(), on lock num of a set from lockGet (p3lock.hpp)
 void P(key_t id, int num) {
-  struct sembuf semCmd;
-  semCmd.sem_num=num;
-  semCmd.sem_op=-1;
-  semCmd.sem_flg=SEM_UNDO;
-  semop(id,&semCmd,1);
+  struct timespec waited;
+  if(semTrace) clock_gettime(CLOCK_MONOTONIC, &waited);
+  lockTake(id, num);
+  if(semTrace) semTrace(id, num, &waited);
 }
 
 // signal()
 void V(key_t id, int num) {
-  struct sembuf semCmd;
-  semCmd.sem_num=num;
-  semCmd.sem_op=1;
-  semCmd.sem_flg=0;
-  semop(id,&semCmd,1);
+  lockGive(id, num);
+  if(semTrace) semTrace(id, num, NULL);
+}
+
+// wait() for a reader: readers hold the lock together, P() waits for them
+void PR(key_t id, int num) {
+  struct timespec waited;
+  if(semTrace) clock_gettime(CLOCK_MONOTONIC, &waited);
+  lockShare(id, num);
+  if(semTrace) semTrace(id, num, &waited);
+}
+
+// signal() for a reader
+void VR(key_t id, int num) {
+  lockUnshare(id, num);
+  if(semTrace) semTrace(id, num, NULL);
 }
 
 #endif
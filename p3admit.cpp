@@ -0,0 +1,184 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3admit.cpp
+ * @brief      token buckets, scan slots and busy replies
+ */
+#include "p3admit.hpp"
+#include "p3msg.hpp"
+#include "p3trace.hpp"
+#include "p3lock.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+
+/** semaphore holding the free scan slots */
+static int slots = -1;
+/** clients' buckets, in shared memory */
+static ADMITCLIENT *clients = NULL;
+/** lock over the clients' buckets */
+static int clientLock = -1;
+/** rates new buckets start with */
+static double pointRate = 0, scanRate = 0;
+
+/**
+ * @brief monotonic clock in seconds
+ */
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void bucketInit(BUCKET *b, double rate) {
+  b->rate = rate;
+  b->burst = rate > 1 ? rate : 1;
+  b->tokens = b->burst;
+  b->last = now();
+}
+
+int bucketTake(BUCKET *b) {
+  if(b->rate <= 0)
+	return 0;
+  double t = now();
+  b->tokens += (t - b->last) * b->rate;
+  if(b->tokens > b->burst)
+	b->tokens = b->burst;
+  b->last = t;
+  if(b->tokens >= 1) {
+	b->tokens--;
+	return 0;
+  }
+  return (int)((1 - b->tokens) / b->rate * 1000) + 1;
+}
+
+bool admitCreate(int n, double point, double scan) {
+  pointRate = point;
+  scanRate = scan;
+  if((slots = semget(IPC_PRIVATE, 1, 0600|IPC_CREAT)) < 0)
+	return false;
+  traceName(slots, -1, "scan slot");
+  if(semctl(slots, 0, SETVAL, n) != 0)
+	return false;
+  if(point <= 0 && scan <= 0)
+	return true; // nothing to count
+  int id = shmget(IPC_PRIVATE, ADMIT_TABLE * sizeof(ADMITCLIENT), IPC_CREAT | 0600);
+  if(id < 0)
+	return false;
+  clients = (ADMITCLIENT *)shmat(id, 0, 0);
+  shmctl(id, IPC_RMID, 0); // goes away with the last process
+  if(clients == (void *)-1) {
+	clients = NULL;
+	return false;
+  }
+  memset(clients, 0, ADMIT_TABLE * sizeof(ADMITCLIENT));
+  if((clientLock = lockGet(IPC_PRIVATE, 1, IPC_CREAT | 0600)) < 0)
+	return false;
+  traceName(clientLock, -1, "client buckets");
+  lockGive(clientLock, 0);
+  return true;
+}
+
+void admitClose() {
+  if(slots >= 0)
+	semctl(slots, 0, IPC_RMID);
+  if(clientLock >= 0)
+	lockRemove(clientLock);
+}
+
+/**
+ * @brief true once an idle bucket would have filled up again, so that
+ * forgetting it changes nothing
+ */
+static bool full(const BUCKET *b, double t) {
+  return b->rate <= 0 || b->tokens + (t - b->last) * b->rate >= b->burst;
+}
+
+/**
+ * @brief when a client's buckets were last drawn on
+ */
+static double lastUse(const ADMITCLIENT *e) {
+  return e->point.last > e->scan.last ? e->point.last : e->scan.last;
+}
+
+/**
+ * @brief the client's entry, claimed if it has none. A client's entry is
+ * one of the ADMIT_PROBE after its key's hash: a free one or one whose
+ * buckets have filled up again, or else the one idle longest. Caller holds
+ * clientLock.
+ */
+static ADMITCLIENT *findClient(uint64_t key, double t) {
+  ADMITCLIENT *spare = NULL, *idle = NULL;
+  size_t h = (key * 0x9e3779b97f4a7c15ULL) >> 40;
+  for(int i=0; i < ADMIT_PROBE; i++) {
+	ADMITCLIENT *e = &clients[(h + i) % ADMIT_TABLE];
+	if(e->key == key)
+	  return e;
+	if(spare == NULL && (e->key == 0 || (full(&e->point, t) && full(&e->scan, t))))
+	  spare = e;
+	if(idle == NULL || lastUse(e) < lastUse(idle))
+	  idle = e;
+  }
+  if(spare == NULL)
+	spare = idle;
+  spare->key = key;
+  bucketInit(&spare->point, pointRate);
+  bucketInit(&spare->scan, scanRate);
+  return spare;
+}
+
+int admitTake(uint64_t client, bool scan) {
+  if(clients == NULL || (scan ? scanRate : pointRate) <= 0)
+	return 0;
+  lockTake(clientLock, 0);
+  ADMITCLIENT *e = findClient(client, now());
+  int wait = bucketTake(scan ? &e->scan : &e->point);
+  lockGive(clientLock, 0);
+  return wait;
+}
+
+/**
+ * @brief adds op to the free slots (SEM_UNDO: a dying child gives its slot back)
+ */
+static void slotOp(int op) {
+  struct sembuf s = {0, (short)op, SEM_UNDO};
+  long long t = traceStart();
+  while(semop(slots, &s, 1) < 0 && errno == EINTR) ;
+  if(op < 0) traceLock(slots, 0, t);
+  else traceUnlock(slots, 0);
+}
+
+void scanEnter() {
+  slotOp(-1);
+}
+
+void scanYield() {
+  if(semctl(slots, 0, GETNCNT) > 0) { // someone is waiting, let it have a turn
+	slotOp(1);
+	slotOp(-1);
+  }
+}
+
+void scanLeave() {
+  slotOp(1);
+}
+
+void admitReject(int fd) {
+  MESSAGE msg;
+  memset(&msg, 0, sizeof(MESSAGE));
+  msg.msg_type = 1;
+  msg.sender = getpid();
+  msg.request = ADMIT_BUSY;
+  msg.buffer[0] = ADMIT_RETRY;
+  msg.buffer[1] = 1; // closing
+  send(fd, &msg, sizeof(MESSAGE), MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+  // closing with the client's hello unread would reset the connection and
+  // could lose the reply, so read what has arrived first
+  char drain[256];
+  while(recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) ;
+  close(fd);
+}
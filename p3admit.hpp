@@ -0,0 +1,129 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3admit.hpp
+ * @brief      admission control: connection limits, per-client rate limits
+ *             and turns for expensive scans
+ *
+ * A server that is full answers a new connection with a busy reply and
+ * closes it, instead of forking for it. Each client has one token bucket
+ * for point requests (create, display one, modify, delete, count) and one
+ * for scans (-999 dumps, log views), kept in shared memory by its address
+ * and pid so that all its connections draw on the same two; a request
+ * with no token left is answered busy too, and the connection stays open. Scans also take one of
+ * a few server-wide scan slots, and give it up between chunks so that
+ * several clients dumping at once take turns. Point requests never wait for
+ * a slot, so at most that many scans compete with them for the machine.
+ */
+#ifndef P3ADMITHEADER
+#define P3ADMITHEADER
+
+#include <cstdint>
+#include <sys/types.h>
+
+/** reply request of a busy server: buffer[0] = ms to wait before retrying,
+ * buffer[1] = 1 if the server closes the connection */
+#define ADMIT_BUSY -4
+/** ms a client turned away at connect time is told to wait */
+#define ADMIT_RETRY 500
+/** clients a server serves at once unless told otherwise (server -l) */
+#define ADMIT_CLIENTS 256
+/** connections waiting to be accepted unless told otherwise (server -q) */
+#define ADMIT_BACKLOG 64
+/** clients whose buckets are kept; past that, the one idle longest is forgotten */
+#define ADMIT_TABLE 4096
+/** entries a client's buckets may be in, from its key's hash on */
+#define ADMIT_PROBE 32
+
+/**
+ * a token bucket. Holds up to burst tokens and gains rate per second.
+ */
+typedef struct {
+  /** tokens per second, 0 for no limit */
+  double rate;
+  /** most tokens held */
+  double burst;
+  /** tokens held */
+  double tokens;
+  /** when tokens was last brought up to date (seconds, monotonic) */
+  double last;
+} BUCKET;
+
+/**
+ * @brief starts a full bucket holding one second's worth (at least 1)
+ * @param rate tokens per second, 0 for no limit
+ */
+void bucketInit(BUCKET *b, double rate);
+
+/**
+ * @brief takes a token
+ * @return 0 if one was taken, otherwise ms until one will be there
+ */
+int bucketTake(BUCKET *b);
+
+/**
+ * a client's token buckets, in the shared table
+ */
+typedef struct {
+  /** the client (admitClient), 0 for a free entry */
+  uint64_t key;
+  /** point requests */
+  BUCKET point;
+  /** scans */
+  BUCKET scan;
+} ADMITCLIENT;
+
+/**
+ * @brief the key a client's buckets are kept under
+ * @param ip its IPv4 address (network order), 0 on this host
+ * @param pid the pid it sent in its hello
+ */
+inline uint64_t admitClient(uint32_t ip, pid_t pid) {
+  return ((uint64_t)ip << 32 | (uint32_t)pid) + 1; // never 0
+}
+
+/**
+ * @brief creates the scan slots and the clients' buckets. Call once in
+ * the server before forking.
+ * @param pointRate point requests per second per client, 0 for no limit
+ * @param scanRate scans per second per client, 0 for no limit
+ * @return false on error
+ */
+bool admitCreate(int slots, double pointRate, double scanRate);
+
+/**
+ * @brief removes the scan slots and the clients' buckets
+ */
+void admitClose();
+
+/**
+ * @brief takes a token from one of a client's buckets. A client not seen
+ * before, or idle long enough for its buckets to have filled up again,
+ * starts with full ones.
+ * @param client admitClient
+ * @param scan the scan bucket, otherwise the point request one
+ * @return 0 if one was taken, otherwise ms until one will be there
+ */
+int admitTake(uint64_t client, bool scan);
+
+/**
+ * @brief waits for a scan slot
+ */
+void scanEnter();
+
+/**
+ * @brief gives the slot to a waiting scan, if any, and waits for it again
+ */
+void scanYield();
+
+/**
+ * @brief gives the scan slot back
+ */
+void scanLeave();
+
+/**
+ * @brief answers a connection that is not admitted with a busy reply and
+ * closes it. Never blocks.
+ */
+void admitReject(int fd);
+
+#endif
@@ -0,0 +1,190 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3agg.cpp
+ * @brief      the shared totals and their updates
+ */
+#include "p3agg.hpp"
+#include "p3lock.hpp"
+#include <cstring>
+#include <climits>
+#include <sys/shm.h>
+#include <utility>
+
+/**
+ * shared state: the totals under a spin lock
+ */
+typedef struct {
+  uint32_t lock;
+  AGGREGATE a;
+} AGGSHARED;
+
+/** the totals, in shared memory */
+static AGGSHARED *g = NULL;
+/** shared memory id of g */
+static int gId = -1;
+
+/**
+ * @brief true if commit a comes after commit b
+ */
+static inline bool after(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+/**
+ * @brief totals of no records
+ */
+static void clear(AGGREGATE *a) {
+  memset(a, 0, sizeof(AGGREGATE));
+  for(int f=0; f < STORE_COLS; f++) {
+	a->min[f] = INT_MAX;
+	a->max[f] = INT_MIN;
+  }
+}
+
+/**
+ * @brief counts one live row in or out
+ * @param sign 1 to add it, -1 to take it away
+ */
+static void count(AGGREGATE *a, const int *row, int sign) {
+  a->count += sign;
+  for(int f=0; f < STORE_COLS; f++)
+	a->sum[f] += sign * (int64_t)row[f];
+}
+
+/**
+ * @brief a value was written: past (or at) the bound, it is the new extreme
+ */
+static void extend(AGGREGATE *a, int f, int v) {
+  if(v < a->min[f] || (a->minStale[f] && v <= a->min[f])) {
+	a->min[f] = v;
+	a->minStale[f] = 0;
+  }
+  if(v > a->max[f] || (a->maxStale[f] && v >= a->max[f])) {
+	a->max[f] = v;
+	a->maxStale[f] = 0;
+  }
+}
+
+bool aggCreate(long long n) {
+  int id = shmget(IPC_PRIVATE, sizeof(AGGSHARED), IPC_CREAT | 0600);
+  if(id < 0)
+	return false;
+  gId = id;
+  g = (AGGSHARED *)shmat(id, 0, 0);
+  shmctl(id, IPC_RMID, 0); // goes away with the last process
+  if(g == (void *)-1) {
+	g = NULL;
+	return false;
+  }
+  g->lock = 0;
+  clear(&g->a);
+  static int rows[1024 * STORE_COLS];
+  for(long long j=0; j < n; j += 1024) {
+	int got = storeRead(j, n - j < 1024 ? n - j : 1024, rows);
+	if(got <= 0) break;
+	schemaTotals<SCHEMA>(rows, got, &g->a.count, g->a.sum, g->a.min, g->a.max);
+  }
+  return true;
+}
+
+void aggPut(uint32_t seq, const int *old, const int *row) {
+  bool was = old[0] != STORE_TOMBSTONE, is = row[0] != STORE_TOMBSTONE;
+  if(!was && !is)
+	return;
+  spinLock(&g->lock);
+  AGGREGATE *a = &g->a;
+  if(was) count(a, old, -1);
+  if(is) count(a, row, 1);
+  for(int f=0; f < STORE_COLS; f++) {
+	if(was && is && old[f] == row[f])
+	  continue;
+	a->changed[f] = seq;
+	if(a->count == 0) { // nothing left to be the extreme
+	  a->min[f] = INT_MAX;
+	  a->max[f] = INT_MIN;
+	  a->minStale[f] = a->maxStale[f] = 0;
+	  continue;
+	}
+	if(was) { // still a bound, since every other value is past it
+	  if(old[f] == a->min[f] && !(is && row[f] <= old[f])) a->minStale[f] = 1;
+	  if(old[f] == a->max[f] && !(is && row[f] >= old[f])) a->maxStale[f] = 1;
+	}
+	if(is)
+	  extend(a, f, row[f]);
+  }
+  spinUnlock(&g->lock);
+}
+
+void aggRebuild(long long n, uint32_t seq) {
+  AGGREGATE a;
+  clear(&a);
+  static int rows[1024 * STORE_COLS];
+  for(long long j=0; j < n; j += 1024) {
+	int got = storeRead(j, n - j < 1024 ? n - j : 1024, rows);
+	if(got <= 0) break;
+	schemaTotals<SCHEMA>(rows, got, &a.count, a.sum, a.min, a.max);
+  }
+  for(int f=0; f < STORE_COLS; f++) // extremes worked out before are void
+	a.changed[f] = seq;
+  spinLock(&g->lock);
+  g->a = a;
+  spinUnlock(&g->lock);
+}
+
+AGGREGATE aggGet() {
+  spinLock(&g->lock);
+  AGGREGATE a = g->a;
+  spinUnlock(&g->lock);
+  return a;
+}
+
+bool aggSettle(int f, uint32_t seq, int min, int max) {
+  spinLock(&g->lock);
+  AGGREGATE *a = &g->a;
+  bool ok = !after(a->changed[f], seq);
+  if(ok && a->count > 0) {
+	a->min[f] = min;
+	a->max[f] = max;
+	a->minStale[f] = a->maxStale[f] = 0;
+  }
+  spinUnlock(&g->lock);
+  return ok;
+}
+
+bool aggAttach(int id) {
+  g = (AGGSHARED *)shmat(id, 0, 0);
+  if(g == (void *)-1) {
+	g = NULL;
+	return false;
+  }
+  gId = id;
+  return true;
+}
+
+int aggId() {
+  return gId;
+}
+
+void aggClose() {
+  if(g)
+	shmdt(g);
+  g = NULL;
+  gId = -1;
+}
+
+/**
+ * the statics above, for a dataset that is not in use
+ */
+struct AGGSTATE {
+  AGGSHARED *g;
+  int gId;
+};
+
+AGGSTATE *aggState() {
+  return new AGGSTATE{NULL, -1};
+}
+
+void aggSwitch(AGGSTATE *s) {
+  std::swap(g, s->g);
+  std::swap(gId, s->gId);
+}
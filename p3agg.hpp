@@ -0,0 +1,110 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3agg.hpp
+ * @brief      running count, sum, min and max of every field, for column
+ *             statistics without a scan (request 41)
+ *
+ * Every create, modify and delete hands the row it replaced and the row it
+ * wrote to aggPut while it has its turn to publish (see p3mvcc.hpp), so the
+ * totals change in commit order. Count and sums move by the difference. A
+ * new value past the minimum or maximum becomes it. Removing the value that
+ * is the minimum or maximum leaves it stale: the old value stays as a bound
+ * every record is still past, and the next value written at or past that
+ * bound is the new extreme. Otherwise the server works it out again only
+ * when it is asked for (aggSettle), from the field's index if it has one, or
+ * from a scan.
+ *
+ * Compaction leaves the totals as they are; only a replica's snapshot
+ * replaces them.
+ */
+#ifndef P3AGGHEADER
+#define P3AGGHEADER
+
+#include <cstdint>
+#include "p3store.hpp"
+
+/**
+ * totals of the records not deleted, as of some commit
+ */
+typedef struct {
+  /** records counted */
+  int64_t count;
+  /** sum of each field */
+  int64_t sum[STORE_COLS];
+  /** smallest / largest value of each field (INT_MAX / INT_MIN with no records) */
+  int32_t min[STORE_COLS], max[STORE_COLS];
+  /** 1 where the extreme was removed: min / max is only a bound */
+  uint8_t minStale[STORE_COLS], maxStale[STORE_COLS];
+  /** last commit that changed a value of each field */
+  uint32_t changed[STORE_COLS];
+} AGGREGATE;
+
+/**
+ * @brief creates the totals and fills them from the data file. Call once
+ * in the server before forking, after storeOpen.
+ * @param count records in the data file
+ * @return false if shared memory cannot be created
+ */
+bool aggCreate(long long count);
+
+/**
+ * @brief applies a write: old replaced by row, either may be a tombstone.
+ * Call in commit order, between mvccTurn and mvccPublish.
+ * @param seq the writer's commit
+ */
+void aggPut(uint32_t seq, const int *old, const int *row);
+
+/**
+ * @brief recounts everything from a new file of n records, read back a
+ * chunk at a time. Call with writers kept out, once the file is in place.
+ * @param seq the commit that replaced the file
+ */
+void aggRebuild(long long n, uint32_t seq);
+
+/**
+ * @brief the totals now
+ */
+AGGREGATE aggGet();
+
+/**
+ * @brief sets a stale field's minimum and maximum, worked out as of commit
+ * seq, if no commit since has changed a value of the field. Commits that
+ * have not reached aggPut yet are applied on top as usual.
+ * @return false if the field changed since seq: work it out again
+ */
+bool aggSettle(int field, uint32_t seq, int min, int max);
+
+/**
+ * @brief attaches, in another process, the totals aggCreate made
+ * @param id from aggId
+ * @return false on error
+ */
+bool aggAttach(int id);
+
+/**
+ * @brief shared memory id of the totals in use
+ */
+int aggId();
+
+/**
+ * @brief lets go of the totals in this process
+ */
+void aggClose();
+
+/**
+ * a process' totals, one per dataset (see p3dset.hpp)
+ */
+typedef struct AGGSTATE AGGSTATE;
+
+/**
+ * @brief totals that are not set up, for aggSwitch
+ */
+AGGSTATE *aggState();
+
+/**
+ * @brief switches this process to the totals s holds; s keeps the ones that
+ * were in use (see storeSwitch)
+ */
+void aggSwitch(AGGSTATE *s);
+
+#endif
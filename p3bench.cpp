@@ -0,0 +1,951 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3bench.cpp
+ * @brief      benchmarks for the record server
+ *
+ * Usage: ./p3bench pack [rows] [datafile]
+ *        ./p3bench load <server IP> [clients] [seconds] [mix] [transport]
+ *        ./p3bench log [clients] [lines] [batch ms] [file]
+ *        ./p3bench lock [processes] [operations]
+ *        ./p3bench render [rows] [file]
+ *        ./p3bench replay <capture> [server IP[:port]] [speed] [scale] [transport]
+ */
+#include "p3.hpp"
+#include "p3xport.hpp"
+#include "p3admit.hpp"
+#include "p3store.hpp"
+#include "p3log.hpp"
+#include "p3render.hpp"
+#include "p3cap.hpp"
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <vector>
+#include <poll.h>
+#include <sys/stat.h>
+
+/** size of a MESSAGE on the wire */
+#define MSG_BYTES sizeof(MESSAGE)
+
+/**
+ * @brief current time in seconds
+ */
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** 
+ * @brief creates a new MESSAGE with default values
+ * @return the new MESSAGE
+ */
+MESSAGE clearMsg() {
+  MESSAGE msg;
+  for(int i=0; i < BSIZE; i++)
+	msg.buffer[i] = 0;
+  msg.sender = getpid();
+  msg.msg_type = 1;
+  msg.request = -1;
+  msg.rec = 0;
+  msg.gen = 0;
+  return msg;
+}
+
+/**
+ * @brief makes n records shaped like the real data: years increase,
+ * tonnage columns wander slowly from one row to the next
+ */
+vector<int> makeRecords(int n) {
+  vector<int> rows(n * PACK_COLS);
+  int col[PACK_COLS] = {1960, 29990, 6720, 10820, 390, 1840, 1760, 3030, 1300};
+  srand(552);
+  for(int r=0; r < n; r++) {
+	rows[r * PACK_COLS] = col[0] + r;
+	for(int c=1; c < PACK_COLS; c++) {
+	  col[c] += rand() % 401 - 180; // slow upward drift
+	  if(col[c] < 0) col[c] = 0;
+	  rows[r * PACK_COLS + c] = col[c];
+	}
+  }
+  return rows;
+}
+
+/**
+ * @brief loads records from a data file: blocks after a header (see
+ * p3store.hpp), or STORE_COLS ints per row back to back in a file from before that
+ */
+vector<int> loadRecords(const char *path) {
+  vector<int> rows;
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) {
+	perror(path);
+	return rows;
+  }
+  STOREHDR h;
+  if(fread(&h, sizeof(h), 1, f) == 1 && h.magic == STORE_MAGIC) {
+	vector<int> block(STORE_BLOCK / sizeof(int));
+	fseek(f, STORE_HEADER, SEEK_SET);
+	for(long long left = h.count; left > 0 && fread(block.data(), STORE_BLOCK, 1, f) == 1;
+		left -= STORE_BLOCK_ROWS)
+	  rows.insert(rows.end(), block.begin(), block.begin() + min(left, STORE_BLOCK_ROWS) * PACK_COLS);
+  } else {
+	rewind(f);
+	int line[PACK_COLS];
+	while(fread(line, sizeof(line), 1, f) == 1)
+	  rows.insert(rows.end(), line, line + PACK_COLS);
+  }
+  fclose(f);
+  return rows;
+}
+
+/**
+ * @brief compares raw and compressed -999 dumps: bytes on the wire and
+ * encode / decode cost, chunked exactly like the server sends them
+ */
+int benchPack(int argc, char **argv) {
+  int n = argc > 2 ? atoi(argv[2]) : 1000000;
+  vector<int> rows = argc > 3 ? loadRecords(argv[3]) : makeRecords(n);
+  n = rows.size() / PACK_COLS;
+  if(n == 0) {
+	cout << "No records" << endl;
+	return -1;
+  }
+  int reps = 50000000 / n + 1; // keep each run long enough to time
+
+  cout << "records: " << n << ", repetitions: " << reps << endl;
+  cout << left << setw(10) << "encoding" << setw(14) << "wire bytes"
+	   << setw(10) << "ratio" << setw(16) << "encode MB/s"
+	   << setw(16) << "decode MB/s" << setw(16) << "decode rows/s" << endl;
+
+  size_t rawBytes = (size_t)n * MSG_BYTES;
+  cout << left << setw(10) << encodingName(ENC_RAW) << setw(14) << rawBytes
+	   << setw(10) << "1.00" << setw(16) << "-" << setw(16) << "-"
+	   << setw(16) << "-" << endl;
+
+  int encs[2] = {ENC_VARINT, ENC_BITPACK};
+  vector<unsigned char> packed(packBound(ENC_VARINT, PACK_CHUNK));
+  vector<int> out(PACK_CHUNK * PACK_COLS);
+
+  for(int e=0; e < 2; e++) {
+	int enc = encs[e];
+	size_t wire = MSG_BYTES; // terminating chunk header
+	double encTime = 0, decTime = 0;
+
+	for(int j=0; j < n; j += PACK_CHUNK) {
+	  int cnt = n - j < PACK_CHUNK ? n - j : PACK_CHUNK;
+	  const int *src = rows.data() + (size_t)j * PACK_COLS;
+	  size_t len = 0;
+
+	  double t = now();
+	  for(int r=0; r < reps; r++)
+		len = packRecords(enc, src, cnt, packed.data());
+	  encTime += now() - t;
+
+	  t = now();
+	  for(int r=0; r < reps; r++)
+		if(!unpackRecords(enc, packed.data(), len, out.data(), cnt)) {
+		  cout << "Error: decode failed" << endl;
+		  return -1;
+		}
+	  decTime += now() - t;
+
+	  if(memcmp(out.data(), src, sizeof(int) * cnt * PACK_COLS) != 0) {
+		cout << "Error: round trip mismatch" << endl;
+		return -1;
+	  }
+	  wire += MSG_BYTES + len;
+	}
+
+	double mb = (double)n * PACK_COLS * sizeof(int) * reps / 1e6;
+	cout << left << setw(10) << encodingName(enc) << setw(14) << wire
+		 << setw(10) << fixed << setprecision(2) << (double)rawBytes / wire
+		 << setw(16) << setprecision(0) << mb / encTime
+		 << setw(16) << mb / decTime
+		 << setw(16) << (double)n * reps / decTime << endl;
+	cout.unsetf(ios::fixed);
+  }
+  return 0;
+}
+
+/**
+ * totals reported by one load client
+ */
+typedef struct {
+  /** requests completed */
+  long ops;
+  /** sum of request latencies (seconds) */
+  double latency;
+  /** slowest request (seconds) */
+  double worst;
+  /** requests answered busy */
+  long busy;
+  /** clients turned away at connect time */
+  long refused;
+} LOADRESULT;
+
+/**
+ * @brief connects to the server, says hello and moves onto shared memory
+ * like the client does
+ * @param transport tcp, unix, shm or auto
+ * @return false on error
+ */
+bool benchDial(XPORT *x, const char *host, int port, string transport) {
+  int type = transport == "tcp" ? XPORT_TCP : transport == "unix" ? XPORT_UNIX
+	: transport == "shm" ? XPORT_SHM : XPORT_AUTO;
+  if(!xportConnect(x, host, port, type)) {
+	perror("cannot connect to server");
+	return false;
+  }
+  MESSAGE msg = clearMsg();
+  xportWrite(x, &msg, sizeof(MESSAGE));
+  if(type == XPORT_SHM) { // same handshake as the client
+	msg.request = 12;
+	xportWrite(x, &msg, sizeof(MESSAGE));
+	xportRead(x, &msg, sizeof(MESSAGE));
+	bool ok = msg.buffer[0] >= 0 && xportShmAttach(x, msg.buffer[0]);
+	msg.buffer[0] = ok ? 1 : 0;
+	xportWrite(x, &msg, sizeof(MESSAGE));
+	if(ok) xportShmStart(x);
+  }
+  return true;
+}
+
+/**
+ * @brief connects to the server and says hello like the client does
+ * @param transport tcp, unix, shm or auto
+ * @return false on error, or if the server is full (errno EBUSY)
+ */
+bool benchConnect(XPORT *x, const char *host, string transport) {
+  if(!benchDial(x, host, PORT, transport))
+	return false;
+  MESSAGE msg = clearMsg();
+  msg.request = 11; // -999 dumps are read as compressed chunks
+  msg.buffer[0] = ENC_BITPACK;
+  xportWrite(x, &msg, sizeof(MESSAGE));
+  if(!xportRead(x, &msg, sizeof(MESSAGE)))
+	return false;
+  if(msg.request == ADMIT_BUSY) {
+	xportClose(x);
+	errno = EBUSY;
+	return false;
+  }
+  return true;
+}
+
+/**
+ * @brief sends one request of the given kind and reads the whole reply
+ * @param op c=create d=display m=modify h=modify record 1 n=count a=display all l=log
+ * t=top 10 of a field s=field statistics
+ * @param numRecords records known to exist, updated by creates
+ * @param wait set to the ms the server asked for if it answered busy, else 0
+ * @return false if the connection failed
+ */
+bool benchRequest(XPORT *x, char op, int &numRecords, int &wait) {
+  MESSAGE msg = clearMsg();
+  int rec = numRecords > 0 ? rand() % numRecords + 1 : 0;
+  switch(op) {
+  case 'c':
+	msg.request = 1;
+	for(int i=0; i < PACK_COLS; i++) msg.buffer[i] = rand() % 100000;
+	numRecords++;
+	break;
+  case 'd':
+	msg.request = 2;
+	msg.rec = rec;
+	break;
+  case 'm':
+	msg.request = 3;
+	for(int i=0; i < PACK_COLS; i++) msg.buffer[i] = rand() % 100000;
+	msg.rec = rec - 1;
+	break;
+  case 'h': // every client on the same record, they share a lock stripe
+	msg.request = 3;
+	for(int i=0; i < PACK_COLS; i++) msg.buffer[i] = rand() % 100000;
+	msg.rec = 0;
+	break;
+  case 'a':
+	msg.request = 2;
+	msg.rec = -999;
+	break;
+  case 'l':
+	msg.request = 4;
+	break;
+  case 't': // largest 10 of a random field
+	msg.request = 40;
+	msg.buffer[0] = rand() % PACK_COLS;
+	msg.buffer[1] = 1;
+	msg.buffer[3] = 10;
+	break;
+  case 's':
+	msg.request = 41;
+	break;
+  default:
+	msg.request = 10;
+  }
+  if(rec == 0 && (op == 'd' || op == 'm' || op == 'h')) msg.request = 10; // nothing to read yet
+  if(!xportWrite(x, &msg, sizeof(MESSAGE))) return false;
+  if(!xportRead(x, &msg, sizeof(MESSAGE))) return false;
+  wait = 0;
+  if(msg.request == ADMIT_BUSY) { // rate limited, nothing else follows
+	if(op == 'c') numRecords--;
+	wait = msg.buffer[0];
+	return true;
+  }
+
+  if(op == 'a') { // chunked dump, read until the empty chunk
+	static unsigned char packed[PACK_CHUNK * PACK_COLS * 5 + 8];
+	while(msg.request > 0) {
+	  if(!xportRead(x, packed, msg.buffer[0])) return false;
+	  if(!xportRead(x, &msg, sizeof(MESSAGE))) return false;
+	}
+  } else if(op == 't' || op == 's') { // count, then 1 MESSAGE per record or field
+	for(int i=msg.request; i > 0; i--)
+	  if(!xportRead(x, &msg, sizeof(MESSAGE))) return false;
+  } else if(op == 'l') { // count, then 1 LOGMSG per line
+	LOGMSG log;
+	for(int i=msg.request; i > 0; i--)
+	  if(!xportRead(x, &log, sizeof(LOGMSG))) return false;
+  } else if(op == 'n') {
+	numRecords = (int)msgGet64(msg.buffer, 0);
+  }
+  return true;
+}
+
+/**
+ * @brief drives the server with concurrent clients issuing the normal
+ * request types, e.g. to compare storage backends (server -b)
+ */
+int benchLoad(int argc, char **argv) {
+  if(argc < 3) {
+	cout << "Usage: " << argv[0] << " load <server IP> [clients] [seconds] [mix] [transport]" << endl;
+	return -1;
+  }
+  const char *host = argv[2];
+  int clients = argc > 3 ? atoi(argv[3]) : 8;
+  double seconds = argc > 4 ? atof(argv[4]) : 5;
+  string mix = argc > 5 ? argv[5] : "ddddmcn";
+  string transport = argc > 6 ? argv[6] : "auto";
+
+  int fds[2];
+  if(pipe(fds) < 0) {
+	perror("pipe");
+	return -1;
+  }
+  for(int c=0; c < clients; c++) {
+	if(fork() == 0) { // one client per process, like the real clients
+	  close(fds[0]);
+	  srand(getpid());
+	  LOADRESULT res = {0, 0, 0, 0, 0};
+	  XPORT x;
+	  bool up = benchConnect(&x, host, transport);
+	  if(!up && errno == EBUSY) res.refused++;
+	  int numRecords = 0, wait = 0;
+	  if(up) benchRequest(&x, 'n', numRecords, wait);
+	  double end = now() + seconds;
+	  while(up && now() < end) {
+		double t = now();
+		if(!benchRequest(&x, mix[(res.ops + res.busy) % mix.length()], numRecords, wait)) {
+		  perror("request failed");
+		  break;
+		}
+		if(wait > 0) { // back off as asked, like a polite client
+		  res.busy++;
+		  usleep(wait * 1000);
+		  continue;
+		}
+		t = now() - t;
+		res.ops++;
+		res.latency += t;
+		if(t > res.worst) res.worst = t;
+	  }
+	  MESSAGE bye = clearMsg();
+	  bye.request = 99;
+	  if(up) {
+		xportWrite(&x, &bye, sizeof(MESSAGE));
+		xportClose(&x);
+	  }
+	  writeFull(fds[1], &res, sizeof(res));
+	  exit(0);
+	}
+  }
+  close(fds[1]);
+
+  LOADRESULT total = {0, 0, 0, 0, 0}, res;
+  while(readFull(fds[0], &res, sizeof(res))) {
+	total.ops += res.ops;
+	total.busy += res.busy;
+	total.refused += res.refused;
+	total.latency += res.latency;
+	if(res.worst > total.worst) total.worst = res.worst;
+  }
+  while(wait(NULL) > 0) ;
+
+  cout << "clients: " << clients << ", mix: " << mix << ", seconds: " << seconds
+	   << ", transport: " << transport << endl;
+  cout << "requests: " << total.ops << endl;
+  cout << "throughput: " << fixed << setprecision(0) << total.ops / seconds << " req/s" << endl;
+  cout << "mean latency: " << setprecision(1)
+	   << (total.ops ? total.latency / total.ops * 1e6 : 0) << " us" << endl;
+  cout << "worst latency: " << total.worst * 1e6 << " us" << endl;
+  if(total.busy > 0 || total.refused > 0)
+	cout << "answered busy: " << total.busy << ", clients turned away: "
+		 << total.refused << endl;
+  return 0;
+}
+
+/**
+ * @brief P() as it was before p3lock.hpp: one semop per call
+ */
+void semWait(int id, int num) {
+  struct sembuf op = {(unsigned short)num, -1, SEM_UNDO};
+  semop(id, &op, 1);
+}
+
+/**
+ * @brief V() as it was before p3lock.hpp
+ */
+void semSignal(int id, int num) {
+  struct sembuf op = {(unsigned short)num, 1, 0};
+  semop(id, &op, 1);
+}
+
+/**
+ * @brief the line a log bench client writes i-th
+ */
+string benchLine(pid_t p, int i) {
+  return "PID: " + to_string(p) + " | bench line " + to_string(i)
+	+ ", about as long as a client's usual log line\n";
+}
+
+/**
+ * @brief checks a log bench file: every client's lines whole and in order
+ * @return lines found intact
+ */
+long checkLog(const char *path) {
+  ifstream in(path);
+  map<pid_t, int> next;
+  long good = 0;
+  string line;
+  while(getline(in, line)) {
+	int p, i;
+	if(sscanf(line.c_str(), "PID: %d | bench line %d", &p, &i) == 2
+	   && line + "\n" == benchLine(p, i) && next[p] == i) {
+	  next[p]++;
+	  good++;
+	}
+  }
+  return good;
+}
+
+/**
+ * @brief many processes appending to one log file at once, the way clients
+ * on one machine share log.cli: the old semaphore-and-stdio writes against
+ * p3log's O_APPEND writes, each line alone and batched
+ */
+int benchLog(int argc, char **argv) {
+  int clients = argc > 2 ? atoi(argv[2]) : MAX_CLI;
+  int lines = argc > 3 ? atoi(argv[3]) : 20000;
+  int batchMs = argc > 4 ? atoi(argv[4]) : 5;
+  const char *path = argc > 5 ? argv[5] : "p3bench.log";
+  cout << "clients: " << clients << ", lines each: " << lines << ", file: " << path << endl;
+  cout << left << setw(22) << "writes" << setw(14) << "lines/s" << setw(12) << "seconds"
+	   << "intact" << endl;
+
+  for(int mode=0; mode < 3; mode++) {
+	unlink(path);
+	int sem = mode == 0 ? semget(IPC_PRIVATE, 1, 0600) : -1;
+	if(mode == 0) {
+	  if(sem < 0) {
+		perror("semget");
+		continue;
+	  }
+	  semSignal(sem, 0);
+	}
+	double t = now();
+	for(int c=0; c < clients; c++) {
+	  if(fork() != 0)
+		continue;
+	  pid_t me = getpid();
+	  if(mode == 0) { // what writeLog did: a lock around buffered stdio
+		FILE *f = fopen(path, "a");
+		for(int i=0; f && i < lines; i++) {
+		  string s = benchLine(me, i);
+		  semWait(sem, 0);
+		  fseek(f, 0, SEEK_END);
+		  fwrite(s.c_str(), s.length(), 1, f);
+		  semSignal(sem, 0);
+		}
+		if(f) fclose(f);
+	  } else {
+		if(!logOpen(path, mode == 1 ? 0 : batchMs))
+		  _exit(1);
+		for(int i=0; i < lines; i++) {
+		  string s = benchLine(me, i);
+		  logLine(s.c_str(), s.length());
+		}
+		logClose();
+	  }
+	  _exit(0);
+	}
+	while(wait(NULL) > 0) ;
+	t = now() - t;
+	if(mode == 0)
+	  semctl(sem, 0, IPC_RMID);
+
+	long want = (long)clients * lines, good = checkLog(path);
+	string name = mode == 0 ? "semaphore + stdio" : mode == 1 ? "O_APPEND per line"
+	  : "O_APPEND " + to_string(batchMs) + " ms batch";
+	cout << left << setw(22) << name << setw(14) << fixed << setprecision(0) << want / t
+		 << setw(12) << setprecision(3) << t << good << " / " << want << endl;
+	cout.unsetf(ios::fixed);
+  }
+  unlink(path);
+  return 0;
+}
+
+/**
+ * @brief lock and unlock cost of SysV semop against p3lock's futex locks,
+ * by one process and by several fighting over the same lock, each adding
+ * one to a shared counter per turn
+ */
+int benchLock(int argc, char **argv) {
+  int procs = argc > 2 ? atoi(argv[2]) : 4;
+  int ops = argc > 3 ? atoi(argv[3]) : 1000000;
+  int cid = shmget(IPC_PRIVATE, sizeof(long), IPC_CREAT | 0600);
+  long *counter = cid < 0 ? NULL : (long *)shmat(cid, 0, 0);
+  shmctl(cid, IPC_RMID, 0);
+  int semid = semget(IPC_PRIVATE, 1, IPC_CREAT | 0600);
+  int lock = lockGet(IPC_PRIVATE, 1, IPC_CREAT | 0600);
+  if(counter == NULL || counter == (void *)-1 || semid < 0 || lock < 0) {
+	perror("cannot create the locks");
+	return -1;
+  }
+  semSignal(semid, 0);
+  V(lock, 0);
+  cout << "operations per process: " << ops << endl;
+  cout << left << setw(18) << "lock" << setw(12) << "processes" << setw(14) << "ns/op"
+	   << setw(14) << "ops/s" << "counter" << endl;
+
+  const char *names[3] = {"semop", "futex", "futex shared"};
+  for(int mode=0; mode < 3; mode++)
+	for(int n = 1; n <= procs; n = n == 1 && procs > 1 ? procs : procs + 1) {
+	  *counter = 0;
+	  double t = now();
+	  for(int c=0; c < n; c++) {
+		if(fork() != 0)
+		  continue;
+		for(int i=0; i < ops; i++) {
+		  if(mode == 0) {
+			semWait(semid, 0);
+			(*counter)++;
+			semSignal(semid, 0);
+		  } else if(mode == 1) {
+			P(lock, 0);
+			(*counter)++;
+			V(lock, 0);
+		  } else {
+			PR(lock, 0);
+			__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED); // readers overlap
+			VR(lock, 0);
+		  }
+		}
+		_exit(0);
+	  }
+	  while(wait(NULL) > 0) ;
+	  t = now() - t;
+	  long total = (long)n * ops;
+	  cout << left << setw(18) << names[mode] << setw(12) << n << setw(14) << fixed
+		   << setprecision(1) << t * 1e9 / total << setw(14) << setprecision(0) << total / t
+		   << *counter << (*counter == total ? "" : " (lost updates)") << endl;
+	  cout.unsetf(ios::fixed);
+	}
+  semctl(semid, 0, IPC_RMID);
+  lockRemove(lock);
+  return 0;
+}
+
+/**
+ * @brief rows per second printing a dump the way the client did (cout,
+ * setw and endl per row) and through p3render in every format, to file
+ * (default /dev/null) so the terminal is not what is measured
+ */
+int benchRender(int argc, char **argv) {
+  int rows = argc > 2 ? atoi(argv[2]) : 1000000;
+  const char *path = argc > 3 ? argv[3] : "/dev/null";
+  vector<int> recs = makeRecords(rows);
+  cout << "rows: " << rows << ", file: " << path << endl;
+  cout << left << setw(22) << "printing" << setw(14) << "rows/s" << setw(12) << "seconds"
+	   << "bytes" << endl;
+
+  const char *names[] = {"table", "csv", "tsv", "raw"};
+  for(int mode=-1; mode < 4; mode++) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+	  perror(path);
+	  return -1;
+	}
+	double t = now();
+	if(mode < 0) { // what displayRecord did
+	  ofstream out(path, ios::trunc);
+	  for(int r=0; r < rows; r++)
+		for(int c=0; c <= PACK_COLS; c++)
+		  if(c == PACK_COLS)
+			out << endl;
+		  else
+			out << setw(SCHEMA::column[c].width) << left << recs[r * PACK_COLS + c];
+	} else if(!renderHeader<SCHEMA>(fd, mode)
+			  || !renderRows<SCHEMA>(fd, mode, recs.data(), rows)) {
+	  perror("write");
+	}
+	t = now() - t;
+	struct stat st;
+	off_t bytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+	close(fd);
+	string name = mode < 0 ? "cout + setw + endl" : "to_chars " + string(names[mode]);
+	cout << left << setw(22) << name << setw(14) << fixed << setprecision(0) << rows / t
+		 << setw(12) << setprecision(3) << t << bytes << endl;
+	cout.unsetf(ios::fixed);
+  }
+  if(strcmp(path, "/dev/null") != 0)
+	unlink(path);
+  return 0;
+}
+
+/** display of every record, kept apart from displays of one in the totals */
+#define REPLAY_DUMP 0
+/** request numbers kept apart in the totals (all there are, below 99) */
+#define REPLAY_KINDS 99
+
+/**
+ * one captured request, to send again
+ */
+typedef struct {
+  /** microseconds after its session opened */
+  long long at;
+  /** the request as the client sent it */
+  MESSAGE msg;
+} REPLAYMSG;
+
+/**
+ * one captured connection
+ */
+typedef struct {
+  /** microseconds after the capture began that it opened */
+  long long start;
+  /** its requests in order */
+  vector<REPLAYMSG> msgs;
+} REPLAYSESSION;
+
+/**
+ * totals reported by one replayed session, small enough for one atomic
+ * pipe write
+ */
+typedef struct {
+  /** requests completed, answered busy and not sent (see replaySession) */
+  long ops, busy, skipped;
+  /** sessions turned away at connect time, or cut short by an error */
+  long refused, failed;
+  /** sum of request latencies and slowest request (seconds) */
+  double latency, worst;
+  /** the same per request number, REPLAY_DUMP for -999 displays */
+  long kindOps[REPLAY_KINDS];
+  double kindLatency[REPLAY_KINDS], kindWorst[REPLAY_KINDS];
+} REPLAYRESULT;
+static_assert(sizeof(REPLAYRESULT) <= PIPE_BUF, "replay results must be written atomically");
+
+/**
+ * @brief reads a capture (server -P, see p3cap.hpp) into its sessions,
+ * ordered by when they opened
+ * @return false if it cannot be read or is not a capture
+ */
+bool replayLoad(const char *path, vector<REPLAYSESSION> &sessions) {
+  ifstream f(path, ios::binary);
+  if(!f) {
+	perror(path);
+	return false;
+  }
+  vector<char> data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+  CAPHDR hdr;
+  if(data.size() >= sizeof(hdr))
+	memcpy(&hdr, data.data(), sizeof(hdr));
+  if(data.size() < sizeof(hdr) || hdr.magic != CAP_MAGIC || hdr.version != CAP_VERSION) {
+	cout << path << " is not a capture file (version " << CAP_VERSION << ")" << endl;
+	return false;
+  }
+
+  map<uint32_t, size_t> open; // session number to its place in sessions
+  for(size_t at = sizeof(hdr); at + sizeof(CAPREQ) <= data.size(); ) {
+	CAPREQ r;
+	memcpy(&r, &data[at], sizeof(r));
+	if(r.words > BSIZE || at + capSize(r) > data.size())
+	  break; // cut short, e.g. by a full disk
+	const char *p = &data[at + sizeof(r)];
+	at += capSize(r);
+	if(r.request == CAP_OPEN) {
+	  open[r.session] = sessions.size();
+	  sessions.push_back({r.at, {}});
+	  continue;
+	}
+	auto s = open.find(r.session);
+	if(s == open.end())
+	  continue;
+	REPLAYSESSION &ses = sessions[s->second];
+	REPLAYMSG m = {r.at - ses.start, clearMsg()};
+	m.msg.request = r.request;
+	memcpy(m.msg.buffer, p, r.words * sizeof(int));
+	p += r.words * sizeof(int);
+	if(r.flags & CAP_REC) {
+	  memcpy(&m.msg.rec, p, sizeof(m.msg.rec));
+	  p += sizeof(m.msg.rec);
+	}
+	if(r.flags & CAP_GEN)
+	  memcpy(&m.msg.gen, p, sizeof(m.msg.gen));
+	ses.msgs.push_back(m);
+  }
+  stable_sort(sessions.begin(), sessions.end(),
+			  [](const REPLAYSESSION &a, const REPLAYSESSION &b) { return a.start < b.start; });
+  return true;
+}
+
+/**
+ * @brief reads the whole reply to a replayed request, in the shapes
+ * libp3client reads
+ * @param enc the connection's encoding, set by request 11
+ * @return 0, 1 if it was answered busy, -1 if the connection failed, -2 if
+ * the server turned the connection away
+ */
+int replayReply(XPORT *x, const MESSAGE &sent, int &enc) {
+  MESSAGE msg;
+  bool dump = sent.request == 2 && sent.rec == -999;
+  if(!xportRead(x, &msg, sizeof(MESSAGE))) return -1;
+  if(msg.request == ADMIT_BUSY) // nothing else follows
+	return msg.buffer[1] ? -2 : 1;
+
+  if(dump && enc == ENC_RAW) { // chunks of 1 MESSAGE per record until the empty one
+	while(msg.request > 0) {
+	  for(int i=msg.request; i > 0; i--)
+		if(!xportRead(x, &msg, sizeof(MESSAGE))) return -1;
+	  if(!xportRead(x, &msg, sizeof(MESSAGE))) return -1;
+	}
+  } else if(dump) { // chunks until the empty one
+	vector<unsigned char> packed(packBound(enc, PACK_CHUNK));
+	while(msg.request > 0) {
+	  if(msg.buffer[0] < 0 || (size_t)msg.buffer[0] > packed.size()) return -1;
+	  if(msg.buffer[0] > 0 && !xportRead(x, packed.data(), msg.buffer[0])) return -1;
+	  if(!xportRead(x, &msg, sizeof(MESSAGE))) return -1;
+	}
+  } else if(sent.request == 4) { // count, then 1 LOGMSG per line
+	LOGMSG log;
+	for(int i=msg.request; i > 0; i--)
+	  if(!xportRead(x, &log, sizeof(LOGMSG))) return -1;
+  } else if(sent.request == 30 || sent.request == 40 || sent.request == 41) {
+	for(int i=msg.request; i > 0; i--) // count, then 1 MESSAGE per shard, record or field
+	  if(!xportRead(x, &msg, sizeof(MESSAGE))) return -1;
+  } else if(sent.request == 11) {
+	enc = msg.buffer[0];
+  }
+  return 0;
+}
+
+/**
+ * @brief sends one session's requests again on a connection of its own,
+ * each speed times faster than captured (0: as soon as the last reply is
+ * in), and times the replies. Requests 12 (the transport is ours to pick)
+ * and 20 with all after it (a replica's stream, not requests) are skipped.
+ */
+REPLAYRESULT replaySession(const REPLAYSESSION &s, const char *host, int port,
+						   const string &transport, double speed) {
+  REPLAYRESULT res;
+  memset(&res, 0, sizeof(res));
+  XPORT x;
+  if(!benchDial(&x, host, port, transport)) {
+	res.failed++;
+	return res;
+  }
+  double opened = now();
+  int enc = ENC_RAW;
+  for(size_t i=0; i < s.msgs.size(); i++) {
+	MESSAGE msg = s.msgs[i].msg;
+	if(msg.request == 12 || msg.request == 20) {
+	  res.skipped += msg.request == 12 ? 1 : s.msgs.size() - i;
+	  if(msg.request == 12) continue;
+	  break;
+	}
+	double due = speed > 0 ? opened + s.msgs[i].at / 1e6 / speed : 0;
+	if(due > now())
+	  usleep((due - now()) * 1e6);
+
+	msg.sender = getpid();
+	double t = now();
+	if(!xportWrite(&x, &msg, sizeof(MESSAGE))) {
+	  res.failed++;
+	  break;
+	}
+	if(msg.request == 99)
+	  break;
+	int got = replayReply(&x, msg, enc);
+	if(got < 0) {
+	  (got == -2 ? res.refused : res.failed)++;
+	  break;
+	}
+	if(got == 1) {
+	  res.busy++;
+	  continue;
+	}
+	t = now() - t;
+	int k = msg.request == 2 && msg.rec == -999 ? REPLAY_DUMP : msg.request;
+	res.ops++;
+	res.latency += t;
+	res.worst = max(res.worst, t);
+	if(k >= 0 && k < REPLAY_KINDS) {
+	  res.kindOps[k]++;
+	  res.kindLatency[k] += t;
+	  res.kindWorst[k] = max(res.kindWorst[k], t);
+	}
+  }
+  xportClose(&x);
+  return res;
+}
+
+/**
+ * @brief adds one session's totals to the run's
+ */
+void replayAdd(REPLAYRESULT &total, const REPLAYRESULT &res) {
+  total.ops += res.ops;
+  total.busy += res.busy;
+  total.skipped += res.skipped;
+  total.refused += res.refused;
+  total.failed += res.failed;
+  total.latency += res.latency;
+  total.worst = max(total.worst, res.worst);
+  for(int k=0; k < REPLAY_KINDS; k++) {
+	total.kindOps[k] += res.kindOps[k];
+	total.kindLatency[k] += res.kindLatency[k];
+	total.kindWorst[k] = max(total.kindWorst[k], res.kindWorst[k]);
+  }
+}
+
+/**
+ * @brief plays a capture (server -P) back against a server: every session
+ * on a connection of its own, in a process of its own, opened and sending
+ * at the captured times divided by speed (0 for as fast as possible, all
+ * sessions at once), each session scale times at once
+ */
+int benchReplay(int argc, char **argv) {
+  if(argc < 3) {
+	cout << "Usage: " << argv[0] << " replay <capture> [server IP[:port]] [speed] [scale] [transport]" << endl;
+	return -1;
+  }
+  string host = argc > 3 ? argv[3] : "127.0.0.1";
+  int port = PORT;
+  if(host.find(':') != string::npos) {
+	port = atoi(host.c_str() + host.find(':') + 1);
+	host.resize(host.find(':'));
+  }
+  double speed = argc > 4 ? atof(argv[4]) : 1;
+  int scale = argc > 5 ? atoi(argv[5]) : 1;
+  string transport = argc > 6 ? argv[6] : "auto";
+  if(speed < 0 || scale < 1) {
+	cout << "Error: speed must be at least 0, scale at least 1" << endl;
+	return -1;
+  }
+  vector<REPLAYSESSION> sessions;
+  if(!replayLoad(argv[2], sessions))
+	return -1;
+  long captured = 0;
+  for(REPLAYSESSION &s : sessions)
+	captured += s.msgs.size();
+
+  int fds[2];
+  if(pipe(fds) < 0) {
+	perror("pipe");
+	return -1;
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK); // drained while sessions start
+  REPLAYRESULT total, res;
+  memset(&total, 0, sizeof(total));
+  double start = now();
+  for(size_t i=0; i < sessions.size(); i++) {
+	double due = speed > 0 ? start + (sessions[i].start - sessions[0].start) / 1e6 / speed : 0;
+	do { // take in the results of finished sessions while waiting
+	  struct pollfd p = {fds[0], POLLIN, 0};
+	  poll(&p, 1, max(0, (int)((due - now()) * 1000)));
+	  while(read(fds[0], &res, sizeof(res)) == sizeof(res))
+		replayAdd(total, res);
+	  while(waitpid(-1, NULL, WNOHANG) > 0) ;
+	} while(due > now());
+
+	for(int c=0; c < scale; c++)
+	  if(fork() == 0) { // one client per process, like the real clients
+		close(fds[0]);
+		res = replaySession(sessions[i], host.c_str(), port, transport, speed);
+		writeFull(fds[1], &res, sizeof(res));
+		exit(0);
+	  }
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, 0);
+  while(readFull(fds[0], &res, sizeof(res)))
+	replayAdd(total, res);
+  while(wait(NULL) > 0) ;
+  double seconds = now() - start;
+
+  cout << "sessions: " << sessions.size() << " x " << scale << ", captured requests: " << captured
+	   << ", speed: ";
+  if(speed > 0) cout << speed << "x";
+  else cout << "as fast as possible";
+  cout << ", transport: " << transport << endl;
+  cout << "requests: " << total.ops << " in " << fixed << setprecision(2) << seconds << " s" << endl;
+  cout << "throughput: " << setprecision(0) << total.ops / seconds << " req/s" << endl;
+  cout << "mean latency: " << setprecision(1)
+	   << (total.ops ? total.latency / total.ops * 1e6 : 0) << " us" << endl;
+  cout << "worst latency: " << total.worst * 1e6 << " us" << endl;
+  if(total.busy > 0 || total.refused > 0 || total.failed > 0 || total.skipped > 0)
+	cout << "answered busy: " << total.busy << ", sessions turned away: " << total.refused
+		 << ", sessions failed: " << total.failed << ", requests skipped: " << total.skipped << endl;
+
+  static map<int, const char *> names = {{REPLAY_DUMP, "display all"}, {1, "create"},
+	{2, "display"}, {3, "modify"}, {4, "log"}, {5, "delete"}, {10, "count"},
+	{11, "encoding"}, {22, "repl status"}, {30, "shard map"}, {40, "sorted"},
+	{41, "stats"}, {50, "dataset"}};
+  if(total.ops > 0)
+	cout << left << setw(16) << "request" << setw(10) << "count" << setw(14) << "mean us"
+		 << "worst us" << endl;
+  for(int k=0; k < REPLAY_KINDS; k++) {
+	if(total.kindOps[k] == 0) continue;
+	string name = names.count(k) ? names[k] : "request " + to_string(k);
+	cout << setw(16) << name << setw(10) << total.kindOps[k]
+		 << setw(14) << total.kindLatency[k] / total.kindOps[k] * 1e6
+		 << total.kindWorst[k] * 1e6 << endl;
+  }
+  cout.unsetf(ios::fixed);
+  return 0;
+}
+
+/** @brief main function */
+int main(int argc, char **argv) {
+  string mode = argc > 1 ? argv[1] : "";
+  if(mode == "pack")
+	return benchPack(argc, argv);
+  if(mode == "load")
+	return benchLoad(argc, argv);
+  if(mode == "log")
+	return benchLog(argc, argv);
+  if(mode == "lock")
+	return benchLock(argc, argv);
+  if(mode == "render")
+	return benchRender(argc, argv);
+  if(mode == "replay")
+	return benchReplay(argc, argv);
+
+  cout << "Usage: " << argv[0] << " pack [rows] [datafile]" << endl
+	   << "       " << argv[0] << " load <server IP> [clients] [seconds] [mix] [transport]" << endl
+	   << "       " << argv[0] << " log [clients] [lines] [batch ms] [file]" << endl
+	   << "       " << argv[0] << " lock [processes] [operations]" << endl
+	   << "       " << argv[0] << " render [rows] [file]" << endl
+	   << "       " << argv[0] << " replay <capture> [server IP[:port]] [speed] [scale] [transport]" << endl
+	   << "  mix letters: c=create d=display m=modify h=modify record 1 n=count"
+	   << " a=display all l=log t=top 10 s=field statistics" << endl;
+  return -1;
+}
@@ -0,0 +1,85 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3cap.cpp
+ * @brief      session numbering and the capture file
+ */
+#include "p3cap.hpp"
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/** capture file (O_APPEND, shared by all children), -1 if capture is off */
+static int capFd = -1;
+/** sessions started, in memory shared by all children */
+static uint32_t *sessions = NULL;
+/** this child's session */
+static uint32_t session = 0;
+/** monotonic clock (ns) when the capture began, inherited by the children */
+static long long began;
+
+/**
+ * @brief monotonic clock in nanoseconds
+ */
+static long long clockNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * @brief appends one record with its payload in a single write
+ */
+static void put(int request, const int *buffer, int words, const long long *rec, const int *gen) {
+  char out[sizeof(CAPREQ) + BSIZE * sizeof(int) + sizeof(long long) + sizeof(int)];
+  CAPREQ r = {session, (int16_t)request, (uint8_t)words,
+			  (uint8_t)((rec ? CAP_REC : 0) | (gen ? CAP_GEN : 0)), (clockNs() - began) / 1000};
+  char *p = out + sizeof(r);
+  memcpy(out, &r, sizeof(r));
+  if(words > 0) {
+	memcpy(p, buffer, words * sizeof(int));
+	p += words * sizeof(int);
+  }
+  if(rec) {
+	memcpy(p, rec, sizeof(*rec));
+	p += sizeof(*rec);
+  }
+  if(gen) {
+	memcpy(p, gen, sizeof(*gen));
+	p += sizeof(*gen);
+  }
+  if(write(capFd, out, p - out) != p - out)
+	capFd = -1; // disk full or similar, stop capturing in this child
+}
+
+bool capOpen(const char *path) {
+  void *m = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(m == MAP_FAILED)
+	return false;
+  sessions = (uint32_t *)m;
+  if((capFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0)
+	return false;
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  began = clockNs();
+  CAPHDR hdr = {CAP_MAGIC, CAP_VERSION, t.tv_sec * 1000000LL + t.tv_nsec / 1000};
+  return write(capFd, &hdr, sizeof(hdr)) == sizeof(hdr);
+}
+
+void capSession() {
+  if(capFd < 0)
+	return;
+  session = __atomic_add_fetch(sessions, 1, __ATOMIC_SEQ_CST);
+  put(CAP_OPEN, NULL, 0, NULL, NULL);
+}
+
+void capRequest(const MESSAGE &msg) {
+  if(capFd < 0)
+	return;
+  int words = BSIZE;
+  while(words > 0 && msg.buffer[words - 1] == 0) // most requests fill a few
+	words--;
+  put(msg.request, msg.buffer, words, msg.rec || msg.gen ? &msg.rec : NULL,
+	  msg.gen ? &msg.gen : NULL);
+}
@@ -0,0 +1,88 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3cap.hpp
+ * @brief      traffic capture: every request of every connection, with its
+ *             payload and arrival time, for "./p3bench replay"
+ *
+ * With capture on (server -P) each child notes every MESSAGE its client
+ * sends, the disconnect (request 99) included, and appends it to the capture
+ * file with one write, so records of different connections never
+ * interleave. A connection is a session, numbered in shared memory so the
+ * numbers stay unique across children and prefork workers.
+ *
+ * The file starts with a CAPHDR, followed by one CAPREQ per request, each
+ * followed by its payload: the first words ints of the buffer (the rest
+ * were 0), then rec if CAP_REC is set and gen if CAP_GEN is. A create takes
+ * about 50 bytes, a display 24, against 72 for the MESSAGE itself. A
+ * session starts with a CAPREQ of request CAP_OPEN, when its client said
+ * hello. msg_type and sender are not kept: a replay sends its own.
+ */
+#ifndef P3CAPHEADER
+#define P3CAPHEADER
+
+#include <stdint.h>
+#include "p3msg.hpp"
+
+/** "P3CP" */
+#define CAP_MAGIC 0x50433350
+#define CAP_VERSION 1
+/** request of the record that opens a session */
+#define CAP_OPEN 0
+/** rec follows the buffer */
+#define CAP_REC 1
+/** gen follows rec */
+#define CAP_GEN 2
+
+/**
+ * start of the capture file
+ */
+typedef struct {
+  /** CAP_MAGIC */
+  uint32_t magic;
+  /** CAP_VERSION */
+  uint32_t version;
+  /** when the capture began (microseconds since the epoch) */
+  int64_t started;
+} CAPHDR;
+
+/**
+ * one captured request, followed by its payload
+ */
+typedef struct {
+  /** the connection it came on */
+  uint32_t session;
+  /** request number from the MESSAGE, CAP_OPEN for a new session */
+  int16_t request;
+  /** buffer ints that follow */
+  uint8_t words;
+  /** CAP_REC, CAP_GEN */
+  uint8_t flags;
+  /** when it was received (microseconds since the capture began) */
+  int64_t at;
+} CAPREQ;
+
+/**
+ * @brief bytes of a captured request with its payload
+ */
+inline size_t capSize(const CAPREQ &r) {
+  return sizeof(CAPREQ) + r.words * sizeof(int) + (r.flags & CAP_REC ? sizeof(long long) : 0)
+	+ (r.flags & CAP_GEN ? sizeof(int) : 0);
+}
+
+/**
+ * @brief starts a capture file, replacing an old one. Call before forking.
+ * @return false on error
+ */
+bool capOpen(const char *path);
+
+/**
+ * @brief starts a session for the connection this child serves
+ */
+void capSession();
+
+/**
+ * @brief notes a request received on this child's session
+ */
+void capRequest(const MESSAGE &msg);
+
+#endif
@@ -1,51 +1,156 @@
 /**
  * @author     Chloe Kelly
  * @file       p3cli.cpp
+ * @brief      interactive menu on top of libp3client (p3client.hpp)
  */
 #include "p3.hpp"
+#include "p3xport.hpp"
+#include "p3client.hpp"
+#include "p3log.hpp"
+#include "p3render.hpp"
 
-bool connectToServer();
 bool semSetup();
 bool shmSetup();
 void clientLoop();
 void printHeader();
-void sendMessage(MESSAGE);
 tm *getTime();
 void writeLog(string);
 void printShm();
-void incCommands();
+void incCommands(int);
+P3CLIENT *connectToServer(const char *, int, int, int, const char *);
+P3RESULT finish(future<P3RESULT>, const char *);
+void printRecord(const int *);
+void showReplStatus(MESSAGE);
+void sortedRecords(MESSAGE);
+void fieldStats(MESSAGE);
 
 int sem, /*!< semaphore */
-  sockfd, /*!< socket for communication */
   shmid, /*!< id of shared memory */
   clinum = -1; /*!< this client's number */
 /** pointer to shm */
 CLI_DAT *shmptr;
 /** info about CURRENT client */
 CLI_INFO cli_info;
-/** local logfile on this machine */
-FILE *logfile;
+/** the server (the primary when reading from a replica) */
+P3CLIENT *server;
+/** where displays and logs are read from: server, or a replica with -r */
+P3CLIENT *reader;
+/** format of -999 dumps (see p3render.hpp) */
+int dumpFormat = RENDER_TABLE;
+/** where -999 dumps go: stdout, or the file given to -o */
+int dumpFd = STDOUT_FILENO;
+/** lines of the server's log shown, from the end (0 for all it keeps) */
+int logLines = 0;
 /** shared memory reader */
 #define SHM_READER 0
 /** shared memory writer */
 #define SHM_WRITER 1
-/** client logfile reader */
-#define LOG_READER 2
-/** client logfile writer */
-#define LOG_WRITER 3
+/** semaphores in the set (log.cli needs none, see p3log.hpp) */
+#define CLI_SEMS 2
 
 /** @brief main function */
 int main(int argc, char **argv) {
   if(signal(SIGINT, SIG_IGN) == SIG_ERR) // ignore SIGINT
 	perror("signal");	
 
-  if(!connectToServer()) return -1;
+  int opt, wanted = ENC_BITPACK, transport = XPORT_AUTO, batchMs = 0;
+  int port = PORT, replicaPort = PORT;
+  const char *addr = SERVER_ADDR, *dataset = NULL;
+  char *replicaAddr = NULL;
+  while((opt = getopt(argc, argv, "e:a:t:p:r:L:d:o:n:")) != -1) {
+	switch(opt) {
+	case 'e': // encoding for -999 dumps
+	  if(strcmp(optarg, "raw") == 0) wanted = ENC_RAW;
+	  else if(strcmp(optarg, "varint") == 0) wanted = ENC_VARINT;
+	  else if(strcmp(optarg, "bitpack") == 0) wanted = ENC_BITPACK;
+	  else {
+		cout << "Error: unknown encoding '" << optarg << "'" << endl;
+		return -1;
+	  }
+	  break;
+	case 'a': // server address
+	  addr = optarg;
+	  break;
+	case 'p': // server port
+	  port = atoi(optarg);
+	  break;
+	case 'r': // read replica, replicaIP[:port]
+	  replicaAddr = optarg;
+	  if(strchr(optarg, ':')) {
+		*strchr(optarg, ':') = '\0';
+		replicaPort = atoi(optarg + strlen(optarg) + 1);
+	  }
+	  break;
+	case 't': // transport
+	  if(strcmp(optarg, "tcp") == 0) transport = XPORT_TCP;
+	  else if(strcmp(optarg, "unix") == 0) transport = XPORT_UNIX;
+	  else if(strcmp(optarg, "shm") == 0) transport = XPORT_SHM;
+	  else if(strcmp(optarg, "auto") == 0) transport = XPORT_AUTO;
+	  else {
+		cout << "Error: unknown transport '" << optarg << "'" << endl;
+		return -1;
+	  }
+	  break;
+	case 'L': // batch log.cli lines for up to this many ms
+	  batchMs = atoi(optarg);
+	  break;
+	case 'd': // named dataset of the server's catalog
+	  dataset = optarg;
+	  break;
+	case 'o': // format[:file] of -999 dumps
+	  if(strchr(optarg, ':')) {
+		*strchr(optarg, ':') = '\0';
+		const char *path = optarg + strlen(optarg) + 1;
+		if((dumpFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		  perror(path);
+		  return -1;
+		}
+	  }
+	  if((dumpFormat = renderFormat(optarg)) < 0) {
+		cout << "Error: unknown dump format '" << optarg << "'" << endl;
+		return -1;
+	  }
+	  break;
+	case 'n': // last lines of the server's log shown
+	  logLines = max(0, atoi(optarg));
+	  break;
+	default:
+	  cout << "Usage: " << argv[0] << " [-a server IP] [-p port] [-t auto|tcp|unix|shm]"
+		   << " [-e raw|varint|bitpack] [-r replicaIP[:port] | -d dataset] [-L ms]"
+		   << " [-o table|csv|tsv|raw[:file]] [-n lines]" << endl;
+	  return -1;
+	}
+  }
+  if(replicaAddr && dataset) {
+	cout << "Error: replicas do not serve datasets" << endl;
+	return -1;
+  }
+
+  if((server = reader = connectToServer(addr, port, transport, wanted, dataset)) == NULL)
+	return -1;
+  if(replicaAddr) { // reads go to the replica
+	if((reader = connectToServer(replicaAddr, replicaPort, transport, wanted, NULL)) == NULL) {
+	  p3Close(server);
+	  return -1;
+	}
+  }
+  if(!logOpen("log.cli", batchMs)) {
+	cout << "Error: Cannot open client log file" << endl;
+	return -1;
+  }
   if(!semSetup()) return -1;
   if(!shmSetup()) return -1;
 
+  int version, num = p3Shards(server, &version);
+  if(num > 0)
+	cout << "Server is sharded: " << num << " shards, map version "
+		 << version << endl;
+
   cout << "Connected to server (client PID: " << getpid() << ")" << endl
-       << "Viewing Materials in the U.S. municipal waste stream between 1960 and 2018"
-       << endl;
+       << "Viewing " << SCHEMA::title;
+  if(dataset)
+	cout << " (dataset " << dataset << ")";
+  cout << endl;
 
   clientLoop();
 
@@ -53,7 +158,7 @@ int main(int argc, char **argv) {
 }
 
 /** 
- * @brief signal handler for exit, closes sockets
+ * @brief signal handler for exit, closes connections
  */
 void closeHandler(int sig) {
   writeLog("disconnecting from server");
@@ -63,7 +168,7 @@ void closeHandler(int sig) {
   if(shmptr->num_clis == 0) {
 	cout << "Shutting down shm and semaphores on this machine"<< endl;
 	shmctl(shmid, IPC_RMID, 0); // clear shm
-	semctl(sem, 0, IPC_RMID); // clear sem
+	lockRemove(sem); // clear sem
   }
 
   shmptr->cli_info[clinum].cli = -1;
@@ -71,48 +176,72 @@ void closeHandler(int sig) {
   V(sem, SHM_WRITER);
   
   cout << "Sending disconnect msg to server" << endl;
-  MESSAGE msg = clearMsg();
-  msg.request = 99;
-  write(sockfd, &msg, sizeof(MESSAGE)); // tell server we are disconnecting
-  
-  close(sockfd);
+  p3Close(server); // tells the server (and its shards) we are disconnecting
+  if(reader != server)
+	p3Close(reader);
   cout << "Client successfully closed" << endl;
+  logClose();
   exit(0);
 }
 
 /** 
- * @brief connects to the server on acad, send 'hello' message 
- * @return true if successful, false otherwise
+ * @brief connects to the server on acad through libp3client
+ * @param addr server IP
+ * @param port server port
+ * @param transport XPORT_AUTO uses the unix socket if the server is local
+ * @param wanted the encoding this client would like for -999 dumps
+ * @param dataset named dataset of the server's catalog, NULL for its own data
+ * @return the connection, NULL on error
 */
-bool connectToServer() {
-  struct sockaddr_in server = {AF_INET, htons(PORT), inet_addr(SERVER_ADDR)};
-  if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
-	perror("cannot open socket");
-	return false;	  
-  }
-  if(connect(sockfd, (struct sockaddr *) &server, sizeof(server)) < 0) {
-	perror("cannot connect to server");
-	return false;
+P3CLIENT *connectToServer(const char *addr, int port, int transport, int wanted,
+						  const char *dataset) {
+  P3OPTIONS opt = p3Options(addr, port);
+  opt.transport = transport;
+  opt.encoding = wanted;
+  opt.dataset = dataset;
+  string error;
+  P3CLIENT *cl = p3Open(opt, &error);
+  if(cl == NULL) {
+	cout << error << endl;
+	return NULL;
   }
 
-  // say hello, give server our PID
-  MESSAGE msg = clearMsg();
-  if(write(sockfd, &msg, sizeof(MESSAGE)) < 0) {
-	perror("cannot send message to server");
-	return false;
-  }
-  
-  return true;
+  if(transport == XPORT_SHM && p3Transport(cl) != XPORT_SHM)
+	cout << "Shared memory transport refused, staying on unix socket" << endl;
+  cout << "Transport to " << addr << ": " << xportName(p3Transport(cl)) << endl;
+  return cl;
 }
 
 
-/**
+/** 
+ * @brief waits for an operation to finish and counts its messages. A
+ * connection that failed ends the client, like any other lost server. A
+ * server still busy after the library's retries is reported, and the
+ * caller goes back to the menu.
+ * @param f the operation
+ * @param what what it was doing, for the error message
+ * @return the result
+*/
+P3RESULT finish(future<P3RESULT> f, const char *what) {
+  P3RESULT r = f.get();
+  incCommands(r.messages);
+  if(r.status == P3_ERROR || r.status == P3_TIMEOUT || r.status == P3_CLOSED) {
+	cout << what << ": " << r.error << endl;
+	closeHandler(-1);
+	exit(-1);
+  }
+  if(r.status == P3_BUSY)
+	cout << "Server busy, try again in " << r.retryAfter << " ms" << endl << endl;
+  return r;
+}
+
+/** 
  * @brief sets up semaphores. create if needed, otherwise access existing
  * @return true on success
 */
 bool semSetup() {
-  if((sem = semget(getuid(), 4, 0)) < 0) { // access existing
-	if((sem = semget(getuid(), 4, 0666|IPC_CREAT|IPC_EXCL)) < 0) { // create
+  if((sem = lockGet(getuid(), CLI_SEMS, 0666)) < 0) { // access existing
+	if((sem = lockGet(getuid(), CLI_SEMS, 0666|IPC_CREAT|IPC_EXCL)) < 0) { // create
 	  perror("Error creating semaphores");
 	  return false;
 
@@ -120,13 +249,9 @@ bool semSetup() {
 	  // creator initially blocks all
 	  V(sem, SHM_READER);
 	  V(sem, SHM_WRITER);
-	  V(sem, LOG_READER);
-	  V(sem, LOG_WRITER);
 	  /*
 	  P(sem, SHM_READER);
 	  P(sem, SHM_WRITER);
-	  P(sem, LOG_READER);
-	  P(sem, LOG_WRITER);
 	  */
 	  clinum = 0;
 	}
@@ -137,7 +262,7 @@ bool semSetup() {
   return true;
 }
 
-/**
+/** 
  * @brief sets up shared memory. create if needed, otherwise access existing
  * @return true on success
 */
@@ -197,10 +322,6 @@ bool shmSetup() {
   shmptr->cli_info[clinum] = cli_info; // copy local cli_info to shm
   shmptr->num_clis++; // increase client count
 
-  P(sem, LOG_WRITER);
-  logfile = fopen("log.cli", "a");
-  V(sem, LOG_WRITER);
-
   if(shmptr->num_clis == 1)
 	cout << "Shared memory created on machine" << endl;
   else
@@ -209,8 +330,6 @@ bool shmSetup() {
   //V(sem, SHM_WRITER); // RELEASE LOCK
   if(creator) {
 	V(sem, SHM_READER);
-	V(sem, LOG_READER);
-	V(sem, LOG_WRITER);
   }
   
   V(sem, SHM_WRITER);
@@ -242,6 +361,8 @@ MESSAGE clearMsg() {
   msg.sender = getpid();
   msg.msg_type = 1;
   msg.request = -1;
+  msg.rec = 0;
+  msg.gen = 0;
   return msg;
 }
 
@@ -256,6 +377,10 @@ void showMenu() {
   cout << "3) Modify Record" << endl;
   cout << "4) Show Log" << endl;
   cout << "5) Show Local Clients" << endl;
+  cout << "6) Show Replication Status" << endl;
+  cout << "7) Delete Record" << endl;
+  cout << "8) Display Records Sorted by a Field" << endl;
+  cout << "9) Display Field Statistics" << endl;
   cout << "(-1 to quit)" << endl;
 }
 
@@ -294,6 +419,22 @@ void clientLoop() {
 	  printShm();
 	  break;
 
+	case 6: // replication
+	  showReplStatus(msg);
+	  break;
+
+	case 7: // delete
+	  deleteRecord(msg);
+	  break;
+
+	case 8: // top / sorted page
+	  sortedRecords(msg);
+	  break;
+
+	case 9: // totals per field
+	  fieldStats(msg);
+	  break;
+
 	case -1: // quit
 	  //kill(getpid(), SIGINT);
 	  closeHandler(-1);
@@ -311,48 +452,7 @@ void clientLoop() {
  * @brief displays header for when printing record
  */
 void printHeader() {
-  cout << "Materials in the U.S. municipal waste stream between 1960 and 2018" << endl;
-  cout << "(in 1000 tons)" << endl;
-  cout << "----------------------------------" << endl;
-  cout << left << setw(6) << "Year"
-	   << left << setw(10) << "Paper"
-	   << left << setw(10) << "Glass"
-	   << left << setw(10) << "Metals"
-	   << left << setw(10) << "Plastics"
-	   << left << setw(10) << "Rubber"
-	   << left << setw(10) << "Textiles"
-	   << left << setw(10) << "Wood"
-	   << left << setw(10) << "Other" << endl;
-}
-
-
-/** 
- * @brief sends the given message to the server
- * @param msg the message to be sent
- */
-void sendMessage(MESSAGE msg) {
-  if(write(sockfd, &msg, sizeof(MESSAGE)) < 0) {
-	perror("cannot send message to server");
-	closeHandler(-1);
-	exit(-1);
-  }
-  incCommands();
-}
-
-
-/** 
- * @brief waits for server to send number of records
- * @return number of records
- */
-int getNumRecords() {
-  MESSAGE msg;
-  if(read(sockfd, &msg, sizeof(MESSAGE)) == -1) {
-	perror("getnumrecords read");
-	closeHandler(-1);
-	exit(-1);
-  }
-  incCommands();
-  return msg.request;
+  schemaHeader<SCHEMA>(cout);
 }
 
 
@@ -361,29 +461,28 @@ int getNumRecords() {
  * @param msg the message to be sent
  */
 void createRecord(MESSAGE msg) {
-  msg = clearMsg();
-  msg.request = 1;
-  cout << "Enter the data for a new record (in 1000 tons) as integers" << endl;
-  string fields[9] = {"Year", "Paper", "Glass", "Metals",
-	"Plastics", "Rubber", "Textiles", "Wood", "Other"};
+  cout << "Enter the data for a new record (" << SCHEMA::unit << ") as integers" << endl;
 
-  for(int i=0; i < 9; i++) {
+  for(int i=0; i < PACK_COLS; i++) {
 	int input;
-	cout << fields[i] << ": ";
+	cout << schemaName(i) << ": ";
 	cin >> input;
 	msg.buffer[i] = input;
 	cin.clear();
   }
-  sendMessage(msg);
-
-  MESSAGE msg_recv;
-  if(read(sockfd, &msg_recv, sizeof(MESSAGE)) == -1) { // get 1 record
-	perror("error getting creation acknowledgement");
-	closeHandler(-1);
-	exit(-1);
+  // the open shard takes new records
+  P3RESULT r = finish(p3Create(server, msg.buffer), "error getting creation acknowledgement");
+  if(r.status == P3_BUSY)
+	return;
+  if(r.status == P3_READONLY) {
+	cout << "Server is a read-only replica, record not created" << endl << endl;
+	return;
   }
-  incCommands();
-  
+  if(r.status == P3_INVALID) {
+	cout << "A " << schemaName(0) << " of " << SCHEMA_TOMBSTONE << " marks deleted records, record not created" << endl << endl;
+	return;
+  }
+
   cout << "Server confirms record created" << endl << endl;
   writeLog("created new record");
 }
@@ -395,167 +494,266 @@ void createRecord(MESSAGE msg) {
  */
 void displayRecord(MESSAGE msg) {
   // get number of records from server
-  msg = clearMsg();
-  msg.request = 10;
-  sendMessage(msg);
-  int numRecords = getNumRecords();
+  P3RESULT r = finish(p3Count(reader), "getnumrecords read");
+  if(r.status == P3_BUSY)
+	return;
+  long long lastRecord = r.last;
 
   // ask user to select a record
-  int rNum = -1;
-  while(rNum != -999 && (rNum < 1 || rNum > numRecords)) {
-	cout << "Enter a record number between 1-" << numRecords << " (-999 for all): ";
+  long long rNum = -1;
+  while(rNum != -999 && (rNum < 1 || rNum > lastRecord)) {
+	cout << "Enter a record number between 1-" << lastRecord << " (-999 for all): ";
 	cin >> rNum;
   }
-  if(rNum != -999)
-	numRecords = 1;
-  
-  // tell server which record(s) to send
-  msg = clearMsg();
-  msg.request = 2;
-  msg.buffer[0] = rNum;
-  sendMessage(msg); 
+
+  // records of a dump arrive compressed, fanned out to shards, or one by one
+  r = finish(rNum == -999 ? p3GetAll(reader) : p3Get(reader, rNum), "get record read");
+  if(r.status == P3_BUSY)
+	return;
+
+  size_t rows = r.rows.size() / PACK_COLS;
+  if(rNum == -999 && (dumpFormat != RENDER_TABLE || dumpFd != STDOUT_FILENO)) {
+	cout << flush; // the dump bypasses cout
+	if(!renderHeader<SCHEMA>(dumpFd, dumpFormat)
+	   || !renderRows<SCHEMA>(dumpFd, dumpFormat, r.rows.data(), rows))
+	  perror("cannot write dump");
+	if(dumpFd != STDOUT_FILENO)
+	  cout << rows << " records written" << endl;
+	cout << endl;
+	writeLog("requested to view record #" + to_string(rNum));
+	return;
+  }
 
   cout << endl;
   printHeader();
-
-  for(int i=0; i < numRecords; i++) { // get all records requested
-	MESSAGE msg_recv;
-	if(read(sockfd, &msg_recv, sizeof(MESSAGE)) == -1) { // get 1 record
-	  perror("get record read");
-	  closeHandler(-1);
-	  exit(-1);
-	}
-	incCommands();
-	
-	for(int i=0; i < 9; i++) { // print 1 record
-	  if(i%9 == 0) cout << setw(6);
-	  else cout << setw(10);
-	  cout << left << msg_recv.buffer[i];
-	  if(i%9 == 8) cout << endl;
-	} // end for
-
-  } // end for
+  if(r.status == P3_DELETED)
+	cout << "(record deleted)" << endl;
+  cout << flush; // rows are written past cout, in one go
+  renderRows<SCHEMA>(STDOUT_FILENO, RENDER_TABLE, r.rows.data(), rows);
   cout << "----------------------------------" << endl << endl;
   writeLog("requested to view record #" + to_string(rNum));
 } // end displayMessage
 
 
+/** 
+ * @brief prints 1 record below the header
+ * @param rec the fields of the record
+ */
+void printRecord(const int *rec) {
+  schemaPrint<SCHEMA>(cout, rec);
+}
+
+
 /** 
  * @brief prompts user to select a record, then modify it
  * @param msg the message to be sent
  */
 void modifyRecord(MESSAGE msg) {
-  msg = clearMsg();
-  msg.request = 10;
-  sendMessage(msg); // ask for # of records
-
-  MESSAGE msg_recv;
-  int numRecords = getNumRecords();
-  int rNum = -1;
+  P3RESULT r = finish(p3Count(server), "getnumrecords read");
+  if(r.status == P3_BUSY)
+	return;
+  long long numRecords = r.last;
+  long long rNum = -1;
   while(rNum < 1 || rNum > numRecords) {
 	cout << "Enter a record number between 1-" << numRecords << ": ";
 	cin >> rNum;
   }
 
   // ask server for record number 'rNum'
-  //clearMsg(msg);
-  msg.request = 2;
-  msg.buffer[0] = rNum;
-  sendMessage(msg);
-
-  if(read(sockfd, &msg_recv, sizeof(MESSAGE)) == -1) {
-	perror("read");
-	closeHandler(-1);
-	exit(-1);
+  r = finish(p3Get(server, rNum), "read");
+  if(r.status == P3_BUSY)
+	return;
+  if(r.status == P3_DELETED) {
+	cout << "Record #" << rNum << " has been deleted" << endl << endl;
+	return;
   }
-  incCommands();
-	
+
   // show record from server
   cout << endl;
   printHeader();
-  for(int i=0; i < 9; i++) {
-	if(i%9 == 0) cout << setw(6);
-	else cout << setw(10);
-	cout << left << msg_recv.buffer[i];
-	if(i%9 == 8) cout << endl;
-  }
+  printRecord(r.rows.data());
   cout << "----------------------------------" << endl << endl;
-  
+
   // display menu to user
-  string fields[9] = {"Year", "Paper", "Glass", "Metals",
-	"Plastics", "Rubber", "Textiles", "Wood", "Other"};
-  for(int i=0; i < 9; i++)
-	cout << i << ") " << fields[i] << endl; 
+  for(int i=0; i < PACK_COLS; i++)
+	cout << i << ") " << schemaName(i) << endl;
   cout << endl;
-  
+
   int val, field = -1;
-  while(field < 0 || field >= 9) { 
-	cout << "Select a field to modify (0-8): ";
+  while(field < 0 || field >= PACK_COLS) {
+	cout << "Select a field to modify (0-" << PACK_COLS - 1 << "): ";
 	cin >> field;
   }
 
-  cout << endl << "Enter a new value for '" << fields[field] << "': ";
+  cout << endl << "Enter a new value for '" << schemaName(field) << "': ";
   cin >> val;
 
   // send 'modifyRecord' request
-  //clearMsg(msg);
-  msg.buffer[9] = rNum - 1;
-  msg.request = 3;
-
-  for(int i=0; i < 9; i++) {
+  for(int i=0; i < PACK_COLS; i++) {
 	if(i == field)
 	  msg.buffer[i] = val; // new value
 	else
-	  msg.buffer[i] = msg_recv.buffer[i]; // old value
+	  msg.buffer[i] = r.rows[i]; // old value
   }
-  
-  sendMessage(msg);
 
-  if(read(sockfd, &msg, sizeof(MESSAGE)) == -1) {
-	perror("error getting modify acknowledgement");
-	closeHandler(-1);
-	exit(-1);
+  r = finish(p3Modify(server, rNum, msg.buffer), "error getting modify acknowledgement");
+  if(r.status == P3_BUSY)
+	return;
+  if(r.status == P3_READONLY) {
+	cout << "Server is a read-only replica, record not modified" << endl << endl;
+	return;
   }
-  incCommands();
-  
+  if(r.status == P3_DELETED) {
+	cout << "Record #" << rNum << " was deleted meanwhile, not modified" << endl << endl;
+	return;
+  }
+  if(r.status == P3_INVALID) {
+	cout << "A " << schemaName(0) << " of " << SCHEMA_TOMBSTONE << " marks deleted records, record not modified" << endl << endl;
+	return;
+  }
+
   cout << "Server confirms record modified" << endl << endl;
   writeLog("modified record #" + to_string(rNum));
 } // end modifyRecord
 
 
 /** 
- * @brief receives logs from server through multiple transmissions
+ * @brief prompts user to select a record, then deletes it
  * @param msg the message to be sent
  */
-void showLog(MESSAGE msg) {
-  msg.request = 4;
-  sendMessage(msg); 
-  // server responds with # of log messages
-  if(read(sockfd, &msg, sizeof(MESSAGE)) == -1) {
-	perror("read");
-	closeHandler(-1);
-	exit(-1);
+void deleteRecord(MESSAGE msg) {
+  P3RESULT r = finish(p3Count(server), "getnumrecords read");
+  if(r.status == P3_BUSY)
+	return;
+  long long numRecords = r.last;
+  long long rNum = -1;
+  while(rNum < 1 || rNum > numRecords) {
+	cout << "Enter a record number between 1-" << numRecords << ": ";
+	cin >> rNum;
   }
-  incCommands();
-	
-  int numLogs = msg.request; // number of times server needs to send LOGMSG
-  LOGMSG log;
-  log.sender = getpid();
-  log.msg_type = 1;
-  
-  for(int i=0; i < numLogs; i++) { // one LOGMSG is 1 line in the logfile
-	memset(log.buffer, ' ', LOGSIZE);
-	if(read(sockfd, &log, sizeof(LOGMSG)) == -1) {
-	  perror("read");
-	  closeHandler(-1);
-	  exit(-1);
-	}
-	cout << log.buffer << endl;
+
+  r = finish(p3Delete(server, rNum), "error getting delete acknowledgement");
+  if(r.status == P3_BUSY)
+	return;
+  if(r.status == P3_READONLY) {
+	cout << "Server is a read-only replica, record not deleted" << endl << endl;
+	return;
+  }
+  if(r.status == P3_DELETED) {
+	cout << "Record #" << rNum << " was already deleted" << endl << endl;
+	return;
+  }
+
+  cout << "Server confirms record deleted" << endl << endl;
+  writeLog("deleted record #" + to_string(rNum));
+}
+
+
+/** 
+ * @brief prompts for a field, an order and a page, then displays the
+ * records of that page with their record numbers
+ * @param msg the message to be sent
+ */
+void sortedRecords(MESSAGE msg) {
+  for(int i=0; i < PACK_COLS; i++)
+	cout << i << ") " << schemaName(i) << endl;
+  cout << endl;
+
+  int field = -1, order = -1, count = 0;
+  long long first = 0;
+  while(field < 0 || field >= PACK_COLS) {
+	cout << "Select a field to sort by (0-" << PACK_COLS - 1 << "): ";
+	cin >> field;
+  }
+  while(order != 0 && order != 1) {
+	cout << "Largest first? (1 yes, 0 no): ";
+	cin >> order;
   }
-  incCommands();
+  while(first < 1) {
+	cout << "Start at position (1 for the top): ";
+	cin >> first;
+  }
+  while(count < 1 || count > SORT_MAX) {
+	cout << "Number of records (1-" << SORT_MAX << "): ";
+	cin >> count;
+  }
+
+  P3RESULT r = finish(p3Sorted(reader, field, order == 1, first - 1, count), "sorted read");
+  if(r.status == P3_BUSY)
+	return;
+
+  cout << endl;
+  printHeader();
+  for(size_t i=0; i < r.recs.size(); i++) {
+	cout << "#" << left << setw(7) << r.recs[i];
+	printRecord(&r.rows[i * PACK_COLS]);
+  }
+  cout << "----------------------------------" << endl;
+  cout << "Sorted by " << schemaName(field) << (order ? ", largest first" : ", smallest first")
+	   << (r.indexed ? " (index)" : " (scan)") << endl << endl;
+  writeLog("requested records sorted by " + string(schemaName(field)));
+}
+
+
+/** 
+ * @brief displays the total, mean, smallest and largest value of every
+ * field over the records not deleted
+ * @param msg the message to be sent
+ */
+void fieldStats(MESSAGE msg) {
+  P3RESULT r = finish(p3Stats(reader, false), "statistics");
+  if(r.status == P3_BUSY)
+	return;
+
+  cout << "----------------------------------" << endl;
+  cout << "Statistics of " << r.count << " records (" << SCHEMA::unit << ")" << endl;
+  cout << left << setw(10) << "Field" << right << setw(14) << "Total" << setw(12) << "Mean"
+	   << setw(12) << "Min" << setw(12) << "Max" << endl;
+  for(int f=0; f < PACK_COLS && r.count > 0; f++)
+	cout << left << setw(10) << schemaName(f) << right << setw(14) << r.stats[f].sum
+		 << setw(12) << fixed << setprecision(1) << (double)r.stats[f].sum / r.count
+		 << setw(12) << r.stats[f].min << setw(12) << r.stats[f].max << endl;
+  cout << defaultfloat;
+  cout << "----------------------------------" << endl << endl;
+  writeLog("displayed field statistics");
+}
+
+
+/** 
+ * @brief receives logs from server through multiple transmissions
+ * @param msg the message to be sent
+ */
+void showLog(MESSAGE msg) {
+  // one LOGMSG is 1 line in the logfile
+  P3RESULT r = finish(p3Log(reader, logLines), "read");
+  if(r.status == P3_BUSY)
+	return;
+  for(const string &line : r.log)
+	cout << line << endl;
   writeLog("displayed server's log file");
 }
 
+
+/** 
+ * @brief shows how far the replica (or the server itself) is behind the
+ * primary's journal
+ * @param msg the message to be sent
+ */
+void showReplStatus(MESSAGE msg) {
+  P3RESULT r = finish(p3ReplStatus(reader), "read");
+  if(r.status == P3_BUSY)
+	return;
+
+  cout << "-------------------------" << endl;
+  cout << "Reading from: " << (r.replica ? "replica" : "primary") << endl;
+  cout << "Applied seq:  " << r.applied << endl;
+  cout << "Primary seq:  " << r.primarySeq << endl;
+  cout << "Lag:          " << r.lag << " ms" << endl;
+  cout << "Connected:    " << (r.linked ? "yes" : "no") << endl;
+  cout << "-------------------------" << endl << endl;
+  writeLog("displayed replication status");
+}
+
 /** 
  * @brief displays contents of ALL shared memory on this machine
  */
@@ -567,7 +765,7 @@ void printShm() {
 	   << setw(20) << "start time" << setw(20) << "last msg time" << endl;
   CLI_INFO c;
 
-  P(sem, SHM_WRITER);
+  PR(sem, SHM_WRITER); // other clients listing it read along
   
   for(int i=0; i < MAX_CLI; i++) {
 	c = shmptr->cli_info[i];
@@ -584,26 +782,25 @@ void printShm() {
   }
   cout << "-------------------------" << endl;
 
-  V(sem, SHM_WRITER);
+  VR(sem, SHM_WRITER);
 }
 
 /** 
- * @brief writes to the LOCAL client log file
+ * @brief writes to the LOCAL client log file, shared with the other clients
+ * on this machine. The line is appended whole, without a lock.
  * @param s text to be written
  */
 void writeLog(string s) {
   string str = "PID: " + to_string(getpid()) + " | " + s + "\n";
-  P(sem, LOG_WRITER);
-  fseek(logfile, 0, SEEK_END); // unnecessary
-  fwrite(str.c_str(), sizeof(char) * str.length(), 1, logfile);
-  V(sem, LOG_WRITER);
+  logLine(str.c_str(), str.length());
 }
 
 /**
- * @brief increments number of commands (in shm) for this client 
+ * @brief adds to the number of commands (in shm) for this client 
+ * @param n messages sent and received
  */
-void incCommands() {
-  cli_info.commands++;
+void incCommands(int n) {
+  cli_info.commands += n;
   tm *t = getTime();
   cli_info.last_time = *t;
   
@@ -639,11 +836,18 @@ void incCommands() {
  * the machine, they remove all shared memory. </p>
  * <h2> Semaphores </h2>
  * <p> Semaphores are used on both the client and server to prevent race conditions
- * when accessing shared memory, logfiles, or the binary data file. </p>
+ * when accessing shared memory, the server's logfile, or the binary data file. </p>
  * <p> P() and V() are defined in p3.hpp and will block / signal, respectively. 
  * The setup works similar to the shared memory, if sempahores do not exist then
  * the process will create them, and remove on disconnect if necessary. Both the
  * client and the server keep a log, clients on the same machine share a logfile. </p>
+ * <p> A semaphore set is a set of locks in shared memory (p3lock.hpp). Taking
+ * a free one and giving it back are single atomic instructions; only a
+ * process that has to wait sleeps, in a futex wait. PR() and VR() share a
+ * lock among readers, as the log and shared-memory views do. A waiter checks
+ * every 100 ms whether the holder is still alive and takes back the hold of
+ * one that died, so a client killed in the middle of P() ... V() does not
+ * wedge the other clients on its machine. </p>
  * <h2> </h2>
  * <h2> Message Request ID Information </h2>
  * <p>The MESSAGE contains an "int request" that identifies which operation
@@ -658,7 +862,23 @@ void incCommands() {
  * </tr> <tr>
  * <td>4</td> <td>show log file </td>
  * </tr> <tr>
+ * <td>5</td> <td>delete a record </td>
+ * </tr> <tr>
  * <td>10</td> <td>get number of records </td>
+ * </tr> <tr>
+ * <td>11</td> <td>set encoding for -999 dumps </td>
+ * </tr> <tr>
+ * <td>12</td> <td>switch to shared-memory transport </td>
+ * </tr> <tr>
+ * <td>20</td> <td>subscribe to the mutation journal (replicas) </td>
+ * </tr> <tr>
+ * <td>22</td> <td>get replication status </td>
+ * </tr> <tr>
+ * <td>30</td> <td>get shard map </td>
+ * </tr> <tr>
+ * <td>40</td> <td>get records sorted by a field </td>
+ * </tr> <tr>
+ * <td>41</td> <td>get count, sum, min and max of every field </td>
  * </tr>
  * </table>
  * <p>Clients may also display the contents of the shared memory on their machine.
@@ -676,15 +896,256 @@ void incCommands() {
  * enter a record number, which is sent back to the server. The server looks up
  * the client's requested record and fills the MESSAGE buffer with it. Then the 
  * client recieves the record and prints it.
- * If -999 is entered (display all), the server once again sends
- * the number of records (in case it has been modified in the meantime). The client then
- * loops for the number of records: each record is sent in a different msgsnd.
+ * If -999 is entered (display all), the server sends the records in
+ * chunks: a MESSAGE with the number of records in the chunk, then each
+ * record in a MESSAGE of its own. A chunk of 0 records ends the dump, so
+ * the client never relies on a count taken earlier.
  * </p>
  * <h4>Modify Record</h4>
  * The client requests the number of records. Then they are prompted to enter the record
  * number to modify. The 9 data fields are displayed, and the client selects one.
  * They enter the new value, and the MESSAGE buffer is filled with the entire record, 
  * with the old value replaced. The server then sends a confirmation of success.
+ * <h4>Compressed Dumps</h4>
+ * Right after connecting, the client sends request 11 with the encoding it
+ * wants in buffer[0] (see p3pack.hpp), and the server answers with the
+ * encoding it will actually use. With a compressed encoding, a -999 dump is
+ * sent in chunks of up to PACK_CHUNK records: a MESSAGE holding the number of
+ * records (request) and the encoded size (buffer[0]), followed by the encoded
+ * bytes. Each column is delta coded and zig-zag mapped, then written either as
+ * varints or bit-packed in blocks of PACK_BLOCK rows. A chunk of 0 records ends
+ * the dump. "./client -e raw" keeps 1 MESSAGE per record, in the chunks
+ * described under Display Record.
+ * <h4>Transports</h4>
+ * The server listens on TCP and on the unix domain socket /tmp/p3.PORT.sock.
+ * A client whose server address belongs to its own machine connects through
+ * the unix socket, skipping the TCP stack. With "-t shm" it then sends request
+ * 12; the server creates a shared-memory segment with one SPSC ring per
+ * direction and replies with its id, the client attaches and confirms over the
+ * socket, and from then on every MESSAGE goes through the rings (futex wakeups
+ * when a side has to wait). The segment belongs to the user the socket says
+ * the client runs as (SO_PEERCRED), mode 0600, so like the socket it works
+ * for clients of any user, and no other user can attach to it. Requests
+ * behave the same on every transport.
+ * <h4>Read Replicas</h4>
+ * "./server -p 9001 -r primaryIP" runs a read-only copy. The replica
+ * subscribes with request 20: the primary takes a snapshot of the data file
+ * and its journal position under the data file lock, sends the number of
+ * records and that position, then the records as compressed chunks. After
+ * that it streams every create and modify from its journal as a JENTRY
+ * (see p3repl.hpp), with a heartbeat each second while idle. The replica
+ * applies them in order and journals them itself, so replicas can chain.
+ * A replica that loses its primary takes a new snapshot when it reconnects
+ * and journals a reset entry, on which the replicas behind it take a new
+ * snapshot from it as well.
+ * Creates and modifies sent to a replica are answered with request -1.
+ * "./client -r replicaIP:9001" sends displays and log views to the replica and
+ * everything else to the primary; a display right after a write may not show
+ * it yet. Request 22 reports the last applied and newest journal positions and
+ * the lag in milliseconds.
+ * <h4>Shards</h4>
+ * "./server -p PORT -s shards.map" runs one shard. Every shard in the map owns
+ * a range of record numbers and has its own data file and semaphores, so
+ * modifies on different shards never wait for each other. The client asks
+ * the server it connects to for the map (request 30) and, if there is one,
+ * connects to each shard on first use. Display and modify go to the shard
+ * owning the record, with the record number made local to that shard. Creates
+ * go to the open shard (the one whose range has no end). The record count
+ * and -999 dumps are sent to all shards at once and merged in range order.
+ * With "-m N", the open shard seals its range at N records and the next spare
+ * becomes open, rewriting the map with a new version. Sharded clients send
+ * -(map version) in msg_type; a shard that has a newer map answers -2, and the
+ * client fetches the map again and resends.
+ * <h4>Snapshot Reads</h4>
+ * Displays (including -999 dumps) and record counts on the server no longer
+ * take the data file lock. Each one reads a snapshot: the record count and
+ * commit number published by the last create or modify. A modify first saves
+ * the row it overwrites in shared memory. Readers whose snapshot is older get
+ * that saved row instead of the new one. Saved rows are reused once no
+ * snapshot needs them (see p3mvcc.hpp). A slow client reading the whole
+ * file therefore no longer holds up creates and modifies.
+ * <h4>Record Locks and Appends</h4>
+ * A modify locks only its record's stripe (record number mod 256, one
+ * semaphore each). A create reserves the next record slot and commit number
+ * with one atomic fetch-add and writes its row there without any lock.
+ * Commits are published to readers in commit order, after their row is
+ * written, so the visible record count never covers a half-written row.
+ * If a server process dies between reserving a commit and publishing it,
+ * the next writer in line publishes it for it after 100 ms: undone if
+ * the dead writer's turn had not come (an appended slot is left as a
+ * deleted record), so later commits are never stuck behind it.
+ * <h4>Delete Record and Compaction</h4>
+ * Request 5 deletes record rec (0-based, like a modify) by overwriting
+ * it with a tombstone, a row whose Year is INT_MIN. Counts leave deleted
+ * records out: request 10 answers the records left in buffer[0-1], and the
+ * highest record number in rec, which clients use as the range to ask
+ * for. Dumps skip deleted records, and displaying or modifying one is
+ * answered with request -3. A create or modify with that Year would delete
+ * the record instead, and is answered with request -5, nothing written.
+ * A create, modify or delete the server cannot write (its I/O failed) is
+ * answered with request -6 and changes nothing; a slot it had taken is
+ * left as a deleted record.
+ * The next create reuses a deleted slot.
+ * Once "-c percent" (default 25) of the file is deleted, a background
+ * process on the server compacts it: writers wait while it writes the
+ * remaining records densely to a new file and renames it over the data file;
+ * readers carry on with the old file. Each compaction starts a new
+ * generation and leaves a map from old record numbers to new ones
+ * (CSC552p3.bin.remap.GEN). The count reply carries the generation in the
+ * MESSAGE's gen field and the client sends it back with record numbers, so
+ * the server maps them forward. A number for a record that is gone, or from
+ * a generation more than 8 compactions old, gets -3 instead of another
+ * record. Replicas compact at the same point in the journal; shards do not
+ * compact, since their ranges are record numbers.
+ * <h4>Admission Control</h4>
+ * The server turns a client away with request -4 (buffer[0] = ms to wait,
+ * buffer[1] = 1) when "-l" clients are already connected, rather than
+ * forking for it, and then closes the connection. With "-R" and "-D" every
+ * client (its address and pid) has a token bucket for point requests and
+ * one for scans, in shared memory, so opening more connections gains it
+ * nothing; a
+ * request with no token left is answered -4 (buffer[1] = 0) and the
+ * connection stays open. At most "-S" scans run at once, and those hand the
+ * slot to a waiting scan after every chunk, so a client dumping over and
+ * over cannot starve the others (see p3admit.hpp). The client library waits
+ * as asked and retries; this client says the server is busy if it still is.
+ * <h4>Output Queues</h4>
+ * Replies go to a per-connection output queue (up to "-O" MB, 4 by
+ * default) and the client gets what its socket or ring takes without the
+ * server waiting. So a dump, sorted page, statistics reply or log view is
+ * built while its snapshot and scan slot are held, and sent once they are
+ * let go. The rest of the queue goes out after the request. A client that
+ * takes nothing for 5 s while replies wait for it, with its queue full or
+ * at the end of a request, is disconnected (XPORT_STALL_MS, see
+ * p3xport.hpp), and that is logged. A slow client
+ * then only costs its own connection, not the scan slots or old record
+ * versions that other clients wait on.
+ * <h4>Data File Format</h4>
+ * The data file starts with a header holding a magic number, the format
+ * version, the record count and the generation, with a CRC32C of its own.
+ * Records follow in 4 KB blocks of 113, each block ending with a CRC32C of
+ * the block, computed with the SSE4.2 crc32 instruction where the CPU has
+ * it. A write puts its rows into the block and writes them with the
+ * block's new checksum in one pwrite, and rewrites the header's count when
+ * the file grew, so a torn append no longer changes the record count the
+ * way a file size did. A file from before, records back to back, is
+ * rewritten in this layout the first time the server opens it.
+ * On startup the server checks every block, split over all cpus, lists the
+ * corrupt ones and refuses to start if there are any (see p3store.hpp).
+ * "./server -F" instead reseals them, taking the rows as they are, and
+ * logs each block it resealed.
+ * Record numbers are 64-bit throughout, in the file, the journal, the
+ * remap files and on the wire (a MESSAGE carries one in rec), so a data file
+ * can hold more than 2^31 records and grow past 2 GB.
+ * <h4>Bulk Loading</h4>
+ * "./p3load data.csv" builds CSC552p3.bin from csv or tsv files, such as
+ * those "./client -o csv" writes, without a server: stop the server, load,
+ * start it again. Inputs are mapped and cut into 16 MB pieces at line ends,
+ * parsed with std::from_chars by -t threads at once (default one per cpu)
+ * and written in input order as checksummed blocks, 4 MB per write. Lines
+ * that are not a record are rejected with file, line and reason (see
+ * p3load.cpp). On one cpu, 2 million records (142 MB) load in about 0.4 s.
+ * <h4>Record Schema</h4>
+ * The record's columns are declared once, in p3schema.hpp, as a constexpr
+ * table of names and printed widths. The record size in the file and on
+ * the wire (STORE_COLS, PACK_COLS), the client's header, rows and field
+ * prompts, and the server's scans are all worked out from it at compile time. Scans that
+ * total every field, or pull one field out of each record for a sort, are
+ * templates instantiated per column, so their loops have the stride and
+ * column as constants; a sort picks the kernel for its field once.
+ * <h4>Request Tracing</h4>
+ * "./server -T 1" traces about 1% of requests. A traced request records,
+ * relative to when it was received, each wait in P() and hold until V() on
+ * every semaphore (and the scan slots and the commit turn), each data and log
+ * file read and write, and each write to the client. The child appends the
+ * request with its events to CSC552p3.trace in one write when it is done
+ * (see p3trace.hpp). Requests that are not picked only draw a random number.
+ * "./p3report" lists the slowest requests and totals per semaphore.
+ * <h4>Capture and Replay</h4>
+ * "./server -P" appends every request of every connection to
+ * CSC552p3.cap: its session, request number, the non-zero part of its
+ * buffer, rec and gen, and when it arrived, in about a third of a MESSAGE
+ * (see p3cap.hpp). "./p3bench replay CSC552p3.cap" sends the sessions again
+ * to a server, each on its own connection and process, at the captured
+ * times (speed 1), faster (2, 10, ...) or as fast as replies come (0), and
+ * each scale times at once; it reports throughput and latency per request
+ * number, so two server builds can be compared on the same traffic.
+ * <h4>Client Library</h4>
+ * The protocol side of this client lives in libp3client (p3client.hpp,
+ * "make libp3client.a", link with -pthread). p3Open connects to a server
+ * with a pool of connections, one thread each. p3Create, p3Get, p3GetAll,
+ * p3Modify, p3Delete, p3Count, p3Sorted, p3Stats, p3Log and p3ReplStatus
+ * queue a request and return a future, and take an optional callback run
+ * when the reply is in.
+ * The library handles transports, encodings, shards and generations, and
+ * never prints or exits: a lost or silent server (10 s timeout by default)
+ * comes back as P3_ERROR or P3_TIMEOUT and the connection is made again on
+ * the next request. This program is only the menu, the prompts and the
+ * local shared memory on top of it.
+ * <h4>Sorted Records</h4>
+ * Request 40 asks for a page of the records sorted by one field: the field
+ * (0-8) in buffer[0], 1 for largest first in buffer[1], the records to pass
+ * over in rec and how many to send (at most SORT_MAX) in buffer[3], so
+ * "ten years with the most Plastics" is 4, 1, 0, 10. The server answers with
+ * the number of records, then one MESSAGE per record with its number in
+ * rec. Every field is indexed unless "./server -x" says otherwise
+ * ("-x 0,4", "-x none"): each index keeps the records in value order in
+ * blocks of up to 256, updated by every create, modify and delete while it
+ * has its turn to publish, and rebuilt after a compaction. A page near
+ * either end of an index costs the same however large the file is. For a
+ * field without an index the server scans a snapshot, keeping only the
+ * records wanted so far in a heap, and the request counts as a scan for
+ * admission control (see p3index.hpp). Shards are each asked for their top
+ * records and the client merges them.
+ * <h4>Field Statistics</h4>
+ * Request 41 answers with the number of records in buffer[0-1], then one
+ * MESSAGE per field with its sum (low and high words in buffer[1-2]) and
+ * its smallest and largest value (buffer[3-4]), without reading a record.
+ * The server keeps these in shared memory: each create, modify and delete
+ * takes away the row it replaced and adds the one it wrote while it has its
+ * turn to publish. A value past the smallest or largest becomes it. When
+ * the smallest or largest value itself goes, the old value is kept as a
+ * bound, and the real one is worked out only when it is next asked for:
+ * from the ends of the field's index if it has one, else from a scan of a
+ * snapshot, which counts only if no write changed that field meanwhile
+ * (after two tries, writes wait for the scan). With buffer[0] = 1 the
+ * server also scans the whole file while writes wait and sends its own
+ * totals in buffer[5-8] and its count in the first reply's buffer[2-3];
+ * "./p3stat -v" uses this to check the two agree (see p3agg.hpp).
+ * <h4>Datasets</h4>
+ * "./server -C catalog" serves the data files named in a catalog besides its
+ * own, each under a name, all on its one port. "./client -d name" first
+ * sends request 50 with the name in buffer; from then on every request of
+ * that connection works on the dataset as usual, with the dataset's own
+ * locks, indexes and statistics. The reply gives the dataset's line in the
+ * catalog in buffer[1] and in buffer[0] 0 when it is in use, -1 if there is
+ * no such dataset or it cannot be opened. A dataset not open yet is opened
+ * by the server's opener process while the connection waits; it publishes
+ * the shared memory ids of the dataset's state in the catalog, and the
+ * process serving the connection attaches to them, whenever it was forked.
+ * The opener adds up the shared memory of each dataset and, over the -M
+ * budget, closes the ones no connection works on that were asked for
+ * longest ago; they are opened again when next asked for. One compactor and
+ * one log packer serve the server's data and every open dataset.
+ * <h4>Dump Output</h4>
+ * Records of a display are formatted with std::to_chars into a 1 MB buffer
+ * and written with write(2), bypassing cout (see p3render.hpp).
+ * "./client -o csv:dump.csv" sends -999 dumps to dump.csv as comma separated
+ * values instead of the table; tsv and raw (binary ints) work the same, and
+ * without ":file" they go to stdout. "./p3bench render" on a million
+ * records: about 0.86 M rows/s through cout, 3.9 M as a table, 6.7 M as csv
+ * and 45 M raw, written to a file.
+ * <h4>Client Log</h4>
+ * Clients on one machine share log.cli without a semaphore. It is opened
+ * with O_APPEND and each line goes to the kernel in a single write, which
+ * lands whole at the end of the file, so lines of different clients never
+ * mix. "./client -L ms" batches a client's lines into writes of up to 4 KB,
+ * sent when full or ms after the first line at the latest (see p3log.hpp).
+ * "./p3bench log" runs 30 processes appending at once to compare.
+ * <h4>Locks</h4>
+ * "./p3bench lock 4 1000000" takes and gives one lock from 4 processes:
+ * about 650 ns per P() + V() with semop, 25 ns with the futex locks (the
+ * system call is gone unless processes really wait), 50 ns shared.
  * <h4>Get Number of Records</h4>
  * The client requests the number of records in the data file. This is used
  * within the other Requests multiple times, so a separate request is easier. 
@@ -693,6 +1154,13 @@ void incCommands() {
  * The server first sends the number of lines in the file to the client using a MESSAGE,
  * then uses the LOGMSG's character array to send 1 line, looping until the entire file
  * has been sent.
+ * The log is kept in segments (see p3seg.hpp): log.ser is renamed to
+ * log.ser.N once it passes the server's -L size cap or -A age cap, the
+ * newest -k closed segments are kept and, with -z, compressed by a
+ * background gzip. log.ser.idx lists each closed segment's first line and
+ * line count. The request's buffer[0] asks for the last N lines (client
+ * -n, 0 for all); the server sends that many and opens only the segments
+ * holding them, reading packed ones through gzip -dc.
  * <h4>Show Local Clients</h4>
  * Displays the contents of the shared memory on this machine.
  */
@@ -0,0 +1,1068 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3client.cpp
+ * @brief      libp3client: connection pool, request queue and the protocol
+ *             spoken by the client (see p3client.hpp)
+ */
+#include "p3client.hpp"
+#include "p3pack.hpp"
+#include "p3xport.hpp"
+#include "p3shard.hpp"
+#include "p3admit.hpp"
+#include "p3dset.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/**
+ * one connection of the pool, only used by its own thread
+ */
+typedef struct {
+  /** connection to the server */
+  XPORT x;
+  /** x is connected */
+  bool open;
+  /** encoding agreed on x */
+  int encoding;
+  /** connections to the shards, by index in the map, NULL until first used */
+  XPORT *shard[MAX_SHARDS];
+  /** encoding agreed with the shards (always compressed) */
+  int shardEncoding;
+  /** MESSAGEs exchanged by the current operation */
+  int messages;
+  /** ms the server asked us to wait in its last busy reply */
+  int retry;
+} P3CONN;
+
+/**
+ * a queued operation
+ */
+typedef struct {
+  /** does the work on a connection */
+  std::function<void(P3CLIENT *, P3CONN *, P3RESULT *)> run;
+  /** called with the result, may be empty */
+  P3CALLBACK callback;
+  /** receives the result */
+  std::promise<P3RESULT> done;
+} P3TASK;
+
+struct P3CLIENT {
+  /** options, host copied */
+  P3OPTIONS opt;
+  /** server address */
+  std::string host;
+  /** connections, one per thread */
+  std::vector<P3CONN *> conns;
+  /** threads, one per connection */
+  std::vector<std::thread> threads;
+  /** guards queue and closing */
+  std::mutex lock;
+  /** signalled when a task is queued or the client closes */
+  std::condition_variable ready;
+  /** operations not started yet */
+  std::deque<P3TASK> queue;
+  /** p3Close was called */
+  bool closing;
+  /** generation of the last count, sent with record numbers */
+  int gen;
+  /** guards shards and gen */
+  std::mutex mapLock;
+  /** shard map from the server, num is 0 if it is not sharded */
+  SHARDMAP shards;
+  /** transport and encoding of the first connection */
+  int transport, encoding;
+};
+
+/**
+ * @brief a MESSAGE with default values (clearMsg() of the client)
+ */
+static MESSAGE newMsg(int request) {
+  MESSAGE msg;
+  memset(&msg, 0, sizeof(MESSAGE));
+  msg.sender = getpid();
+  msg.msg_type = 1;
+  msg.request = request;
+  return msg;
+}
+
+/**
+ * @brief a result with nothing filled in yet
+ */
+static P3RESULT newResult(int status) {
+  P3RESULT r;
+  r.status = status;
+  r.count = r.last = r.gen = 0;
+  r.replica = r.applied = r.primarySeq = r.lag = r.linked = 0;
+  r.indexed = 0;
+  r.scannedCount = -1;
+  r.messages = r.retryAfter = 0;
+  return r;
+}
+
+/**
+ * @brief closes a connection without saying goodbye
+ */
+static void drop(XPORT **x) {
+  if(*x) {
+	xportClose(*x);
+	delete *x;
+	*x = NULL;
+  }
+}
+
+/**
+ * @brief fills in a busy result with the wait the server asked for
+ */
+static void busyResult(P3CONN *c, P3RESULT *r) {
+  r->status = P3_BUSY;
+  r->retryAfter = c->retry;
+  r->error = "server busy, retry after " + std::to_string(c->retry) + " ms";
+}
+
+/**
+ * @brief records why an operation failed and drops the connection's links,
+ * which may be half way through a reply
+ * @param what what was being done
+ * @return false
+ */
+static bool fail(P3CONN *c, P3RESULT *r, const char *what) {
+  int err = errno;
+  r->status = err == ETIMEDOUT ? P3_TIMEOUT : P3_ERROR;
+  r->error = std::string(what) + ": "
+	+ (err == 0 ? "connection closed by server" : strerror(err));
+  if(err == EBUSY) // turned away, see busy()
+	busyResult(c, r);
+  if(c->open)
+	xportClose(&c->x);
+  c->open = false;
+  for(int i=0; i < MAX_SHARDS; i++)
+	drop(&c->shard[i]);
+  return false;
+}
+
+/**
+ * @brief sends one MESSAGE
+ */
+static bool put(P3CONN *c, XPORT *x, MESSAGE msg, P3RESULT *r) {
+  errno = 0;
+  if(!xportWrite(x, &msg, sizeof(MESSAGE)))
+	return fail(c, r, "cannot send message to server");
+  c->messages++;
+  return true;
+}
+
+/**
+ * @brief reads len bytes of a reply
+ */
+static bool get(P3CONN *c, XPORT *x, void *buf, size_t len, P3RESULT *r) {
+  errno = 0;
+  if(!xportRead(x, buf, len))
+	return fail(c, r, "cannot read reply from server");
+  c->messages++;
+  return true;
+}
+
+/**
+ * @brief true if msg is a busy reply (ADMIT_BUSY). A server that turned
+ * the connection away closes it; one that rate limited the request keeps it.
+ */
+static bool busy(P3CONN *c, const MESSAGE *msg, P3RESULT *r) {
+  if(msg->request != ADMIT_BUSY)
+	return false;
+  c->retry = msg->buffer[0];
+  errno = EBUSY;
+  if(msg->buffer[1]) // the server closed the connection
+	fail(c, r, "");
+  else
+	busyResult(c, r);
+  return true;
+}
+
+/**
+ * @brief reads the MESSAGE that starts a reply
+ * @return false on error or if it is a busy reply
+ */
+static bool reply(P3CONN *c, XPORT *x, MESSAGE *msg, P3RESULT *r) {
+  return get(c, x, msg, sizeof(MESSAGE), r) && !busy(c, msg, r);
+}
+
+/**
+ * @brief connects, says hello, moves onto shared memory if asked to and
+ * agrees on an encoding
+ * @param wanted encoding to ask for
+ * @param agreed output, the encoding the server will use
+ * @param retry output, the wait asked for if the server is busy
+ * @return false on error (why is in errno, EBUSY if turned away)
+ */
+static bool dial(P3CLIENT *cl, XPORT *x, const char *host, int port,
+				 int wanted, int *agreed, int *retry) {
+  if(!xportConnect(x, host, port, cl->opt.transport))
+	return false;
+  if(cl->opt.timeout > 0)
+	xportTimeout(x, cl->opt.timeout);
+
+  // say hello, give server our PID
+  MESSAGE msg = newMsg(-1);
+  bool ok = xportWrite(x, &msg, sizeof(MESSAGE));
+
+  if(ok && cl->opt.transport == XPORT_SHM) { // move onto shared-memory rings
+	msg.request = 12;
+	ok = xportWrite(x, &msg, sizeof(MESSAGE)) && xportRead(x, &msg, sizeof(MESSAGE));
+	if(ok && msg.request == ADMIT_BUSY) {
+	  *retry = msg.buffer[0];
+	  errno = EBUSY;
+	  ok = false;
+	}
+	if(ok) {
+	  bool attached = msg.buffer[0] >= 0 && xportShmAttach(x, msg.buffer[0]);
+	  msg = newMsg(12);
+	  msg.buffer[0] = attached ? 1 : 0;
+	  ok = xportWrite(x, &msg, sizeof(MESSAGE));
+	  if(ok && attached) // else it stays on the unix socket
+		xportShmStart(x);
+	}
+  }
+
+  *agreed = ENC_RAW;
+  if(ok && wanted != ENC_RAW) { // raw is the legacy format, nothing to ask
+	msg = newMsg(11);
+	msg.buffer[0] = wanted;
+	ok = xportWrite(x, &msg, sizeof(MESSAGE)) && xportRead(x, &msg, sizeof(MESSAGE));
+	*agreed = msg.buffer[0]; // server may fall back to raw
+	if(ok && msg.request == ADMIT_BUSY) {
+	  *retry = msg.buffer[0];
+	  errno = EBUSY;
+	  ok = false;
+	}
+  }
+  if(!ok) {
+	int err = errno;
+	xportClose(x);
+	errno = err;
+  }
+  return ok;
+}
+
+/**
+ * @brief asks the server to work on the dataset on this connection (request
+ * 50)
+ * @return false on error, with why in r
+ */
+static bool openDataset(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  MESSAGE msg = newMsg(50);
+  strncpy((char *)msg.buffer, cl->opt.dataset, DATASET_NAME - 1);
+  if(!put(c, &c->x, msg, r) || !reply(c, &c->x, &msg, r))
+	return false;
+  if(msg.request == 50 && msg.buffer[0] == 0)
+	return true;
+  r->status = P3_ERROR;
+  r->error = std::string(msg.buffer[1] < 0 ? "no such dataset: " : "cannot open dataset: ")
+	+ cl->opt.dataset;
+  return false;
+}
+
+/**
+ * @brief connects a pool connection to the server if it is not connected,
+ * and to the dataset if there is one
+ */
+static bool connectMain(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  if(c->open) return true;
+  errno = 0;
+  if(!dial(cl, &c->x, cl->host.c_str(), cl->opt.port, cl->opt.encoding, &c->encoding,
+			&c->retry))
+	return fail(c, r, "cannot connect to server");
+  c->open = true;
+  if(!cl->opt.dataset || openDataset(cl, c, r))
+	return true;
+  if(c->open) { // still connected: say goodbye
+	MESSAGE bye = newMsg(99);
+	xportWrite(&c->x, &bye, sizeof(MESSAGE));
+	xportClose(&c->x);
+	c->open = false;
+  }
+  return false;
+}
+
+/**
+ * @brief copy of the current shard map
+ */
+static SHARDMAP currentMap(P3CLIENT *cl) {
+  std::lock_guard<std::mutex> l(cl->mapLock);
+  return cl->shards;
+}
+
+/**
+ * @brief asks the server for its shard map (request 30). Called when the
+ * client opens and whenever a shard says the map we routed by is stale.
+ */
+static bool fetchMap(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  MESSAGE msg;
+  if(!connectMain(cl, c, r) || !put(c, &c->x, newMsg(30), r)
+	 || !reply(c, &c->x, &msg, r))
+	return false;
+
+  SHARDMAP map;
+  memset(&map, 0, sizeof(SHARDMAP));
+  map.num = msg.request < MAX_SHARDS ? msg.request : MAX_SHARDS;
+  map.version = msg.buffer[0];
+  for(int i=0; i < msg.request; i++) {
+	MESSAGE s;
+	if(!get(c, &c->x, &s, sizeof(MESSAGE), r))
+	  return false;
+	if(i >= map.num) continue;
+	map.shard[i].lo = msgGet64(s.buffer, 0);
+	map.shard[i].hi = msgGet64(s.buffer, 2);
+	map.shard[i].port = s.buffer[4];
+	struct in_addr a = {(in_addr_t)s.buffer[5]};
+	inet_ntop(AF_INET, &a, map.shard[i].host, sizeof(map.shard[i].host));
+  }
+  std::lock_guard<std::mutex> l(cl->mapLock);
+  cl->shards = map;
+  return true;
+}
+
+/**
+ * @brief connection to shard i, connected on first use. Shards always
+ * compress -999 dumps, shardDump reads them with recvPacked.
+ * @return NULL on error
+ */
+static XPORT *shardConn(P3CLIENT *cl, P3CONN *c, const SHARDMAP *map, int i,
+						P3RESULT *r) {
+  if(c->shard[i] == NULL) {
+	XPORT *x = new XPORT;
+	errno = 0;
+	int wanted = cl->opt.encoding == ENC_RAW ? ENC_VARINT : cl->opt.encoding;
+	if(!dial(cl, x, map->shard[i].host, map->shard[i].port, wanted, &c->shardEncoding,
+			 &c->retry)) {
+	  delete x;
+	  fail(c, r, "cannot connect to shard");
+	  return NULL;
+	}
+	c->shard[i] = x;
+	if(c->shardEncoding == ENC_RAW) {
+	  errno = EPROTO;
+	  fail(c, r, "shard refused a compressed encoding");
+	  return NULL;
+	}
+  }
+  return c->shard[i];
+}
+
+/**
+ * @brief sends a request about one record to the shard that owns it and
+ * reads the reply. Record numbers are global in the library and local
+ * (starting at 1 on every shard) on the wire. A shard that answers -2 has a
+ * newer map; fetch it and send again.
+ * @param msg request 1, 2, 3 or 5
+ * @param rNum global record number, 0 for a create
+ */
+static bool shardRequest(P3CLIENT *cl, P3CONN *c, MESSAGE msg, long long rNum,
+						 MESSAGE *answer, P3RESULT *r) {
+  for(int tries=0; tries < 10; tries++) {
+	SHARDMAP map = currentMap(cl);
+	int i = rNum > 0 ? shardFind(&map, rNum) : shardOpen(&map);
+	if(i < 0) break;
+	MESSAGE m = msg;
+	m.msg_type = -map.version;
+	if(m.request == 2) m.rec = rNum - map.shard[i].lo + 1;
+	if(m.request == 3 || m.request == 5) m.rec = rNum - map.shard[i].lo;
+
+	XPORT *x = shardConn(cl, c, &map, i, r);
+	if(x == NULL || !put(c, x, m, r) || !reply(c, x, answer, r))
+	  return false;
+	if(answer->request != -2)
+	  return true;
+	if(!fetchMap(cl, c, r))
+	  return false;
+  }
+  r->status = P3_ERROR;
+  r->error = "no shard owns record " + std::to_string(rNum);
+  return false;
+}
+
+/**
+ * @brief counts the records of every shard: asks them all at once, then
+ * adds up the replies
+ */
+static bool shardCount(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  while(true) {
+	SHARDMAP map = currentMap(cl);
+	MESSAGE msg = newMsg(10);
+	msg.msg_type = -map.version;
+	for(int i=0; i < map.num; i++)
+	  if(map.shard[i].lo > 0) {
+		XPORT *x = shardConn(cl, c, &map, i, r);
+		if(x == NULL || !put(c, x, msg, r)) return false;
+	  }
+
+	bool stale = false;
+	r->count = r->last = 0;
+	for(int i=0; i < map.num; i++)
+	  if(map.shard[i].lo > 0) {
+		if(!get(c, c->shard[i], &msg, sizeof(MESSAGE), r)) return false;
+		if(msg.request == -2) stale = true; // the map changed
+		else if(busy(c, &msg, r)) { // read the other replies, then give up
+		  if(msg.buffer[1]) return false; // connections dropped
+		} else {
+		  r->count += msgGet64(msg.buffer, 0);
+		  r->last += msg.rec; // numbered by slot, deleted ones too
+		}
+	  }
+	if(r->status == P3_BUSY)
+	  return false;
+	if(!stale)
+	  return true;
+	if(!fetchMap(cl, c, r))
+	  return false;
+  }
+}
+
+/**
+ * @brief receives a -999 dump sent in compressed chunks
+ * @param keep false to read and drop the records
+ * @return number of records received, -1 if a shard said our map is
+ * stale or the server is busy (nothing follows either), -2 on error
+ */
+static long long recvPacked(P3CONN *c, XPORT *x, int enc, bool keep, P3RESULT *r) {
+  std::vector<unsigned char> packed(packBound(enc, PACK_CHUNK));
+  long long total = 0;
+
+  while(true) {
+	MESSAGE hdr;
+	if(!get(c, x, &hdr, sizeof(MESSAGE), r)) return -2;
+	int n = hdr.request, len = hdr.buffer[0];
+	if(n == -2) return -1; // stale shard map, nothing follows
+	if(busy(c, &hdr, r)) return hdr.buffer[1] ? -2 : -1; // -2: connections dropped
+	if(n <= 0) break; // end of transfer
+
+	if(n > PACK_CHUNK || len < 0 || (size_t)len > packBound(enc, n) - 8
+	   || !get(c, x, packed.data(), len, r)) {
+	  if(r->status == P3_OK) {
+		errno = EPROTO;
+		fail(c, r, "malformed record chunk from server");
+	  }
+	  return -2;
+	}
+	size_t at = r->rows.size();
+	r->rows.resize(at + n * PACK_COLS);
+	if(!unpackRecords(enc, packed.data(), len, r->rows.data() + at, n)) {
+	  errno = EPROTO;
+	  fail(c, r, "malformed record chunk from server");
+	  return -2;
+	}
+	if(!keep)
+	  r->rows.resize(at);
+	total += n;
+  }
+  return total;
+}
+
+/**
+ * @brief reads every record of every shard in record number order. The
+ * -999 requests go out to all shards first so they read and compress in
+ * parallel, then the replies are read shard by shard. If a shard says our
+ * map is stale, the rest are read and dropped, the map is fetched again,
+ * and the dump carries on from the first shard not read yet.
+ */
+static bool shardDump(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  long long next = 1; // first record not read yet
+  while(true) {
+	SHARDMAP map = currentMap(cl);
+	int order[MAX_SHARDS], n = 0;
+	for(int i=0; i < map.num; i++) { // shards not read yet, by range
+	  SHARD *s = &map.shard[i];
+	  if(s->lo == 0 || (s->hi != -1 && s->hi < next)) continue;
+	  int j = n++;
+	  for(; j > 0 && map.shard[order[j - 1]].lo > s->lo; j--)
+		order[j] = order[j - 1];
+	  order[j] = i;
+	}
+
+	MESSAGE msg = newMsg(2);
+	msg.rec = -999;
+	msg.msg_type = -map.version;
+	for(int k=0; k < n; k++) {
+	  XPORT *x = shardConn(cl, c, &map, order[k], r);
+	  if(x == NULL || !put(c, x, msg, r)) return false;
+	}
+
+	bool keep = true;
+	for(int k=0; k < n; k++) {
+	  long long got = recvPacked(c, c->shard[order[k]], c->shardEncoding, keep, r);
+	  SHARD *s = &map.shard[order[k]];
+	  if(got == -2) return false;
+	  if(got < 0) keep = false; // stale map, or busy
+	  else if(keep) next = s->hi == -1 ? s->lo + got : s->hi + 1; // dumps skip deleted records
+	}
+	if(r->status == P3_BUSY)
+	  return false;
+	if(keep)
+	  return true;
+	if(!fetchMap(cl, c, r))
+	  return false;
+  }
+}
+
+/**
+ * @brief sends a request about one record and reads the reply, through
+ * the shards if there are any
+ */
+static bool recordRequest(P3CLIENT *cl, P3CONN *c, MESSAGE msg, long long rNum,
+						  MESSAGE *answer, P3RESULT *r) {
+  if(currentMap(cl).num > 0)
+	return shardRequest(cl, c, msg, rNum, answer, r);
+  return put(c, &c->x, msg, r) && reply(c, &c->x, answer, r);
+}
+
+/**
+ * @brief generation to send with record numbers
+ */
+static int currentGen(P3CLIENT *cl) {
+  std::lock_guard<std::mutex> l(cl->mapLock);
+  return cl->gen;
+}
+
+/**
+ * @brief count (request 10)
+ */
+static void runCount(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  if(currentMap(cl).num > 0) {
+	shardCount(cl, c, r);
+	return;
+  }
+  MESSAGE msg;
+  if(!put(c, &c->x, newMsg(10), r) || !reply(c, &c->x, &msg, r))
+	return;
+  r->count = msgGet64(msg.buffer, 0);
+  r->last = msg.rec;
+  r->gen = msg.gen;
+  std::lock_guard<std::mutex> l(cl->mapLock);
+  cl->gen = msg.gen;
+}
+
+/**
+ * @brief fills in the result of a write the server could not do (request
+ * -6). The connection is fine and stays open.
+ */
+static void writeFailed(P3RESULT *r) {
+  r->status = P3_ERROR;
+  r->error = "the server could not write the record";
+}
+
+/**
+ * @brief create (request 1)
+ */
+static void runCreate(P3CLIENT *cl, P3CONN *c, const std::vector<int> &row,
+					  P3RESULT *r) {
+  MESSAGE msg = newMsg(1), reply;
+  memcpy(msg.buffer, row.data(), PACK_COLS * sizeof(int));
+  if(!recordRequest(cl, c, msg, 0, &reply, r))
+	return;
+  if(reply.request == -1) r->status = P3_READONLY;
+  if(reply.request == -5) r->status = P3_INVALID;
+  if(reply.request == -6) writeFailed(r);
+}
+
+/**
+ * @brief display of one record (request 2)
+ */
+static void runGet(P3CLIENT *cl, P3CONN *c, long long rec, P3RESULT *r) {
+  MESSAGE msg = newMsg(2), reply;
+  msg.rec = rec;
+  msg.gen = currentGen(cl);
+  if(!recordRequest(cl, c, msg, rec, &reply, r))
+	return;
+  if(reply.request == -3)
+	r->status = P3_DELETED;
+  else
+	r->rows.assign(reply.buffer, reply.buffer + PACK_COLS);
+}
+
+/**
+ * @brief display of all records (request 2 with -999)
+ */
+static void runGetAll(P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+  if(currentMap(cl).num > 0) {
+	if(shardDump(cl, c, r))
+	  r->count = r->rows.size() / PACK_COLS;
+	return;
+  }
+
+  MESSAGE msg = newMsg(2);
+  msg.rec = -999;
+  if(c->encoding != ENC_RAW) { // records arrive in compressed chunks
+	long long got;
+	if(put(c, &c->x, msg, r) && (got = recvPacked(c, &c->x, c->encoding, true, r)) >= 0)
+	  r->count = got;
+	return;
+  }
+
+  // raw dumps send one MESSAGE per record, counted at the head of each chunk
+  if(!put(c, &c->x, msg, r))
+	return;
+  MESSAGE hdr;
+  while(reply(c, &c->x, &hdr, r) && hdr.request > 0) {
+	if(hdr.request > PACK_CHUNK) {
+	  errno = EPROTO;
+	  fail(c, r, "malformed record chunk from server");
+	  return;
+	}
+	size_t at = r->rows.size();
+	r->rows.resize(at + hdr.request * PACK_COLS);
+	for(int i=0; i < hdr.request; i++) {
+	  if(!reply(c, &c->x, &msg, r))
+		return;
+	  memcpy(&r->rows[at + i * PACK_COLS], msg.buffer, PACK_COLS * sizeof(int));
+	}
+  }
+  r->count = r->rows.size() / PACK_COLS;
+}
+
+/**
+ * @brief modify (request 3) or delete (request 5)
+ */
+static void runWrite(P3CLIENT *cl, P3CONN *c, int request, long long rec,
+					 const std::vector<int> &row, P3RESULT *r) {
+  MESSAGE msg = newMsg(request), reply;
+  if(!row.empty())
+	memcpy(msg.buffer, row.data(), PACK_COLS * sizeof(int));
+  msg.rec = rec - 1;
+  msg.gen = currentGen(cl);
+  if(!recordRequest(cl, c, msg, rec, &reply, r))
+	return;
+  if(reply.request == -1) r->status = P3_READONLY;
+  if(reply.request == -3) r->status = P3_DELETED;
+  if(reply.request == -5) r->status = P3_INVALID;
+  if(reply.request == -6) writeFailed(r);
+}
+
+/**
+ * @brief reads the records of a sorted reply (request 40) after its first
+ * MESSAGE
+ * @param n records that follow
+ * @param lo number of the shard's first record, 1 if not sharded
+ * @param out output, a row then its global record number for each
+ */
+static bool recvSorted(P3CONN *c, XPORT *x, int n, long long lo,
+					   std::vector<long long> *out, P3RESULT *r) {
+  if(n < 0 || n > SORT_MAX) {
+	errno = EPROTO;
+	return fail(c, r, "malformed sorted reply from server");
+  }
+  for(int i=0; i < n; i++) {
+	MESSAGE msg;
+	if(!get(c, x, &msg, sizeof(MESSAGE), r))
+	  return false;
+	out->insert(out->end(), msg.buffer, msg.buffer + PACK_COLS);
+	out->push_back(lo + msg.rec - 1);
+  }
+  return true;
+}
+
+/**
+ * @brief sorted page (request 40). Shards are each asked for their records
+ * up to the end of the page, all at once; the replies are merged here.
+ */
+static void runSorted(P3CLIENT *cl, P3CONN *c, int field, bool descending,
+					  long long skip, int count, P3RESULT *r) {
+  const int width = PACK_COLS + 1;
+  MESSAGE msg = newMsg(40);
+  msg.buffer[0] = field;
+  msg.buffer[1] = descending;
+  msg.rec = skip;
+  msg.buffer[3] = count;
+  std::vector<long long> got; // rows with their record numbers
+
+  if(currentMap(cl).num == 0) {
+	MESSAGE hdr;
+	if(!put(c, &c->x, msg, r) || !reply(c, &c->x, &hdr, r)
+	   || !recvSorted(c, &c->x, hdr.request, 1, &got, r))
+	  return;
+	r->indexed = hdr.buffer[1];
+	r->gen = hdr.gen;
+	std::lock_guard<std::mutex> l(cl->mapLock);
+	cl->gen = hdr.gen;
+  } else {
+	msg.rec = 0;
+	msg.buffer[3] = (int)std::min(skip + count, (long long)SORT_MAX);
+	while(true) {
+	  SHARDMAP map = currentMap(cl);
+	  msg.msg_type = -map.version;
+	  for(int i=0; i < map.num; i++)
+		if(map.shard[i].lo > 0) {
+		  XPORT *x = shardConn(cl, c, &map, i, r);
+		  if(x == NULL || !put(c, x, msg, r)) return;
+		}
+
+	  bool stale = false;
+	  got.clear();
+	  r->indexed = 1;
+	  for(int i=0; i < map.num; i++)
+		if(map.shard[i].lo > 0) {
+		  MESSAGE hdr;
+		  if(!get(c, c->shard[i], &hdr, sizeof(MESSAGE), r)) return;
+		  if(hdr.request == -2) stale = true; // the map changed
+		  else if(busy(c, &hdr, r)) { // read the other replies, then give up
+			if(hdr.buffer[1]) return; // connections dropped
+		  } else {
+			if(!recvSorted(c, c->shard[i], hdr.request, map.shard[i].lo, &got, r))
+			  return;
+			r->indexed &= hdr.buffer[1];
+		  }
+		}
+	  if(r->status == P3_BUSY)
+		return;
+	  if(!stale)
+		break;
+	  if(!fetchMap(cl, c, r))
+		return;
+	}
+
+	// each shard's page is in order; merge them by (value, record number)
+	int n = got.size() / width;
+	std::vector<int> order(n);
+	for(int i=0; i < n; i++)
+	  order[i] = i;
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		long long va = got[a * width + field], vb = got[b * width + field];
+		long long ra = got[a * width + PACK_COLS], rb = got[b * width + PACK_COLS];
+		if(descending)
+		  return vb < va || (va == vb && rb < ra);
+		return va < vb || (va == vb && ra < rb);
+	  });
+	std::vector<long long> page;
+	for(long long i=skip; i < n && i < skip + count; i++)
+	  page.insert(page.end(), &got[order[i] * width], &got[order[i] * width] + width);
+	got.swap(page);
+  }
+
+  for(size_t i=0; i < got.size(); i += width) {
+	r->rows.insert(r->rows.end(), &got[i], &got[i] + PACK_COLS);
+	r->recs.push_back(got[i + PACK_COLS]);
+  }
+  r->count = r->recs.size();
+}
+
+/**
+ * @brief adds one server's field statistics reply into r
+ * @param hdr the reply's first MESSAGE
+ */
+static bool recvStats(P3CONN *c, XPORT *x, const MESSAGE &hdr, P3RESULT *r) {
+  if(hdr.request != PACK_COLS) {
+	errno = EPROTO;
+	return fail(c, r, "malformed statistics reply from server");
+  }
+  r->count += msgGet64(hdr.buffer, 0);
+  if(msgGet64(hdr.buffer, 2) >= 0)
+	r->scannedCount = std::max(r->scannedCount, 0LL) + msgGet64(hdr.buffer, 2);
+  for(int f=0; f < PACK_COLS; f++) {
+	MESSAGE msg;
+	if(!get(c, x, &msg, sizeof(MESSAGE), r))
+	  return false;
+	const int *b = msg.buffer;
+	P3STAT kept = {msgGet64(b, 1), b[3], b[4]};
+	P3STAT seen = {msgGet64(b, 5), b[7], b[8]};
+	for(int k=0; k < 2; k++) {
+	  P3STAT *s = &(k == 0 ? r->stats : r->scanned)[f], *t = k == 0 ? &kept : &seen;
+	  s->sum += t->sum;
+	  s->min = std::min(s->min, t->min);
+	  s->max = std::max(s->max, t->max);
+	}
+  }
+  return true;
+}
+
+/**
+ * @brief field statistics (request 41). Shards are all asked at once and
+ * their totals added up.
+ */
+static void runStats(P3CLIENT *cl, P3CONN *c, bool verify, P3RESULT *r) {
+  MESSAGE msg = newMsg(41);
+  msg.buffer[0] = verify;
+  const P3STAT none = {0, INT_MAX, INT_MIN};
+
+  if(currentMap(cl).num == 0) {
+	MESSAGE hdr;
+	r->stats.assign(PACK_COLS, none);
+	r->scanned.assign(PACK_COLS, none);
+	if(!put(c, &c->x, msg, r) || !reply(c, &c->x, &hdr, r) || !recvStats(c, &c->x, hdr, r))
+	  return;
+	r->gen = hdr.gen;
+  } else {
+	while(true) {
+	  SHARDMAP map = currentMap(cl);
+	  msg.msg_type = -map.version;
+	  for(int i=0; i < map.num; i++)
+		if(map.shard[i].lo > 0) {
+		  XPORT *x = shardConn(cl, c, &map, i, r);
+		  if(x == NULL || !put(c, x, msg, r)) return;
+		}
+
+	  bool stale = false;
+	  r->count = 0;
+	  r->scannedCount = -1;
+	  r->stats.assign(PACK_COLS, none);
+	  r->scanned.assign(PACK_COLS, none);
+	  for(int i=0; i < map.num; i++)
+		if(map.shard[i].lo > 0) {
+		  MESSAGE hdr;
+		  if(!get(c, c->shard[i], &hdr, sizeof(MESSAGE), r)) return;
+		  if(hdr.request == -2) stale = true; // the map changed
+		  else if(busy(c, &hdr, r)) { // read the other replies, then give up
+			if(hdr.buffer[1]) return; // connections dropped
+		  } else if(!recvStats(c, c->shard[i], hdr, r))
+			return;
+		}
+	  if(r->status == P3_BUSY || !stale)
+		break;
+	  if(!fetchMap(cl, c, r))
+		return;
+	}
+  }
+  if(!verify)
+	r->scanned.clear();
+}
+
+/**
+ * @brief log (request 4): the number of lines, then one LOGMSG per line
+ */
+static void runLog(P3CLIENT *, P3CONN *c, int last, P3RESULT *r) {
+  MESSAGE msg = newMsg(4);
+  msg.buffer[0] = last;
+  if(!put(c, &c->x, msg, r) || !reply(c, &c->x, &msg, r))
+	return;
+  for(int i=0; i < msg.request; i++) {
+	LOGMSG log;
+	if(!get(c, &c->x, &log, sizeof(LOGMSG), r))
+	  return;
+	r->log.push_back(std::string(log.buffer, strnlen(log.buffer, LOGSIZE)));
+  }
+  r->count = r->log.size();
+}
+
+/**
+ * @brief replication status (request 22)
+ */
+static void runRepl(P3CLIENT *, P3CONN *c, P3RESULT *r) {
+  MESSAGE msg;
+  if(!put(c, &c->x, newMsg(22), r) || !reply(c, &c->x, &msg, r))
+	return;
+  r->replica = msg.buffer[0];
+  r->applied = msgGet64(msg.buffer, 1);
+  r->primarySeq = msgGet64(msg.buffer, 3);
+  r->lag = msg.buffer[5];
+  r->linked = msg.buffer[6];
+}
+
+/**
+ * @brief runs queued operations on one connection until the client closes
+ * and the queue is empty
+ */
+static void worker(P3CLIENT *cl, P3CONN *c) {
+  while(true) {
+	P3TASK t;
+	{
+	  std::unique_lock<std::mutex> l(cl->lock);
+	  cl->ready.wait(l, [cl] { return cl->closing || !cl->queue.empty(); });
+	  if(cl->queue.empty())
+		return;
+	  t = std::move(cl->queue.front());
+	  cl->queue.pop_front();
+	}
+	P3RESULT r = newResult(P3_OK);
+	c->messages = 0;
+	for(int tries=0; ; tries++) {
+	  if(connectMain(cl, c, &r))
+		t.run(cl, c, &r);
+	  if(r.status != P3_BUSY || tries >= cl->opt.retries)
+		break;
+	  usleep(r.retryAfter * 1000); // as long as the server asked
+	  r = newResult(P3_OK);
+	}
+	r.messages = c->messages;
+	if(t.callback)
+	  t.callback(r);
+	t.done.set_value(r);
+  }
+}
+
+/**
+ * @brief queues an operation for the next free connection
+ */
+static std::future<P3RESULT> submit(P3CLIENT *cl,
+	std::function<void(P3CLIENT *, P3CONN *, P3RESULT *)> run, P3CALLBACK done) {
+  P3TASK t;
+  t.run = run;
+  t.callback = done;
+  std::future<P3RESULT> f = t.done.get_future();
+  {
+	std::lock_guard<std::mutex> l(cl->lock);
+	if(!cl->closing) {
+	  cl->queue.push_back(std::move(t));
+	  cl->ready.notify_one();
+	  return f;
+	}
+  }
+  P3RESULT r = newResult(P3_CLOSED);
+  r.error = "client is closed";
+  if(t.callback)
+	t.callback(r);
+  t.done.set_value(r);
+  return f;
+}
+
+P3OPTIONS p3Options(const char *host, int port) {
+  P3OPTIONS opt;
+  opt.host = host;
+  opt.port = port;
+  opt.transport = XPORT_AUTO;
+  opt.encoding = ENC_BITPACK;
+  opt.connections = 1;
+  opt.timeout = 10000;
+  opt.retries = 3;
+  opt.dataset = NULL;
+  return opt;
+}
+
+/**
+ * @brief says goodbye on every link of a connection and frees it
+ */
+static void hangUp(P3CONN *c) {
+  MESSAGE msg = newMsg(99); // tell server we are disconnecting
+  if(c->open) {
+	xportWrite(&c->x, &msg, sizeof(MESSAGE));
+	xportClose(&c->x);
+  }
+  for(int i=0; i < MAX_SHARDS; i++)
+	if(c->shard[i]) {
+	  xportWrite(c->shard[i], &msg, sizeof(MESSAGE));
+	  drop(&c->shard[i]);
+	}
+  delete c;
+}
+
+P3CLIENT *p3Open(const P3OPTIONS &opt, std::string *error) {
+  P3CLIENT *cl = new P3CLIENT;
+  cl->opt = opt;
+  cl->host = opt.host;
+  cl->closing = false;
+  cl->gen = 0;
+  memset(&cl->shards, 0, sizeof(SHARDMAP));
+  int n = opt.connections < 1 ? 1 : opt.connections > P3_MAXCONN ? P3_MAXCONN : opt.connections;
+  for(int i=0; i < n; i++) {
+	P3CONN *c = new P3CONN;
+	memset(c, 0, sizeof(P3CONN));
+	cl->conns.push_back(c);
+  }
+
+  // the first connection is made here so a bad address fails now
+  P3RESULT r = newResult(P3_OK);
+  for(int tries=0; !fetchMap(cl, cl->conns[0], &r); tries++) { // connects too
+	if(r.status != P3_BUSY || tries >= opt.retries) {
+	  if(error) *error = r.error;
+	  for(P3CONN *c : cl->conns)
+		hangUp(c);
+	  delete cl;
+	  return NULL;
+	}
+	usleep(r.retryAfter * 1000);
+	r = newResult(P3_OK);
+  }
+  cl->transport = cl->conns[0]->x.type;
+  cl->encoding = cl->conns[0]->encoding;
+
+  for(P3CONN *c : cl->conns)
+	cl->threads.push_back(std::thread(worker, cl, c));
+  return cl;
+}
+
+void p3Close(P3CLIENT *cl) {
+  {
+	std::lock_guard<std::mutex> l(cl->lock);
+	cl->closing = true;
+  }
+  cl->ready.notify_all();
+  for(std::thread &t : cl->threads)
+	t.join();
+  for(P3CONN *c : cl->conns)
+	hangUp(c);
+  delete cl;
+}
+
+int p3Transport(P3CLIENT *cl) {
+  return cl->transport;
+}
+
+int p3Encoding(P3CLIENT *cl) {
+  return cl->encoding;
+}
+
+int p3Shards(P3CLIENT *cl, int *version) {
+  SHARDMAP map = currentMap(cl);
+  if(version) *version = map.version;
+  return map.num;
+}
+
+std::future<P3RESULT> p3Create(P3CLIENT *cl, const int *row, P3CALLBACK done) {
+  std::vector<int> copy(row, row + PACK_COLS);
+  return submit(cl, [copy](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runCreate(cl, c, copy, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3Get(P3CLIENT *cl, long long rec, P3CALLBACK done) {
+  return submit(cl, [rec](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runGet(cl, c, rec, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3GetAll(P3CLIENT *cl, P3CALLBACK done) {
+  return submit(cl, runGetAll, done);
+}
+
+std::future<P3RESULT> p3Modify(P3CLIENT *cl, long long rec, const int *row, P3CALLBACK done) {
+  std::vector<int> copy(row, row + PACK_COLS);
+  return submit(cl, [rec, copy](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runWrite(cl, c, 3, rec, copy, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3Delete(P3CLIENT *cl, long long rec, P3CALLBACK done) {
+  return submit(cl, [rec](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runWrite(cl, c, 5, rec, std::vector<int>(), r);
+	}, done);
+}
+
+std::future<P3RESULT> p3Count(P3CLIENT *cl, P3CALLBACK done) {
+  return submit(cl, runCount, done);
+}
+
+std::future<P3RESULT> p3Sorted(P3CLIENT *cl, int field, bool descending, long long skip,
+							   int count, P3CALLBACK done) {
+  return submit(cl, [=](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runSorted(cl, c, field, descending, skip, count, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3Stats(P3CLIENT *cl, bool verify, P3CALLBACK done) {
+  return submit(cl, [=](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runStats(cl, c, verify, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3Log(P3CLIENT *cl, int last, P3CALLBACK done) {
+  return submit(cl, [last](P3CLIENT *cl, P3CONN *c, P3RESULT *r) {
+	  runLog(cl, c, last, r);
+	}, done);
+}
+
+std::future<P3RESULT> p3ReplStatus(P3CLIENT *cl, P3CALLBACK done) {
+  return submit(cl, runRepl, done);
+}
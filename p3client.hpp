@@ -0,0 +1,243 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3client.hpp
+ * @brief      libp3client: asynchronous access to the record server for
+ *             programs other than the interactive client
+ *
+ * A P3CLIENT holds a pool of connections to one server, each served by its
+ * own thread. Every operation is queued and returns at once with a future,
+ * and may also take a callback that runs on the connection's thread when the
+ * reply is in. Operations on a client with one connection run in the order
+ * they were queued; with more, they spread over the connections.
+ *
+ * The library never prints and never exits. A failed operation reports
+ * P3_ERROR or P3_TIMEOUT in its result and drops that connection; the next
+ * operation on it connects again. A write the server could not do is
+ * P3_ERROR too, but leaves the connection open. A server that is busy (see p3admit.hpp)
+ * says how long to wait; the operation is retried after that a few times
+ * before it reports P3_BUSY. Sharded servers (see p3shard.hpp) are
+ * handled the same way as by the client: requests are routed by record
+ * number and counts and dumps go to every shard.
+ */
+#ifndef P3CLIENTHEADER
+#define P3CLIENTHEADER
+
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include "p3msg.hpp"
+
+/** the server did what was asked */
+#define P3_OK 0
+/** the server is a read-only replica, nothing was written */
+#define P3_READONLY -1
+/** the record is deleted, or its number cannot be mapped any more */
+#define P3_DELETED -3
+/** the record's Year marks deleted records (INT_MIN), nothing was written */
+#define P3_INVALID -5
+/** the server is busy: too many clients, or this one is over its rate
+ * (retryAfter says when to try again) */
+#define P3_BUSY -4
+/** the connection failed, the server sent something malformed or could not
+ * write the record */
+#define P3_ERROR -10
+/** the server did not answer within the timeout */
+#define P3_TIMEOUT -11
+/** the client was closed before the operation ran */
+#define P3_CLOSED -12
+
+/** most connections in one client's pool */
+#define P3_MAXCONN 64
+
+/**
+ * how to reach the server
+ */
+typedef struct {
+  /** server IPv4 address */
+  const char *host;
+  /** server port */
+  int port;
+  /** XPORT_AUTO, XPORT_TCP, XPORT_UNIX or XPORT_SHM */
+  int transport;
+  /** encoding asked for -999 dumps (ENC_RAW, ENC_VARINT, ENC_BITPACK) */
+  int encoding;
+  /** connections (and threads) in the pool */
+  int connections;
+  /** ms a connection may wait on the server for each read or write, 0 forever */
+  int timeout;
+  /** times an operation answered busy is sent again, after the wait the
+   * server asked for */
+  int retries;
+  /** named dataset of the server's catalog to open (server -C), NULL for
+   * the server's own data */
+  const char *dataset;
+} P3OPTIONS;
+
+/**
+ * one field's totals over the records not deleted (stats)
+ */
+typedef struct {
+  /** sum of the field */
+  long long sum;
+  /** smallest and largest value (INT_MAX / INT_MIN with no records) */
+  int min, max;
+} P3STAT;
+
+/**
+ * outcome of one operation. Fields an operation does not fill stay 0.
+ */
+typedef struct {
+  /** P3_OK or one of the other P3_ codes */
+  int status;
+  /** what went wrong, for P3_BUSY, P3_ERROR and P3_TIMEOUT */
+  std::string error;
+  /** P3_BUSY: ms the server asked us to wait */
+  int retryAfter;
+  /** records not deleted (count, stats), records sent (get all) or log lines */
+  long long count;
+  /** highest record number (count), deleted records included */
+  long long last;
+  /** data file generation the record numbers belong to */
+  int gen;
+  /** records, PACK_COLS ints each (get, get all, sorted) */
+  std::vector<int> rows;
+  /** sorted: the records' numbers (1-based), in the same order as rows */
+  std::vector<long long> recs;
+  /** sorted: 1 if the server (every shard) read the order from an index
+   * rather than sorting a scan */
+  int indexed;
+  /** stats: each field's totals, as kept up to date by the server */
+  std::vector<P3STAT> stats;
+  /** stats with a check: the same worked out by a scan at the same point,
+   * and the records it counted (-1 without a check) */
+  std::vector<P3STAT> scanned;
+  long long scannedCount;
+  /** lines of the server's log (log) */
+  std::vector<std::string> log;
+  /** replication status: 1 if the server is a replica */
+  int replica;
+  /** replication status: last journal position applied */
+  long long applied;
+  /** replication status: newest journal position of the primary */
+  long long primarySeq;
+  /** replication status: lag in ms */
+  int lag;
+  /** replication status: 1 while connected to the primary */
+  int linked;
+  /** MESSAGEs sent and received for this operation */
+  int messages;
+} P3RESULT;
+
+/** called on the connection's thread once an operation has finished */
+typedef std::function<void(const P3RESULT &)> P3CALLBACK;
+
+/** a pool of connections to one server */
+typedef struct P3CLIENT P3CLIENT;
+
+/**
+ * @brief options with the defaults: automatic transport, bit-packed dumps,
+ * one connection, a 10 second timeout, 3 retries when busy and the server's
+ * own data
+ */
+P3OPTIONS p3Options(const char *host, int port);
+
+/**
+ * @brief connects to a server. The first connection is made (and the shard
+ * map fetched) before returning, the rest on first use.
+ * @param error output, why it failed
+ * @return NULL on error
+ */
+P3CLIENT *p3Open(const P3OPTIONS &opt, std::string *error);
+
+/**
+ * @brief finishes the operations already queued, disconnects and frees the
+ * client. Operations queued from here on end with P3_CLOSED.
+ */
+void p3Close(P3CLIENT *cl);
+
+/**
+ * @brief transport the first connection ended up on (XPORT_TCP, XPORT_UNIX,
+ * XPORT_SHM), e.g. unix when shared memory was refused
+ */
+int p3Transport(P3CLIENT *cl);
+
+/**
+ * @brief encoding the server agreed to for -999 dumps
+ */
+int p3Encoding(P3CLIENT *cl);
+
+/**
+ * @brief number of shards, 0 if the server is not sharded
+ * @param version output, the shard map's version (may be NULL)
+ */
+int p3Shards(P3CLIENT *cl, int *version);
+
+/**
+ * @brief creates a record
+ * @param row PACK_COLS ints, copied before returning
+ */
+std::future<P3RESULT> p3Create(P3CLIENT *cl, const int *row, P3CALLBACK done = nullptr);
+
+/**
+ * @brief reads record rec (1-based, numbered as of the last p3Count)
+ * into rows. P3_DELETED if it is gone.
+ */
+std::future<P3RESULT> p3Get(P3CLIENT *cl, long long rec, P3CALLBACK done = nullptr);
+
+/**
+ * @brief reads every record that is not deleted into rows
+ */
+std::future<P3RESULT> p3GetAll(P3CLIENT *cl, P3CALLBACK done = nullptr);
+
+/**
+ * @brief replaces record rec (1-based) with row
+ * @param row PACK_COLS ints, copied before returning
+ */
+std::future<P3RESULT> p3Modify(P3CLIENT *cl, long long rec, const int *row,
+							   P3CALLBACK done = nullptr);
+
+/**
+ * @brief deletes record rec (1-based). P3_DELETED if it already was.
+ */
+std::future<P3RESULT> p3Delete(P3CLIENT *cl, long long rec, P3CALLBACK done = nullptr);
+
+/**
+ * @brief counts the records. Later record numbers are sent with the
+ * generation this returns, so the server can map them across compactions.
+ */
+std::future<P3RESULT> p3Count(P3CLIENT *cl, P3CALLBACK done = nullptr);
+
+/**
+ * @brief reads a page of the records sorted by one field into rows, with
+ * their numbers in recs: the top count when skip is 0. Ties are in record
+ * number order, reversed when descending. A sharded server can only page
+ * through its first SORT_MAX records of each order.
+ * @param field 0-8 (Year ... Other)
+ * @param skip records passed over first
+ * @param count most records wanted, at most SORT_MAX
+ */
+std::future<P3RESULT> p3Sorted(P3CLIENT *cl, int field, bool descending, long long skip,
+							   int count, P3CALLBACK done = nullptr);
+
+/**
+ * @brief count, sum, minimum and maximum of every field, without reading the
+ * records: the server keeps them up to date as it writes. On a sharded
+ * server they are the totals over every shard.
+ * @param verify true to have the server also work them out by a full scan
+ * while writes wait, into scanned, to check the two agree
+ */
+std::future<P3RESULT> p3Stats(P3CLIENT *cl, bool verify, P3CALLBACK done = nullptr);
+
+/**
+ * @brief reads the server's log file
+ * @param last lines wanted from its end, 0 for every line the server keeps
+ */
+std::future<P3RESULT> p3Log(P3CLIENT *cl, int last = 0, P3CALLBACK done = nullptr);
+
+/**
+ * @brief how far the server is behind its primary's journal
+ */
+std::future<P3RESULT> p3ReplStatus(P3CLIENT *cl, P3CALLBACK done = nullptr);
+
+#endif
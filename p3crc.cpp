@@ -0,0 +1,81 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3crc.cpp
+ * @brief      CRC32C with the SSE4.2 instruction and a table fallback
+ *
+ * The instruction is picked at run time, so the binary still runs on CPUs
+ * without it. Both give the same checksums.
+ */
+#include "p3crc.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42 1
+#endif
+
+/** reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/** byte-at-a-time table, built on first use */
+static uint32_t table[256];
+static bool tableReady = false;
+
+/**
+ * @brief CRC32C one byte at a time (no ~ at either end)
+ */
+static uint32_t crcTable(uint32_t crc, const unsigned char *p, size_t len) {
+  if(!tableReady) { // same result in every thread, racing is harmless
+	for(uint32_t i=0; i < 256; i++) {
+	  uint32_t c = i;
+	  for(int k=0; k < 8; k++)
+		c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+	  table[i] = c;
+	}
+	tableReady = true;
+  }
+  while(len-- > 0)
+	crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef HAVE_SSE42
+/**
+ * @brief CRC32C 8 bytes per instruction (no ~ at either end)
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c = crc;
+  for(; len >= 8; p += 8, len -= 8) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint32_t)c;
+  for(; len > 0; p++, len--)
+	crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+
+/** 1 if the CPU has SSE4.2, 0 if not, -1 not checked yet */
+static int sse42 = -1;
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf;
+#ifdef HAVE_SSE42
+  if(sse42 < 0)
+	sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  if(sse42)
+	return ~crcSse42(~crc, p, len);
+#endif
+  return ~crcTable(~crc, p, len);
+}
+
+const char *crc32cName() {
+#ifdef HAVE_SSE42
+  if(__builtin_cpu_supports("sse4.2"))
+	return "sse4.2";
+#endif
+  return "table";
+}
@@ -0,0 +1,23 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3crc.hpp
+ * @brief      CRC32C (Castagnoli) checksums
+ */
+#ifndef P3CRCHEADER
+#define P3CRCHEADER
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief CRC32C of len bytes, continuing from crc (0 to start). Uses the
+ * SSE4.2 crc32 instruction when the CPU has it, a table otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief "sse4.2" or "table", for printing
+ */
+const char *crc32cName();
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3dset.cpp
+ * @brief      the dataset catalog: which datasets are open, who uses them,
+ *             and which to close when memory is short
+ */
+#include "p3dset.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/shm.h>
+
+/**
+ * a process working on a dataset
+ */
+typedef struct {
+  /** the process, 0 for a free entry */
+  pid_t pid;
+  /** the dataset */
+  int set;
+} DATAUSER;
+
+/**
+ * the catalog, in shared memory
+ */
+typedef struct {
+  /** datasets in set */
+  int num;
+  /** bytes the datasets may take together */
+  long long budget;
+  DATAUSER user[DATASET_USERS];
+  DATASET set[DATASET_MAX];
+} CATALOG;
+
+/** the catalog, NULL without one */
+static CATALOG *cat = NULL;
+
+/**
+ * @brief monotonic clock in ms
+ */
+static long long msNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+bool datasetLoad(const char *path, long long budgetMB) {
+  FILE *f = fopen(path, "r");
+  if(f == NULL)
+	return false;
+  int id = shmget(IPC_PRIVATE, sizeof(CATALOG), IPC_CREAT | 0600);
+  CATALOG *c = id < 0 ? NULL : (CATALOG *)shmat(id, 0, 0);
+  if(id >= 0)
+	shmctl(id, IPC_RMID, 0); // goes away with the last process
+  if(c == NULL || c == (void *)-1) {
+	fclose(f);
+	return false;
+  }
+  memset(c, 0, sizeof(CATALOG));
+  c->budget = budgetMB << 20;
+
+  char line[512];
+  bool ok = true;
+  while(ok && fgets(line, sizeof(line), f)) {
+	char name[DATASET_NAME], file[256], more;
+	int n = sscanf(line, " %39s %255s %c", name, file, &more);
+	if(n <= 0 || name[0] == '#')
+	  continue;
+	if(n != 2 || c->num == DATASET_MAX) {
+	  ok = false;
+	  break;
+	}
+	for(int i=0; i < c->num; i++)
+	  if(strcmp(c->set[i].name, name) == 0)
+		ok = false;
+	DATASET *d = &c->set[c->num++];
+	strcpy(d->name, name);
+	strcpy(d->path, file);
+  }
+  fclose(f);
+  if(!ok) {
+	shmdt(c);
+	return false;
+  }
+  cat = c;
+  return true;
+}
+
+int datasetCount() {
+  return cat ? cat->num : 0;
+}
+
+DATASET *datasetAt(int i) {
+  return &cat->set[i];
+}
+
+int datasetFind(const char *name) {
+  for(int i=0; i < datasetCount(); i++)
+	if(strncmp(cat->set[i].name, name, DATASET_NAME) == 0)
+	  return i;
+  return -1;
+}
+
+/**
+ * @brief true if process p is gone (a zombie still counts until reaped)
+ */
+static bool dead(pid_t p) {
+  return p > 0 && kill(p, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * @brief true if a connection works on dataset i. Frees the entries of
+ * processes that died on the way.
+ */
+static bool inUse(int i) {
+  bool used = false;
+  for(int u=0; u < DATASET_USERS; u++) {
+	DATAUSER *e = &cat->user[u];
+	pid_t p = __atomic_load_n(&e->pid, __ATOMIC_SEQ_CST);
+	if(p == 0)
+	  continue;
+	if(dead(p))
+	  __atomic_compare_exchange_n(&e->pid, &p, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	else if(__atomic_load_n(&e->set, __ATOMIC_SEQ_CST) == i)
+	  used = true;
+  }
+  return used;
+}
+
+bool datasetUse(int i, int opens, bool recent) {
+  DATASET *d = &cat->set[i];
+  if(recent)
+	__atomic_store_n(&d->used, msNow(), __ATOMIC_RELEASE);
+  pid_t me = getpid();
+  for(int u=0; u < DATASET_USERS; u++) {
+	DATAUSER *e = &cat->user[u];
+	pid_t none = 0;
+	if(!__atomic_compare_exchange_n(&e->pid, &none, me, false,
+									__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	  continue;
+	__atomic_store_n(&e->set, i, __ATOMIC_SEQ_CST);
+	// counted before looking, so datasetEvict sees it or it sees the closing
+	if(__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) == DATASET_OPEN
+	   && __atomic_load_n(&d->opens, __ATOMIC_SEQ_CST) == opens)
+	  return true;
+	__atomic_store_n(&e->set, -1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&e->pid, 0, __ATOMIC_SEQ_CST);
+	return false;
+  }
+  return false;
+}
+
+void datasetLeave() {
+  pid_t me = getpid();
+  for(int u=0; cat && u < DATASET_USERS; u++)
+	if(__atomic_load_n(&cat->user[u].pid, __ATOMIC_SEQ_CST) == me) {
+	  __atomic_store_n(&cat->user[u].set, -1, __ATOMIC_SEQ_CST);
+	  __atomic_store_n(&cat->user[u].pid, 0, __ATOMIC_SEQ_CST);
+	}
+}
+
+bool datasetWant(int i, pid_t opener, int waitMs) {
+  DATASET *d = &cat->set[i];
+  int failures = __atomic_load_n(&d->failures, __ATOMIC_ACQUIRE);
+  for(long long start = msNow(); msNow() - start < waitMs; usleep(DATASET_TICK_MS * 1000)) {
+	__atomic_store_n(&d->used, msNow(), __ATOMIC_RELEASE); // not closed while we wait
+	int s = DATASET_CLOSED;
+	__atomic_compare_exchange_n(&d->state, &s, DATASET_WANTED, false,
+								__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if(s == DATASET_OPEN)
+	  return true;
+	if(__atomic_load_n(&d->failures, __ATOMIC_ACQUIRE) != failures)
+	  return false; // the opener could not open it
+	kill(opener, SIGUSR1); // again each round: it may have been busy
+  }
+  return false;
+}
+
+int datasetWanted() {
+  for(int i=0; i < datasetCount(); i++)
+	if(__atomic_load_n(&cat->set[i].state, __ATOMIC_ACQUIRE) == DATASET_WANTED)
+	  return i;
+  return -1;
+}
+
+void datasetOpened(int i, bool ok, long long bytes) {
+  DATASET *d = &cat->set[i];
+  d->bytes = ok ? bytes : 0;
+  if(ok)
+	__atomic_add_fetch(&d->opens, 1, __ATOMIC_SEQ_CST);
+  else
+	__atomic_add_fetch(&d->failures, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&d->state, ok ? DATASET_OPEN : DATASET_CLOSED, __ATOMIC_SEQ_CST);
+}
+
+int datasetEvict() {
+  long long total = 0, now = msNow();
+  for(int i=0; i < datasetCount(); i++)
+	if(__atomic_load_n(&cat->set[i].state, __ATOMIC_ACQUIRE) == DATASET_OPEN)
+	  total += cat->set[i].bytes;
+  while(cat && total > cat->budget) {
+	int lru = -1;
+	for(int i=0; i < cat->num; i++) {
+	  DATASET *d = &cat->set[i];
+	  if(__atomic_load_n(&d->state, __ATOMIC_ACQUIRE) != DATASET_OPEN
+		 || now - __atomic_load_n(&d->used, __ATOMIC_ACQUIRE) < DATASET_TICK_MS)
+		continue; // just asked for, its connection is on the way
+	  if(lru < 0 || d->used < cat->set[lru].used)
+		lru = i;
+	}
+	if(lru < 0)
+	  return -1;
+	DATASET *d = &cat->set[lru];
+	__atomic_store_n(&d->state, DATASET_CLOSING, __ATOMIC_SEQ_CST);
+	if(!inUse(lru)) // see datasetUse
+	  return lru;
+	__atomic_store_n(&d->state, DATASET_OPEN, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&d->used, now, __ATOMIC_RELEASE); // in use: not now, try the next
+  }
+  return -1;
+}
+
+void datasetClosed(int i) {
+  DATASET *d = &cat->set[i];
+  d->bytes = 0;
+  __atomic_store_n(&d->state, DATASET_CLOSED, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,158 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3dset.hpp
+ * @brief      named datasets: a catalog of data files one server holds,
+ *             each opened on first use and closed again when memory is short
+ *
+ * The catalog file is plain text, one dataset per line:
+ *
+ *     # name datafile
+ *     waste2019 data/waste2019.bin
+ *     trial     /srv/p3/trial.bin
+ *
+ * A server started with "-C catalog" still serves its own data file, and
+ * also answers request 50 (use a dataset, by name): the connection works on
+ * that dataset from then on, on the server's own port. A process of the
+ * server's, the opener, opens a dataset the first time it is asked for: its
+ * data file, log, journal, locks, indexes and statistics are set up there,
+ * and the ids of their shared memory and lock sets are published in the
+ * dataset's entry. Any process serving a connection, whenever it was
+ * forked, attaches to them and keeps the dataset behind a handle of its own
+ * (the modules' ...Attach, ...State and ...Switch functions). Every dataset
+ * has the columns of SCHEMA (see p3schema.hpp).
+ *
+ * The opener adds up the shared memory each dataset takes. Over the
+ * budget, it closes the dataset used least recently that no connection
+ * works on, until it is under again; a dataset that is asked for later is
+ * simply opened again. Its memory goes once the processes that attached
+ * to it let go too: a worker does after its client, the compactor and log
+ * packer on their next round.
+ */
+#ifndef P3DSETHEADER
+#define P3DSETHEADER
+
+#include <sys/types.h>
+
+/** most datasets in one catalog */
+#define DATASET_MAX 512
+/** longest dataset name, with its NUL (it travels in a MESSAGE's buffer) */
+#define DATASET_NAME 40
+/** memory the datasets may take together unless told otherwise (server
+ * -M, MB) */
+#define DATASET_BUDGET 512
+/** ms request 50 waits for the opener to open a dataset */
+#define DATASET_WAIT_MS 60000
+/** ms between the reminders a waiting connection sends the opener */
+#define DATASET_TICK_MS 100
+/** connections working on a dataset at once */
+#define DATASET_USERS 4096
+/** shared memory and lock set ids an open dataset is attached by */
+#define DATASET_IDS 8
+
+/** not open */
+#define DATASET_CLOSED 0
+/** asked for, the opener opens it next */
+#define DATASET_WANTED 1
+/** open */
+#define DATASET_OPEN 2
+/** the opener is closing it */
+#define DATASET_CLOSING 3
+
+/**
+ * one dataset of the catalog, in memory shared by the server and the
+ * processes it forks
+ */
+typedef struct {
+  /** name clients ask for */
+  char name[DATASET_NAME];
+  /** data file */
+  char path[256];
+  /** DATASET_CLOSED ... DATASET_CLOSING */
+  int state;
+  /** times it was opened: a handle from an earlier opening is stale */
+  int opens;
+  /** shared memory it takes */
+  long long bytes;
+  /** when it was last asked for (ms, monotonic) */
+  long long used;
+  /** times it could not be opened */
+  int failures;
+  /** while it is open: the ids of its shared memory and lock sets, for
+   * processes to attach to (what each is, is up to the server) */
+  int ids[DATASET_IDS];
+} DATASET;
+
+/**
+ * @brief reads the catalog into shared memory. Call once in the server
+ * before forking.
+ * @param budgetMB memory the datasets may take together
+ * @return false if the catalog cannot be read, is malformed, names a
+ * dataset twice or has more than DATASET_MAX
+ */
+bool datasetLoad(const char *path, long long budgetMB);
+
+/**
+ * @brief datasets in the catalog, 0 without one
+ */
+int datasetCount();
+
+/**
+ * @brief dataset i of the catalog
+ */
+DATASET *datasetAt(int i);
+
+/**
+ * @brief index of the dataset called name, -1 if there is none
+ */
+int datasetFind(const char *name);
+
+/**
+ * @brief counts this process as working on dataset i, which keeps it open,
+ * if the dataset is open and opens is still its opening
+ * @param opens the opening this process attaches to, or has a handle to
+ * @param recent a connection's use, which counts for closing the datasets
+ * used least recently first (not the compactor's or log packer's)
+ * @return false, with nothing counted, if not
+ */
+bool datasetUse(int i, int opens, bool recent);
+
+/**
+ * @brief this process no longer works on a dataset. That of a process that
+ * died is let go by itself.
+ */
+void datasetLeave();
+
+/**
+ * @brief asks the opener to open dataset i, reminding it every
+ * DATASET_TICK_MS with SIGUSR1, and waits up to waitMs for it to be open
+ * @param opener the opener process
+ * @return false if it could not be opened in time
+ */
+bool datasetWant(int i, pid_t opener, int waitMs);
+
+/**
+ * @brief in the opener: a dataset a connection asked for, to open next
+ * @return its index, -1 if none
+ */
+int datasetWanted();
+
+/**
+ * @brief in the opener: dataset i is open (ok), with its ids filled in, or
+ * could not be opened
+ * @param bytes shared memory it takes
+ */
+void datasetOpened(int i, bool ok, long long bytes);
+
+/**
+ * @brief in the opener: over the memory budget, picks the dataset used
+ * least recently that no process works on and marks it closing
+ * @return its index, -1 if under the budget or every open one is in use
+ */
+int datasetEvict();
+
+/**
+ * @brief in the opener: dataset i, marked closing, is closed
+ */
+void datasetClosed(int i);
+
+#endif
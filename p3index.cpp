@@ -0,0 +1,461 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3index.cpp
+ * @brief      block lists of sorted entries in shared memory
+ *
+ * The shared segment holds, per indexed column, a header, the block list
+ * and free block stack, the value each record was indexed under, and the
+ * blocks themselves. It is attached before forking, so the pointers into it
+ * are the same in every process.
+ */
+#include "p3index.hpp"
+#include "p3lock.hpp"
+#include "p3store.hpp"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <sys/shm.h>
+
+/**
+ * one entry of an index
+ */
+typedef struct {
+  int32_t value;
+  /** record number, 0-based */
+  int64_t rec;
+} IENTRY;
+
+/**
+ * shared state of one index
+ */
+typedef struct {
+  /** spin lock for everything below and the column's arrays */
+  uint32_t lock;
+  /** 1 while the index is complete */
+  int on;
+  /** generation the record numbers belong to */
+  uint32_t gen;
+  /** blocks in the list */
+  int blocks;
+  /** blocks on the free stack */
+  int spares;
+} IHEAD;
+
+/**
+ * the start of the segment: what it holds, so another process can find
+ * its way around it (indexAttach)
+ */
+typedef struct {
+  /** records each index has room for */
+  long long cap;
+  /** blocks each index has */
+  int maxBlocks;
+  /** 1 for each column that has an index */
+  uint8_t columns[STORE_COLS];
+} ISEG;
+
+/** bytes before the first index, so the indexes stay 8-byte aligned */
+#define ISEG_SIZE ((sizeof(ISEG) + 7) & ~(size_t)7)
+
+/**
+ * one index, as pointers into the segment
+ */
+typedef struct {
+  IHEAD *h;
+  /** block numbers in entry order, h->blocks of them */
+  int *order;
+  /** entries in each block */
+  int *used;
+  /** free block numbers, h->spares of them */
+  int *spare;
+  /** value each record is indexed under, valid where in[rec] is 1 */
+  int32_t *key;
+  uint8_t *in;
+  /** maxBlocks blocks of INDEX_BLOCK entries */
+  IENTRY *block;
+} INDEX;
+
+/** indexes by column, h NULL if the column is not indexed */
+static INDEX col[STORE_COLS];
+/** records each index has room for */
+static long long cap = 0;
+/** blocks each index has */
+static int maxBlocks = 0;
+/** the segment, NULL if nothing is indexed */
+static ISEG *seg = NULL;
+/** its shared memory id, -1 if none */
+static int segId = -1;
+
+/**
+ * @brief entry order: by value, then by record number
+ */
+static inline bool less(const IENTRY &a, const IENTRY &b) {
+  return a.value < b.value || (a.value == b.value && a.rec < b.rec);
+}
+
+/**
+ * @brief first entry of block b
+ */
+static inline IENTRY *entries(INDEX *x, int b) {
+  return x->block + (size_t)b * INDEX_BLOCK;
+}
+
+/**
+ * @brief empties an index, every block on the free stack
+ */
+static void clear(INDEX *x) {
+  x->h->blocks = 0;
+  x->h->spares = maxBlocks;
+  for(int i=0; i < maxBlocks; i++)
+	x->spare[i] = maxBlocks - 1 - i;
+  memset(x->in, 0, cap);
+}
+
+/**
+ * @brief position in the block list of the block e belongs in: the last
+ * one whose first entry is not after e
+ */
+static int findBlock(INDEX *x, const IENTRY &e) {
+  int lo = 0, hi = x->h->blocks - 1;
+  while(lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+	if(less(e, entries(x, x->order[mid])[0])) hi = mid - 1;
+	else lo = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief adds e, splitting its block if it is full
+ * @return false if there was no free block for the split
+ */
+static bool insert(INDEX *x, const IENTRY &e) {
+  IHEAD *h = x->h;
+  if(h->blocks == 0) {
+	if(h->spares == 0) return false;
+	x->order[0] = x->spare[--h->spares];
+	x->used[x->order[0]] = 0;
+	h->blocks = 1;
+  }
+  int pos = findBlock(x, e), b = x->order[pos];
+  if(x->used[b] == INDEX_BLOCK) { // upper half to a new block after it
+	if(h->spares == 0) return false;
+	int nb = x->spare[--h->spares], half = INDEX_BLOCK / 2;
+	memcpy(entries(x, nb), entries(x, b) + half, (INDEX_BLOCK - half) * sizeof(IENTRY));
+	x->used[nb] = INDEX_BLOCK - half;
+	x->used[b] = half;
+	memmove(x->order + pos + 2, x->order + pos + 1, (h->blocks - pos - 1) * sizeof(int));
+	x->order[pos + 1] = nb;
+	h->blocks++;
+	if(!less(e, entries(x, nb)[0]))
+	  b = nb;
+  }
+  IENTRY *first = entries(x, b), *end = first + x->used[b];
+  IENTRY *at = std::lower_bound(first, end, e, less);
+  memmove(at + 1, at, (end - at) * sizeof(IENTRY));
+  *at = e;
+  x->used[b]++;
+  return true;
+}
+
+/**
+ * @brief refills the block at pos in the list, less than a quarter full,
+ * from a neighbour: merges the two if they fit in one, else evens them out
+ */
+static void rebalance(INDEX *x, int pos) {
+  IHEAD *h = x->h;
+  int left = pos > 0 ? pos - 1 : pos, right = left + 1;
+  int bl = x->order[left], br = x->order[right];
+  int total = x->used[bl] + x->used[br];
+  if(total <= INDEX_BLOCK) { // right into left, right back on the free stack
+	memcpy(entries(x, bl) + x->used[bl], entries(x, br), x->used[br] * sizeof(IENTRY));
+	x->used[bl] = total;
+	memmove(x->order + right, x->order + right + 1, (h->blocks - right - 1) * sizeof(int));
+	h->blocks--;
+	x->spare[h->spares++] = br;
+	return;
+  }
+  int want = total / 2, move = x->used[bl] - want;
+  if(move < 0) { // left is short, take from the front of right
+	memcpy(entries(x, bl) + x->used[bl], entries(x, br), -move * sizeof(IENTRY));
+	memmove(entries(x, br), entries(x, br) - move, (x->used[br] + move) * sizeof(IENTRY));
+  } else { // right is short, give it the end of left
+	memmove(entries(x, br) + move, entries(x, br), x->used[br] * sizeof(IENTRY));
+	memcpy(entries(x, br), entries(x, bl) + want, move * sizeof(IENTRY));
+  }
+  x->used[bl] = want;
+  x->used[br] = total - want;
+}
+
+/**
+ * @brief removes e
+ * @return false if it was not there
+ */
+static bool erase(INDEX *x, const IENTRY &e) {
+  IHEAD *h = x->h;
+  if(h->blocks == 0) return false;
+  int pos = findBlock(x, e), b = x->order[pos];
+  IENTRY *first = entries(x, b), *end = first + x->used[b];
+  IENTRY *at = std::lower_bound(first, end, e, less);
+  if(at == end || at->value != e.value || at->rec != e.rec)
+	return false;
+  memmove(at, at + 1, (end - at - 1) * sizeof(IENTRY));
+  x->used[b]--;
+  if(x->used[b] < INDEX_BLOCK / 4 && h->blocks > 1)
+	rebalance(x, pos);
+  return true;
+}
+
+/**
+ * @brief adds column c of the live records among n rows, the first of
+ * them record first, to entries
+ */
+static void collect(int c, const int *rows, int n, long long first,
+					std::vector<IENTRY> &entries) {
+  for(int i=0; i < n; i++) {
+	const int *row = rows + (size_t)i * STORE_COLS;
+	if(row[0] == STORE_TOMBSTONE) continue;
+	IENTRY e = {row[c], first + i};
+	entries.push_back(e);
+  }
+}
+
+/**
+ * @brief fills an index with the entries collected from a file of n records
+ */
+static void load(INDEX *x, long long n, uint32_t gen, std::vector<IENTRY> &sorted) {
+  std::sort(sorted.begin(), sorted.end(), less);
+
+  spinLock(&x->h->lock);
+  clear(x);
+  bool ok = n <= cap;
+  // three quarters full, so the first inserts do not all split
+  const size_t per = INDEX_BLOCK * 3 / 4;
+  for(size_t i=0; ok && i < sorted.size(); i += per) {
+	if(x->h->spares == 0) { ok = false; break; }
+	int b = x->spare[--x->h->spares];
+	int k = (int)std::min(per, sorted.size() - i);
+	memcpy(entries(x, b), &sorted[i], k * sizeof(IENTRY));
+	x->used[b] = k;
+	x->order[x->h->blocks++] = b;
+  }
+  for(size_t i=0; ok && i < sorted.size(); i++) {
+	x->key[sorted[i].rec] = sorted[i].value;
+	x->in[sorted[i].rec] = 1;
+  }
+  x->h->on = ok;
+  x->h->gen = gen;
+  spinUnlock(&x->h->lock);
+}
+
+/**
+ * @brief points the indexes into the segment, as its header says
+ */
+static void layout() {
+  cap = seg->cap;
+  maxBlocks = seg->maxBlocks;
+  size_t each = sizeof(IHEAD) + 3 * (size_t)maxBlocks * sizeof(int) + cap * sizeof(int32_t) + cap;
+  each = (each + 7) & ~(size_t)7;
+  size_t per = each + (size_t)maxBlocks * INDEX_BLOCK * sizeof(IENTRY);
+  char *at = (char *)seg + ISEG_SIZE;
+  for(int c=0; c < STORE_COLS; c++) {
+	if(!seg->columns[c]) continue;
+	INDEX *x = &col[c];
+	x->h = (IHEAD *)at;
+	x->order = (int *)(x->h + 1);
+	x->used = x->order + maxBlocks;
+	x->spare = x->used + maxBlocks;
+	x->key = (int32_t *)(x->spare + maxBlocks);
+	x->in = (uint8_t *)(x->key + cap);
+	x->block = (IENTRY *)(at + each);
+	at += per;
+  }
+}
+
+bool indexCreate(const bool *columns, long long count, uint32_t gen) {
+  long long room = std::max(2 * count, (long long)INDEX_MIN);
+  int blocks = 2 * (room / INDEX_BLOCK) + 2; // half full on average
+  size_t each = sizeof(IHEAD) + 3 * (size_t)blocks * sizeof(int) + room * sizeof(int32_t) + room;
+  each = (each + 7) & ~(size_t)7;
+  size_t per = each + (size_t)blocks * INDEX_BLOCK * sizeof(IENTRY), size = 0;
+  for(int c=0; c < STORE_COLS; c++)
+	if(columns[c]) size += per;
+  if(size == 0)
+	return true;
+
+  int id = shmget(IPC_PRIVATE, ISEG_SIZE + size, IPC_CREAT | 0600);
+  if(id < 0)
+	return false;
+  seg = (ISEG *)shmat(id, 0, 0);
+  shmctl(id, IPC_RMID, 0); // goes away with the last process
+  if(seg == (void *)-1) {
+	seg = NULL;
+	return false;
+  }
+  segId = id;
+  seg->cap = room; // zero-filled, only touched as it is used
+  seg->maxBlocks = blocks;
+  for(int c=0; c < STORE_COLS; c++)
+	seg->columns[c] = columns[c];
+  layout();
+
+  // a pass over the file per column, so only one column's entries are held
+  static int rows[1024 * STORE_COLS];
+  std::vector<IENTRY> entries;
+  for(int c=0; c < STORE_COLS; c++) {
+	if(!columns[c]) continue;
+	entries.clear();
+	for(long long j=0; j < count; j += 1024) {
+	  int got = storeRead(j, (int)std::min(count - j, 1024LL), rows);
+	  if(got <= 0) break;
+	  collect(c, rows, got, j, entries);
+	}
+	load(&col[c], count, gen, entries);
+  }
+  return true;
+}
+
+bool indexed(int c) {
+  return c >= 0 && c < STORE_COLS && col[c].h && col[c].h->on;
+}
+
+void indexPut(long long rec, const int *row) {
+  if(rec < 0) // the write failed
+	return;
+  bool live = row[0] != STORE_TOMBSTONE;
+  for(int c=0; c < STORE_COLS; c++) {
+	INDEX *x = &col[c];
+	if(x->h == NULL || !x->h->on) continue;
+	if(live && rec < cap && x->in[rec] && x->key[rec] == row[c])
+	  continue; // another column changed
+	spinLock(&x->h->lock);
+	bool ok = rec < cap;
+	if(ok && x->in[rec]) {
+	  IENTRY old = {x->key[rec], rec};
+	  ok = erase(x, old);
+	  x->in[rec] = 0;
+	}
+	if(ok && live) {
+	  IENTRY e = {row[c], rec};
+	  ok = insert(x, e);
+	  x->key[rec] = row[c];
+	  x->in[rec] = 1;
+	}
+	if(!ok) // out of room, requests sort scans from now on
+	  x->h->on = 0;
+	spinUnlock(&x->h->lock);
+  }
+}
+
+void indexRebuild(long long n, uint32_t gen) {
+  static int rows[1024 * STORE_COLS];
+  std::vector<IENTRY> entries;
+  for(int c=0; c < STORE_COLS; c++) { // a pass per column, like indexCreate
+	if(col[c].h == NULL) continue;
+	entries.clear();
+	for(long long j=0; j < n; j += 1024) {
+	  int got = storeRead(j, (int)std::min(n - j, 1024LL), rows);
+	  if(got <= 0) break;
+	  collect(c, rows, got, j, entries);
+	}
+	load(&col[c], n, gen, entries);
+  }
+}
+
+int indexRange(int c, bool descending, long long skip, int n, uint32_t gen,
+			   long long *recs) {
+  if(c < 0 || c >= STORE_COLS || col[c].h == NULL)
+	return -1;
+  INDEX *x = &col[c];
+  spinLock(&x->h->lock);
+  if(!x->h->on || x->h->gen != gen) {
+	spinUnlock(&x->h->lock);
+	return -1;
+  }
+  int got = 0, blocks = x->h->blocks;
+  for(int p=0; p < blocks && got < n; p++) {
+	int b = x->order[descending ? blocks - 1 - p : p], used = x->used[b];
+	if(skip >= used) { // whole block passed over
+	  skip -= used;
+	  continue;
+	}
+	const IENTRY *e = entries(x, b);
+	for(int i=skip; i < used && got < n; i++)
+	  recs[got++] = e[descending ? used - 1 - i : i].rec;
+	skip = 0;
+  }
+  spinUnlock(&x->h->lock);
+  return got;
+}
+
+bool indexBounds(int c, uint32_t gen, int *min, int *max) {
+  if(c < 0 || c >= STORE_COLS || col[c].h == NULL)
+	return false;
+  INDEX *x = &col[c];
+  spinLock(&x->h->lock);
+  int blocks = x->h->blocks;
+  bool ok = x->h->on && x->h->gen == gen && blocks > 0;
+  if(ok) { // blocks in the list are never empty unless it is the only one
+	int first = x->order[0], last = x->order[blocks - 1];
+	ok = x->used[first] > 0;
+	if(ok) {
+	  *min = entries(x, first)[0].value;
+	  *max = entries(x, last)[x->used[last] - 1].value;
+	}
+  }
+  spinUnlock(&x->h->lock);
+  return ok;
+}
+
+bool indexAttach(int id) {
+  if(id < 0) // nothing indexed
+	return true;
+  seg = (ISEG *)shmat(id, 0, 0);
+  if(seg == (void *)-1) {
+	seg = NULL;
+	return false;
+  }
+  segId = id;
+  layout();
+  return true;
+}
+
+int indexId() {
+  return segId;
+}
+
+void indexClose() {
+  if(seg)
+	shmdt(seg);
+  seg = NULL;
+  segId = -1;
+  memset(col, 0, sizeof(col));
+  cap = 0;
+  maxBlocks = 0;
+}
+
+/**
+ * the statics above, for a dataset that is not in use
+ */
+struct INDEXSTATE {
+  INDEX col[STORE_COLS];
+  long long cap;
+  int maxBlocks;
+  ISEG *seg;
+  int segId;
+};
+
+INDEXSTATE *indexState() {
+  INDEXSTATE *s = new INDEXSTATE(); // zeroed: nothing indexed
+  s->segId = -1;
+  return s;
+}
+
+void indexSwitch(INDEXSTATE *s) {
+  std::swap(col, s->col);
+  std::swap(cap, s->cap);
+  std::swap(maxBlocks, s->maxBlocks);
+  std::swap(seg, s->seg);
+  std::swap(segId, s->segId);
+}
@@ -0,0 +1,116 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3index.hpp
+ * @brief      per-column sort orders of the records, for top-K and sorted
+ *             page requests (request 40)
+ *
+ * Each indexed column keeps every live record as a (value, record) entry in
+ * ascending order, split over blocks of up to INDEX_BLOCK entries. A list of
+ * the blocks in order sits in front of them, so finding the block for an
+ * entry is a binary search over that list, and an insert or a removal moves
+ * at most one block's entries. A full block is split in two; one left less
+ * than a quarter full is merged with its neighbour or takes some of its
+ * entries. Reading a page walks the list from either end, skipping whole
+ * blocks, so the first K records cost the same however big the file is.
+ *
+ * Everything is in shared memory, sized when the server starts for twice the
+ * records the file has then (at least INDEX_MIN). Each create, modify and
+ * delete updates the indexes while it has its turn to publish (see
+ * p3mvcc.hpp), so they change in commit order. Compaction and a replica's
+ * snapshot renumber the records; the indexes are rebuilt from the new file,
+ * and until then they belong to the old generation and are not used. A
+ * column whose records outgrow the index is dropped until the server
+ * restarts; requests for it sort a scan instead.
+ */
+#ifndef P3INDEXHEADER
+#define P3INDEXHEADER
+
+#include <cstdint>
+
+/** most entries in one block */
+#define INDEX_BLOCK 256
+/** records an index has room for at least */
+#define INDEX_MIN 65536
+
+/**
+ * @brief creates the indexes and fills them from the data file. Call once
+ * in the server before forking, after mvccCreate.
+ * @param columns which of the STORE_COLS columns to index
+ * @param count records in the data file
+ * @param gen the data file's generation
+ * @return false if shared memory cannot be created
+ */
+bool indexCreate(const bool *columns, long long count, uint32_t gen);
+
+/**
+ * @brief true if column col has an index that can be used
+ */
+bool indexed(int col);
+
+/**
+ * @brief record rec now holds row (a tombstone removes it). Call in commit
+ * order, between mvccTurn and mvccPublish.
+ */
+void indexPut(long long rec, const int *row);
+
+/**
+ * @brief refills every index from a new file of n records, read back a
+ * chunk at a time. Call with writers kept out (compaction's gate, or a
+ * replica's applier) once the file is in place; tombstones are left out.
+ * @param gen the new file's generation
+ */
+void indexRebuild(long long n, uint32_t gen);
+
+/**
+ * @brief reads a page of one column's order
+ * @param descending true to start from the largest value (ties by
+ * record number, reversed too)
+ * @param skip entries passed over first
+ * @param n most record numbers to return
+ * @param gen generation of the caller's snapshot
+ * @param recs output, 0-based record numbers
+ * @return number of record numbers, -1 if col has no index for gen
+ */
+int indexRange(int col, bool descending, long long skip, int n, uint32_t gen,
+			   long long *recs);
+
+/**
+ * @brief smallest and largest value of a column
+ * @return false if col has no index for gen, or no records
+ */
+bool indexBounds(int col, uint32_t gen, int *min, int *max);
+
+/**
+ * @brief attaches, in another process, the indexes indexCreate made
+ * @param id from indexId
+ * @return false on error
+ */
+bool indexAttach(int id);
+
+/**
+ * @brief shared memory id of the indexes in use, -1 if nothing is indexed
+ */
+int indexId();
+
+/**
+ * @brief lets go of the indexes in this process
+ */
+void indexClose();
+
+/**
+ * a process' indexes, one set per dataset (see p3dset.hpp)
+ */
+typedef struct INDEXSTATE INDEXSTATE;
+
+/**
+ * @brief no indexes, for indexSwitch
+ */
+INDEXSTATE *indexState();
+
+/**
+ * @brief switches this process to the indexes s holds; s keeps the ones that
+ * were in use (see storeSwitch)
+ */
+void indexSwitch(INDEXSTATE *s);
+
+#endif
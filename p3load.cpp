@@ -0,0 +1,338 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3load.cpp
+ * @brief      builds a data file from CSV offline: parsed in parallel with
+ *             std::from_chars, written in large sequential blocks
+ *
+ * Usage: ./p3load [-t threads] [-o datafile] [-r rejectfile] file.csv ...
+ *
+ * Each line is one record, the SCHEMA_COLS columns of SCHEMA (see
+ * p3schema.hpp) as ints separated by commas or tabs: what "./client -o csv"
+ * and "-o tsv" write, column-name line included, which is skipped. Blank
+ * lines are skipped. Any other line that is not exactly a record (too few
+ * or too many fields, a field that is not an int or does not fit one, the
+ * tombstone year) is rejected: counted, the first LOAD_SHOWN listed with
+ * file, line and reason, and every one copied to the reject file if asked.
+ *
+ * The inputs are mapped and cut into LOAD_CHUNK pieces at line ends. The
+ * threads parse a round of chunks at once; the main thread then appends
+ * their records in input order to the data file, a checksummed block at a
+ * time, LOAD_BATCH blocks per write, so memory stays at a few chunks
+ * whatever the input's size. The header goes in last and the file is
+ * renamed over datafile (default CSC552p3.bin) once complete, generation 1.
+ * Stop the server first: it builds its indexes and statistics from the file
+ * when it starts, and checks every block.
+ */
+#include "p3store.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+/** bytes of input per chunk, cut at the next line end */
+#define LOAD_CHUNK (16 << 20)
+/** blocks per write */
+#define LOAD_BATCH 1024
+/** rejected lines listed */
+#define LOAD_SHOWN 20
+
+/**
+ * one line that is not a record
+ */
+typedef struct {
+  /** the line, without its newline */
+  const char *text;
+  size_t len;
+  /** line number within the chunk, from 0 */
+  long long line;
+  /** why it was rejected */
+  const char *why;
+} REJECT;
+
+/**
+ * a piece of one input, whole lines
+ */
+typedef struct {
+  /** input it is from */
+  int file;
+  const char *begin, *end;
+  /** filled in by parseChunk */
+  vector<int> rows;
+  vector<REJECT> rejects;
+  long long lines;
+} CHUNK;
+
+/**
+ * @brief monotonic clock in seconds
+ */
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * @brief parses one line of S's columns
+ * @param row output, schemaCols<S>() ints
+ * @return NULL if it is a record, else why not
+ */
+template<class S>
+const char *parseRow(const char *p, const char *end, int *row) {
+  for(int c=0; c < schemaCols<S>(); c++) {
+	if(c > 0) {
+	  if(p == end || (*p != ',' && *p != '\t'))
+		return "too few fields";
+	  p++;
+	}
+	from_chars_result r = from_chars(p, end, row[c]);
+	if(r.ec == errc::result_out_of_range)
+	  return "number too large for an int";
+	if(r.ec != errc())
+	  return "not a number";
+	p = r.ptr;
+  }
+  if(p != end)
+	return *p == ',' || *p == '\t' ? "too many fields" : "not a number";
+  if(row[0] == SCHEMA_TOMBSTONE)
+	return "year marks deleted records";
+  return NULL;
+}
+
+/**
+ * @brief the column-name line "./client -o csv" (sep ',') or tsv writes
+ */
+static string heading(char sep) {
+  string line;
+  for(int c=0; c < SCHEMA_COLS; c++)
+	line += (c > 0 ? string(1, sep) : "") + schemaName(c);
+  return line;
+}
+
+/**
+ * @brief parses every line of a chunk into its rows and rejects
+ * @param first true if the chunk starts its input (which may have a heading)
+ */
+static void parseChunk(CHUNK *c, bool first) {
+  static const string csv = heading(','), tsv = heading('\t');
+  int row[SCHEMA_COLS];
+  c->rows.clear();
+  c->rejects.clear();
+  c->lines = 0;
+  for(const char *p = c->begin; p < c->end; c->lines++) {
+	const char *nl = (const char *)memchr(p, '\n', c->end - p);
+	const char *eol = nl ? nl : c->end, *next = nl ? nl + 1 : c->end;
+	if(eol > p && eol[-1] == '\r')
+	  eol--;
+	size_t len = eol - p;
+	if(len > 0 && !(first && c->lines == 0 && (string(p, len) == csv || string(p, len) == tsv))) {
+	  const char *why = parseRow<SCHEMA>(p, eol, row);
+	  if(why)
+		c->rejects.push_back({p, len, c->lines, why});
+	  else
+		c->rows.insert(c->rows.end(), row, row + SCHEMA_COLS);
+	}
+	p = next;
+  }
+}
+
+/**
+ * @brief appends records to the data file a block at a time, LOAD_BATCH
+ * blocks per write
+ */
+class BlockWriter {
+public:
+  BlockWriter(int fd) : fd(fd), buf(LOAD_BATCH * STORE_BLOCK, 0) {}
+
+  /**
+   * @brief adds n records
+   * @return false on a write error
+   */
+  bool add(const int *rows, size_t n) {
+	while(n > 0) {
+	  size_t in = count % STORE_BLOCK_ROWS, k = min(n, (size_t)(STORE_BLOCK_ROWS - in));
+	  memcpy(block() + in * STORE_ROW, rows, k * STORE_ROW);
+	  count += k;
+	  rows += k * STORE_COLS;
+	  n -= k;
+	  if(count % STORE_BLOCK_ROWS == 0 && !seal())
+		return false;
+	}
+	return true;
+  }
+
+  /**
+   * @brief writes out the last, partly filled block and what is batched
+   * @return false on a write error
+   */
+  bool finish() {
+	if(count % STORE_BLOCK_ROWS != 0 && !seal())
+	  return false;
+	return flush();
+  }
+
+  /** records added */
+  long long count = 0;
+
+private:
+  int fd;
+  vector<char> buf;
+  /** blocks in buf, and blocks written before them */
+  long long batched = 0, written = 0;
+
+  /** the block being filled */
+  char *block() {
+	return buf.data() + batched * STORE_BLOCK;
+  }
+
+  /** checksums the block being filled and moves on to the next */
+  bool seal() {
+	uint32_t crc = crc32c(0, block(), STORE_BLOCK_DATA);
+	memcpy(block() + STORE_BLOCK_DATA, &crc, sizeof(crc));
+	return ++batched < LOAD_BATCH || flush();
+  }
+
+  /** writes the batched blocks, leaving buf zeroed */
+  bool flush() {
+	size_t len = batched * STORE_BLOCK;
+	const char *p = buf.data();
+	for(off_t off = STORE_HEADER + written * STORE_BLOCK; len > 0; ) {
+	  ssize_t n = pwrite(fd, p, len, off);
+	  if(n < 0 && errno == EINTR) continue;
+	  if(n <= 0) return false;
+	  p += n;
+	  off += n;
+	  len -= n;
+	}
+	memset(buf.data(), 0, batched * STORE_BLOCK);
+	written += batched;
+	batched = 0;
+	return true;
+  }
+};
+
+/** @brief main function */
+int main(int argc, char **argv) {
+  int opt, threads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  const char *out = "CSC552p3.bin", *rejectPath = NULL;
+  while((opt = getopt(argc, argv, "t:o:r:")) != -1) {
+	if(opt == 't') threads = atoi(optarg);
+	else if(opt == 'o') out = optarg;
+	else if(opt == 'r') rejectPath = optarg;
+	else break;
+  }
+  if(opt != -1 || optind == argc || threads < 1) {
+	cout << "Usage: " << argv[0] << " [-t threads] [-o datafile] [-r rejectfile] file.csv ..." << endl;
+	return -1;
+  }
+
+  // map the inputs and cut them into chunks at line ends
+  vector<string> names;
+  vector<CHUNK> chunks;
+  long long bytes = 0;
+  for(int a=optind; a < argc; a++) {
+	int fd = open(argv[a], O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0) {
+	  perror(argv[a]);
+	  return -1;
+	}
+	names.push_back(argv[a]);
+	if(st.st_size == 0) {
+	  close(fd);
+	  continue;
+	}
+	const char *map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+	  perror(argv[a]);
+	  return -1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	bytes += st.st_size;
+	for(const char *p = map, *end = map + st.st_size; p < end; ) {
+	  const char *cut = end - p > LOAD_CHUNK ? p + LOAD_CHUNK : end;
+	  const char *nl = (const char *)memchr(cut, '\n', end - cut);
+	  cut = cut == end || nl == NULL ? end : nl + 1;
+	  chunks.push_back({(int)names.size() - 1, p, cut, {}, {}, 0});
+	  p = cut;
+	}
+  }
+
+  string tmp = string(out) + ".load.tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+	perror(tmp.c_str());
+	return -1;
+  }
+  FILE *rejectFile = rejectPath ? fopen(rejectPath, "w") : NULL;
+  if(rejectPath && rejectFile == NULL) {
+	perror(rejectPath);
+	return -1;
+  }
+
+  // a round of chunks parsed at once, then written out in order
+  double started = now();
+  BlockWriter writer(fd);
+  long long rejected = 0, line = 0; // lines of the current input before the chunk
+  bool ok = true;
+  for(size_t round = 0; ok && round < chunks.size(); round += threads) {
+	size_t last = min(chunks.size(), round + threads);
+	atomic<size_t> next(round);
+	vector<thread> pool;
+	for(int t=0; t < threads && round + t < last; t++)
+	  pool.emplace_back([&]() {
+		  for(size_t i; (i = next++) < last; )
+			parseChunk(&chunks[i], i == 0 || chunks[i - 1].file != chunks[i].file);
+		});
+	for(thread &t : pool)
+	  t.join();
+
+	for(size_t i=round; ok && i < last; i++) {
+	  CHUNK *c = &chunks[i];
+	  if(i == 0 || chunks[i - 1].file != c->file)
+		line = 0;
+	  ok = writer.add(c->rows.data(), c->rows.size() / SCHEMA_COLS);
+	  for(REJECT &r : c->rejects) {
+		if(rejected++ < LOAD_SHOWN)
+		  cout << names[c->file] << ":" << line + r.line + 1 << ": " << r.why << ": "
+			   << string(r.text, min(r.len, (size_t)80)) << endl;
+		if(rejectFile) {
+		  fwrite(r.text, 1, r.len, rejectFile);
+		  fputc('\n', rejectFile);
+		}
+	  }
+	  line += c->lines;
+	  vector<int>().swap(c->rows); // done with it
+	  vector<REJECT>().swap(c->rejects);
+	}
+  }
+  if(rejected > LOAD_SHOWN)
+	cout << "... and " << rejected - LOAD_SHOWN << " more rejected lines" << endl;
+
+  STOREHDR h = storeHeader(writer.count, 1);
+  ok = ok && writer.finish() && ftruncate(fd, storeFileSize(writer.count)) == 0
+	&& pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if(rejectFile && fclose(rejectFile) != 0)
+	ok = false;
+  if(!ok || rename(tmp.c_str(), out) < 0) {
+	perror("cannot write data file");
+	unlink(tmp.c_str());
+	return -1;
+  }
+  double t = now() - started;
+  cout << "Loaded " << writer.count << " records into " << out << ", rejected " << rejected
+	   << " lines (" << bytes / 1000000 << " MB, " << threads << " threads, "
+	   << (long long)(t * 1000) << " ms, " << (long long)(writer.count / max(t, 1e-6))
+	   << " records/s)" << endl;
+  return rejected > 0 ? 1 : 0;
+}
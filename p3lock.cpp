@@ -0,0 +1,298 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3lock.cpp
+ * @brief      futex locks with an atomic fast path and dead holder checks
+ */
+#include "p3lock.hpp"
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <ctime>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/** the word of a lock open to P and PR; otherwise it holds the pid of
+ * the process holding it by P (pids are below 2^22), or 0 until first V'd */
+#define LOCK_OPEN 0x3fffffffu
+/** someone may sleep on the word: wake one on release */
+#define LOCK_WAITING 0x40000000u
+/** reader slot: pid << LOCK_PIDSHIFT | the process's holds */
+#define LOCK_PIDSHIFT 8
+/** ms a reader naps while every reader slot is taken */
+#define LOCK_NAP_MS 1
+/** mixed into keys so a lock set never gets a shmget key in use */
+#define LOCK_KEYBITS 0x4c4b0000
+
+/** the sets this process has attached */
+static struct { int id; LOCK *base; } sets[LOCK_SETS];
+static int numSets = 0;
+/** the set looked up last */
+static int lastSet = 0;
+/** this process, without a getpid() system call per lock */
+static pid_t self = 0;
+
+/**
+ * @brief a forked child is a new holder
+ */
+static void forked() {
+  self = getpid();
+}
+
+/**
+ * @brief remembers an attached set
+ */
+static LOCK *attach(int id) {
+  for(int i=0; i < numSets; i++)
+	if(sets[i].id == id) {
+	  lastSet = i;
+	  return sets[i].base;
+	}
+  if(self == 0) {
+	self = getpid();
+	pthread_atfork(NULL, NULL, forked);
+  }
+  LOCK *base = (LOCK *)shmat(id, 0, 0);
+  if(base == (void *)-1)
+	return NULL;
+  if(numSets < LOCK_SETS) {
+	sets[numSets].id = id;
+	sets[numSets].base = base;
+	numSets++;
+  }
+  return base;
+}
+
+/**
+ * @brief lock num of set id
+ */
+static LOCK *lockAt(int id, int num) {
+  if(numSets > 0 && sets[0].id == id) // most callers use one set
+	return sets[0].base + num;
+  if(lastSet < numSets && sets[lastSet].id == id) // or one at a time
+	return sets[lastSet].base + num;
+  return attach(id) + num;
+}
+
+/**
+ * @brief the futex system call
+ */
+static long futex(uint32_t *word, int op, uint32_t val, const struct timespec *t) {
+  return syscall(SYS_futex, word, op, val, t, NULL, 0);
+}
+
+/**
+ * @brief wakes everyone sleeping on the lock
+ */
+static void wakeAll(LOCK *l) {
+  futex(&l->word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/**
+ * @brief wakes one process sleeping on the lock
+ */
+static void wakeOne(LOCK *l) {
+  futex(&l->word, FUTEX_WAKE, 1, NULL);
+}
+
+/**
+ * @brief tells a P() waiting for the readers that one has left
+ */
+static void left(LOCK *l) {
+  __atomic_add_fetch(&l->leave, 1, __ATOMIC_SEQ_CST);
+  futex(&l->leave, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/**
+ * @brief true if process p is gone (a zombie still counts until reaped)
+ */
+static bool dead(pid_t p) {
+  return p > 0 && kill(p, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * @brief gives back the holds of processes that died holding the lock.
+ * The holder's pid is in the word or its reader slot from the instruction
+ * that took the hold to the one that gave it back, so no hold is missed.
+ */
+static void recover(LOCK *l) {
+  uint32_t w = __atomic_load_n(&l->word, __ATOMIC_ACQUIRE);
+  uint32_t o = w & LOCK_OPEN;
+  if(o != LOCK_OPEN && dead((pid_t)o)
+	 && __atomic_compare_exchange_n(&l->word, &w, LOCK_OPEN, false,
+									__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	wakeAll(l);
+  for(int i=0; i < LOCK_READERS; i++) {
+	uint32_t r = __atomic_load_n(&l->reader[i], __ATOMIC_ACQUIRE);
+	if(r != 0 && dead((pid_t)(r >> LOCK_PIDSHIFT))
+	   && __atomic_compare_exchange_n(&l->reader[i], &r, 0, false,
+									  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	  left(l);
+  }
+}
+
+/**
+ * @brief marks the lock as waited on and sleeps until its word changes
+ * from w, or LOCK_CHECK_MS pass and the holders are checked
+ */
+static void sleepOn(LOCK *l, uint32_t w) {
+  if(!(w & LOCK_WAITING)) {
+	if(!__atomic_compare_exchange_n(&l->word, &w, w | LOCK_WAITING, false,
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	  return; // changed meanwhile, look again
+	w |= LOCK_WAITING;
+  }
+  struct timespec t = {LOCK_CHECK_MS / 1000, (LOCK_CHECK_MS % 1000) * 1000000L};
+  if(futex(&l->word, FUTEX_WAIT, w, &t) < 0 && errno == ETIMEDOUT)
+	recover(l);
+}
+
+/**
+ * @brief sleeps until a reader leaves (leave moves on from seen), or ms
+ * pass; the holders are checked every LOCK_CHECK_MS of naps
+ */
+static void napOnLeave(LOCK *l, uint32_t seen, int ms, int *naps) {
+  struct timespec t = {ms / 1000, (ms % 1000) * 1000000L};
+  if(futex(&l->leave, FUTEX_WAIT, seen, &t) < 0 && errno == ETIMEDOUT
+	 && (*naps += ms) >= LOCK_CHECK_MS) {
+	*naps = 0;
+	recover(l);
+  }
+}
+
+/**
+ * @brief true while some process shares the lock
+ */
+static bool shared(LOCK *l) {
+  for(int i=0; i < LOCK_READERS; i++)
+	if(__atomic_load_n(&l->reader[i], __ATOMIC_SEQ_CST) != 0)
+	  return true;
+  return false;
+}
+
+/**
+ * @brief this process's reader slot, NULL if it has none
+ */
+static uint32_t *mySlot(LOCK *l) {
+  for(int i=0; i < LOCK_READERS; i++)
+	if(__atomic_load_n(&l->reader[i], __ATOMIC_RELAXED) >> LOCK_PIDSHIFT == (uint32_t)self)
+	  return &l->reader[i];
+  return NULL;
+}
+
+int lockGet(key_t key, int n, int flags) {
+  if(key != IPC_PRIVATE)
+	key ^= LOCK_KEYBITS;
+  int id = shmget(key, n * sizeof(LOCK), flags);
+  if(id < 0)
+	return -1;
+  if(attach(id) == NULL) {
+	if(flags & IPC_CREAT)
+	  shmctl(id, IPC_RMID, 0);
+	return -1;
+  }
+  return id;
+}
+
+void lockRemove(int id) {
+  shmctl(id, IPC_RMID, 0); // the attachments keep it until they go
+}
+
+void lockDetach(int id) {
+  for(int i=0; i < numSets; i++)
+	if(sets[i].id == id) {
+	  shmdt(sets[i].base);
+	  sets[i] = sets[--numSets];
+	  lastSet = 0;
+	  return;
+	}
+}
+
+void lockTake(int id, int num) {
+  LOCK *l = lockAt(id, num);
+  uint32_t w = LOCK_OPEN; // the usual case, tried first without a load
+  uint32_t held = 0;
+  while(true) {
+	if((w & LOCK_OPEN) == LOCK_OPEN) {
+	  // the word names this process from here on: if it dies, it is seen
+	  if(__atomic_compare_exchange_n(&l->word, &w, (uint32_t)self | held | (w & LOCK_WAITING),
+									 false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		break;
+	} else {
+	  sleepOn(l, w);
+	  held = LOCK_WAITING; // others may sleep too, so V() must wake one
+	  w = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+	}
+  }
+  // new readers now wait; those already in are let finish
+  int naps = 0;
+  while(true) {
+	uint32_t seen = __atomic_load_n(&l->leave, __ATOMIC_SEQ_CST);
+	if(!shared(l))
+	  break;
+	napOnLeave(l, seen, LOCK_CHECK_MS, &naps);
+  }
+}
+
+void lockGive(int id, int num) {
+  LOCK *l = lockAt(id, num);
+  if(__atomic_exchange_n(&l->word, LOCK_OPEN, __ATOMIC_RELEASE) & LOCK_WAITING)
+	wakeOne(l);
+}
+
+void lockShare(int id, int num) {
+  LOCK *l = lockAt(id, num);
+  uint32_t *slot = mySlot(l);
+  if(slot != NULL) { // holds it already: no P() can be in, take one more
+	__atomic_add_fetch(slot, 1, __ATOMIC_ACQUIRE);
+	return;
+  }
+  uint32_t mine = (uint32_t)self << LOCK_PIDSHIFT | 1;
+  uint32_t slept = 0;
+  int naps = 0;
+  while(true) {
+	uint32_t w = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+	if((w & LOCK_OPEN) != LOCK_OPEN) {
+	  sleepOn(l, w);
+	  slept = LOCK_WAITING;
+	  continue;
+	}
+	uint32_t seen = __atomic_load_n(&l->leave, __ATOMIC_RELAXED);
+	slot = NULL;
+	for(int i=0; i < LOCK_READERS && slot == NULL; i++) {
+	  uint32_t none = 0;
+	  if(__atomic_compare_exchange_n(&l->reader[i], &none, mine, false,
+									 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		slot = &l->reader[i];
+	}
+	if(slot == NULL) { // every slot taken: wait for a reader to leave
+	  napOnLeave(l, seen, LOCK_NAP_MS, &naps);
+	  continue;
+	}
+	// the slot is seen by any P() that takes the word from here on
+	if((__atomic_load_n(&l->word, __ATOMIC_SEQ_CST) & LOCK_OPEN) == LOCK_OPEN)
+	  break;
+	__atomic_store_n(slot, 0, __ATOMIC_SEQ_CST); // a P() got in first
+	left(l);
+  }
+  if(slept)
+	wakeOne(l); // the next waiter may be a reader that can come in too
+}
+
+void lockUnshare(int id, int num) {
+  LOCK *l = lockAt(id, num);
+  uint32_t *slot = mySlot(l);
+  if(slot == NULL)
+	return;
+  uint32_t r = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  if((r & ((1u << LOCK_PIDSHIFT) - 1)) > 1) {
+	__atomic_sub_fetch(slot, 1, __ATOMIC_RELEASE);
+	return;
+  }
+  // the last hold: the slot goes in the same instruction as the hold
+  __atomic_store_n(slot, 0, __ATOMIC_SEQ_CST);
+  if((__atomic_load_n(&l->word, __ATOMIC_SEQ_CST) & LOCK_OPEN) != LOCK_OPEN)
+	left(l); // a P() waits for the readers
+}
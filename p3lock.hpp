@@ -0,0 +1,110 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3lock.hpp
+ * @brief      process-shared locks in shared memory, for P() and V() in
+ *             p3.hpp
+ *
+ * A lock set is a shared memory segment of LOCKs, made and named like a
+ * semaphore set: lockGet takes a key, a count and IPC_ flags and returns an
+ * id, and a lock is (id, number). Taking a free lock or giving one back is
+ * one atomic instruction; only a process that has to wait goes to the
+ * kernel, in a futex wait, and a release wakes the waiters only if there
+ * are some. A lock can be held by one process (P) or shared by up to
+ * LOCK_READERS reader processes at once (PR), each of which may take it
+ * again while it holds it. A P() closes the lock to new readers and waits
+ * for those in to leave.
+ *
+ * Like a new semaphore, a new lock is held by nobody and open to nobody
+ * until its first V(). The process holding the lock by P is the lock's
+ * word itself, and a reader's hold is its slot, each taken and given back
+ * in one atomic instruction, so there is no moment a hold is not tied to
+ * its process. A waiter checks every LOCK_CHECK_MS whether those processes
+ * still exist; the hold of one that died is given back, so a client killed
+ * inside P() ... V() no longer wedges the others on its machine.
+ */
+#ifndef P3LOCKHEADER
+#define P3LOCKHEADER
+
+#include <cstdint>
+#include <sched.h>
+#include <sys/types.h>
+
+/** processes sharing a lock at once; more wait for one to leave */
+#define LOCK_READERS 30
+/** ms a waiter sleeps before checking the holders are alive */
+#define LOCK_CHECK_MS 100
+/** lock sets one process keeps attached (a server holding datasets uses
+ * three per dataset: its locks, stripes and store, see p3dset.hpp) */
+#define LOCK_SETS 1552
+
+/**
+ * one lock, two cache lines of its own
+ */
+typedef struct {
+  /** open, the pid of the process holding it by P, or 0 until the first
+   * V(); and whether someone sleeps on it */
+  uint32_t word;
+  /** moves on when a reader leaves while a P() waits for the readers */
+  uint32_t leave;
+  /** processes sharing it by PR: pid and holds, 0 for a free slot */
+  uint32_t reader[LOCK_READERS];
+} LOCK;
+
+/**
+ * @brief finds or creates a lock set, like semget. The locks of a new set
+ * are closed until V()'d. Keys do not clash with shmget's.
+ * @param key IPC_PRIVATE or a key
+ * @param n locks in the set
+ * @param flags IPC_CREAT, IPC_EXCL and permissions
+ * @return the set's id, -1 on error (errno tells why)
+ */
+int lockGet(key_t key, int n, int flags);
+
+/**
+ * @brief removes a lock set once every process using it has let go
+ */
+void lockRemove(int id);
+
+/**
+ * @brief detaches a lock set from this process, which must not use it again
+ */
+void lockDetach(int id);
+
+/**
+ * @brief takes lock num of set id for this process alone
+ */
+void lockTake(int id, int num);
+
+/**
+ * @brief gives back a lock taken by lockTake (or opens a new one)
+ */
+void lockGive(int id, int num);
+
+/**
+ * @brief takes lock num of set id shared with other readers
+ */
+void lockShare(int id, int num);
+
+/**
+ * @brief gives back a lock taken by lockShare
+ */
+void lockUnshare(int id, int num);
+
+/**
+ * @brief takes a spin lock: a word in shared memory held for a few
+ * instructions (a header, a checksum, an index, free lists), not tied to
+ * a process like a LOCK
+ */
+inline void spinLock(uint32_t *l) {
+  for(int i=0; __atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE); i++)
+	if(i > 100) sched_yield();
+}
+
+/**
+ * @brief releases a spin lock
+ */
+inline void spinUnlock(uint32_t *l) {
+  __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,134 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3log.cpp
+ * @brief      O_APPEND log file writes, one line or one batch of lines each
+ */
+#include "p3log.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/** the log file, -1 while closed */
+static int fd = -1;
+/** batch delay in ms, 0 for none */
+static int delayMs = 0;
+/** lines waiting to be written, whole ones only */
+static char batch[LOG_BATCH];
+static size_t used = 0;
+/** when the first line in the batch was logged */
+static struct timespec first;
+/** guards the batch and fd against the flusher thread */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/** wakes the flusher when a batch starts */
+static pthread_cond_t started = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief appends len bytes with as few writes as the kernel allows (one, for
+ * a regular file)
+ */
+static void append(const char *buf, size_t len) {
+  while(len > 0) {
+	ssize_t n = write(fd, buf, len);
+	if(n < 0 && errno == EINTR)
+	  continue;
+	if(n <= 0)
+	  return; // nowhere to report it; the log is best effort
+	buf += n;
+	len -= n;
+  }
+}
+
+/**
+ * @brief writes the batch out. Call with the lock held.
+ */
+static void drain() {
+  if(used > 0 && fd >= 0)
+	append(batch, used);
+  used = 0;
+}
+
+/**
+ * @brief writes each batch once it is delayMs old
+ */
+static void *flusher(void *) {
+  pthread_mutex_lock(&lock);
+  while(true) {
+	if(used == 0) {
+	  pthread_cond_wait(&started, &lock);
+	  continue;
+	}
+	struct timespec due = first;
+	due.tv_sec += delayMs / 1000;
+	due.tv_nsec += (delayMs % 1000) * 1000000L;
+	if(due.tv_nsec >= 1000000000L) {
+	  due.tv_sec++;
+	  due.tv_nsec -= 1000000000L;
+	}
+	// woken early only by a batch that started after this one was written
+	if(pthread_cond_timedwait(&started, &lock, &due) != ETIMEDOUT)
+	  continue;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if(now.tv_sec > due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec))
+	  drain();
+  }
+  return NULL;
+}
+
+bool logOpen(const char *path, int batchMs) {
+  fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if(fd < 0)
+	return false;
+  delayMs = batchMs > 0 ? batchMs : 0;
+  if(delayMs > 0) {
+	pthread_t t;
+	if(pthread_create(&t, NULL, flusher, NULL) != 0)
+	  delayMs = 0; // every line at once, then
+	else
+	  pthread_detach(t);
+	atexit(logFlush); // exit() without logClose
+  }
+  return true;
+}
+
+void logLine(const char *line, size_t len) {
+  if(delayMs == 0) { // one write, no lock needed
+	if(fd >= 0)
+	  append(line, len);
+	return;
+  }
+  pthread_mutex_lock(&lock);
+  if(used + len > LOG_BATCH)
+	drain();
+  if(len > LOG_BATCH) {
+	if(fd >= 0)
+	  append(line, len);
+  } else {
+	if(used == 0) {
+	  clock_gettime(CLOCK_REALTIME, &first);
+	  pthread_cond_signal(&started);
+	}
+	memcpy(batch + used, line, len);
+	used += len;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void logFlush() {
+  pthread_mutex_lock(&lock);
+  drain();
+  pthread_mutex_unlock(&lock);
+}
+
+void logClose() {
+  pthread_mutex_lock(&lock);
+  drain();
+  if(fd >= 0)
+	close(fd);
+  fd = -1;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,48 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3log.hpp
+ * @brief      a log file shared by every client on the machine (log.cli),
+ *             appended to without a lock
+ *
+ * The file is opened with O_APPEND, so each write() lands whole at the end
+ * of the file whichever process makes it, and a line is only ever handed to
+ * one write(). Without batching, every line is written as it comes. With
+ * batching, lines collect in a buffer of up to LOG_BATCH bytes and go out
+ * in one write when it is full, or at the latest the batch delay after the
+ * first of them was logged (a thread of the process sees to that). Lines
+ * from one process stay in order; lines of different processes interleave
+ * only between lines. A process that dies loses at most the lines of the
+ * last batch delay.
+ */
+#ifndef P3LOGHEADER
+#define P3LOGHEADER
+
+#include <cstddef>
+
+/** most bytes written at once by a batch (a longer line goes alone) */
+#define LOG_BATCH 4096
+
+/**
+ * @brief opens (creates) the log file for appending
+ * @param batchMs 0 to write every line at once, else the longest a line
+ * waits in this process's buffer
+ * @return false if the file cannot be opened
+ */
+bool logOpen(const char *path, int batchMs);
+
+/**
+ * @brief logs one line; it should end with a newline
+ */
+void logLine(const char *line, size_t len);
+
+/**
+ * @brief writes the lines still in the buffer
+ */
+void logFlush();
+
+/**
+ * @brief flushes and closes the log file
+ */
+void logClose();
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3msg.hpp
+ * @brief      wire format shared by the server, the client and libp3client
+ */
+#ifndef P3MSGHEADER
+#define P3MSGHEADER
+
+#include <cstdint>
+#include <sys/types.h>
+#include "p3schema.hpp"
+
+#define BSIZE 10
+#define LOGSIZE 256
+static_assert(SCHEMA_COLS <= BSIZE, "a record must fit in one MESSAGE");
+/** most records in one reply to a sorted request (40) */
+#define SORT_MAX 1000
+
+/** 
+ * message struct used for cli/ser communication
+ */
+typedef struct {
+  /** type of msg */
+  long msg_type;
+  /** sender pid */
+  pid_t sender;
+  /** request id */
+  int request;
+  /** data buffer */
+  int buffer[BSIZE]; 
+  /** record number (or count) the request or reply is about, 64 bits so
+   * data files can outgrow an int */
+  long long rec;
+  /** data file generation the record numbers refer to, 0 for the current one */
+  int gen;
+} MESSAGE;
+
+/**
+ * @brief stores a 64-bit value in buffer[i] (low word) and buffer[i + 1]
+ */
+inline void msgPut64(int *buffer, int i, long long v) {
+  buffer[i] = (int)(uint32_t)v;
+  buffer[i + 1] = (int)(v >> 32);
+}
+
+/**
+ * @brief the 64-bit value msgPut64 stored at buffer[i]
+ */
+inline long long msgGet64(const int *buffer, int i) {
+  return (long long)(uint32_t)buffer[i] | ((long long)buffer[i + 1] << 32);
+}
+
+/**
+ * used for sending log file info to client
+ */
+typedef struct {
+  /** type of msg */
+  long msg_type;
+  /** sender pid */
+  pid_t sender;
+  /** log msg buffer */
+  char buffer[LOGSIZE];
+} LOGMSG;
+
+#endif
@@ -0,0 +1,875 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3mvcc.cpp
+ * @brief      snapshot reads over the data file
+ *
+ * Writers reserve a commit with a compare-and-swap, do their I/O, then
+ * publish in commit order, so a reader's count never covers a row still being written.
+ * Commit sequence numbers are 32 bits and compared by signed difference, so
+ * they may wrap as long as no reader lags 2^31 commits behind. The record
+ * count shares a 64-bit word with the sequence, so only its low 32 bits are
+ * there; the rest comes from the full count kept beside it (see widen).
+ */
+#include "p3mvcc.hpp"
+#include "p3lock.hpp"
+#include "p3store.hpp"
+#include "p3trace.hpp"
+#include "p3repl.hpp"
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <ctime>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <utility>
+
+/**
+ * old row of a record, valid for snapshots before until
+ */
+typedef struct {
+  /** record index (0-based) */
+  long long rec;
+  /** data file generation rec belongs to */
+  uint32_t gen;
+  /** commit that overwrote this row */
+  uint32_t until;
+  /** next entry in the bucket or free list, -1 at the end */
+  int next;
+  /** the row */
+  int row[STORE_COLS];
+} MVERSION;
+
+/**
+ * reader slot
+ */
+typedef struct {
+  /** owner, 0 if free */
+  pid_t pid;
+  /** owner's snapshot */
+  uint32_t seq;
+  /** bumped before and after each walk of the buckets (odd while walking) */
+  uint32_t walk;
+} MREADER;
+
+/** writer slot states: between mvccHold and a reservation */
+#define MW_HOLD 0
+/** trying to reserve c; it may or may not have been taken yet */
+#define MW_RESERVING 1
+/** c reserved, its row being written */
+#define MW_RESERVED 2
+/** c's turn came: journal, indexes and publishing */
+#define MW_TURN 3
+
+/**
+ * writer slot: a process between mvccHold and mvccPublish, and its commit
+ */
+typedef struct {
+  /** owner, 0 if free */
+  pid_t pid;
+  /** MW_HOLD, MW_RESERVING, MW_RESERVED or MW_TURN */
+  uint32_t state;
+  /** the commit reserved, or being tried while MW_RESERVING */
+  COMMIT c;
+} MWRITER;
+
+/**
+ * everything shared between the server's processes
+ */
+typedef struct {
+  /** latest commit: (seq << 32) | low 32 bits of the record count, read in
+   * one load */
+  uint64_t snap;
+  /** next commit to reserve, same layout (count includes unpublished appends) */
+  uint64_t next;
+  /** record count of the latest commit, all 64 bits */
+  int64_t total;
+  /** seq of snap, on its own as a futex word for writers waiting their turn */
+  uint32_t published;
+  /** writers asleep on published */
+  uint32_t turnWaiters;
+  /** held while changing the free list or bucket links */
+  uint32_t arenaLock;
+  /** set while mvccReset replaces the file */
+  uint32_t frozen;
+  /** data file generation, bumped by each compaction */
+  uint32_t gen;
+  /** odd while mvccSwap changes snap and gen together */
+  uint32_t swapping;
+  /** pid of the compaction keeping writers out, 0 if none */
+  pid_t gated;
+  /** the waiter publishing the commit of a writer that died, 0 if none */
+  pid_t rescuer;
+  /** writer slots */
+  MWRITER writer[MVCC_WRITERS];
+  /** deleted records as of the latest commit */
+  int64_t deleted;
+  /** held while changing the deleted slot stack */
+  uint32_t slotLock;
+  /** deleted slots on the stack */
+  int freeSlots;
+  /** deleted slots that creates may reuse */
+  int64_t freeSlot[MVCC_FREESLOTS];
+  /** entries linked into buckets */
+  int live;
+  /** unused entries */
+  int freeList;
+  /** bucket heads, by record index */
+  int bucket[MVCC_BUCKETS];
+  /** reader slots */
+  MREADER reader[MVCC_READERS];
+  /** version arena */
+  MVERSION version[MVCC_VERSIONS];
+} MVCC;
+
+/** shared state, attached before the server forks or by mvccAttach */
+static MVCC *m = NULL;
+/** shared memory id of m */
+static int mId = -1;
+/** generation of the data file this process has open */
+static uint32_t openGen = 1;
+/** this process holds a writer slot */
+static bool holding = false;
+/** this process' writer slot while holding, -1 otherwise */
+static int mySlot = -1;
+
+/**
+ * @brief true if commit a comes after commit b
+ */
+static inline bool after(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+/**
+ * @brief true if process pid has exited
+ */
+static inline bool gone(pid_t pid) {
+  return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * @brief empties the version arena. Only safe with no readers.
+ */
+static void clearArena() {
+  for(int i=0; i < MVCC_BUCKETS; i++)
+	m->bucket[i] = -1;
+  for(int i=0; i < MVCC_VERSIONS; i++)
+	m->version[i].next = i + 1 < MVCC_VERSIONS ? i + 1 : -1;
+  m->freeList = 0;
+  __atomic_store_n(&m->live, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief true if row is a tombstone
+ */
+static inline bool deleted(const int *row) {
+  return row[0] == STORE_TOMBSTONE;
+}
+
+/**
+ * @brief the record count whose low 32 bits are low. Counts in flight
+ * (reserved, not yet published) are never 2^31 records away from the
+ * latest commit's, so it is the one nearest to that.
+ */
+static inline long long widen(uint32_t low) {
+  long long near = __atomic_load_n(&m->total, __ATOMIC_SEQ_CST);
+  return near + (int32_t)(low - (uint32_t)near);
+}
+
+/**
+ * @brief makes commit seq with count records visible
+ */
+static void publish(uint32_t seq, long long count) {
+  __atomic_store_n(&m->total, count, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&m->snap, ((uint64_t)seq << 32) | (uint32_t)count, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief counts the tombstones in the first count records and remembers
+ * their slots for reuse. No writer may run.
+ */
+static void scanDeleted(long long count) {
+  static int rows[1024 * STORE_COLS];
+  m->deleted = m->freeSlots = 0;
+  for(long long j=0; j < count; j += 1024) {
+	int n = storeRead(j, count - j < 1024 ? count - j : 1024, rows);
+	for(int i=0; i < n; i++) {
+	  if(!deleted(rows + i * STORE_COLS)) continue;
+	  m->deleted++;
+	  if(m->freeSlots < MVCC_FREESLOTS)
+		m->freeSlot[m->freeSlots++] = j + i;
+	}
+	if(n <= 0) break;
+  }
+}
+
+bool mvccCreate(long long count, uint32_t gen) {
+  int id = shmget(IPC_PRIVATE, sizeof(MVCC), IPC_CREAT | 0600);
+  if(id < 0)
+	return false;
+  mId = id;
+  m = (MVCC *)shmat(id, 0, 0);
+  shmctl(id, IPC_RMID, 0); // goes away with the last process
+  if(m == (void *)-1) {
+	m = NULL;
+	return false;
+  }
+  memset(m, 0, sizeof(MVCC));
+  clearArena();
+  publish(1, count);
+  m->published = 1;
+  m->next = ((uint64_t)1 << 32) | (uint32_t)count;
+  m->gen = openGen = gen;
+  scanDeleted(count);
+  traceName(TRACE_TURN, -1, "commit turn");
+  return true;
+}
+
+SNAPSHOT mvccBegin() {
+  SNAPSHOT s = {0, 0, -1};
+  pid_t me = getpid();
+  while(true) {
+	for(int i=0; s.slot < 0; i = (i + 1) % MVCC_READERS) { // claim a slot
+	  pid_t none = 0;
+	  if(__atomic_compare_exchange_n(&m->reader[i].pid, &none, me, false,
+									 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		s.slot = i;
+	  else if(i == MVCC_READERS - 1)
+		usleep(1000); // all taken
+	}
+	if(m->reader[s.slot].walk & 1) // left odd by a reader that died mid-walk
+	  __atomic_fetch_add(&m->reader[s.slot].walk, 1, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&m->frozen, __ATOMIC_SEQ_CST))
+	  break;
+	__atomic_store_n(&m->reader[s.slot].pid, 0, __ATOMIC_SEQ_CST); // let the reset drain
+	s.slot = -1;
+	usleep(1000);
+  }
+
+  // announce the snapshot, then make sure it was still current when announced
+  // (and that no compaction swapped files in between)
+  uint64_t snap;
+  while(true) {
+	uint32_t swap = __atomic_load_n(&m->swapping, __ATOMIC_SEQ_CST);
+	if(swap & 1) {
+	  sched_yield();
+	  continue;
+	}
+	snap = __atomic_load_n(&m->snap, __ATOMIC_SEQ_CST);
+	s.gen = __atomic_load_n(&m->gen, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&m->reader[s.slot].seq, (uint32_t)(snap >> 32), __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&m->snap, __ATOMIC_SEQ_CST) == snap
+	   && __atomic_load_n(&m->swapping, __ATOMIC_SEQ_CST) == swap)
+	  break;
+  }
+  s.seq = snap >> 32;
+  s.count = widen((uint32_t)snap);
+  if(s.gen != openGen && storeReopen()) // compacted since our last request
+	openGen = s.gen;
+  return s;
+}
+
+void mvccEnd(SNAPSHOT *snap) {
+  if(snap->slot >= 0)
+	__atomic_store_n(&m->reader[snap->slot].pid, 0, __ATOMIC_SEQ_CST);
+  snap->slot = -1;
+}
+
+/**
+ * @brief replaces row with the version of record rec visible at seq, if it
+ * has been overwritten since
+ */
+static void overlay(long long rec, int *row, uint32_t seq, uint32_t gen) {
+  const MVERSION *best = NULL;
+  for(int e = __atomic_load_n(&m->bucket[rec % MVCC_BUCKETS], __ATOMIC_ACQUIRE); e >= 0;
+	  e = __atomic_load_n(&m->version[e].next, __ATOMIC_ACQUIRE)) {
+	const MVERSION *v = &m->version[e];
+	if(v->rec == rec && v->gen == gen && after(v->until, seq) && (best == NULL || after(best->until, v->until)))
+	  best = v; // oldest version replaced after our snapshot
+  }
+  if(best)
+	memcpy(row, best->row, sizeof(best->row));
+}
+
+int mvccRead(const SNAPSHOT *snap, long long first, int n, int *rows) {
+  if(first >= snap->count) return 0;
+  if(first + n > snap->count) n = snap->count - first;
+  n = storeRead(first, n, rows);
+  if(n <= 0 || __atomic_load_n(&m->live, __ATOMIC_SEQ_CST) == 0)
+	return n; // nothing overwritten since any snapshot still held
+
+  uint32_t *walk = &m->reader[snap->slot].walk;
+  __atomic_fetch_add(walk, 1, __ATOMIC_SEQ_CST); // entries we can reach stay put
+  for(int i=0; i < n; i++)
+	overlay(first + i, rows + i * STORE_COLS, snap->seq, snap->gen);
+  __atomic_fetch_add(walk, 1, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+long long mvccCount() {
+  return widen((uint32_t)__atomic_load_n(&m->snap, __ATOMIC_SEQ_CST));
+}
+
+long long mvccRecords() {
+  return mvccCount() - __atomic_load_n(&m->deleted, __ATOMIC_SEQ_CST);
+}
+
+uint32_t mvccGen() {
+  return __atomic_load_n(&m->gen, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief true once nobody needs anything more from writer slot w: it
+ * reserved nothing, or its commit is published
+ */
+static bool settled(MWRITER *w) {
+  return __atomic_load_n(&w->state, __ATOMIC_SEQ_CST) == MW_HOLD
+	|| !after(__atomic_load_n(&w->c.seq, __ATOMIC_SEQ_CST), __atomic_load_n(&m->published, __ATOMIC_SEQ_CST));
+}
+
+/**
+ * @brief frees the slot of writer pid, which has exited
+ */
+static void freeDead(MWRITER *w, pid_t pid) {
+  __atomic_compare_exchange_n(&w->pid, &pid, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief takes a writer slot for this process, reusing those of writers
+ * that died with nothing left to publish
+ */
+static void claimSlot() {
+  pid_t me = getpid();
+  for(int i=0; ; i = (i + 1) % MVCC_WRITERS) {
+	MWRITER *w = &m->writer[i];
+	pid_t pid = __atomic_load_n(&w->pid, __ATOMIC_SEQ_CST);
+	if(pid != 0 && gone(pid) && settled(w))
+	  freeDead(w, pid);
+	pid_t none = 0;
+	if(__atomic_compare_exchange_n(&w->pid, &none, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	  __atomic_store_n(&w->state, MW_HOLD, __ATOMIC_SEQ_CST);
+	  mySlot = i;
+	  return;
+	}
+	if(i == MVCC_WRITERS - 1)
+	  usleep(1000); // all taken
+  }
+}
+
+/**
+ * @brief true while a compaction that is still running keeps writers
+ * out. A gate left shut by a compaction that died is opened.
+ */
+static bool gateShut() {
+  pid_t pid = __atomic_load_n(&m->gated, __ATOMIC_SEQ_CST);
+  if(pid == 0)
+	return false;
+  if(!gone(pid))
+	return true;
+  __atomic_compare_exchange_n(&m->gated, &pid, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return false;
+}
+
+uint32_t mvccHold() {
+  if(!holding) {
+	while(true) {
+	  claimSlot();
+	  if(!gateShut())
+		break;
+	  __atomic_store_n(&m->writer[mySlot].pid, 0, __ATOMIC_SEQ_CST); // compaction running
+	  usleep(1000);
+	}
+	holding = true;
+  }
+  uint32_t gen = __atomic_load_n(&m->gen, __ATOMIC_SEQ_CST);
+  if(gen != openGen && storeReopen())
+	openGen = gen;
+  return gen;
+}
+
+void mvccRelease() {
+  if(holding)
+	__atomic_store_n(&m->writer[mySlot].pid, 0, __ATOMIC_SEQ_CST);
+  holding = false;
+  mySlot = -1;
+}
+
+/**
+ * @brief reserves the next commit; appends also reserve the next record
+ * index. Both come from one compare-and-swap, so commit order and record
+ * order agree (an add would carry from the count into the sequence).
+ */
+static void reserve(COMMIT *c, int records) {
+  mvccHold();
+  MWRITER *w = &m->writer[mySlot];
+  c->rec = -1;
+  c->dead = 0;
+  uint64_t r = __atomic_load_n(&m->next, __ATOMIC_SEQ_CST), next;
+  while(true) {
+	next = ((uint64_t)((uint32_t)(r >> 32) + 1) << 32) | (uint32_t)((uint32_t)r + records);
+	c->seq = (uint32_t)(r >> 32) + 1;
+	c->count = widen((uint32_t)r) + records;
+	w->c.count = c->count; // the slot names the commit before it can be ours
+	w->c.rec = -1;
+	w->c.dead = 0;
+	__atomic_store_n(&w->c.seq, c->seq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&w->state, MW_RESERVING, __ATOMIC_SEQ_CST);
+	if(__atomic_compare_exchange_n(&m->next, &r, next, false,
+								   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	  break;
+  }
+  __atomic_store_n(&w->state, MW_RESERVED, __ATOMIC_SEQ_CST);
+}
+
+void mvccReserve(COMMIT *c) {
+  reserve(c, 0);
+}
+
+bool mvccAppend(const int *row, COMMIT *c, bool reuse, int *old) {
+  if(old) // a new slot replaces nothing
+	old[0] = STORE_TOMBSTONE;
+  if(reuse) {
+	mvccHold(); // deleted slots belong to the generation
+	spinLock(&m->slotLock);
+	long long rec = m->freeSlots > 0 ? m->freeSlot[--m->freeSlots] : -1;
+	spinUnlock(&m->slotLock);
+	if(rec >= 0)
+	  return mvccWrite(rec, row, c, old); // only creates write deleted slots
+  }
+  reserve(c, 1);
+  c->rec = c->count - 1;
+  c->dead = deleted(row);
+  return storeWrite(c->rec, row); // our own slot, nobody else writes it
+}
+
+/**
+ * @brief makes commit c visible and wakes the writers waiting their turn
+ */
+static void commitVisible(const COMMIT *c) {
+  if(c->dead)
+	__atomic_fetch_add(&m->deleted, c->dead, __ATOMIC_SEQ_CST);
+  if(c->dead > 0 && c->rec >= 0) {
+	spinLock(&m->slotLock);
+	if(m->freeSlots < MVCC_FREESLOTS)
+	  m->freeSlot[m->freeSlots++] = c->rec;
+	spinUnlock(&m->slotLock);
+  }
+  publish(c->seq, c->count);
+  __atomic_store_n(&m->published, c->seq, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&m->turnWaiters, __ATOMIC_SEQ_CST))
+	syscall(SYS_futex, &m->published, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief undoes commit c, whose turn it is: the rows saved under it are
+ * written back and the records it appended become deleted ones, journaled
+ * as such so replicas number records the same. c is left changing nothing
+ * else.
+ */
+static void undo(COMMIT *c) {
+  c->rec = -1;
+  c->dead = 0;
+  spinLock(&m->arenaLock);
+  for(int b=0; b < MVCC_BUCKETS; b++)
+	for(int e = m->bucket[b]; e >= 0; e = m->version[e].next) {
+	  const MVERSION *v = &m->version[e];
+	  if(v->rec < 0 || v->gen != m->gen || v->until != c->seq) continue;
+	  storeWrite(v->rec, v->row);
+	  if(deleted(v->row)) { // a create had taken this deleted slot
+		spinLock(&m->slotLock);
+		if(m->freeSlots < MVCC_FREESLOTS)
+		  m->freeSlot[m->freeSlots++] = v->rec;
+		spinUnlock(&m->slotLock);
+	  }
+	}
+  spinUnlock(&m->arenaLock);
+  int tombstone[STORE_COLS] = {STORE_TOMBSTONE};
+  for(long long rec = m->total; rec < c->count; rec++) {
+	storeWrite(rec, tombstone);
+	journalAppend(REPL_CREATE, rec, tombstone);
+	c->dead++;
+	spinLock(&m->slotLock);
+	if(m->freeSlots < MVCC_FREESLOTS)
+	  m->freeSlot[m->freeSlots++] = rec;
+	spinUnlock(&m->slotLock);
+  }
+}
+
+/**
+ * @brief publishes commit seq for writer slot w, whose process died before
+ * it could. A writer that had its turn is published as it was (what it
+ * had not journaled or indexed yet is lost). Otherwise nothing of it was
+ * journaled, and it is undone.
+ */
+static void settle(MWRITER *w, pid_t pid, uint32_t seq) {
+  COMMIT c = w->c;
+  c.seq = seq;
+  if(__atomic_load_n(&w->state, __ATOMIC_SEQ_CST) != MW_TURN)
+	undo(&c);
+  commitVisible(&c);
+  freeDead(w, pid);
+}
+
+/**
+ * @brief called by a writer whose turn is taking long: if the writer that
+ * reserved commit seq, the next to publish, has died, publishes it for it.
+ * One waiter at a time looks.
+ */
+static void rescue(uint32_t seq) {
+  pid_t me = getpid(), busy = 0;
+  if(!__atomic_compare_exchange_n(&m->rescuer, &busy, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	if(!gone(busy)) return;
+	if(!__atomic_compare_exchange_n(&m->rescuer, &busy, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	  return;
+  }
+  MWRITER *dead = NULL;
+  pid_t deadPid = 0;
+  bool alive = false; // whoever holds seq is still running
+  if(__atomic_load_n(&m->published, __ATOMIC_SEQ_CST) == seq - 1)
+	for(int i=0; i < MVCC_WRITERS && !alive; i++) {
+	  MWRITER *w = &m->writer[i];
+	  pid_t pid = __atomic_load_n(&w->pid, __ATOMIC_SEQ_CST);
+	  if(pid == 0 || __atomic_load_n(&w->state, __ATOMIC_SEQ_CST) == MW_HOLD
+		 || __atomic_load_n(&w->c.seq, __ATOMIC_SEQ_CST) != seq)
+		continue;
+	  if(!gone(pid))
+		alive = true;
+	  else if(dead == NULL || __atomic_load_n(&dead->state, __ATOMIC_SEQ_CST) == MW_RESERVING) {
+		dead = w; // a slot still trying seq may have lost it, prefer one that took it
+		deadPid = pid;
+	  }
+	}
+  if(!alive && dead)
+	settle(dead, deadPid, seq);
+  __atomic_store_n(&m->rescuer, 0, __ATOMIC_SEQ_CST);
+}
+
+void mvccTurn(const COMMIT *c) {
+  long long t = 0;
+  MWRITER *w = &m->writer[mySlot];
+  w->c.count = c->count; // what to publish if this process dies in its turn
+  w->c.rec = c->rec;
+  w->c.dead = c->dead;
+  uint32_t last = c->seq;
+  int naps = 0;
+  while(true) {
+	uint32_t done = __atomic_load_n(&m->published, __ATOMIC_SEQ_CST);
+	if(done == c->seq - 1) {
+	  __atomic_store_n(&w->state, MW_TURN, __ATOMIC_SEQ_CST);
+	  if(t) traceWait(TRACE_TURN, 0, t); // traced only if it had to wait
+	  return;
+	}
+	if(!t) t = traceStart();
+	if(done != last) {
+	  last = done;
+	  naps = 0;
+	} else if(++naps % (MVCC_CHECK_MS / 10) == 0)
+	  rescue(done + 1);
+	__atomic_fetch_add(&m->turnWaiters, 1, __ATOMIC_SEQ_CST);
+	struct timespec nap = {0, 10000000L}; // in case a wake is missed
+	if(__atomic_load_n(&m->published, __ATOMIC_SEQ_CST) == done)
+	  syscall(SYS_futex, &m->published, FUTEX_WAIT, done, &nap, NULL, 0);
+	__atomic_fetch_sub(&m->turnWaiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void mvccPublish(const COMMIT *c) {
+  mvccTurn(c);
+  commitVisible(c);
+  mvccRelease();
+}
+
+void mvccAbort(COMMIT *c) {
+  mvccTurn(c);
+  undo(c);
+  commitVisible(c);
+  mvccRelease();
+}
+
+/**
+ * @brief oldest snapshot any reader may hold, no later than the latest
+ * commit (new readers start there). Slots of readers that died are freed
+ * on the way.
+ * @param active output, number of readers holding a snapshot
+ */
+static uint32_t oldestReader(int *active) {
+  uint32_t oldest = (uint32_t)(__atomic_load_n(&m->snap, __ATOMIC_SEQ_CST) >> 32);
+  *active = 0;
+  for(int i=0; i < MVCC_READERS; i++) {
+	pid_t pid = __atomic_load_n(&m->reader[i].pid, __ATOMIC_SEQ_CST);
+	if(pid == 0) continue;
+	if(gone(pid)) { // client's child exited mid-read
+	  __atomic_compare_exchange_n(&m->reader[i].pid, &pid, 0, false,
+								  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	  continue;
+	}
+	uint32_t seq = __atomic_load_n(&m->reader[i].seq, __ATOMIC_SEQ_CST);
+	if(after(oldest, seq)) oldest = seq;
+	(*active)++;
+  }
+  return oldest;
+}
+
+/**
+ * @brief waits until every reader walking the buckets right now has
+ * finished that walk. Walks cover one mvccRead, so this is short.
+ */
+static void waitForWalks() {
+  uint32_t seen[MVCC_READERS];
+  for(int i=0; i < MVCC_READERS; i++)
+	seen[i] = __atomic_load_n(&m->reader[i].walk, __ATOMIC_SEQ_CST);
+  for(int i=0; i < MVCC_READERS; i++)
+	while((seen[i] & 1) && __atomic_load_n(&m->reader[i].walk, __ATOMIC_SEQ_CST) == seen[i]
+		  && __atomic_load_n(&m->reader[i].pid, __ATOMIC_SEQ_CST) != 0)
+	  sched_yield();
+}
+
+/**
+ * @brief unlinks versions no reader's snapshot needs any more and, once no
+ * reader can still be stepping on them, puts them on the free list.
+ * Caller holds the arena lock.
+ */
+static void collect() {
+  int active;
+  uint32_t oldest = oldestReader(&active);
+  int unlinked = -1;
+
+  for(int b=0; b < MVCC_BUCKETS; b++) {
+	int *link = &m->bucket[b];
+	while(*link >= 0) {
+	  MVERSION *v = &m->version[*link];
+	  if(after(v->until, oldest)) { // some snapshot may need it
+		link = &v->next;
+		continue;
+	  }
+	  int e = *link;
+	  __atomic_store_n(link, v->next, __ATOMIC_SEQ_CST); // readers may still be on it
+	  __atomic_fetch_sub(&m->live, 1, __ATOMIC_SEQ_CST);
+	  m->version[e].rec = -1; // keep its next intact for them, chain it separately
+	  m->version[e].until = (uint32_t)unlinked;
+	  unlinked = e;
+	}
+  }
+  if(unlinked < 0)
+	return;
+
+  waitForWalks();
+  while(unlinked >= 0) {
+	int e = unlinked;
+	unlinked = (int)m->version[e].until;
+	m->version[e].next = m->freeList;
+	m->freeList = e;
+  }
+}
+
+/**
+ * @brief short lock over the arena's free list and bucket links
+ */
+static void lockArena() {
+  spinLock(&m->arenaLock);
+}
+
+/**
+ * @brief releases the arena lock
+ */
+static void unlockArena() {
+  spinUnlock(&m->arenaLock);
+}
+
+/**
+ * @brief takes an entry from the version arena, reclaiming (and waiting for
+ * slow readers) when it is empty. Caller holds the arena lock.
+ */
+static int allocVersion() {
+  while(m->freeList < 0) {
+	collect();
+	if(m->freeList < 0) { // every saved row is still needed by a reader
+	  unlockArena();
+	  usleep(1000);
+	  lockArena();
+	}
+  }
+  int e = m->freeList;
+  m->freeList = m->version[e].next;
+  return e;
+}
+
+/**
+ * @brief mvccWrite and mvccUpdate
+ * @param mustExist leave deleted and unpublished records alone
+ * @return 1 if written, 0 if the record does not exist (nothing reserved),
+ * -1 on error
+ */
+static int overwrite(long long rec, const int *row, COMMIT *c, bool mustExist, int *old) {
+  mvccHold(); // rec must stay in this generation
+
+  // save the old row before the file changes
+  lockArena();
+  int e = allocVersion();
+  unlockArena();
+  MVERSION *v = &m->version[e];
+  bool ok = rec >= 0 && storeRead(rec, 1, v->row) == 1;
+  if(mustExist && (!ok || rec >= mvccCount() || deleted(v->row))) {
+	lockArena();
+	v->next = m->freeList;
+	m->freeList = e;
+	unlockArena();
+	return 0;
+  }
+
+  reserve(c, 0);
+  v->rec = rec;
+  v->gen = openGen;
+  v->until = c->seq;
+  if(ok) {
+	c->rec = rec;
+	c->dead = deleted(row) - deleted(v->row);
+	if(old)
+	  memcpy(old, v->row, STORE_ROW);
+  }
+  lockArena();
+  if(ok) {
+	int b = rec % MVCC_BUCKETS;
+	v->next = m->bucket[b];
+	__atomic_fetch_add(&m->live, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&m->bucket[b], e, __ATOMIC_SEQ_CST);
+  } else {
+	v->next = m->freeList;
+	m->freeList = e;
+  }
+  unlockArena();
+
+  return ok && storeWrite(rec, row) ? 1 : -1;
+}
+
+bool mvccWrite(long long rec, const int *row, COMMIT *c, int *old) {
+  return overwrite(rec, row, c, false, old) > 0;
+}
+
+int mvccUpdate(long long rec, const int *row, COMMIT *c, int *old) {
+  return overwrite(rec, row, c, true, old);
+}
+
+bool mvccReset(STORENEW *f) {
+  __atomic_store_n(&m->frozen, 1, __ATOMIC_SEQ_CST);
+  int active;
+  for(oldestReader(&active); active > 0; oldestReader(&active)) // drain current readers
+	usleep(1000);
+
+  COMMIT c;
+  reserve(&c, 0);
+  mvccTurn(&c);
+  long long n = f->n;
+  bool ok = storeInstall(f, m->gen + 1);
+  clearArena();
+  c.count = ok ? n : storeCount();
+  scanDeleted(c.count);
+  __atomic_store_n(&m->next, ((uint64_t)c.seq << 32) | (uint32_t)c.count, __ATOMIC_SEQ_CST);
+  openGen = __atomic_add_fetch(&m->gen, 1, __ATOMIC_SEQ_CST); // old record numbers are gone
+  mvccPublish(&c);
+  __atomic_store_n(&m->frozen, 0, __ATOMIC_SEQ_CST);
+  return ok;
+}
+
+/**
+ * @brief writers holding a slot, other than this process. Slots of writers
+ * that died are freed once nothing is left to publish for them.
+ */
+static int writers() {
+  pid_t me = getpid();
+  int n = 0;
+  for(int i=0; i < MVCC_WRITERS; i++) {
+	MWRITER *w = &m->writer[i];
+	pid_t pid = __atomic_load_n(&w->pid, __ATOMIC_SEQ_CST);
+	if(pid == 0 || pid == me) continue;
+	if(gone(pid) && settled(w))
+	  freeDead(w, pid);
+	else
+	  n++;
+  }
+  return n;
+}
+
+uint32_t mvccGate() {
+  __atomic_store_n(&m->gated, getpid(), __ATOMIC_SEQ_CST);
+  for(int naps = 1; writers() > 0; naps++) {
+	usleep(1000);
+	uint32_t done = __atomic_load_n(&m->published, __ATOMIC_SEQ_CST);
+	if(naps % MVCC_CHECK_MS == 0 && (uint32_t)(__atomic_load_n(&m->next, __ATOMIC_SEQ_CST) >> 32) != done)
+	  rescue(done + 1); // the last writer in may have died with nobody behind it
+  }
+  uint32_t gen = __atomic_load_n(&m->gen, __ATOMIC_SEQ_CST);
+  if(gen != openGen && storeReopen())
+	openGen = gen;
+  return gen;
+}
+
+uint32_t mvccSwap(long long count) {
+  claimSlot(); // the gate is shut, no waiting
+  holding = true;
+  COMMIT c;
+  reserve(&c, 0);
+  mvccTurn(&c);
+  c.count = count;
+  __atomic_fetch_add(&m->swapping, 1, __ATOMIC_SEQ_CST); // new snapshots wait
+  __atomic_store_n(&m->next, ((uint64_t)c.seq << 32) | (uint32_t)count, __ATOMIC_SEQ_CST);
+  m->deleted = m->freeSlots = 0;
+  openGen = __atomic_add_fetch(&m->gen, 1, __ATOMIC_SEQ_CST);
+  mvccPublish(&c);
+  __atomic_fetch_add(&m->swapping, 1, __ATOMIC_SEQ_CST);
+  return openGen;
+}
+
+void mvccUngate() {
+  __atomic_store_n(&m->gated, 0, __ATOMIC_SEQ_CST);
+}
+
+bool mvccAttach(int id) {
+  m = (MVCC *)shmat(id, 0, 0);
+  if(m == (void *)-1) {
+	m = NULL;
+	return false;
+  }
+  mId = id;
+  openGen = __atomic_load_n(&m->gen, __ATOMIC_SEQ_CST); // before the data file is opened
+  return true;
+}
+
+int mvccId() {
+  return mId;
+}
+
+void mvccClose() {
+  if(m)
+	shmdt(m);
+  m = NULL;
+  mId = -1;
+  holding = false;
+  mySlot = -1;
+}
+
+/**
+ * the statics above, for a dataset that is not in use
+ */
+struct MVCCSTATE {
+  MVCC *m;
+  int mId;
+  uint32_t openGen;
+  bool holding;
+  int mySlot;
+};
+
+MVCCSTATE *mvccState() {
+  return new MVCCSTATE{NULL, -1, 1, false, -1};
+}
+
+void mvccSwitch(MVCCSTATE *s) {
+  std::swap(m, s->m);
+  std::swap(mId, s->mId);
+  std::swap(openGen, s->openGen);
+  std::swap(holding, s->holding);
+  std::swap(mySlot, s->mySlot);
+}
@@ -0,0 +1,257 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3mvcc.hpp
+ * @brief      multi-version reads of the data file: readers see a snapshot
+ *             and never take the data file lock
+ *
+ * Each create or modify is a commit with its own sequence number, reserved
+ * with an atomic compare-and-swap and published in order once its row is
+ * written. A reader's snapshot is the commit sequence plus the record count
+ * published with it. Before a modify
+ * overwrites a record, the old row is saved in a shared version arena,
+ * tagged with the commit that replaced it. A reader reads rows straight
+ * from the file, then swaps in the saved row for any record overwritten
+ * after its snapshot. The old row is saved before the file is touched, so a
+ * row torn by a concurrent write is always replaced too.
+ *
+ * Each writer holds a slot naming its pid and the commit it reserved. If a
+ * writer dies before publishing, the next one in line publishes for it
+ * once its turn has waited MVCC_CHECK_MS: as it was if the dead writer had
+ * reached its turn, otherwise undone (saved rows written back, appended
+ * records left as deleted ones), so later commits are never stuck.
+ *
+ * Readers announce their snapshot in a slot (epoch-based reclamation). A
+ * saved row is unlinked once every active reader's snapshot is at or past
+ * the commit that replaced it. Its memory is reused once every reader that
+ * could still be walking past it has finished.
+ *
+ * A delete is a modify that writes a tombstone (Year = STORE_TOMBSTONE).
+ * Deleted slots go on a free list that creates may reuse. Compaction
+ * rewrites the file without them: it keeps writers out (the gate), writes a
+ * new file, renames it over the old one and starts a new generation. Readers
+ * are never held up, a snapshot of the old generation keeps reading the old
+ * file through its open descriptor. Each process reopens the data file when
+ * it first sees a new generation.
+ */
+#ifndef P3MVCCHEADER
+#define P3MVCCHEADER
+
+#include <cstddef>
+#include <cstdint>
+#include "p3store.hpp"
+
+/** readers that can hold a snapshot at once */
+#define MVCC_READERS 256
+/** saved rows in the version arena */
+#define MVCC_VERSIONS 65536
+/** hash buckets of the version arena */
+#define MVCC_BUCKETS 16384
+/** deleted slots remembered for reuse (more are only reclaimed by compaction) */
+#define MVCC_FREESLOTS 65536
+/** processes that can be writing at once */
+#define MVCC_WRITERS 512
+/** ms a writer waits for its turn before checking the commit ahead for a dead writer */
+#define MVCC_CHECK_MS 100
+
+/**
+ * a reader's view of the data file
+ */
+typedef struct {
+  /** last commit visible */
+  uint32_t seq;
+  /** records visible */
+  long long count;
+  /** reader slot held, -1 if none */
+  int slot;
+  /** data file generation */
+  uint32_t gen;
+} SNAPSHOT;
+
+/**
+ * a writer's reserved commit
+ */
+typedef struct {
+  /** commit sequence number */
+  uint32_t seq;
+  /** records visible once it is published */
+  long long count;
+  /** record written, -1 if none */
+  long long rec;
+  /** change in deleted records: 1 for a delete, -1 for a reused slot */
+  int dead;
+} COMMIT;
+
+/**
+ * @brief creates the shared state. Call once in the server before forking,
+ * after storeOpen.
+ * @param count records in the data file
+ * @param gen the data file's generation (storeGen)
+ * @return false if shared memory cannot be created
+ */
+bool mvccCreate(long long count, uint32_t gen);
+
+/**
+ * @brief takes a snapshot and holds a reader slot until mvccEnd
+ */
+SNAPSHOT mvccBegin();
+
+/**
+ * @brief releases a snapshot's reader slot
+ */
+void mvccEnd(SNAPSHOT *snap);
+
+/**
+ * @brief reads n records starting at index first as of the snapshot.
+ * Records past the snapshot's count are not read.
+ * @return records read, -1 on error
+ */
+int mvccRead(const SNAPSHOT *snap, long long first, int n, int *rows);
+
+/**
+ * @brief record count of the latest commit, deleted records included
+ * (record numbers go up to this)
+ */
+long long mvccCount();
+
+/**
+ * @brief records of the latest commit that are not deleted
+ */
+long long mvccRecords();
+
+/**
+ * @brief current data file generation
+ */
+uint32_t mvccGen();
+
+/**
+ * @brief waits while compaction runs and keeps it out until this process
+ * publishes a commit or calls mvccRelease. Record numbers looked up while
+ * holding stay valid for the commit. Writes hold on their own.
+ * @return the data file generation
+ */
+uint32_t mvccHold();
+
+/**
+ * @brief lets compaction in again without publishing a commit
+ */
+void mvccRelease();
+
+/**
+ * @brief reserves the next record slot and commit, and writes the record
+ * there. No lock needed. The caller must mvccPublish the commit, or
+ * mvccAbort it on error.
+ * @param reuse take a deleted record's slot instead if there is one
+ * (c->rec tells which slot was written, c->dead is -1 if it was reused)
+ * @param old output, the row replaced: a tombstone for a new slot (may be NULL)
+ * @return false on error
+ */
+bool mvccAppend(const int *row, COMMIT *c, bool reuse = false, int *old = NULL);
+
+/**
+ * @brief overwrites record rec (0-based) under a reserved commit. The caller
+ * holds the record's stripe lock and must mvccPublish the commit, or
+ * mvccAbort it on error. May wait for readers when the version arena is full.
+ * @param old output, the row replaced (may be NULL)
+ * @return false on error
+ */
+bool mvccWrite(long long rec, const int *row, COMMIT *c, int *old = NULL);
+
+/**
+ * @brief mvccWrite for a record that must exist (modify, delete)
+ * @return 1 if written, -1 on error (abort the commit), 0 if
+ * the record is deleted or was never published: nothing is reserved, and
+ * the caller calls mvccRelease
+ */
+int mvccUpdate(long long rec, const int *row, COMMIT *c, int *old = NULL);
+
+/**
+ * @brief reserves a commit that changes nothing. Publishing it after
+ * mvccTurn lets a caller act while no other commit can be published.
+ */
+void mvccReserve(COMMIT *c);
+
+/**
+ * @brief waits until every earlier commit is published. Work done between
+ * this and mvccPublish (e.g. journaling) happens in commit order.
+ */
+void mvccTurn(const COMMIT *c);
+
+/**
+ * @brief waits for earlier commits, then makes this one visible to readers
+ */
+void mvccPublish(const COMMIT *c);
+
+/**
+ * @brief publishes a commit whose write failed (mvccAppend, mvccWrite or
+ * mvccUpdate returned an error) as one that changes nothing: the row it
+ * replaced is written back, a record it appended is left as a deleted one.
+ * Nothing of it may have been journaled, indexed or aggregated.
+ */
+void mvccAbort(COMMIT *c);
+
+/**
+ * @brief replaces the whole data file with a new one (replica resync). No
+ * other writer may run. New readers wait and current readers are drained
+ * first. Starts a new generation, record numbers from before are not mapped.
+ * @param f the new file, installed or discarded
+ * @return false on error
+ */
+bool mvccReset(STORENEW *f);
+
+/**
+ * @brief keeps new writers out and waits for the ones in progress to
+ * publish. Readers carry on. Only one process may compact at a time.
+ * Writers that died are not waited for, and writers open a gate left
+ * shut by a process that died.
+ * @return the data file generation
+ */
+uint32_t mvccGate();
+
+/**
+ * @brief starts a new generation after the data file was replaced with
+ * count records while gated. Clears the deleted slots.
+ * @return the new generation
+ */
+uint32_t mvccSwap(long long count);
+
+/**
+ * @brief lets writers in again
+ */
+void mvccUngate();
+
+/**
+ * @brief attaches, in another process, the shared state mvccCreate made.
+ * Call before opening the data file (storeAttach).
+ * @param id from mvccId
+ * @return false on error
+ */
+bool mvccAttach(int id);
+
+/**
+ * @brief shared memory id of the state in use, for mvccAttach
+ */
+int mvccId();
+
+/**
+ * @brief lets go of the shared state in this process
+ */
+void mvccClose();
+
+/**
+ * a process' view of the snapshot state, one per dataset of a server
+ * holding several (see p3dset.hpp)
+ */
+typedef struct MVCCSTATE MVCCSTATE;
+
+/**
+ * @brief snapshot state that is not set up, for mvccSwitch
+ */
+MVCCSTATE *mvccState();
+
+/**
+ * @brief switches this process to the snapshot state s holds; s keeps the
+ * one that was in use (see storeSwitch)
+ */
+void mvccSwitch(MVCCSTATE *s);
+
+#endif
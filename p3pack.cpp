@@ -0,0 +1,193 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3pack.cpp
+ * @brief      delta / zig-zag / varint and bit-packing of record columns
+ *
+ * Records are encoded column by column. Each column is delta coded against
+ * the previous row (the first row against 0), and the deltas are zig-zag
+ * mapped so small negative changes stay small. ENC_VARINT writes each delta
+ * as a LEB128 varint, ENC_BITPACK writes blocks of PACK_BLOCK deltas using
+ * the smallest bit width that fits the whole block (1 width byte per block).
+ */
+#include "p3pack.hpp"
+#include <cstring>
+
+/** zig-zag map a signed delta */
+static inline uint32_t zigzag(uint32_t d) {
+  return (d << 1) ^ (uint32_t)((int32_t)d >> 31);
+}
+
+/** inverse of zigzag() */
+static inline uint32_t unzigzag(uint32_t z) {
+  return (z >> 1) ^ (0u - (z & 1));
+}
+
+/** number of bits needed for v */
+static inline int bitWidth(uint32_t v) {
+  return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+size_t packBound(int enc, int n) {
+  size_t cols = PACK_COLS;
+  if(enc == ENC_VARINT)
+	return cols * n * 5 + 8;
+  // 1 width byte per block + 4 bytes per value worst case, + 8 for 64-bit loads
+  size_t blocks = (n + PACK_BLOCK - 1) / PACK_BLOCK;
+  return cols * (blocks + (size_t)n * 4) + 8;
+}
+
+/**
+ * @brief writes column c as delta varints
+ * @return new output position
+ */
+static unsigned char *packVarint(const int *rows, int n, int c, unsigned char *out) {
+  uint32_t prev = 0;
+  for(int r=0; r < n; r++) {
+	uint32_t v = (uint32_t)rows[r * PACK_COLS + c];
+	uint32_t z = zigzag(v - prev);
+	prev = v;
+	while(z >= 0x80) {
+	  *out++ = (unsigned char)(z | 0x80);
+	  z >>= 7;
+	}
+	*out++ = (unsigned char)z;
+  }
+  return out;
+}
+
+/**
+ * @brief writes column c as bit-packed blocks of zig-zag deltas
+ * @return new output position
+ */
+static unsigned char *packBits(const int *rows, int n, int c, unsigned char *out) {
+  uint32_t prev = 0;
+  uint32_t zz[PACK_BLOCK];
+  for(int b=0; b < n; b += PACK_BLOCK) {
+	int cnt = n - b < PACK_BLOCK ? n - b : PACK_BLOCK;
+	uint32_t all = 0;
+	for(int i=0; i < cnt; i++) {
+	  uint32_t v = (uint32_t)rows[(b + i) * PACK_COLS + c];
+	  zz[i] = zigzag(v - prev);
+	  prev = v;
+	  all |= zz[i];
+	}
+	int w = bitWidth(all);
+	*out++ = (unsigned char)w;
+
+	uint64_t acc = 0;
+	int bits = 0;
+	for(int i=0; i < cnt; i++) {
+	  acc |= (uint64_t)zz[i] << bits;
+	  bits += w;
+	  while(bits >= 8) {
+		*out++ = (unsigned char)acc;
+		acc >>= 8;
+		bits -= 8;
+	  }
+	}
+	if(bits > 0)
+	  *out++ = (unsigned char)acc;
+  }
+  return out;
+}
+
+size_t packRecords(int enc, const int *rows, int n, unsigned char *out) {
+  unsigned char *p = out;
+  for(int c=0; c < PACK_COLS; c++) {
+	if(enc == ENC_VARINT)
+	  p = packVarint(rows, n, c, p);
+	else
+	  p = packBits(rows, n, c, p);
+  }
+  return p - out;
+}
+
+/**
+ * @brief unpacks cnt values of a fixed width W
+ * W is a template argument so the shifts and masks are constants and the
+ * loop can be unrolled / vectorized by the compiler.
+ */
+template<int W>
+static void unpackBlock(const unsigned char *in, uint32_t *out, int cnt) {
+  const uint64_t mask = W == 32 ? 0xffffffffull : ((1ull << W) - 1);
+  for(int i=0; i < cnt; i++) {
+	uint64_t bit = (uint64_t)i * W;
+	uint64_t word;
+	memcpy(&word, in + (bit >> 3), sizeof(word)); // needs 8 bytes of padding
+	out[i] = (uint32_t)((word >> (bit & 7)) & mask);
+  }
+}
+
+/** zero width: every delta in the block is 0 */
+template<>
+void unpackBlock<0>(const unsigned char *in, uint32_t *out, int cnt) {
+  memset(out, 0, sizeof(uint32_t) * cnt);
+}
+
+typedef void (*UNPACKFN)(const unsigned char *, uint32_t *, int);
+
+/** unpacker for each bit width 0-32 */
+static const UNPACKFN unpackers[33] = {
+  unpackBlock<0>, unpackBlock<1>, unpackBlock<2>, unpackBlock<3>,
+  unpackBlock<4>, unpackBlock<5>, unpackBlock<6>, unpackBlock<7>,
+  unpackBlock<8>, unpackBlock<9>, unpackBlock<10>, unpackBlock<11>,
+  unpackBlock<12>, unpackBlock<13>, unpackBlock<14>, unpackBlock<15>,
+  unpackBlock<16>, unpackBlock<17>, unpackBlock<18>, unpackBlock<19>,
+  unpackBlock<20>, unpackBlock<21>, unpackBlock<22>, unpackBlock<23>,
+  unpackBlock<24>, unpackBlock<25>, unpackBlock<26>, unpackBlock<27>,
+  unpackBlock<28>, unpackBlock<29>, unpackBlock<30>, unpackBlock<31>,
+  unpackBlock<32>
+};
+
+bool unpackRecords(int enc, const unsigned char *in, size_t len, int *rows, int n) {
+  const unsigned char *p = in, *end = in + len;
+  uint32_t zz[PACK_BLOCK];
+
+  for(int c=0; c < PACK_COLS; c++) {
+	uint32_t prev = 0;
+	if(enc == ENC_VARINT) {
+	  for(int r=0; r < n; r++) {
+		uint32_t z = 0;
+		int shift = 0;
+		while(true) {
+		  if(p >= end || shift > 28) return false;
+		  unsigned char b = *p++;
+		  z |= (uint32_t)(b & 0x7f) << shift;
+		  if(!(b & 0x80)) break;
+		  shift += 7;
+		}
+		prev += unzigzag(z);
+		rows[r * PACK_COLS + c] = (int)prev;
+	  }
+
+	} else if(enc == ENC_BITPACK) {
+	  for(int b=0; b < n; b += PACK_BLOCK) {
+		int cnt = n - b < PACK_BLOCK ? n - b : PACK_BLOCK;
+		if(p >= end) return false;
+		int w = *p++;
+		if(w > 32) return false;
+		size_t bytes = ((size_t)cnt * w + 7) / 8;
+		if(p + bytes > end) return false;
+		unpackers[w](p, zz, cnt);
+		p += bytes;
+		for(int i=0; i < cnt; i++) { // prefix sum back to values
+		  prev += unzigzag(zz[i]);
+		  rows[(b + i) * PACK_COLS + c] = (int)prev;
+		}
+	  }
+
+	} else {
+	  return false;
+	}
+  }
+  return p == end;
+}
+
+const char *encodingName(int enc) {
+  switch(enc) {
+  case ENC_RAW: return "raw";
+  case ENC_VARINT: return "varint";
+  case ENC_BITPACK: return "bitpack";
+  }
+  return "unknown";
+}
@@ -0,0 +1,60 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3pack.hpp
+ * @brief      compressed encodings for multi-record transfers
+ */
+#ifndef P3PACKHEADER
+#define P3PACKHEADER
+
+#include <cstddef>
+#include <cstdint>
+#include "p3schema.hpp"
+
+/** raw encoding: 1 record per MESSAGE (default, legacy) */
+#define ENC_RAW 0
+/** per-column delta + zig-zag varint */
+#define ENC_VARINT 1
+/** per-column delta + zig-zag, bit-packed in blocks of PACK_BLOCK rows */
+#define ENC_BITPACK 2
+/** number of rows per bit-packed block */
+#define PACK_BLOCK 128
+/** max records encoded into one chunk on the wire */
+#define PACK_CHUNK 4096
+/** ints per record (see p3schema.hpp) */
+#define PACK_COLS SCHEMA_COLS
+
+/**
+ * @brief upper bound of the encoded size of n records
+ * @param enc encoding (ENC_VARINT or ENC_BITPACK)
+ * @param n number of records
+ * @return max bytes packRecords() can write, including padding
+ */
+size_t packBound(int enc, int n);
+
+/**
+ * @brief encodes n records (row-major, PACK_COLS ints each)
+ * @param enc encoding (ENC_VARINT or ENC_BITPACK)
+ * @param rows the records
+ * @param n number of records
+ * @param out output buffer of at least packBound(enc, n) bytes
+ * @return number of bytes written
+ */
+size_t packRecords(int enc, const int *rows, int n, unsigned char *out);
+
+/**
+ * @brief decodes n records produced by packRecords
+ * @param enc encoding used by the sender
+ * @param in encoded bytes, readable up to packBound(enc, n)
+ * @param len number of encoded bytes
+ * @param rows output, n * PACK_COLS ints
+ * @param n number of records
+ * @return false if the input is malformed
+ */
+bool unpackRecords(int enc, const unsigned char *in, size_t len, int *rows, int n);
+
+/**
+ * @brief name of an encoding, for printing
+ */
+const char *encodingName(int enc);
+
+#endif
@@ -0,0 +1,143 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3render.hpp
+ * @brief      prints many records at once: formatted with std::to_chars
+ *             into one large buffer, written with write(2)
+ *
+ * Printing a -999 dump through cout costs a stream formatter call per
+ * field (setw, left, the locale) and a flush per row with endl; on a large
+ * file that takes longer than fetching it. renderRows formats the rows
+ * itself into RENDER_BUFFER bytes and hands them to the kernel in one write
+ * each time the buffer fills, in one of four formats:
+ *
+ *     table  the client's table, the same bytes as schemaPrint
+ *     csv    column names, then comma separated values
+ *     tsv    the same, tab separated
+ *     raw    the ints of each record as in the data file (SCHEMA_COLS
+ *            native ints per record), for programs that read them back
+ *
+ * Anything printed through cout before must be flushed first, since the
+ * rows bypass it. "./p3bench render" compares the formats with cout.
+ */
+#ifndef P3RENDERHEADER
+#define P3RENDERHEADER
+
+#include "p3schema.hpp"
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+/** the client's table */
+#define RENDER_TABLE 0
+/** comma separated values */
+#define RENDER_CSV 1
+/** tab separated values */
+#define RENDER_TSV 2
+/** native binary ints */
+#define RENDER_RAW 3
+/** bytes formatted before each write */
+#define RENDER_BUFFER (1 << 20)
+
+/**
+ * @brief the format called name ("table", "csv", "tsv" or "raw"), -1 if
+ * there is none
+ */
+inline int renderFormat(const char *name) {
+  static const char *names[] = {"table", "csv", "tsv", "raw"};
+  for(int f=0; f < 4; f++)
+	if(strcmp(name, names[f]) == 0)
+	  return f;
+  return -1;
+}
+
+/**
+ * @brief writes all of buf, through short writes and signals
+ * @return false on error (errno tells why)
+ */
+inline bool renderWrite(int fd, const char *buf, size_t len) {
+  while(len > 0) {
+	ssize_t n = write(fd, buf, len);
+	if(n < 0 && errno == EINTR)
+	  continue;
+	if(n <= 0)
+	  return false;
+	buf += n;
+	len -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief most bytes one record of S takes in any text format
+ */
+template<class S>
+constexpr size_t renderRowMax() {
+  size_t n = 1;
+  for(int c=0; c < schemaCols<S>(); c++)
+	n += 11 + (S::column[c].width > 0 ? S::column[c].width : 0); // "-2147483648"
+  return n;
+}
+
+/**
+ * @brief formats one record of S at out
+ * @return the end of what was written
+ */
+template<class S>
+inline char *renderRow(char *out, const int *row, int format) {
+  forColumns<S>([&](auto c) {
+	char *start = out;
+	out = std::to_chars(out, out + 11, row[c]).ptr;
+	if(format == RENDER_TABLE) { // left aligned in the column, like setw
+	  for(int pad = S::column[c].width - (int)(out - start); pad > 0; pad--)
+		*out++ = ' ';
+	} else if(c + 1 < schemaCols<S>()) {
+	  *out++ = format == RENDER_CSV ? ',' : '\t';
+	}
+  });
+  *out++ = '\n';
+  return out;
+}
+
+/**
+ * @brief writes the column names of S, for csv and tsv (other formats
+ * have no heading here)
+ * @return false on a write error
+ */
+template<class S>
+bool renderHeader(int fd, int format) {
+  if(format != RENDER_CSV && format != RENDER_TSV)
+	return true;
+  std::string line;
+  for(int c=0; c < schemaCols<S>(); c++)
+	line += (c > 0 ? (format == RENDER_CSV ? "," : "\t") : "") + std::string(S::column[c].name);
+  line += '\n';
+  return renderWrite(fd, line.data(), line.size());
+}
+
+/**
+ * @brief writes n records of S (row-major) to fd in format
+ * @return false on a write error
+ */
+template<class S>
+bool renderRows(int fd, int format, const int *rows, size_t n) {
+  constexpr int cols = schemaCols<S>();
+  if(format == RENDER_RAW)
+	return renderWrite(fd, (const char *)rows, n * cols * sizeof(int));
+
+  std::vector<char> buf(RENDER_BUFFER);
+  char *out = buf.data(), *limit = buf.data() + buf.size() - renderRowMax<S>();
+  for(const int *row = rows, *end = rows + n * cols; row < end; row += cols) {
+	out = renderRow<S>(out, row, format);
+	if(out > limit) {
+	  if(!renderWrite(fd, buf.data(), out - buf.data()))
+		return false;
+	  out = buf.data();
+	}
+  }
+  return renderWrite(fd, buf.data(), out - buf.data());
+}
+
+#endif
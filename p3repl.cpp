@@ -0,0 +1,95 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3repl.cpp
+ * @brief      mutation journal for read replicas
+ *
+ * The journal is a flat file of fixed-size JENTRY, so entry seq lives at
+ * offset (seq - 1) * sizeof(JENTRY) and readers in other processes find new
+ * entries from the file size alone.
+ */
+#include "p3repl.hpp"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <utility>
+
+/** journal file descriptor */
+static int journalFd = -1;
+
+long long usecNow() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+bool journalOpen(const char *path) {
+  journalFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  return journalFd >= 0;
+}
+
+bool journalAttach(const char *path) {
+  journalFd = open(path, O_RDWR);
+  return journalFd >= 0;
+}
+
+long long journalSeq() {
+  struct stat st;
+  if(journalFd < 0 || fstat(journalFd, &st) < 0)
+	return 0;
+  return st.st_size / sizeof(JENTRY);
+}
+
+long long journalAppend(int op, long long rec, const int *row) {
+  if(journalFd < 0) return -1;
+  JENTRY e;
+  memset(&e, 0, sizeof(e));
+  e.seq = journalSeq() + 1;
+  e.usec = usecNow();
+  e.op = op;
+  e.rec = rec;
+  memcpy(e.row, row, sizeof(e.row));
+  if(pwrite(journalFd, &e, sizeof(e), (e.seq - 1) * sizeof(JENTRY)) != sizeof(e))
+	return -1;
+  return e.seq;
+}
+
+int journalRead(long long after, JENTRY *out, int max) {
+  long long n = journalSeq() - after;
+  if(n <= 0) return 0;
+  if(n > max) n = max;
+  ssize_t got = pread(journalFd, out, n * sizeof(JENTRY), after * sizeof(JENTRY));
+  if(got < 0) return -1;
+  return got / sizeof(JENTRY); // a torn last entry is picked up next time
+}
+
+long long replLagMs(const REPLSTAT *stat) {
+  if(!stat->connected)
+	return (usecNow() - stat->heardUsec) / 1000;
+  if(stat->applied >= stat->primary)
+	return 0;
+  return (stat->heardUsec - stat->appliedUsec) / 1000;
+}
+
+void journalClose() {
+  if(journalFd >= 0)
+	close(journalFd);
+  journalFd = -1;
+}
+
+/**
+ * the static above, for a dataset that is not in use
+ */
+struct JOURNALSTATE {
+  int journalFd;
+};
+
+JOURNALSTATE *journalState() {
+  return new JOURNALSTATE{-1};
+}
+
+void journalSwitch(JOURNALSTATE *s) {
+  std::swap(journalFd, s->journalFd);
+}
@@ -0,0 +1,127 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3repl.hpp
+ * @brief      mutation journal and replica status for read replicas
+ */
+#ifndef P3REPLHEADER
+#define P3REPLHEADER
+
+#include "p3schema.hpp"
+
+/** heartbeat, no mutation (seq is the sender's current journal seq) */
+#define REPL_HEARTBEAT 0
+/** record appended */
+#define REPL_CREATE 1
+/** record overwritten (a delete writes a tombstone) */
+#define REPL_MODIFY 3
+/** deleted records dropped from the data file, the replica compacts too */
+#define REPL_COMPACT 5
+/** the sender installed a new snapshot (a replica that resynced): what
+ * follows is against that, so a replica behind it resyncs too */
+#define REPL_RESET 6
+
+/** seconds between heartbeats on an idle replication stream */
+#define REPL_HEARTBEAT_SEC 1
+
+/**
+ * one entry of the mutation journal, also sent as-is to replicas
+ */
+typedef struct {
+  /** position in the journal, starting at 1 */
+  long long seq;
+  /** when the primary committed it (microseconds since the epoch) */
+  long long usec;
+  /** record index (0-based) written */
+  long long rec;
+  /** REPL_CREATE, REPL_MODIFY, REPL_COMPACT, REPL_RESET or REPL_HEARTBEAT */
+  int op;
+  /** the record's fields (64 bytes in all with the 9 columns of WASTE) */
+  int row[SCHEMA_COLS];
+} JENTRY;
+
+/**
+ * in shared memory on a replica, written by the process applying the stream
+ */
+typedef struct {
+  /** snapshot received, the replica may serve reads */
+  int synced;
+  /** connected to the primary right now */
+  int connected;
+  /** last journal seq applied */
+  long long applied;
+  /** newest journal seq the primary has told us about */
+  long long primary;
+  /** primary's commit time of the last applied entry */
+  long long appliedUsec;
+  /** primary's clock at the last message received */
+  long long heardUsec;
+} REPLSTAT;
+
+/**
+ * @brief microseconds since the epoch
+ */
+long long usecNow();
+
+/**
+ * @brief opens the journal, discarding old entries. Replicas bootstrap from
+ * a snapshot taken together with a journal position, so history from an
+ * earlier run is never needed.
+ * @return false on error
+ */
+bool journalOpen(const char *path);
+
+/**
+ * @brief opens, in another process, the journal journalOpen started,
+ * keeping its entries
+ * @return false on error
+ */
+bool journalAttach(const char *path);
+
+/**
+ * @brief appends a mutation. Callers hold the data file lock so journal
+ * order matches the order mutations hit the data file.
+ * @return the entry's seq, -1 on error
+ */
+long long journalAppend(int op, long long rec, const int *row);
+
+/**
+ * @brief seq of the newest entry (0 if empty)
+ */
+long long journalSeq();
+
+/**
+ * @brief reads entries with seq > after
+ * @param out room for max entries
+ * @return entries read, -1 on error
+ */
+int journalRead(long long after, JENTRY *out, int max);
+
+/**
+ * @brief replication lag of a replica in milliseconds: how far the last
+ * applied mutation is behind the newest one the primary announced, or the
+ * time since the primary was last heard from when disconnected
+ */
+long long replLagMs(const REPLSTAT *stat);
+
+/**
+ * @brief closes the journal in this process
+ */
+void journalClose();
+
+/**
+ * a process' journal, one per dataset (see p3dset.hpp)
+ */
+typedef struct JOURNALSTATE JOURNALSTATE;
+
+/**
+ * @brief a journal that is not open, for journalSwitch
+ */
+JOURNALSTATE *journalState();
+
+/**
+ * @brief switches this process to the journal s holds; s keeps the one that
+ * was in use (see storeSwitch)
+ */
+void journalSwitch(JOURNALSTATE *s);
+
+#endif
@@ -0,0 +1,227 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3report.cpp
+ * @brief      summarizes a trace file written by "./server -T percent"
+ *
+ * Usage: ./p3report [-n requests] [tracefile]
+ *
+ * Lists the slowest traced requests with where their time went, the phases
+ * of the slowest one, and per semaphore how often it was taken and how long
+ * requests waited for it and held it.
+ */
+#include "p3trace.hpp"
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * one traced request as read back
+ */
+typedef struct {
+  TRACEREQ req;
+  vector<TRACEEVENT> events;
+} TRACED;
+
+/**
+ * totals for one semaphore name
+ */
+typedef struct {
+  long long acquires, waitNs, waitMax, holds, holdNs, holdMax;
+} LOCKSTAT;
+
+/**
+ * @brief short name of a request
+ */
+string requestName(const TRACEREQ &r) {
+  switch(r.request) {
+  case 1: return "create";
+  case 2: return r.arg == -999 ? "dump" : "display";
+  case 3: return "modify";
+  case 4: return "log";
+  case 5: return "delete";
+  case 10: return "count";
+  case 11: return "encoding";
+  case 12: return "shm";
+  case 20: return "subscribe";
+  case 22: return "replstat";
+  case 30: return "shardmap";
+  case 40: return "sorted";
+  case 41: return r.arg == 1 ? "statsverify" : "stats";
+  default: return to_string(r.request);
+  }
+}
+
+/**
+ * @brief name of an event kind
+ */
+const char *kindName(int kind) {
+  static const char *names[TRACE_KINDS] = {"?", "wait", "hold", "read", "write", "send"};
+  return kind > 0 && kind < TRACE_KINDS ? names[kind] : "?";
+}
+
+/**
+ * @brief reads a whole trace file
+ * @return false if it is not one
+ */
+bool readTrace(const char *path, TRACEHDR *hdr, vector<TRACED> *out) {
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) {
+	perror(path);
+	return false;
+  }
+  if(fread(hdr, sizeof(TRACEHDR), 1, f) != 1 || hdr->magic != TRACE_MAGIC
+	 || hdr->version != TRACE_VERSION || hdr->locks > TRACE_LOCKS) {
+	cout << path << " is not a trace file" << endl;
+	fclose(f);
+	return false;
+  }
+  TRACED t;
+  while(fread(&t.req, sizeof(TRACEREQ), 1, f) == 1) {
+	if(t.req.events > TRACE_EVENTS) {
+	  cout << "corrupt request record, stopping at " << out->size() << endl;
+	  break;
+	}
+	t.events.resize(t.req.events);
+	if(t.req.events > 0 && fread(t.events.data(), sizeof(TRACEEVENT), t.req.events, f)
+	   != t.req.events)
+	  break; // cut short by a server still writing
+	out->push_back(t);
+  }
+  fclose(f);
+  return true;
+}
+
+/**
+ * @brief "name" or "name[num]" of an event's semaphore
+ */
+string lockName(const TRACEHDR &hdr, const TRACEEVENT &e) {
+  string name = e.lock < hdr.locks ? hdr.name[e.lock] : "?";
+  if(e.lock == 0 || strcmp(hdr.name[e.lock], "record stripe") == 0)
+	name += "[" + to_string(e.num) + "]";
+  return name;
+}
+
+/** @brief main function */
+int main(int argc, char **argv) {
+  int opt, top = 10;
+  while((opt = getopt(argc, argv, "n:")) != -1) {
+	if(opt == 'n') top = atoi(optarg);
+	else {
+	  cout << "Usage: " << argv[0] << " [-n requests] [tracefile]" << endl;
+	  return -1;
+	}
+  }
+  const char *path = optind < argc ? argv[optind] : "CSC552p3.trace";
+
+  TRACEHDR hdr;
+  vector<TRACED> traced;
+  if(!readTrace(path, &hdr, &traced))
+	return -1;
+  cout << path << ": " << traced.size() << " requests traced ("
+	   << hdr.rate / 1000.0 << "% sampled)" << endl << endl;
+  if(traced.empty())
+	return 0;
+
+  // slowest requests and where their time went
+  sort(traced.begin(), traced.end(),
+	   [](const TRACED &a, const TRACED &b) { return a.req.total > b.req.total; });
+  cout << fixed << setprecision(3);
+  cout << "Slowest requests (ms):" << endl
+	   << right << setw(10) << "total" << setw(10) << "request" << setw(8) << "pid"
+	   << setw(8) << "client";
+  for(int k=TRACE_WAIT; k < TRACE_KINDS; k++)
+	cout << setw(10) << kindName(k);
+  cout << endl;
+  for(size_t i=0; i < traced.size() && (int)i < top; i++) {
+	const TRACEREQ &r = traced[i].req;
+	cout << setw(10) << r.total / 1e6 << setw(10) << requestName(r) << setw(8) << r.pid
+		 << setw(8) << r.client;
+	for(int k=TRACE_WAIT; k < TRACE_KINDS; k++)
+	  cout << setw(10) << r.spent[k] / 1e6;
+	if(r.dropped)
+	  cout << "  (+" << r.dropped << " events)";
+	cout << endl;
+  }
+
+  const TRACED &worst = traced[0];
+  cout << endl << "Phases of the slowest (" << requestName(worst.req) << ", "
+	   << worst.req.total / 1e3 << " us):" << endl;
+  for(const TRACEEVENT &e : worst.events) {
+	cout << "  at " << setw(10) << e.at << " us  " << setw(5) << kindName(e.kind)
+		 << setw(12) << e.len / 1e3 << " us";
+	if(e.count > 1)
+	  cout << " (" << e.count << " times)";
+	if(e.kind == TRACE_WAIT || e.kind == TRACE_HOLD)
+	  cout << "  " << lockName(hdr, e);
+	cout << endl;
+  }
+
+  // per request type
+  cout << endl << "By request:" << endl
+	   << setw(10) << "request" << setw(10) << "count" << setw(12) << "mean ms"
+	   << setw(12) << "max ms" << endl;
+  vector<string> names;
+  for(const TRACED &t : traced)
+	if(find(names.begin(), names.end(), requestName(t.req)) == names.end())
+	  names.push_back(requestName(t.req));
+  for(const string &name : names) {
+	long long n = 0, sum = 0, most = 0;
+	for(const TRACED &t : traced)
+	  if(requestName(t.req) == name) {
+		n++;
+		sum += t.req.total;
+		most = max(most, (long long)t.req.total);
+	  }
+	cout << setw(10) << name << setw(10) << n << setw(12) << sum / 1e6 / n
+		 << setw(12) << most / 1e6 << endl;
+  }
+
+  // per semaphore
+  vector<LOCKSTAT> locks(hdr.locks);
+  memset(locks.data(), 0, locks.size() * sizeof(LOCKSTAT));
+  for(const TRACED &t : traced)
+	for(const TRACEEVENT &e : t.events) {
+	  if(e.lock >= hdr.locks) continue;
+	  LOCKSTAT &s = locks[e.lock];
+	  if(e.kind == TRACE_WAIT) {
+		s.acquires += e.count;
+		s.waitNs += e.len;
+		s.waitMax = max(s.waitMax, (long long)e.len / e.count);
+	  } else if(e.kind == TRACE_HOLD) {
+		s.holds += e.count;
+		s.holdNs += e.len;
+		s.holdMax = max(s.holdMax, (long long)e.len / e.count);
+	  }
+	}
+  cout << endl << "Semaphores (us):" << endl
+	   << left << setw(16) << "name" << right << setw(10) << "acquires"
+	   << setw(12) << "wait total" << setw(10) << "mean" << setw(10) << "max"
+	   << setw(12) << "hold total" << setw(10) << "mean" << setw(10) << "max" << endl;
+  for(uint32_t i=0; i < hdr.locks; i++) {
+	const LOCKSTAT &s = locks[i];
+	if(s.acquires == 0 && s.holds == 0) continue;
+	cout << left << setw(16) << hdr.name[i] << right << setw(10) << s.acquires
+		 << setw(12) << s.waitNs / 1e3 << setw(10) << (s.acquires ? s.waitNs / 1e3 / s.acquires : 0)
+		 << setw(10) << s.waitMax / 1e3
+		 << setw(12) << s.holdNs / 1e3 << setw(10) << (s.holds ? s.holdNs / 1e3 / s.holds : 0)
+		 << setw(10) << s.holdMax / 1e3 << endl;
+  }
+
+  // file I/O and sends over all requests
+  cout << endl << "Other phases (ms):" << endl;
+  for(int k=TRACE_READ; k < TRACE_KINDS; k++) {
+	long long sum = 0;
+	for(const TRACED &t : traced)
+	  sum += t.req.spent[k];
+	cout << "  " << left << setw(6) << kindName(k) << right << setw(12) << sum / 1e6 << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3schema.hpp
+ * @brief      the record layout, described once and worked out by the
+ *             compiler
+ *
+ * A data set is a struct with a title, a unit and a constexpr array of
+ * COLUMNs. Everything that depends on the layout comes from it: the ints
+ * per record in the data file, in packed dumps and in a MESSAGE
+ * (SCHEMA_COLS, see STORE_COLS and PACK_COLS), the table the client prints, and the scan kernels below. The kernels are templates over the
+ * data set and the column, so each is compiled with the stride and the
+ * column as constants: no loop over a run-time field list, no field switch
+ * inside a scan. Serving another data set is a new struct and a different
+ * SCHEMA typedef.
+ *
+ * Column 0 also marks deleted records: SCHEMA_TOMBSTONE there (see
+ * STORE_TOMBSTONE in p3store.hpp).
+ */
+#ifndef P3SCHEMAHEADER
+#define P3SCHEMAHEADER
+
+#include <climits>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <utility>
+
+/** column 0 of a deleted record */
+#define SCHEMA_TOMBSTONE INT_MIN
+
+/**
+ * one int column of a record
+ */
+typedef struct {
+  /** heading, and the name prompts use */
+  const char *name;
+  /** characters it is printed in */
+  int width;
+} COLUMN;
+
+/**
+ * materials in the U.S. municipal waste stream, one record per year
+ */
+struct WASTE {
+  static constexpr const char *title =
+	"Materials in the U.S. municipal waste stream between 1960 and 2018";
+  static constexpr const char *unit = "in 1000 tons";
+  static constexpr COLUMN column[] = {
+	{"Year", 6}, {"Paper", 10}, {"Glass", 10}, {"Metals", 10}, {"Plastics", 10},
+	{"Rubber", 10}, {"Textiles", 10}, {"Wood", 10}, {"Other", 10}
+  };
+};
+
+/** the data set this build serves */
+typedef WASTE SCHEMA;
+
+/**
+ * @brief columns of data set S
+ */
+template<class S>
+constexpr int schemaCols() {
+  return sizeof(S::column) / sizeof(S::column[0]);
+}
+
+/** ints per record */
+#define SCHEMA_COLS (schemaCols<SCHEMA>())
+
+/**
+ * @brief name of column c of the served data set
+ */
+inline const char *schemaName(int c) {
+  return SCHEMA::column[c].name;
+}
+
+/**
+ * @brief calls f(std::integral_constant<int, c>()) for c in C, in order
+ */
+template<class F, int... C>
+inline void eachColumn(F &&f, std::integer_sequence<int, C...>) {
+  (f(std::integral_constant<int, C>()), ...);
+}
+
+/**
+ * @brief calls f with every column of S as a constant, unrolled
+ */
+template<class S, class F>
+inline void forColumns(F &&f) {
+  eachColumn(f, std::make_integer_sequence<int, schemaCols<S>()>());
+}
+
+/**
+ * @brief prints the title, unit and column headings of S
+ */
+template<class S>
+void schemaHeader(std::ostream &out) {
+  out << S::title << std::endl;
+  out << "(" << S::unit << ")" << std::endl;
+  out << "----------------------------------" << std::endl;
+  forColumns<S>([&](auto c) {
+	out << std::left << std::setw(S::column[c].width) << S::column[c].name;
+  });
+  out << std::endl;
+}
+
+/**
+ * @brief prints one record of S under schemaHeader
+ */
+template<class S>
+void schemaPrint(std::ostream &out, const int *row) {
+  forColumns<S>([&](auto c) {
+	out << std::setw(S::column[c].width) << std::left << row[c];
+  });
+  out << std::endl;
+}
+
+/**
+ * @brief adds the live records among n (row-major) to a count and to each
+ * column's sum, minimum and maximum
+ */
+template<class S>
+void schemaTotals(const int *rows, int n, int64_t *count, int64_t *sum,
+				  int32_t *min, int32_t *max) {
+  constexpr int cols = schemaCols<S>();
+  for(const int *row = rows, *end = rows + (size_t)n * cols; row < end; row += cols) {
+	if(row[0] == SCHEMA_TOMBSTONE) continue;
+	++*count;
+	forColumns<S>([&](auto c) {
+	  int v = row[c];
+	  sum[c] += v;
+	  if(v < min[c]) min[c] = v;
+	  if(v > max[c]) max[c] = v;
+	});
+  }
+}
+
+/**
+ * @brief copies column C of the live records among n (row-major) to vals,
+ * and their positions (first + i) to recs
+ * @return how many were copied
+ */
+template<class S, int C>
+int schemaPick(const int *rows, int n, long long first, int *vals, long long *recs) {
+  constexpr int cols = schemaCols<S>();
+  int m = 0;
+  for(int i=0; i < n; i++) {
+	const int *row = rows + (size_t)i * cols;
+	if(row[0] == SCHEMA_TOMBSTONE) continue;
+	vals[m] = row[C];
+	recs[m++] = first + i;
+  }
+  return m;
+}
+
+typedef int (*PICKFN)(const int *, int, long long, int *, long long *);
+
+/**
+ * @brief schemaPick of column c, from a table made once per data set
+ */
+template<class S, int... C>
+inline PICKFN pickerOf(int c, std::integer_sequence<int, C...>) {
+  static const PICKFN pickers[] = {schemaPick<S, C>...};
+  return pickers[c];
+}
+
+/**
+ * @brief schemaPick of column c of S, chosen once per scan
+ */
+template<class S>
+inline PICKFN schemaPicker(int c) {
+  return pickerOf<S>(c, std::make_integer_sequence<int, schemaCols<S>()>());
+}
+
+#endif
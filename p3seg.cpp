@@ -0,0 +1,453 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3seg.cpp
+ * @brief      log rotation, the segment index, compression and retention
+ */
+#include "p3seg.hpp"
+#include "p3lock.hpp"
+#include "p3store.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+/**
+ * one closed segment
+ */
+typedef struct {
+  /** its number, log.ser.num */
+  long long num;
+  /** number of its first line since the log began */
+  long long first;
+  /** lines in it */
+  long long lines;
+  /** bytes on disk, compressed if packed */
+  long long bytes;
+  /** when it was started and closed (unix seconds) */
+  long long opened, closed;
+  /** 1 compressed, 0 not yet, -1 gzip failed (it stays as it is) */
+  int packed;
+} SEGMENT;
+
+/**
+ * in memory shared by the server and its children (made by segOpen)
+ */
+typedef struct {
+  /** spin lock for everything below but the current segment's counts,
+   * which the log's write lock covers */
+  uint32_t lock;
+  /** rotations so far; a process that saw fewer reopens the log */
+  int gen;
+  /** number the current segment gets when it is closed */
+  long long next;
+  /** number of the current segment's first line */
+  long long first;
+  /** current segment: lines, bytes and when it was started */
+  long long lines, bytes, opened;
+  /** closed segments kept, oldest first */
+  int num;
+  SEGMENT seg[SEG_MAX];
+  /** what segOpen was given, for segAttach */
+  char path[256];
+  long long maxBytes;
+  int maxSec, keep;
+} SEGSHARED;
+
+/** shared state, NULL before segOpen */
+static SEGSHARED *st = NULL;
+/** shared memory id of st */
+static int stId = -1;
+/** the current segment */
+static char logPath[256];
+/** size cap (bytes) and age cap (seconds), 0 for none */
+static long long capBytes = 0;
+static int capSec = 0;
+/** closed segments kept */
+static int keepSegs = SEG_KEEP;
+/** rotations this process has opened the log after */
+static int seenGen = 0;
+
+/**
+ * @brief file of segment num, compressed or not
+ */
+static string segName(long long num, bool packed) {
+  return string(logPath) + "." + to_string(num) + (packed ? ".gz" : "");
+}
+
+/**
+ * @brief size of a file, -1 if there is none
+ */
+static long long fileSize(const string &path) {
+  struct stat s;
+  return stat(path.c_str(), &s) < 0 ? -1 : s.st_size;
+}
+
+/**
+ * @brief lines and bytes in a file (0 if there is none)
+ */
+static long long countLines(const string &path, long long *bytes) {
+  long long lines = 0;
+  *bytes = 0;
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+	return 0;
+  vector<char> buf(1 << 16);
+  for(ssize_t got; (got = read(fd, buf.data(), buf.size())) > 0; ) {
+	*bytes += got;
+	lines += count(buf.data(), buf.data() + got, '\n');
+  }
+  close(fd);
+  return lines;
+}
+
+/**
+ * @brief writes the index, replacing the old one in one rename. With the
+ * spin lock held.
+ */
+static void save() {
+  string idx = string(logPath) + ".idx", tmp = idx + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if(f == NULL)
+	return;
+  fprintf(f, "# segment first lines bytes opened closed packed\n");
+  fprintf(f, "next %lld %lld\n", st->next, st->first);
+  for(int i=0; i < st->num; i++) {
+	const SEGMENT *s = &st->seg[i];
+	fprintf(f, "%lld %lld %lld %lld %lld %lld %d\n", s->num, s->first, s->lines,
+			s->bytes, s->opened, s->closed, s->packed);
+  }
+  if(fclose(f) == 0)
+	rename(tmp.c_str(), idx.c_str());
+  else
+	unlink(tmp.c_str());
+}
+
+/**
+ * @brief reads the index. The files there have the last word: a server
+ * that stopped between renaming a file and saving the index left it one
+ * step behind.
+ */
+static void load() {
+  st->next = 1;
+  st->first = 0;
+  FILE *f = fopen((string(logPath) + ".idx").c_str(), "r");
+  char line[256];
+  while(f && fgets(line, sizeof(line), f)) {
+	SEGMENT s;
+	if(line[0] == '#' || sscanf(line, "next %lld %lld", &st->next, &st->first) == 2)
+	  continue;
+	if(sscanf(line, "%lld %lld %lld %lld %lld %lld %d", &s.num, &s.first, &s.lines,
+			  &s.bytes, &s.opened, &s.closed, &s.packed) != 7 || st->num == SEG_MAX)
+	  continue;
+	long long plain = fileSize(segName(s.num, false)), packed = fileSize(segName(s.num, true));
+	if(plain >= 0) { // not compressed yet, or compressed but not marked
+	  unlink(segName(s.num, true).c_str());
+	  s.bytes = plain;
+	  s.packed = s.packed < 0 ? -1 : 0;
+	} else if(packed >= 0) {
+	  s.bytes = packed;
+	  s.packed = 1;
+	} else {
+	  continue; // deleted
+	}
+	st->seg[st->num++] = s;
+  }
+  if(f)
+	fclose(f);
+
+  // renamed by a rotation the index did not get to hear about
+  while(st->num < SEG_MAX && fileSize(segName(st->next, false)) >= 0) {
+	SEGMENT s = {st->next, st->first, 0, 0, 0, 0, 0};
+	s.lines = countLines(segName(s.num, false), &s.bytes);
+	s.opened = s.closed = time(NULL);
+	st->seg[st->num++] = s;
+	st->next++;
+	st->first += s.lines;
+  }
+}
+
+/**
+ * @brief deletes the oldest closed segments over the limit. With the spin
+ * lock held.
+ */
+static void trim() {
+  int drop = max(0, st->num - keepSegs);
+  for(int i=0; i < drop; i++) {
+	unlink(segName(st->seg[i].num, false).c_str());
+	unlink(segName(st->seg[i].num, true).c_str());
+  }
+  if(drop > 0) {
+	memmove(st->seg, st->seg + drop, (st->num - drop) * sizeof(SEGMENT));
+	st->num -= drop;
+  }
+}
+
+bool segOpen(const char *path, long long maxBytes, int maxSec, int keep) {
+  snprintf(logPath, sizeof(logPath), "%s", path);
+  capBytes = maxBytes;
+  capSec = maxSec;
+  keepSegs = min(keep, SEG_MAX - 1);
+  if((stId = shmget(IPC_PRIVATE, sizeof(SEGSHARED), IPC_CREAT | 0600)) < 0)
+	return false;
+  st = (SEGSHARED *)shmat(stId, 0, 0);
+  shmctl(stId, IPC_RMID, 0); // goes away with the last process
+  if(st == (void *)-1) {
+	st = NULL;
+	return false;
+  }
+  memset(st, 0, sizeof(SEGSHARED));
+  snprintf(st->path, sizeof(st->path), "%s", path);
+  st->maxBytes = maxBytes;
+  st->maxSec = maxSec;
+  st->keep = keepSegs;
+  load();
+  st->lines = countLines(logPath, &st->bytes); // once, not per request
+  st->opened = time(NULL);
+  trim();
+  save();
+  seenGen = st->gen;
+  return true;
+}
+
+/**
+ * @brief true if the current segment should be closed before len more
+ * bytes go in
+ */
+static bool due(size_t len) {
+  if(st->bytes == 0)
+	return false;
+  return (capBytes > 0 && st->bytes + (long long)len > capBytes)
+	|| (capSec > 0 && time(NULL) - st->opened >= capSec);
+}
+
+bool segAppend(const char *line, size_t len) {
+  if(st == NULL)
+	return storeLogAppend(line, len);
+  if(due(len)) {
+	spinLock(&st->lock);
+	long long num = st->next, now = time(NULL);
+	if(rename(logPath, segName(num, false).c_str()) == 0) {
+	  SEGMENT s = {num, st->first, st->lines, st->bytes, st->opened, now, 0};
+	  st->seg[st->num++] = s;
+	  st->next++;
+	  st->first += st->lines;
+	  st->lines = st->bytes = 0;
+	  __atomic_add_fetch(&st->gen, 1, __ATOMIC_RELEASE);
+	  trim();
+	  save();
+	} else {
+	  perror("cannot rotate log");
+	}
+	spinUnlock(&st->lock);
+	st->opened = now;
+  }
+  int gen = __atomic_load_n(&st->gen, __ATOMIC_ACQUIRE);
+  if(gen != seenGen) { // rotated, by us or another process
+	if(!storeLogReopen(logPath))
+	  return false;
+	seenGen = gen;
+  }
+  if(!storeLogAppend(line, len))
+	return false;
+  st->bytes += len;
+  st->lines += count(line, line + len, '\n');
+  return true;
+}
+
+int segPlan(long long want, SEGREAD *plan, long long *lines) {
+  int n = 0;
+  long long have = 0;
+  // newest first: the current segment, then back through the closed ones
+  auto add = [&](const string &name, int packed, long long count) {
+	if(count == 0 || (want > 0 && have >= want))
+	  return;
+	int fd = open(name.c_str(), O_RDONLY);
+	if(fd < 0)
+	  return;
+	long long take = want > 0 ? min(count, want - have) : count;
+	SEGREAD r = {fd, packed == 1, count - take, take};
+	plan[n++] = r;
+	have += take;
+  };
+  spinLock(&st->lock); // a compression swaps files under it
+  add(logPath, 0, st->lines);
+  for(int i = st->num - 1; i >= 0; i--)
+	add(segName(st->seg[i].num, st->seg[i].packed == 1), st->seg[i].packed, st->seg[i].lines);
+  spinUnlock(&st->lock);
+  reverse(plan, plan + n);
+  *lines = have;
+  return n;
+}
+
+/**
+ * @brief starts "gzip -dc" reading the compressed file in
+ * @param child output, its pid
+ * @return its output, -1 on error (in is closed either way)
+ */
+static int gunzip(int in, pid_t *child) {
+  int p[2];
+  if(pipe(p) < 0) {
+	close(in);
+	return -1;
+  }
+  pid_t c = fork();
+  if(c == 0) {
+	dup2(in, 0);
+	dup2(p[1], 1);
+	execlp("gzip", "gzip", "-dc", (char *)NULL);
+	_exit(127);
+  }
+  close(in);
+  close(p[1]);
+  if(c < 0) {
+	close(p[0]);
+	return -1;
+  }
+  *child = c;
+  return p[0];
+}
+
+void segRead(SEGREAD *plan, int n, void (*each)(const char *line, void *arg), void *arg) {
+  // our gzip children are reaped here, not by the server's SIGCHLD handler
+  sigset_t chld, old;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &old);
+  char *buf = NULL;
+  size_t cap = 0;
+  for(int i=0; i < n; i++) {
+	SEGREAD *r = &plan[i];
+	pid_t gz = -1;
+	int fd = r->packed ? gunzip(r->fd, &gz) : r->fd;
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "r");
+	if(f == NULL && fd >= 0)
+	  close(fd);
+
+	long long at = 0, end = r->skip + r->lines;
+	for(ssize_t got; f && at < end && (got = getline(&buf, &cap, f)) >= 0; at++) {
+	  if(at < r->skip)
+		continue;
+	  if(got > 0 && buf[got - 1] == '\n')
+		buf[got - 1] = '\0';
+	  each(buf, arg);
+	}
+	for(; at < end; at++) // shorter than counted
+	  if(at >= r->skip)
+		each("", arg);
+	if(f)
+	  fclose(f); // gzip stops at its next write
+	if(gz > 0)
+	  waitpid(gz, NULL, 0);
+  }
+  free(buf);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+bool segPack() {
+  long long num = -1;
+  spinLock(&st->lock);
+  for(int i=0; i < st->num && num < 0; i++)
+	if(st->seg[i].packed == 0)
+	  num = st->seg[i].num;
+  spinUnlock(&st->lock);
+  if(num < 0)
+	return false;
+
+  string plain = segName(num, false), packed = segName(num, true), tmp = packed + ".tmp";
+  int in = open(plain.c_str(), O_RDONLY);
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = false;
+  if(in >= 0 && out >= 0) {
+	pid_t c = fork();
+	if(c == 0) {
+	  dup2(in, 0);
+	  dup2(out, 1);
+	  execlp("gzip", "gzip", "-c", "-n", (char *)NULL);
+	  _exit(127);
+	}
+	int stat;
+	ok = c > 0 && waitpid(c, &stat, 0) == c && WIFEXITED(stat) && WEXITSTATUS(stat) == 0;
+  }
+  if(in >= 0) close(in);
+  if(out >= 0) close(out);
+
+  spinLock(&st->lock);
+  int i = 0;
+  while(i < st->num && st->seg[i].num != num)
+	i++;
+  if(i < st->num && ok && rename(tmp.c_str(), packed.c_str()) == 0) {
+	unlink(plain.c_str()); // a reader that opened it still has it
+	st->seg[i].packed = 1;
+	st->seg[i].bytes = fileSize(packed);
+  } else {
+	unlink(tmp.c_str());
+	if(i < st->num)
+	  st->seg[i].packed = -1; // not tried again
+  }
+  save();
+  spinUnlock(&st->lock);
+  return i < st->num && st->seg[i].packed == 1;
+}
+
+bool segAttach(int id) {
+  st = (SEGSHARED *)shmat(id, 0, 0);
+  if(st == (void *)-1) {
+	st = NULL;
+	return false;
+  }
+  stId = id;
+  snprintf(logPath, sizeof(logPath), "%s", st->path);
+  capBytes = st->maxBytes;
+  capSec = st->maxSec;
+  keepSegs = st->keep;
+  seenGen = __atomic_load_n(&st->gen, __ATOMIC_ACQUIRE); // before the log is opened
+  return true;
+}
+
+int segId() {
+  return stId;
+}
+
+void segClose() {
+  if(st)
+	shmdt(st);
+  st = NULL;
+  stId = -1;
+}
+
+/**
+ * the statics above, for a dataset that is not in use
+ */
+struct SEGSTATE {
+  SEGSHARED *st;
+  int stId;
+  char logPath[256];
+  long long capBytes;
+  int capSec, keepSegs, seenGen;
+};
+
+SEGSTATE *segState() {
+  return new SEGSTATE{NULL, -1, "", 0, 0, SEG_KEEP, 0};
+}
+
+void segSwitch(SEGSTATE *s) {
+  swap(st, s->st);
+  swap(stId, s->stId);
+  swap(logPath, s->logPath);
+  swap(capBytes, s->capBytes);
+  swap(capSec, s->capSec);
+  swap(keepSegs, s->keepSegs);
+  swap(seenGen, s->seenGen);
+}
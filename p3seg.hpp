@@ -0,0 +1,140 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3seg.hpp
+ * @brief      the server log in numbered segments: rotated by size or age,
+ *             compressed in the background, indexed and kept only so long
+ *
+ * The server appends to log.ser as before. Once it would pass the size cap
+ * (server -L MB), or has been open longer than the age cap (-A seconds),
+ * the next line first rotates it: log.ser is renamed to log.ser.N, with N
+ * counting up from 1, and a new log.ser is started. Every process notices
+ * the rotation at its next line and opens the new file.
+ *
+ * Closed segments are listed in log.ser.idx, one per line, oldest first:
+ *
+ *     # segment first lines bytes opened closed packed
+ *     next 14 260000
+ *     12 220000 20000 1048570 1700000000 1700003600 1
+ *     13 240000 20000 1048560 1700003600 1700007200 0
+ *
+ * "first" is the number of the segment's first line since the log began
+ * (0-based), so a line's segment is found without opening any; the "next"
+ * line gives the current segment's number and first line. With -z a
+ * background process compresses closed segments with gzip, to
+ * log.ser.N.gz, and marks them packed. Only the newest -k closed segments
+ * are kept; a rotation deletes older ones, so the log never takes more than
+ * (k + 1) times the size cap (less once compressed).
+ *
+ * Request 4 asks for the last buffer[0] lines (0 for all kept). The counts
+ * come from the index and a running count of the current segment, so the
+ * server opens only the segments holding those lines and reads each once.
+ */
+#ifndef P3SEGHEADER
+#define P3SEGHEADER
+
+#include <cstddef>
+
+/** closed segments the index can list */
+#define SEG_MAX 1024
+/** size cap unless told otherwise (server -L, MB) */
+#define SEG_MB 16
+/** closed segments kept unless told otherwise (server -k) */
+#define SEG_KEEP 8
+/** seconds between the compressing process' rounds */
+#define SEG_TICK_SEC 1
+
+/**
+ * one segment to read, from segPlan
+ */
+typedef struct {
+  /** the open file */
+  int fd;
+  /** 1 if it is gzip compressed */
+  int packed;
+  /** lines to pass over first */
+  long long skip;
+  /** lines to read after them */
+  long long lines;
+} SEGREAD;
+
+/**
+ * @brief loads the index (checking it against the files there), counts the
+ * lines of the current segment and sets up the shared state. Call once in
+ * the server before forking, after storeOpen.
+ * @param path the log file, the current segment
+ * @param maxBytes size cap, 0 for none
+ * @param maxSec age cap, 0 for none
+ * @param keep closed segments kept, less than SEG_MAX
+ * @return false if the shared state cannot be created
+ */
+bool segOpen(const char *path, long long maxBytes, int maxSec, int keep);
+
+/**
+ * @brief appends one line (with its newline) to the log, rotating first if
+ * it is due. Call with the log's write lock held.
+ * @return false on error
+ */
+bool segAppend(const char *line, size_t len);
+
+/**
+ * @brief opens the segments holding the last want lines of the log (0 for
+ * every line kept), oldest first. Call with the log's write lock held
+ * shared, so the current segment's count stays put; the files may be read
+ * after letting it go.
+ * @param plan output, room for SEG_MAX + 1
+ * @param lines output, the lines the plan covers
+ * @return entries in plan
+ */
+int segPlan(long long want, SEGREAD *plan, long long *lines);
+
+/**
+ * @brief reads the lines of a plan in order, calling each for every one
+ * (without its newline), and closes the files. A segment that turns out
+ * shorter than its count gives empty lines, so each is called exactly as
+ * many times as segPlan said.
+ */
+void segRead(SEGREAD *plan, int n, void (*each)(const char *line, void *arg), void *arg);
+
+/**
+ * @brief compresses the oldest closed segment not compressed yet, if any.
+ * For a process of its own: it waits for gzip.
+ * @return true if it compressed one
+ */
+bool segPack();
+
+/**
+ * @brief attaches, in another process, the shared state segOpen set up,
+ * with the path and caps it was given. Call before opening the log
+ * (storeAttach).
+ * @param id from segId
+ * @return false on error
+ */
+bool segAttach(int id);
+
+/**
+ * @brief shared memory id of the state in use, for segAttach
+ */
+int segId();
+
+/**
+ * @brief lets go of the shared state in this process
+ */
+void segClose();
+
+/**
+ * a process' log segments, one set per dataset (see p3dset.hpp)
+ */
+typedef struct SEGSTATE SEGSTATE;
+
+/**
+ * @brief segments that are not open, for segSwitch
+ */
+SEGSTATE *segState();
+
+/**
+ * @brief switches this process to the log segments s holds; s keeps the
+ * ones that were in use (see storeSwitch)
+ */
+void segSwitch(SEGSTATE *s);
+
+#endif
@@ -3,28 +3,118 @@
  * @file       p3ser.cpp
 */
 #include "p3.hpp"
+#include "p3store.hpp"
+#include "p3xport.hpp"
+#include "p3repl.hpp"
+#include "p3shard.hpp"
+#include "p3mvcc.hpp"
+#include "p3admit.hpp"
+#include "p3trace.hpp"
+#include "p3cap.hpp"
+#include "p3crc.hpp"
+#include "p3index.hpp"
+#include "p3agg.hpp"
+#include "p3dset.hpp"
+#include "p3seg.hpp"
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+
+/**
+ * one dataset's state in this process: every module's, and its locks.
+ * dataSwitch exchanges it with the state in use.
+ */
+typedef struct {
+  STORESTATE *store;
+  MVCCSTATE *mvcc;
+  INDEXSTATE *index;
+  AGGSTATE *agg;
+  JOURNALSTATE *journal;
+  SEGSTATE *seg;
+  int sem, stripes;
+  /** the dataset's opening this is (DATASET.opens), 0 if closed */
+  int opens;
+} DATAHANDLE;
 
 bool startServer();
+int openTCP();
 void serverListen();
+void preforkListen();
+void startWorker(int);
+void workerLoop();
+int acceptClient(struct sockaddr_in *, bool *);
+void serveClient(int, bool, struct sockaddr_in);
+int countClients();
 void handleClient();
 void handleRequest(MESSAGE);
 void sendNumRecords();
 void writeLog(pid_t, string);
+void setEncoding(MESSAGE);
+void sendPacked(MESSAGE, SNAPSHOT *);
+void startShm(MESSAGE);
+void sendChunk(MESSAGE, int *, int);
+void sendReplication(MESSAGE);
+void sendReplStatus(MESSAGE);
+void readOnly(MESSAGE);
+void startReplica();
+void replicaLoop();
+bool replicaSync(XPORT *);
+bool applyStream(XPORT *);
+bool staleMap(MESSAGE);
+bool admitRequest(MESSAGE);
+void sendShardMap(MESSAGE);
+void sendGone(MESSAGE);
+void sendUnwritten(MESSAGE);
+bool refuseTombstone(MESSAGE);
+void sendSorted(MESSAGE);
+void sendStats(MESSAGE);
+void openDataset(MESSAGE);
+bool openData(string, string);
+bool createLocks(key_t);
+DATAHANDLE *useDataset(int);
+DATAHANDLE *attachDataset(int, int);
+void dropStale();
+void eachDataset(void (*)());
+DATAHANDLE *newHandle();
+void dataSwitch(DATAHANDLE *);
+void dataIds(int *);
+bool attachData(const DATASET *);
+void closeData();
+long long sharedBytes(const int *);
+pid_t startOpener();
+void serveDatasets();
+void wakeCatcher(int);
+AGGREGATE scanTotals(SNAPSHOT *, bool);
+long long remapRecord(int, long long, uint32_t);
+string remapName(uint32_t);
+pid_t startCompactor();
+void compactDue();
+bool compactData();
+pid_t startPacker();
+void packAll();
+void sendLogLine(const char *, void *);
+void sendFailed(const char *);
 void childCatcher(int);
+void logReaped();
 void intCatcher(int);
 
 
-/** binary data file for operations */
-FILE *file;
-/** server logfile */
-fstream logfile;
 int sockfd, /*!< socket for listening */
+  unixfd, /*!< unix domain socket for listening (same-host clients) */
   newsockfd, /*!< client / child's socket */
   cliPID; /*!< client's PID */
+/** child's connection to its client */
+XPORT conn;
 /** client's IP */
 char *cliIP;
-/** semaphore */
+/** data file and log locks (p3lock.hpp) */
 int sem;
+/** striped record locks for modifies, one lock per stripe */
+int stripes;
 //int readerCount = 0, writerCount = 0;
 /** number of children active */
 int childCount = 0;
@@ -34,6 +124,72 @@ key_t semKey;
 int pid = -1;
 /** parent's pid */
 int parentPID = -1;
+/** encoding for multi-record responses, negotiated per connection */
+int encoding = ENC_RAW;
+/** number of prefork workers, 0 forks per connection */
+int numWorkers = 0;
+/** worker pool, in shared memory (prefork mode only) */
+POOL *pool = NULL;
+/** this process' slot in the pool, -1 if not a worker */
+int workerID = -1;
+/** port to listen on */
+int port = PORT;
+/** primary's IP when running as a read replica, NULL on the primary */
+char *primaryAddr = NULL;
+/** primary's port */
+int primaryPort = PORT;
+/** replication status, in shared memory (replica only) */
+REPLSTAT *repl = NULL;
+/** shard map file when this server is one shard of many, NULL otherwise */
+char *shardPath = NULL;
+/** records after which the open shard hands new records to a spare, 0 never */
+long long shardMax = 0;
+/** this process' copy of the shard map */
+SHARDMAP shards;
+/** deleted percentage of the data file that triggers compaction, 0 never */
+int compactPct = 25;
+/** clients served at once, more are turned away busy */
+int maxClients = ADMIT_CLIENTS;
+/** connections waiting to be accepted, per listening socket */
+int backlog = ADMIT_BACKLOG;
+/** point requests and scans per second allowed per client, 0 no limit */
+double pointRate = 0, scanRate = 0;
+/** scans (-999 dumps, log views) the server runs at once */
+int scanSlots = 0;
+/** client's IPv4 address (network order), 0 on this host */
+uint32_t cliAddr = 0;
+/** key of the client's token buckets (see p3admit.hpp) */
+uint64_t cliKey = 0;
+/** percent of requests traced (see p3trace.hpp), 0 none */
+double tracePct = 0;
+/** capture every request for replay (see p3cap.hpp) */
+bool capture = false;
+/** fields kept sorted for request 40 (see p3index.hpp), all unless -x */
+bool indexFields[STORE_COLS];
+/** catalog of named datasets this server holds (see p3dset.hpp), NULL if none */
+char *catalogPath = NULL;
+/** MB the datasets may take together */
+long long datasetMB = DATASET_BUDGET;
+
+
+/** handles of the catalog's datasets, NULL until one is first opened */
+DATAHANDLE *handles[DATASET_MAX];
+/** while this connection works on a dataset: its handle, which holds the
+ * server's own data meanwhile; NULL otherwise */
+DATAHANDLE *switched = NULL;
+/** storage backend asked for (-b) */
+int backend = STORE_URING;
+/** log segment size cap in MB and age cap in seconds, 0 for none (see p3seg.hpp) */
+long long logMB = SEG_MB;
+int logSec = 0;
+/** closed log segments kept */
+int logKeep = SEG_KEEP;
+/** compress closed log segments */
+bool logPack = false;
+/** reseal corrupt blocks at startup instead of refusing to serve */
+bool reseal = false;
+/** MB of replies queued per connection before waiting on the client (see p3xport.hpp) */
+long long queueMB = XPORT_QUEUE_MB;
 /** datafile reader */
 #define D_READER 0
 /** datafile writer */
@@ -42,6 +198,51 @@ int parentPID = -1;
 #define L_READER 2
 /** logfile reader */
 #define L_WRITER 3
+/** record lock stripes, record n uses stripe n % LOCK_STRIPES */
+#define LOCK_STRIPES 256
+/** seconds between the compactor's checks */
+#define COMPACT_SEC 5
+/** deleted records needed before compacting at all */
+#define COMPACT_MIN 16
+/** records compaction reads, filters and writes at a time */
+#define COMPACT_CHUNK 65536
+/** generations a client's record numbers can be mapped forward from */
+#define REMAP_KEEP 8
+/** corrupt blocks listed at startup */
+#define VERIFY_SHOWN 20
+/** DATASET.ids: the store's shared header and block locks */
+#define ID_STORE 0
+#define ID_STORELOCKS 1
+/** DATASET.ids: snapshot state, indexes, totals and log segments */
+#define ID_MVCC 2
+#define ID_INDEX 3
+#define ID_AGG 4
+#define ID_SEG 5
+/** DATASET.ids: data file and log locks, record locks */
+#define ID_SEM 6
+#define ID_STRIPES 7
+/** children of the server that serve no client */
+#define HELPERS 4
+/** the server's compactor, log packer, replica process and dataset opener
+ * (0 if none) */
+pid_t helperPid[HELPERS];
+/** index of the compactor in helperPid */
+#define HELPER_COMPACTOR 0
+/** index of the log packer in helperPid */
+#define HELPER_PACKER 1
+/** index of the replica process in helperPid */
+#define HELPER_REPLICA 2
+/** index of the dataset opener in helperPid */
+#define HELPER_OPENER 3
+/** exited children childCatcher keeps for logReaped */
+#define REAPED 256
+/** children reaped by childCatcher, for logReaped to log outside the handler
+ * (negated for helpers) */
+pid_t reaped[REAPED];
+/** entries put in reaped by childCatcher and taken by logReaped, counting up */
+unsigned reapedIn = 0, reapedOut = 0;
+/** children reaped while reaped was full */
+int reapedLost = 0;
 
 /** @brief main function */
 int main(int argc, char **argv) {
@@ -49,60 +250,355 @@ int main(int argc, char **argv) {
   if(signal(SIGINT, SIG_IGN) == SIG_ERR) // ignore SIGINT
 	perror("signal");	
 
-  cout << "Opening data file" << endl;
-  if((file = fopen("CSC552p3.bin", "rb+")) == NULL) {
-	cout << "Error: Cannot open binary data file" << endl;
+  int opt;
+  fill(indexFields, indexFields + STORE_COLS, true);
+  while((opt = getopt(argc, argv, "b:w:p:r:s:m:c:l:q:O:R:D:S:T:Px:C:M:L:A:k:zF")) != -1) {
+	switch(opt) {
+	case 'b': // storage backend
+	  if(strcmp(optarg, "pread") == 0) backend = STORE_PREAD;
+	  else if(strcmp(optarg, "uring") == 0) backend = STORE_URING;
+	  else {
+		cout << "Error: unknown backend '" << optarg << "'" << endl;
+		return -1;
+	  }
+	  break;
+	case 'w': // prefork workers
+	  numWorkers = atoi(optarg);
+	  if(numWorkers < 0 || numWorkers > MAX_WORKERS) {
+		cout << "Error: workers must be 0-" << MAX_WORKERS << endl;
+		return -1;
+	  }
+	  break;
+	case 'p': // listening port
+	  port = atoi(optarg);
+	  break;
+	case 'r': // read replica of primaryIP[:port]
+	  primaryAddr = optarg;
+	  if(strchr(optarg, ':')) {
+		*strchr(optarg, ':') = '\0';
+		primaryPort = atoi(optarg + strlen(optarg) + 1);
+	  }
+	  break;
+	case 's': // one shard of many
+	  shardPath = optarg;
+	  break;
+	case 'm': // shard split threshold
+	  shardMax = atoll(optarg);
+	  break;
+	case 'c': // compaction threshold
+	  compactPct = atoi(optarg);
+	  break;
+	case 'l': // connection limit
+	  maxClients = atoi(optarg);
+	  break;
+	case 'q': // accept queue
+	  backlog = atoi(optarg);
+	  break;
+	case 'O': // output queue per connection, MB
+	  queueMB = atoll(optarg);
+	  break;
+	case 'R': // point requests per second per client
+	  pointRate = atof(optarg);
+	  break;
+	case 'D': // scans per second per client
+	  scanRate = atof(optarg);
+	  break;
+	case 'S': // scans at once
+	  scanSlots = atoi(optarg);
+	  break;
+	case 'T': // trace a sample of requests
+	  tracePct = atof(optarg);
+	  break;
+	case 'P': // capture all traffic for replay
+	  capture = true;
+	  break;
+	case 'x': // indexed fields: all, none or a list of columns
+	  for(int i=0; i < STORE_COLS; i++)
+		indexFields[i] = strcmp(optarg, "all") == 0;
+	  if(strcmp(optarg, "all") == 0 || strcmp(optarg, "none") == 0)
+		break;
+	  for(char *f = strtok(optarg, ","); f; f = strtok(NULL, ",")) {
+		int i = atoi(f);
+		if(i < 0 || i >= STORE_COLS || !isdigit(*f)) {
+		  cout << "Error: -x takes all, none or fields 0-" << STORE_COLS - 1 << endl;
+		  return -1;
+		}
+		indexFields[i] = true;
+	  }
+	  break;
+	case 'C': // catalog of named datasets
+	  catalogPath = optarg;
+	  break;
+	case 'M': // memory budget of the datasets, MB
+	  datasetMB = atoll(optarg);
+	  break;
+	case 'L': // log segment size cap, MB
+	  logMB = atoll(optarg);
+	  break;
+	case 'A': // log segment age cap, seconds
+	  logSec = atoi(optarg);
+	  break;
+	case 'k': // closed log segments kept
+	  logKeep = atoi(optarg);
+	  break;
+	case 'z': // compress closed log segments
+	  logPack = true;
+	  break;
+	case 'F': // accept corrupt blocks as they are
+	  reseal = true;
+	  break;
+	default:
+	  cout << "Usage: " << argv[0] << " [-b pread|uring] [-w workers] [-p port]"
+		   << " [-c percent] [-l clients] [-q backlog] [-O MB] [-R rate] [-D rate] [-S scans]"
+		   << " [-T percent] [-P] [-x all|none|fields] [-C catalog [-M MB]]"
+		   << " [-L MB] [-A seconds] [-k segments] [-z] [-F]"
+		   << " [-r primaryIP[:port] | -s shardmap [-m records]]" << endl;
+	  return -1;
+	}
+  }
+
+  if(maxClients < 1 || backlog < 1 || queueMB < 1 || scanSlots < 0) {
+	cout << "Error: -l, -q and -O must be at least 1, -S at least 0" << endl;
 	return -1;
   }
-  cout << "Opening log file" << endl;
-  logfile.open("log.ser", fstream::in | fstream::app);
-  if(logfile.fail()) {
-	cout << "Error: Cannot open log file" << endl;
+  if(tracePct < 0 || tracePct > 100) {
+	cout << "Error: -T must be 0-100" << endl;
 	return -1;
   }
+  if(logMB < 0 || logSec < 0 || logKeep < 0 || logKeep >= SEG_MAX) {
+	cout << "Error: -L and -A must be at least 0, -k 0-" << SEG_MAX - 1 << endl;
+	return -1;
+  }
+  if(scanSlots == 0) // half the cpus for scans, the rest for point requests
+	scanSlots = max(1L, sysconf(_SC_NPROCESSORS_ONLN) / 2);
+
+  if(catalogPath) {
+	if(primaryAddr || shardPath) {
+	  cout << "Error: only a primary that is not sharded can serve a catalog" << endl;
+	  return -1;
+	}
+	if(datasetMB < 1 || !datasetLoad(catalogPath, datasetMB)) {
+	  cout << "Error: cannot load dataset catalog " << catalogPath
+		   << " (one \"name datafile\" per line, at most " << DATASET_MAX << ")" << endl;
+	  return -1;
+	}
+	if(datasetCount() > 0)
+	  cout << "Catalog " << catalogPath << ": " << datasetCount() << " datasets, "
+		   << datasetMB << " MB budget" << endl;
+  }
+  if(shardPath) {
+	if(primaryAddr) {
+	  cout << "Error: a replica cannot be a shard" << endl;
+	  return -1;
+	}
+	if(!shardRefresh(shardPath, &shards) || shardSelf(&shards, port) < 0) {
+	  cout << "Error: port " << port << " is not in shard map " << shardPath << endl;
+	  return -1;
+	}
+  }
+
+  // replicas and shards keep their own copy of everything, named after their port
+  string suffix = primaryAddr ? ".r" + to_string(port) : shardPath ? ".s" + to_string(port) : "";
+  string dataName = "CSC552p3" + suffix + ".bin";
+  if(primaryAddr || shardPath) // filled in from the primary's snapshot / by clients
+	close(open(dataName.c_str(), O_RDWR | O_CREAT, 0644));
+  if(!openData(dataName, suffix))
+	return -1;
   
-	
   cout << "Starting server..." << endl;
   if(!startServer()) { closeHandler(-1); return -1; }
+  string tracePath = "CSC552p3" + suffix + ".trace";
+  if(tracePct > 0) {
+	if(!traceOpen(tracePath.c_str(), tracePct)) {
+	  perror("cannot open trace file");
+	  closeHandler(-1);
+	  return -1;
+	}
+	cout << "Tracing " << tracePct << "% of requests to " << tracePath << endl;
+  }
+  string capPath = "CSC552p3" + suffix + ".cap";
+  if(capture) {
+	if(!capOpen(capPath.c_str())) {
+	  perror("cannot open capture file");
+	  closeHandler(-1);
+	  return -1;
+	}
+	cout << "Capturing requests to " << capPath << endl;
+  }
+
+  if(primaryAddr)
+	startReplica();
+  else if(!shardPath && compactPct > 0) // shard ranges depend on record numbers
+	helperPid[HELPER_COMPACTOR] = startCompactor();
+  if(logPack)
+	helperPid[HELPER_PACKER] = startPacker();
+  if(datasetCount() > 0)
+	helperPid[HELPER_OPENER] = startOpener();
 
   cout << "Waiting for clients..." << endl << endl;
-  serverListen();
+  if(numWorkers > 0)
+	preforkListen();
+  else
+	serverListen();
   
   return 0;
 } // end main
 
 /** 
- * @brief starts up the server socket 
- * @return true on success
+ * @brief opens a data file and everything kept with it: checks its blocks,
+ * opens its journal and log and builds its snapshot state, indexes and
+ * statistics. The server's own data at startup, a dataset's when it is
+ * first asked for, in the opener (see serveDatasets).
+ * @param suffix put in the names of the log, journal and other files
+ * @return false on error, after saying why
 */
-bool startServer() {
-  // create semaphores for binary file and log
-  semKey = PORT;
-  parentPID = getpid();
-  if((sem = semget(semKey, 4, 0666|IPC_CREAT)) < 0) {
+bool openData(string dataName, string suffix) {
+  cout << "Opening data file" << endl;
+  string logName = "log" + suffix + ".ser";
+  if(!storeOpen(dataName.c_str(), logName.c_str(), backend)) {
+	cout << "Error: Cannot open binary data file" << endl;
+	return false;
+  }
+  { // every block's checksum, on all cpus; refuse to serve garbage
+	long long started = usecNow(), bad[VERIFY_SHOWN];
+	int cpus = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	long long corrupt = storeVerify(cpus, bad, VERIFY_SHOWN);
+	cout << "Checked " << storeCount() << " records, generation " << storeGen()
+		 << " (crc32c " << crc32cName() << ", " << cpus << " threads, "
+		 << (usecNow() - started) / 1000 << " ms)" << endl;
+	for(int i=0; i < corrupt && i < VERIFY_SHOWN; i++)
+	  cout << "Corrupt block " << bad[i] << ": records " << bad[i] * STORE_BLOCK_ROWS + 1
+		   << "-" << min((bad[i] + 1) * STORE_BLOCK_ROWS, storeCount()) << endl;
+	if(corrupt > VERIFY_SHOWN)
+	  cout << "... and " << corrupt - VERIFY_SHOWN << " more" << endl;
+	if(corrupt > 0 && reseal) { // take the rows as they are, the log keeps which
+	  vector<long long> all(corrupt);
+	  corrupt = storeVerify(cpus, all.data(), corrupt);
+	  for(long long i=0; i < corrupt && i < (long long)all.size(); i++) {
+		string what = "resealed corrupt block " + to_string(all[i]) + ": records "
+		  + to_string(all[i] * STORE_BLOCK_ROWS + 1) + "-"
+		  + to_string(min((all[i] + 1) * STORE_BLOCK_ROWS, storeCount()));
+		if(!storeReseal(all[i])) {
+		  cout << "Error: cannot reseal block " << all[i] << endl;
+		  return false;
+		}
+		cout << what << endl;
+		string line = "Client PID: 0 | Operation: " + what + "\n"; // log locks come later
+		storeLogAppend(line.c_str(), line.size());
+	  }
+	  corrupt = 0;
+	}
+	if(corrupt > 0) {
+	  cout << "Error: " << dataName << " is corrupt, not serving it (-F reseals it as it is)" << endl;
+	  return false;
+	}
+  }
+  if(!journalOpen(("CSC552p3" + suffix + ".journal").c_str())) {
+	cout << "Error: Cannot open journal file" << endl;
+	return false;
+  }
+  if(!mvccCreate(storeCount(), storeGen())) {
+	cout << "Error: Cannot create snapshot state" << endl;
+	return false;
+  }
+  { // sort orders for request 40, kept up to date by every write from here on
+	long long started = usecNow();
+	if(!indexCreate(indexFields, storeCount(), storeGen())) {
+	  cout << "Error: Cannot create indexes" << endl;
+	  return false;
+	}
+	int fields = 0;
+	for(int i=0; i < STORE_COLS; i++)
+	  fields += indexed(i);
+	cout << "Indexed " << fields << " fields (" << (usecNow() - started) / 1000 << " ms)" << endl;
+  }
+  if(!aggCreate(storeCount())) { // field totals for request 41
+	cout << "Error: Cannot create field statistics" << endl;
+	return false;
+  }
+  { // record maps of an earlier run would mistranslate this run's generations
+	string dir = "." , base = string(storePath()) + ".remap.";
+	DIR *d = opendir(dir.c_str());
+	for(struct dirent *e; d && (e = readdir(d)) != NULL; )
+	  if(strncmp(e->d_name, base.c_str(), base.length()) == 0)
+		unlink(e->d_name);
+	if(d) closedir(d);
+  }
+  cout << "Storage backend: " << storeBackendName(storeBackend()) << endl;
+  cout << "Opening log file" << endl;
+  if(!segOpen(logName.c_str(), logMB << 20, logSec, logKeep)) {
+	cout << "Error: Cannot open log file" << endl;
+	return false;
+  }
+  return true;
+}
+
+/** 
+ * @brief creates the data file and log locks and the record locks
+ * @param key key of the data file and log locks, IPC_PRIVATE for a dataset
+ * @return false on error
+*/
+bool createLocks(key_t key) {
+  if((sem = lockGet(key, 4, 0666|IPC_CREAT)) < 0) {
 	perror("cannot create semaphores");
 	return false;
   }
-  // TODO: FIX
-  V(sem, D_READER);
+  V(sem, D_READER); // opens them, also if a server that crashed left them held
   V(sem, D_WRITER);
   V(sem, L_READER);
   V(sem, L_WRITER);
-  
-  struct sockaddr_in server = {AF_INET, htons(PORT), INADDR_ANY};
-  // create socket, bind it, listen
-  if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
-	perror("cannot open socket");
-	return false;	  
+
+  // record locks, private to this server and its children
+  if((stripes = lockGet(IPC_PRIVATE, LOCK_STRIPES, 0600|IPC_CREAT)) < 0) {
+	perror("cannot create record locks");
+	return false;
   }
-  if(bind(sockfd, (struct sockaddr *) &server, sizeof(server)) < 0) {
-	perror("bind error");
+  for(int i=0; i < LOCK_STRIPES; i++)
+	V(stripes, i);
+  return true;
+}
+
+/** 
+ * @brief starts up the server socket 
+ * @return true on success
+*/
+bool startServer() {
+  // create locks for binary file and log
+  semKey = port;
+  parentPID = getpid();
+  if(!createLocks(semKey))
+	return false;
+  traceName(sem, D_READER, "D_READER");
+  traceName(sem, D_WRITER, "D_WRITER");
+  traceName(sem, L_READER, "L_READER");
+  traceName(sem, L_WRITER, "L_WRITER");
+  traceName(stripes, -1, "record stripe");
+  if(!admitCreate(scanSlots, pointRate, scanRate)) {
+	perror("cannot create scan slots");
 	return false;
   }
-  if(listen(sockfd, 5) == -1) {
-	perror("listen failed");
-    return false;
+  
+  if((sockfd = openTCP()) < 0)
+	return false;
+
+  // same-host clients skip the TCP stack through a unix domain socket
+  struct sockaddr_un local;
+  memset(&local, 0, sizeof(local));
+  local.sun_family = AF_UNIX;
+  strncpy(local.sun_path, xportUnixPath(port), sizeof(local.sun_path) - 1);
+  unlink(local.sun_path); // left over from a killed server
+  if((unixfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	 || bind(unixfd, (struct sockaddr *) &local, sizeof(local)) < 0
+	 || listen(unixfd, backlog) == -1) {
+	perror("cannot open unix socket");
+	return false;
+  }
+  chmod(local.sun_path, 0777); // clients may run as other users
+  if(numWorkers > 0) { // workers share both, only one wins each accept
+	fcntl(sockfd, F_SETFL, O_NONBLOCK);
+	fcntl(unixfd, F_SETFL, O_NONBLOCK);
   }
+
   // display current IP address of server
   char host[256];
   int hostname = gethostname(host, sizeof(host));
@@ -110,23 +606,65 @@ bool startServer() {
   char *IP = inet_ntoa(*((struct in_addr*) host_entry->h_addr_list[0]));
 
   cout << "-------------------------------------" << endl;
-  cout << "Server started on '" << IP << "'" << endl;
+  cout << "Server started on '" << IP << "' port " << port << endl;
+  if(primaryAddr)
+	cout << "Read replica of " << primaryAddr << " port " << primaryPort << endl;
+  if(shardPath) {
+	SHARD *self = &shards.shard[shardSelf(&shards, port)];
+	cout << "Shard of " << shardPath << " (version " << shards.version << "): ";
+	if(self->lo == 0) cout << "spare" << endl;
+	else cout << "records " << self->lo << "-"
+			  << (self->hi == -1 ? string("") : to_string(self->hi)) << endl;
+  }
   cout << "-------------------------------------" << endl;
 
   return true;
 }
 
+/** 
+ * @brief opens the TCP listening socket
+ * @return the socket, -1 on error
+*/
+int openTCP() {
+  struct sockaddr_in server = {AF_INET, htons(port), INADDR_ANY};
+  int fd;
+  // create socket, bind it, listen
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
+	perror("cannot open socket");
+	return -1;	  
+  }
+  if(bind(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+	perror("bind error");
+	close(fd);
+	return -1;
+  }
+  if(listen(fd, backlog) == -1) {
+	perror("listen failed");
+	close(fd);
+    return -1;
+  }
+  return fd;
+}
+
 /** 
  * @brief signal handler for exit/kill, closes sockets
 */
 void closeHandler(int sig) {
   cout << "Server closing..." << endl;
   if(pid != 0) { // if parent
-	semctl(sem, 0, IPC_RMID);
+	for(int i=0; pool != NULL && i < numWorkers; i++) {
+	  pid_t w = pool->worker[i].pid;
+	  pool->worker[i].pid = 0; // not a crash, don't restart
+	  if(w > 0) kill(w, SIGKILL);
+	}
+	lockRemove(sem);
+	lockRemove(stripes);
+	admitClose();
 	close(newsockfd);
 	close(sockfd);
-	logfile.close();
-	fclose(file);
+	close(unixfd);
+	unlink(xportUnixPath(port));
+	storeClose();
 	exit(0);
   } else { // if child
 	//kill(parentPID, SIGCHLD);
@@ -142,80 +680,230 @@ void serverListen() {
   
   while(true) { // wait for connections
 	struct sockaddr_in cli;
-	socklen_t clilen = sizeof(cli);
-	/*
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(sockfd, &set);
-	int result = select(sockfd, &set, NULL, NULL, NULL);
-	if(result < 0) {
-	  perror("select error");
-	  exit(-1);
-	  } */
+	bool local;
 
 	// wait for incoming clients
 	signal(SIGINT, intCatcher); // unblock SIGINT
-	while(((newsockfd = accept(sockfd, (struct sockaddr *) &cli, &clilen)) < 0)) ;
+	while((newsockfd = acceptClient(&cli, &local)) < 0)
+	  logReaped(); // a SIGCHLD interrupts the wait
 	signal(SIGINT, SIG_IGN); // reblock
-
-	
-	if(newsockfd < 0) {
-	  perror("accept error");
-	  exit(-1);
+	logReaped();
+	if(countClients() >= maxClients) { // full, answer now instead of forking
+	  admitReject(newsockfd);
+	  writeLog(0, "server full, turned a client away");
+	  continue;
 	}
+
 	if((pid = fork()) < 0) {
 	  perror("fork error");
 	  exit(-1);
 	  
 	} else if(pid == 0) { // child
-	  cliIP = inet_ntoa(cli.sin_addr);
 	  close(sockfd);
-	  handleClient();
-	  close(newsockfd);
+	  close(unixfd);
+	  serveClient(newsockfd, local, cli);
 	  exit(0);
 	  
 	} else { // parent
 	  close(newsockfd);
-	  childCount++;
+	  __atomic_add_fetch(&childCount, 1, __ATOMIC_SEQ_CST); // childCatcher may run any time
 	}	
 	
   } // end while
 } // end serverListen
 
+/** 
+ * @brief waits for a client on the TCP or the unix socket
+ * @param cli filled with the client's address (TCP only)
+ * @param local set to true if the client came through the unix socket
+ * @return the client's socket, -1 if interrupted or another worker took it
+*/
+int acceptClient(struct sockaddr_in *cli, bool *local) {
+  socklen_t clilen = sizeof(*cli);
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(sockfd, &set);
+  FD_SET(unixfd, &set);
+  if(select(max(sockfd, unixfd) + 1, &set, NULL, NULL, NULL) <= 0)
+	return -1; // interrupted by a signal
+  *local = FD_ISSET(unixfd, &set);
+  return accept(*local ? unixfd : sockfd, (struct sockaddr *) cli, &clilen);
+}
+
+/** 
+ * @brief serves one client until it disconnects
+ * @param fd the client's socket
+ * @param local true if it came through the unix socket
+ * @param cli the client's address
+*/
+void serveClient(int fd, bool local, struct sockaddr_in cli) {
+  static char localIP[] = "local";
+  newsockfd = fd;
+  cliIP = local ? localIP : inet_ntoa(cli.sin_addr);
+  encoding = ENC_RAW; // per connection
+  cliAddr = local ? 0 : cli.sin_addr.s_addr;
+  xportAccept(&conn, fd, local ? XPORT_UNIX : XPORT_TCP);
+  xportQueue(&conn, queueMB << 20); // replies are sent after locks are let go
+  handleClient();
+  xportClose(&conn);
+  if(switched) { // back to the server's own data
+	dataSwitch(switched);
+	switched = NULL;
+	datasetLeave();
+  }
+}
+
+/** 
+ * @brief prefork mode: starts the workers, then restarts any that exit.
+ * Connection counts live in the shared POOL, so they stay exact even if a
+ * worker dies in the middle of a client.
+*/
+void preforkListen() {
+  int id = shmget(IPC_PRIVATE, sizeof(POOL), IPC_CREAT | 0600);
+  if(id < 0 || (pool = (POOL *)shmat(id, 0, 0)) == (void *)-1) {
+	perror("cannot create worker pool");
+	exit(-1);
+  }
+  shmctl(id, IPC_RMID, 0); // gone once every worker and the parent exit
+  memset(pool, 0, sizeof(POOL));
+  pool->num_workers = numWorkers;
+
+  for(int i=0; i < numWorkers; i++)
+	startWorker(i);
+  cout << "Started " << numWorkers << " workers" << endl;
+
+  signal(SIGINT, intCatcher); // waitpid is the only place SIGINT can arrive
+  while(true) {
+	int stat;
+	pid_t w = waitpid(-1, &stat, 0);
+	if(w < 0) {
+	  if(errno != EINTR) sleep(1);
+	  continue;
+	}
+	for(int i=0; i < numWorkers; i++) {
+	  if(pool->worker[i].pid != w) continue;
+
+	  cout << "Server: worker " << i << " (" << w << ") exited, restarting" << endl;
+	  writeLog(w, "worker exited with status " + to_string(stat)
+			   + ", dropping " + to_string(pool->worker[i].active) + " clients");
+	  pool->worker[i].active = 0; // its connections died with it
+	  if(time(NULL) - pool->worker[i].started < 1)
+		sleep(1); // don't spin if it dies right away (e.g. bind fails)
+	  pool->worker[i].restarts++;
+	  startWorker(i);
+	}
+  }
+}
+
+/** 
+ * @brief forks the worker for pool slot i
+*/
+void startWorker(int i) {
+  pid_t w = fork();
+  if(w < 0) {
+	perror("fork error");
+	return;
+  } else if(w == 0) { // worker
+	pid = 0;
+	workerID = i;
+	prctl(PR_SET_PDEATHSIG, SIGKILL); // don't outlive the supervisor
+	if(getppid() != parentPID) exit(0);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	workerLoop();
+	exit(0);
+  }
+  pool->worker[i].pid = w;
+  pool->worker[i].started = time(NULL);
+}
+
+/** 
+ * @brief prefork worker: accepts and serves clients one after another.
+ * Every worker waits on the same listening sockets and only a free one
+ * accepts, so a connection waits for the first worker to finish its client,
+ * never behind one that is busy while others sit idle.
+*/
+void workerLoop() {
+  while(true) {
+	struct sockaddr_in cli;
+	bool local;
+	int fd = acceptClient(&cli, &local);
+	if(fd < 0) continue; // another worker won the accept
+	fcntl(fd, F_SETFL, 0); // blocking, whatever the listening socket is
+	if(countClients() >= maxClients) {
+	  admitReject(fd);
+	  writeLog(0, "server full, turned a client away");
+	  continue;
+	}
+
+	WORKER *me = &pool->worker[workerID];
+	__atomic_add_fetch(&me->active, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&me->served, 1, __ATOMIC_SEQ_CST);
+	serveClient(fd, local, cli);
+	__atomic_sub_fetch(&me->active, 1, __ATOMIC_SEQ_CST);
+	writeLog(cliPID, "client disconnected");
+	dropStale(); // datasets closed since, so their memory can go
+  }
+}
+
+/** 
+ * @brief number of clients currently connected
+*/
+int countClients() {
+  if(pool == NULL)
+	return childCount;
+  int n = 0;
+  for(int i=0; i < numWorkers; i++)
+	n += __atomic_load_n(&pool->worker[i].active, __ATOMIC_SEQ_CST);
+  return n;
+}
+
 /** 
  * @brief child server handles 1 client. main loop
 */
 void handleClient() {
   MESSAGE hello; // get the PID from the client
-  if(read(newsockfd, &hello, sizeof(MESSAGE)) == -1) {
+  if(!xportRead(&conn, &hello, sizeof(MESSAGE))) {
 	  perror("read");
 	  return;
   }
   cliPID = hello.sender;
+  cliKey = admitClient(cliAddr, cliPID); // its connections share buckets
   cout << "[" << cliPID << "]: " << "client connected from " << cliIP << endl;
   string ip(cliIP);
   writeLog(cliPID, "connected from [" + ip + "]");
+  capSession(); // with -P, every request is kept for replay (see p3cap.hpp)
   
   // main loop
   while(true) {
 	MESSAGE msg;
 	// SIGINT is blocked. Only want parent server handling it.
 	//signal(SIGINT, intCatcher); // unblock signal
-	if(read(newsockfd, &msg, sizeof(MESSAGE)) < 0) {
+	if(!xportRead(&conn, &msg, sizeof(MESSAGE))) {
 	  perror("read");
 	  return;
 	}
 	//signal(SIGINT, SIG_IGN); // block
+	capRequest(msg);
 	
 	if(msg.request == 99) {
 	  cout << "[" << cliPID << "]: client requests disconnect" << endl;
-	  kill(parentPID, SIGCHLD);
+	  if(pool == NULL) // prefork workers don't exit per client
+		kill(parentPID, SIGCHLD);
 	  return;
 		//exit(0);
 	}
 
 	//cout << "[" << cliPID << "]: received " << msg.request << endl;
+	traceBegin(msg); // a sample of requests is traced (see p3trace.hpp)
+	semTrace = tracing ? traceSem : NULL;
 	handleRequest(msg);
+	long long t = traceStart(); // the reply went to the output queue, locks let go
+	if(!xportFlush(&conn))
+	  sendFailed("cannot send reply to client");
+	traceSpan(TRACE_SEND, t);
+	traceEnd();
+	semTrace = NULL;
   }
 }
 
@@ -225,11 +913,17 @@ void handleClient() {
 */
 void handleRequest(MESSAGE msg) {
   //MESSAGE *msg;
+  if(shardPath && staleMap(msg))
+	return;
+  if(!admitRequest(msg))
+	return;
+
   switch(msg.request) {
   case 1: // create new record
 	cout << "received createRecord" << endl;
 	writeLog(msg.sender, "requesting to create record");
-	createRecord(msg);
+	if(primaryAddr) readOnly(msg);
+	else createRecord(msg);
 	break;
 	
   case 2: // display a record
@@ -241,7 +935,15 @@ void handleRequest(MESSAGE msg) {
   case 3: // modify record
 	cout << "received modifyRecord" << endl;
 	writeLog(msg.sender, "requesting to modify record");
-	modifyRecord(msg);
+	if(primaryAddr) readOnly(msg);
+	else modifyRecord(msg);
+	break;
+
+  case 5: // delete record
+	cout << "received deleteRecord" << endl;
+	writeLog(msg.sender, "requesting to delete record");
+	if(primaryAddr) readOnly(msg);
+	else deleteRecord(msg);
 	break;
 
   case 4: // log
@@ -256,6 +958,54 @@ void handleRequest(MESSAGE msg) {
 	sendNumRecords();
 	break;
 
+  case 11: // negotiate bulk encoding
+	cout << "received setEncoding" << endl;
+	writeLog(msg.sender, "requesting encoding " + string(encodingName(msg.buffer[0])));
+	setEncoding(msg);
+	break;
+
+  case 12: // switch to a shared-memory link
+	cout << "received startShm" << endl;
+	writeLog(msg.sender, "requesting shared-memory transport");
+	startShm(msg);
+	break;
+
+  case 20: // replica subscribing to mutations
+	cout << "received subscribe" << endl;
+	writeLog(msg.sender, "replica subscribing");
+	sendReplication(msg);
+	break;
+
+  case 22: // replication status
+	cout << "received replStatus" << endl;
+	writeLog(msg.sender, "requesting replication status");
+	sendReplStatus(msg);
+	break;
+
+  case 30: // shard map
+	cout << "received shardMap" << endl;
+	writeLog(msg.sender, "requesting shard map");
+	sendShardMap(msg);
+	break;
+
+  case 40: // records sorted by a field
+	cout << "received sortedRecords" << endl;
+	writeLog(msg.sender, "requesting records sorted by field " + to_string(msg.buffer[0]));
+	sendSorted(msg);
+	break;
+
+  case 41: // field statistics
+	cout << "received fieldStats" << endl;
+	writeLog(msg.sender, msg.buffer[0] == 1 ? "requesting field statistics, checked by a scan"
+			 : "requesting field statistics");
+	sendStats(msg);
+	break;
+
+  case 50: // open a named dataset
+	cout << "received openDataset" << endl;
+	openDataset(msg);
+	break;
+
   default:
 	cout << "Client sent invalid request number: " << msg.request << endl;
 	exit(0);
@@ -270,10 +1020,10 @@ void handleRequest(MESSAGE msg) {
  * @param msg the message to be sent
 */
 void sendMessage(MESSAGE msg) {
-  if(write(newsockfd, &msg, sizeof(MESSAGE)) < 0) {
-	perror("cannot send message to client");
-	exit(-1);
-  }  
+  long long t = traceStart();
+  if(!xportWrite(&conn, &msg, sizeof(MESSAGE)))
+	sendFailed("cannot send message to client");
+  traceSpan(TRACE_SEND, t);
 }
 
 /** 
@@ -281,36 +1031,59 @@ void sendMessage(MESSAGE msg) {
  * @param log the LOGMSG to be sent
 */
 void sendMessage(LOGMSG log) {
-  if(write(newsockfd, &log, sizeof(LOGMSG)) < 0) {
-	perror("cannot send LOGMSG to client");
-	exit(-1);
-  }  
+  long long t = traceStart();
+  if(!xportWrite(&conn, &log, sizeof(LOGMSG)))
+	sendFailed("cannot send LOGMSG to client");
+  traceSpan(TRACE_SEND, t);
 }
 
 /** 
- * @brief sends the number of records in the data file to client
+ * @brief gives up on a client that cannot be sent to: it went away, or
+ * it stopped reading with its output queue full (errno ENOBUFS)
+ * @param what the error to print
+*/
+void sendFailed(const char *what) {
+  if(errno == ENOBUFS) {
+	cout << "[" << cliPID << "]: client stopped reading, disconnecting" << endl;
+	writeLog(cliPID, "stopped reading with " + to_string(queueMB)
+			 + " MB queued, disconnected");
+	errno = ENOBUFS;
+  }
+  perror(what);
+  exit(-1);
+}
+
+/** 
+ * @brief sends the number of records in the data file to client: records
+ * that are not deleted in buffer[0-1] (see msgPut64), the highest record
+ * number in rec and the data file generation in gen, all as of one commit
 */
 void sendNumRecords() {
-  int n = getNumRecords();
+  // with our turn held no commit publishes, so the count and the snapshot agree
+  COMMIT barrier;
+  mvccReserve(&barrier);
+  mvccTurn(&barrier);
+  SNAPSHOT snap = mvccBegin();
+  long long n = getNumRecords();
+  mvccEnd(&snap);
+  mvccPublish(&barrier);
   cout << "num records: " << n << endl;
   MESSAGE msg = clearMsg();
-  msg.request = n;
+  msg.request = 10;
+  msgPut64(msg.buffer, 0, n);
+  msg.rec = snap.count;
+  msg.gen = snap.gen;
   sendMessage(msg);
   writeLog(cliPID, "sending number of records");
 }
 
 
 /** 
- * @brief calculates number of records in data file
+ * @brief number of records as of the latest commit, not counting deleted ones
  * @return number of records
 */
-int getNumRecords() {
-  P(sem, D_WRITER);
-  fseek(file, 0, SEEK_END);
-  int fsize = ftell(file);
-  int numRecords = fsize / 9 / sizeof(int); // 9 ints per row
-  V(sem, D_WRITER);
-  return numRecords;
+long long getNumRecords() {
+  return mvccRecords(); // published by writers, no lock needed
 }
 
 
@@ -320,13 +1093,55 @@ int getNumRecords() {
 */
 void createRecord(MESSAGE msg) {
   writeLog(msg.sender, "creating new record");
+  if(refuseTombstone(msg))
+	return;
 
-  P(sem, D_WRITER);
+  if(shardPath) { // only the open shard takes new records
+	P(sem, D_WRITER); // sealing needs a count no other create is moving
+	shardRefresh(shardPath, &shards);
+	if(shards.shard[shardSelf(&shards, port)].hi != -1) {
+	  V(sem, D_WRITER);
+	  msg.request = -2;
+	  msg.buffer[0] = shards.version;
+	  sendMessage(msg);
+	  writeLog(msg.sender, "refused record, shard is sealed");
+	  return;
+	}
+  }
   
-  fseek(file, 0, SEEK_END);
-  fwrite(msg.buffer, sizeof(int) * 9, 1, file);
+  // reuse a deleted slot, or reserve a new one with a compare-and-swap, no lock needed
+  COMMIT c;
+  int old[STORE_COLS];
+  if(!mvccAppend(msg.buffer, &c, true, old)) {
+	perror("cannot append record");
+	mvccAbort(&c);
+	if(shardPath)
+	  V(sem, D_WRITER);
+	sendUnwritten(msg);
+	return;
+  }
+  mvccTurn(&c);
+  if(c.dead < 0) // replicas append in order, a reused slot is a modify for them
+	journalAppend(REPL_MODIFY, c.rec, msg.buffer);
+  else
+	journalAppend(REPL_CREATE, c.rec, msg.buffer); // for replicas, in commit order
+  indexPut(c.rec, msg.buffer);
+  aggPut(c.seq, old, msg.buffer);
+  mvccPublish(&c); // readers see it only now
 
-  V(sem, D_WRITER);
+  if(shardPath) {
+	long long numRecords = c.count;
+	if(shardMax > 0 && numRecords >= shardMax) {
+	  if(shardSeal(shardPath, port, numRecords)) {
+		shardRefresh(shardPath, &shards);
+		writeLog(msg.sender, "sealed shard at " + to_string(numRecords)
+				 + " records, map version " + to_string(shards.version));
+	  } else if(numRecords == shardMax) {
+		writeLog(msg.sender, "shard is full but there is no spare, staying open");
+	  }
+	}
+	V(sem, D_WRITER);
+  }
   
   sendMessage(msg); // send acknowledgement of creation
   writeLog(msg.sender, "sent record-created confirmation");
@@ -334,140 +1149,1417 @@ void createRecord(MESSAGE msg) {
 
 
 /** 
- * @brief handles a displayRecord request from the client
+ * @brief handles a displayRecord request from the client. Without an
+ * encoding, a -999 dump goes in chunks of up to PACK_CHUNK records: a
+ * MESSAGE with the number of records in request, then one MESSAGE per
+ * record. A chunk of 0 records ends it.
  * @param msg message from the client
 */
 void displayRecord(MESSAGE msg) {
-  int rNum = msg.buffer[0]; // record number to read
-
+  long long rNum = msg.rec; // record number to read
+  if(rNum == -999) // dumps take turns (see p3admit.hpp)
+	scanEnter();
   
+  // reads see a snapshot and never block writers (see p3mvcc.hpp)
+  SNAPSHOT snap = mvccBegin();
+  if(rNum != -999) // numbered in the client's generation
+	rNum = remapRecord(msg.gen, rNum - 1, snap.gen) + 1;
   if(rNum == -999) { // send all records
 	writeLog(msg.sender, "sending ALL records to client");
-	int numRecords = getNumRecords();
-	P(sem, D_WRITER);
-	for(int j=0; j < numRecords; j++) {
-	  fseek(file, j * sizeof(int) * 9, SEEK_SET);
-	  int line[9];
-	  fread(line, sizeof(int)*9, 1, file); // read record from file
+	if(encoding != ENC_RAW) {
+	  sendPacked(msg, &snap);
+	  mvccEnd(&snap);
+	  scanLeave();
+	  return;
+	}
+	static int lines[PACK_CHUNK * STORE_COLS];
+	MESSAGE head = clearMsg();
+	for(long long j=0; j < snap.count; j += PACK_CHUNK) {
+	  int n = mvccRead(&snap, j, PACK_CHUNK, lines); // read a batch of records
+	  if(n <= 0) break;
 
-	  for(int i=0; i < 9; i++)
-		msg.buffer[i] = line[i]; // copy record to message
+	  head.request = 0;
+	  for(int k=0; k < n; k++)
+		head.request += lines[k * STORE_COLS] != STORE_TOMBSTONE;
+	  if(head.request > 0) // a chunk of 0 would end the dump
+		sendMessage(head);
 
-	  sendMessage(msg);	  
+	  for(int k=0; k < n; k++) {
+		if(lines[k * STORE_COLS] == STORE_TOMBSTONE) continue; // deleted
+		memcpy(msg.buffer, lines + k * STORE_COLS, STORE_ROW); // copy record to message
+
+		sendMessage(msg);
+	  }
+	  scanYield();
 	}
-	V(sem, D_WRITER);
+	head.request = 0;
+	sendMessage(head); // end of dump
+	scanLeave();
 	
   } else { // only send 1 record
 	writeLog(msg.sender, "sending 1 record to client");
-	P(sem, D_WRITER);
-	fseek(file, (rNum-1) * sizeof(int) * 9, SEEK_SET);
-	int line[9];
-	fread(line, sizeof(int)*9, 1, file); // read record from file
+	int line[STORE_COLS];
+	if(rNum < 1 || mvccRead(&snap, rNum-1, 1, line) != 1 // read record from file
+	   || line[0] == STORE_TOMBSTONE) {
+	  mvccEnd(&snap);
+	  sendGone(msg);
+	  return;
+	}
 
-	for(int i=0; i < 9; i++)
-	  msg.buffer[i] = line[i]; // copy record to message
+	memcpy(msg.buffer, line, STORE_ROW); // copy record to message
 	sendMessage(msg);
-	V(sem, D_WRITER);
   }
+  mvccEnd(&snap);
 } // end displayRecord
 
 
 /** 
- * @brief handles a modify-record request from the client
+ * @brief sends every record of a snapshot in compressed chunks.
+ * Each chunk is a MESSAGE with the record count in request and the
+ * encoded size in buffer[0], followed by the encoded bytes. A chunk
+ * with 0 records ends the transfer. Waiting scans get a turn between
+ * chunks.
  * @param msg message from the client
+ * @param snap snapshot to send
 */
-void modifyRecord(MESSAGE msg) {
-  int recordNum = msg.buffer[9];
-  int record[9];
-  for(int i=0; i < 9; i++) {
-	record[i] = msg.buffer[i];
+void sendPacked(MESSAGE msg, SNAPSHOT *snap) {
+  static int rows[PACK_CHUNK * PACK_COLS];
+
+  for(long long j=0; j < snap->count; j += PACK_CHUNK) {
+	int n = mvccRead(snap, j, PACK_CHUNK, rows); // read chunk from file
+	if(n <= 0) break;
+	int live = 0;
+	for(int k=0; k < n; k++) // leave out deleted records
+	  if(rows[k * PACK_COLS] != STORE_TOMBSTONE) {
+		if(live != k)
+		  memcpy(rows + live * PACK_COLS, rows + k * PACK_COLS, STORE_ROW);
+		live++;
+	  }
+	if(live > 0) // a chunk of 0 would end the transfer
+	  sendChunk(msg, rows, live);
+	scanYield();
   }
-  
-  writeLog(msg.sender, "modifying record");
 
-  P(sem, D_WRITER);
-  
-  fseek(file, recordNum * sizeof(int) * 9, SEEK_SET); // go to record
-  fwrite(record, sizeof(int) * 9, 1, file);
+  sendChunk(msg, rows, 0); // end of transfer
+}
 
-  V(sem, D_WRITER);
-  
-  sendMessage(msg); // send acknowledgement of creation
-  writeLog(msg.sender, "sent record-modified confirmation");  
 
+/** 
+ * @brief sends one compressed chunk of records (0 records ends a transfer)
+ * @param msg message from the client
+ * @param rows the records
+ * @param n number of records
+*/
+void sendChunk(MESSAGE msg, int *rows, int n) {
+  static unsigned char packed[PACK_CHUNK * PACK_COLS * 5 + 8];
+  msg.request = n;
+  msg.buffer[0] = n > 0 ? packRecords(encoding, rows, n, packed) : 0;
+  sendMessage(msg);
+  long long t = traceStart();
+  if(!xportWrite(&conn, packed, msg.buffer[0]))
+	sendFailed("cannot send records to client");
+  traceSpan(TRACE_SEND, t);
 }
 
 
 /** 
- * @brief sends logs to client through multiple transmissions
- * @param msg message from client
+ * @brief checks the shard map version a client routed by. Sharded clients put
+ * -(map version) in msg_type, others leave it positive and are not checked.
+ * A client with an old map gets request -2 and the current version back,
+ * and should fetch the map again (request 30) and resend.
+ * @param msg message from the client
+ * @return true if the request was answered as stale
 */
-void showLog(MESSAGE msg) {
-  int lineCount = 0;
-  string line;
+bool staleMap(MESSAGE msg) {
+  if(msg.msg_type >= 0 || (msg.request != 1 && msg.request != 2
+						   && msg.request != 3 && msg.request != 5 && msg.request != 10))
+	return false;
+  shardRefresh(shardPath, &shards);
+  if(-msg.msg_type == shards.version)
+	return false;
 
-  P(sem, L_WRITER);
-  
-  logfile.clear(); // reset EOF flag
-  logfile.seekg(0); // back to start
-  while(getline(logfile, line)) // count lines in file
-	lineCount++;
+  msg.request = -2;
+  msg.buffer[0] = shards.version;
+  sendMessage(msg);
+  writeLog(msg.sender, "client's shard map is stale");
+  return true;
+}
 
-  V(sem, L_WRITER);
-  cout << "sending " + to_string(lineCount) + " log messages" << endl;
 
-  msg.request = lineCount;
-  sendMessage(msg); // tell client how many LOGMSG to expect
+/** 
+ * @brief takes a token from the client's bucket for the request's kind.
+ * A client out of tokens gets ADMIT_BUSY back with the ms until its next
+ * token in buffer[0]; the connection stays open.
+ * @param msg message from the client
+ * @return false if the request was answered busy
+*/
+bool admitRequest(MESSAGE msg) {
+  bool scan;
+  if((msg.request == 2 && msg.rec == -999) || msg.request == 4
+	 || (msg.request == 40 && !indexed(msg.buffer[0])) || (msg.request == 41 && msg.buffer[0] == 1))
+	scan = true;
+  else if((msg.request >= 1 && msg.request <= 10) || msg.request == 40 || msg.request == 41)
+	scan = false;
+  else
+	return true; // handshakes and status are never limited
+  int wait = admitTake(cliKey, scan);
+  if(wait == 0)
+	return true;
+  writeLog(msg.sender, "rate limited, retry after " + to_string(wait) + " ms");
+  msg.request = ADMIT_BUSY;
+  msg.buffer[0] = wait;
+  msg.buffer[1] = 0; // staying connected
+  sendMessage(msg);
+  return false;
+}
 
-  LOGMSG log;
-  log.msg_type = msg.sender; // necessary??
 
-  P(sem, L_WRITER);
-  logfile.clear();
-  logfile.seekg(0); // back to start
-  while(getline(logfile, line)) { // send each line to the client
-	memset(log.buffer, ' ', LOGSIZE); // unnecessary?
-	strcpy(log.buffer, line.c_str());
-	sendMessage(log);
+/** 
+ * @brief sends the shard map: a MESSAGE with the number of shards in request
+ * (0 if this server is not sharded) and the version in buffer[0], then one
+ * MESSAGE per shard with first and last (see msgPut64) in buffer[0-1] and
+ * buffer[2-3], port and IPv4 address in buffer[4-5]
+ * @param msg message from the client
+*/
+void sendShardMap(MESSAGE msg) {
+  if(shardPath)
+	shardRefresh(shardPath, &shards);
+  msg = clearMsg();
+  msg.request = shardPath ? shards.num : 0;
+  msg.buffer[0] = shards.version;
+  sendMessage(msg);
+
+  for(int i=0; i < msg.request; i++) {
+	MESSAGE s = clearMsg();
+	s.request = 30;
+	msgPut64(s.buffer, 0, shards.shard[i].lo);
+	msgPut64(s.buffer, 2, shards.shard[i].hi);
+	s.buffer[4] = shards.shard[i].port;
+	s.buffer[5] = inet_addr(shards.shard[i].host);
+	sendMessage(s);
   }
+}
 
-  V(sem, L_WRITER);
-  
-  writeLog(msg.sender, "sent " + to_string(lineCount) + " log messages");
+
+/** 
+ * @brief answers a write request on a read-only replica
+ * @param msg message from the client
+*/
+void readOnly(MESSAGE msg) {
+  msg.request = -1; // rejected
+  sendMessage(msg);
+  writeLog(msg.sender, "rejected write, this server is a read-only replica");
 }
 
 
 /** 
- * @brief writes server status to a logfile (appending)
- * @param client the client's PID
- * @param request information about the operation performed
+ * @brief streams mutations to a replica until it disconnects.
+ * First a snapshot: a MESSAGE with the number of records in rec and the
+ * journal seq it corresponds to in buffer[0-1], then the records as
+ * compressed chunks, read from the snapshot one chunk at a time. After that, every journal entry as a raw JENTRY, with
+ * heartbeats while idle.
+ * @param msg message from the replica
 */
-void writeLog(pid_t client, string request) {
-  P(sem, L_WRITER); // wait
+void sendReplication(MESSAGE msg) {
+  if(encoding == ENC_RAW) {
+	cout << "Replica did not negotiate an encoding" << endl;
+	exit(-1);
+  }
 
-  logfile.clear();
-  logfile.seekp(0, ios::end);
-  logfile << "Client PID: " << client << " | Operation: " << request << endl;
+  // snapshot and journal position are taken together while an empty commit
+  // holds back every later one, the records are read after letting them go
+  COMMIT barrier;
+  mvccReserve(&barrier);
+  mvccTurn(&barrier);
+  SNAPSHOT snap = mvccBegin();
+  long long seq = journalSeq();
+  mvccPublish(&barrier);
+  long long numRecords = snap.count;
 
-  V(sem, L_WRITER); // signal
+  msg.request = 20;
+  msg.rec = numRecords;
+  msgPut64(msg.buffer, 0, seq);
+  sendMessage(msg);
+  static int rows[PACK_CHUNK * STORE_COLS];
+  for(long long j=0; j < numRecords; j += PACK_CHUNK) {
+	int n = mvccRead(&snap, j, PACK_CHUNK, rows);
+	if(n <= 0) break; // the replica sees a short snapshot and gives up
+	sendChunk(msg, rows, n);
+  }
+  mvccEnd(&snap);
+  sendChunk(msg, rows, 0);
+  writeLog(msg.sender, "sent snapshot of " + to_string(numRecords) + " records at seq "
+		   + to_string(seq));
+
+  // tail the journal
+  JENTRY entries[64];
+  long long lastSent = usecNow();
+  while(true) {
+	int n = journalRead(seq, entries, 64);
+	if(n > 0) {
+	  if(!xportWrite(&conn, entries, n * sizeof(JENTRY))) break;
+	  seq = entries[n - 1].seq;
+	  lastSent = usecNow();
+	} else if(usecNow() - lastSent > REPL_HEARTBEAT_SEC * 1000000LL) {
+	  JENTRY beat;
+	  memset(&beat, 0, sizeof(beat));
+	  beat.op = REPL_HEARTBEAT;
+	  beat.seq = journalSeq();
+	  beat.usec = lastSent = usecNow();
+	  if(!xportWrite(&conn, &beat, sizeof(beat))) break;
+	} else {
+	  if(!xportFlush(&conn)) break;
+	  usleep(2000);
+	}
+  }
+  cout << "[" << cliPID << "]: replica disconnected" << endl;
+  writeLog(msg.sender, "replica disconnected");
 }
 
+
 /** 
- * @brief handles when a child disconnects from the parent
- * @param sig signal
+ * @brief sends replication status: buffer[0] is 1 on a replica, 0 on the
+ * primary; buffer[1-2] the last applied journal seq; buffer[3-4] the
+ * primary's newest seq (both msgPut64); buffer[5] the lag in ms; buffer[6]
+ * 1 if connected to the primary
+ * @param msg message from the client
+*/
+void sendReplStatus(MESSAGE msg) {
+  msg = clearMsg();
+  msg.request = 22;
+  if(repl == NULL) { // primary
+	msgPut64(msg.buffer, 1, journalSeq());
+	msgPut64(msg.buffer, 3, journalSeq());
+	msg.buffer[6] = 1;
+  } else {
+	msg.buffer[0] = 1;
+	msgPut64(msg.buffer, 1, repl->applied);
+	msgPut64(msg.buffer, 3, repl->primary);
+	msg.buffer[5] = replLagMs(repl);
+	msg.buffer[6] = repl->connected;
+  }
+  sendMessage(msg);
+}
+
+
+/** 
+ * @brief replica mode: forks the process that keeps this server's copy in
+ * sync with the primary, then waits for the first snapshot
+*/
+void startReplica() {
+  int id = shmget(IPC_PRIVATE, sizeof(REPLSTAT), IPC_CREAT | 0600);
+  if(id < 0 || (repl = (REPLSTAT *)shmat(id, 0, 0)) == (void *)-1) {
+	perror("cannot create replication status");
+	exit(-1);
+  }
+  shmctl(id, IPC_RMID, 0);
+  memset(repl, 0, sizeof(REPLSTAT));
+
+  pid_t p = fork();
+  if(p < 0) {
+	perror("fork error");
+	exit(-1);
+  } else if(p == 0) {
+	pid = 0;
+	prctl(PR_SET_PDEATHSIG, SIGKILL); // don't outlive the server
+	signal(SIGINT, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	close(sockfd);
+	close(unixfd);
+	replicaLoop();
+	exit(0);
+  }
+  helperPid[HELPER_REPLICA] = p;
+
+  cout << "Waiting for snapshot from primary..." << endl;
+  while(!repl->synced)
+	usleep(50000);
+  cout << "Replica synced at seq " << repl->applied << endl;
+}
+
+
+/** 
+ * @brief keeps (re)connecting to the primary and applying its mutations
+*/
+void replicaLoop() {
+  while(true) {
+	XPORT x;
+	bool again = false;
+	if(replicaSync(&x)) {
+	  again = applyStream(&x);
+	  xportClose(&x);
+	  writeLog(getpid(), again ? "primary installed a new snapshot, resyncing"
+			   : "lost connection to primary");
+	}
+	repl->connected = 0;
+	if(!again)
+	  sleep(1);
+  }
+}
+
+
+/** 
+ * @brief connects to the primary, subscribes and installs its snapshot
+ * @return false if the primary cannot be reached or the snapshot did not
+ * arrive whole (the replica's data is left as it was)
+*/
+bool replicaSync(XPORT *x) {
+  if(!xportConnect(x, primaryAddr, primaryPort, XPORT_AUTO))
+	return false;
+  MESSAGE msg = clearMsg();
+  msg.sender = getpid();
+  bool ok = xportWrite(x, &msg, sizeof(MESSAGE)); // hello
+  msg.request = 11;
+  msg.buffer[0] = ENC_BITPACK;
+  ok = ok && xportWrite(x, &msg, sizeof(MESSAGE)) && xportRead(x, &msg, sizeof(MESSAGE));
+  int enc = msg.buffer[0];
+  msg = clearMsg();
+  msg.sender = getpid();
+  msg.request = 20;
+  ok = ok && enc != ENC_RAW && xportWrite(x, &msg, sizeof(MESSAGE))
+	&& xportRead(x, &msg, sizeof(MESSAGE));
+  if(!ok) {
+	xportClose(x);
+	return false;
+  }
+
+  long long numRecords = msg.rec;
+  long long seq = msgGet64(msg.buffer, 0);
+  if(numRecords < 0) {
+	xportClose(x);
+	return false;
+  }
+  // written to a new file as it comes, the old one is served meanwhile
+  STORENEW f;
+  if(!storeNew(&f)) {
+	xportClose(x);
+	return false;
+  }
+  static int rows[PACK_CHUNK * STORE_COLS];
+  static unsigned char packed[PACK_CHUNK * PACK_COLS * 5 + 8];
+  long long got = 0;
+  bool ended = false;
+  while(true) { // same chunk format as a -999 dump
+	if(!xportRead(x, &msg, sizeof(MESSAGE))) break;
+	int n = msg.request, len = msg.buffer[0];
+	if((ended = n <= 0)) break;
+	if(n > PACK_CHUNK || got + n > numRecords || len < 0
+	   || (size_t)len > packBound(enc, n) - 8 || !xportRead(x, packed, len)
+	   || !unpackRecords(enc, packed, len, rows, n) || !storeAdd(&f, rows, n))
+	  break;
+	got += n;
+  }
+  if(!ended || got != numRecords) { // cut short: keep the copy we have
+	storeDiscard(&f);
+	xportClose(x);
+	return false;
+  }
+
+  if(mvccReset(&f)) { // the applier is the replica's only writer
+	indexRebuild(got, mvccGen());
+	SNAPSHOT s = mvccBegin(); // its seq is the reset's commit
+	mvccEnd(&s);
+	aggRebuild(got, s.seq);
+	// replicas of this one applied the old state; the entries from here on
+	// are against the new one, so they start over from a snapshot too
+	int none[STORE_COLS] = {0};
+	journalAppend(REPL_RESET, got, none);
+  }
+
+  repl->applied = repl->primary = seq;
+  repl->appliedUsec = repl->heardUsec = usecNow();
+  repl->connected = 1;
+  repl->synced = 1;
+  writeLog(getpid(), "installed snapshot of " + to_string(got) + " records at seq "
+		   + to_string(seq));
+  return true;
+}
+
+
+/** 
+ * @brief applies mutations from the primary until the connection drops.
+ * Applied entries are journaled again, so replicas can chain.
+ * @return true if the primary (itself a replica) resynced or an entry could
+ * not be applied, so this one must take a new snapshot
+*/
+bool applyStream(XPORT *x) {
+  JENTRY e;
+  while(xportRead(x, &e, sizeof(JENTRY))) {
+	repl->heardUsec = e.usec;
+	if(e.seq > repl->primary) repl->primary = e.seq;
+	if(e.op == REPL_HEARTBEAT) continue;
+	if(e.op == REPL_RESET)
+	  return true;
+
+	COMMIT c;
+	int old[STORE_COLS];
+	bool ok;
+	if(e.op == REPL_COMPACT) { // journals it again itself
+	  compactData();
+	  repl->appliedUsec = e.usec;
+	  repl->applied = e.seq;
+	  continue;
+	}
+	if(e.op == REPL_CREATE)
+	  ok = mvccAppend(e.row, &c, false, old);
+	else if(e.op == REPL_MODIFY)
+	  ok = mvccWrite(e.rec, e.row, &c, old);
+	else
+	  continue;
+	if(!ok) { // the copy is short of this entry now, start over from a snapshot
+	  perror("cannot apply journal entry");
+	  mvccAbort(&c);
+	  return true;
+	}
+	journalAppend(e.op, e.rec, e.row);
+	indexPut(c.rec, e.row);
+	aggPut(c.seq, old, e.row);
+	mvccPublish(&c);
+
+	repl->appliedUsec = e.usec;
+	repl->applied = e.seq;
+  }
+  return false;
+}
+
+
+/** 
+ * @brief moves a unix socket connection onto shared-memory rings.
+ * The reply carries the segment id in buffer[0] (-1 if refused). The
+ * client answers over the socket with buffer[0] = 1 once attached, after
+ * which both sides only use the rings.
+ * @param msg message from the client
+*/
+void startShm(MESSAGE msg) {
+  msg.buffer[0] = -1;
+  if(conn.type == XPORT_UNIX) // only for clients on this host
+	msg.buffer[0] = xportShmCreate(&conn, cliPID);
+  sendMessage(msg);
+  if(msg.buffer[0] < 0) return;
+
+  if(!xportRead(&conn, &msg, sizeof(MESSAGE))) {
+	perror("read");
+	exit(-1);
+  }
+  if(msg.buffer[0] != 1) { // client could not attach, stay on the socket
+	xportShmDrop(&conn);
+	return;
+  }
+  xportShmStart(&conn);
+  writeLog(msg.sender, "using shared-memory transport");
+}
+
+
+/** 
+ * @brief negotiates the encoding used for multi-record responses
+ * @param msg message from the client, buffer[0] is the wanted encoding
+*/
+void setEncoding(MESSAGE msg) {
+  int enc = msg.buffer[0];
+  if(enc != ENC_VARINT && enc != ENC_BITPACK)
+	enc = ENC_RAW; // unknown, stay with the legacy format
+  encoding = enc;
+  msg.buffer[0] = enc;
+  sendMessage(msg); // tell client which encoding will be used
+  writeLog(msg.sender, "using " + string(encodingName(enc)) + " encoding");
+}
+
+
+/** 
+ * @brief handles a modify-record request from the client
+ * @param msg message from the client
+*/
+void modifyRecord(MESSAGE msg) {
+  long long recordNum = msg.rec;
+  int record[STORE_COLS];
+  memcpy(record, msg.buffer, STORE_ROW);
+  
+  writeLog(msg.sender, "modifying record");
+  if(refuseTombstone(msg))
+	return;
+
+  // compaction can't renumber records from here until the commit is published
+  recordNum = remapRecord(msg.gen, recordNum, mvccHold());
+  int stripe = (unsigned long long)recordNum % LOCK_STRIPES;
+  P(stripes, stripe); // only modifies of records on the same stripe wait
+  
+  COMMIT c;
+  int old[STORE_COLS];
+  int done = mvccUpdate(recordNum, record, &c, old);
+  if(done == 0) { // deleted
+	V(stripes, stripe);
+	mvccRelease();
+	sendGone(msg);
+	return;
+  }
+  if(done < 0) {
+	perror("cannot modify record");
+	mvccAbort(&c);
+	V(stripes, stripe);
+	sendUnwritten(msg);
+	return;
+  }
+  mvccTurn(&c);
+  journalAppend(REPL_MODIFY, recordNum, record); // for replicas, in commit order
+  indexPut(recordNum, record);
+  aggPut(c.seq, old, record);
+  mvccPublish(&c);
+
+  V(stripes, stripe);
+  
+  sendMessage(msg); // send acknowledgement of creation
+  writeLog(msg.sender, "sent record-modified confirmation");  
+
+}
+
+
+/** 
+ * @brief handles a delete-record request from the client: overwrites the
+ * record with a tombstone. Its slot may be reused by a later create and
+ * disappears when the data file is compacted.
+ * @param msg message from the client, rec is the record index
+*/
+void deleteRecord(MESSAGE msg) {
+  writeLog(msg.sender, "deleting record");
+
+  long long recordNum = remapRecord(msg.gen, msg.rec, mvccHold());
+  int stripe = (unsigned long long)recordNum % LOCK_STRIPES;
+  P(stripes, stripe);
+
+  int tombstone[STORE_COLS] = {STORE_TOMBSTONE};
+  COMMIT c;
+  int old[STORE_COLS];
+  int done = mvccUpdate(recordNum, tombstone, &c, old);
+  if(done == 0) { // already deleted
+	V(stripes, stripe);
+	mvccRelease();
+	sendGone(msg);
+	return;
+  }
+  if(done < 0) {
+	perror("cannot delete record");
+	mvccAbort(&c);
+	V(stripes, stripe);
+	sendUnwritten(msg);
+	return;
+  }
+  mvccTurn(&c);
+  journalAppend(REPL_MODIFY, recordNum, tombstone);
+  indexPut(recordNum, tombstone);
+  aggPut(c.seq, old, tombstone);
+  mvccPublish(&c);
+
+  V(stripes, stripe);
+
+  sendMessage(msg);
+  writeLog(msg.sender, "sent record-deleted confirmation");
+}
+
+
+/** 
+ * @brief answers with request -3: the record was deleted, or the client's
+ * record number is from a generation that can no longer be mapped
+ * @param msg message from the client
+*/
+void sendGone(MESSAGE msg) {
+  msg.request = -3;
+  msg.gen = mvccGen();
+  sendMessage(msg);
+  writeLog(msg.sender, "record does not exist");
+}
+
+/** 
+ * @brief answers with request -6: the write could not be done on the
+ * server, nothing was changed
+ * @param msg message from the client
+*/
+void sendUnwritten(MESSAGE msg) {
+  msg.request = -6;
+  sendMessage(msg);
+  writeLog(msg.sender, "could not write the record");
+}
+
+/** 
+ * @brief answers a create or modify whose Year is STORE_TOMBSTONE with
+ * request -5, since writing it would delete the record
+ * @param msg message from the client
+ * @return true if it was refused
+*/
+bool refuseTombstone(MESSAGE msg) {
+  if(msg.buffer[0] != STORE_TOMBSTONE)
+	return false;
+  msg.request = -5;
+  sendMessage(msg);
+  writeLog(msg.sender, "refused record, its year marks deleted records");
+  return true;
+}
+/**
+ * @brief sends a page of the records sorted by one field (request 40): a
+ * MESSAGE with the number of records, then one per record with its number
+ * (1-based) in rec. The page comes from the field's index if it has
+ * one; otherwise the snapshot is scanned, keeping the first skip + count
+ * records in a bounded heap that is sorted once the scan ends. The
+ * index is read while an empty commit holds back every later one, so it
+ * is exactly as of the snapshot the rows are read from.
+ */
+void sendSorted(MESSAGE msg) {
+  int field = msg.buffer[0];
+  long long skip = max(0LL, msg.rec);
+  int want = min(max(0, msg.buffer[3]), SORT_MAX);
+  bool descending = msg.buffer[1] != 0;
+  if(field < 0 || field >= STORE_COLS)
+	want = 0;
+  static long long recs[SORT_MAX];
+  static int rows[SORT_MAX * STORE_COLS];
+
+  // commits put their rows in the index in their turn, before publishing,
+  // so with our turn held the index and the snapshot agree
+  COMMIT barrier;
+  bool held = want > 0 && indexed(field);
+  if(held) {
+	mvccReserve(&barrier);
+	mvccTurn(&barrier);
+  }
+  SNAPSHOT snap = mvccBegin();
+  int n = want > 0 ? indexRange(field, descending, skip, want, snap.gen, recs) : 0;
+  if(held)
+	mvccPublish(&barrier);
+  bool fromIndex = n >= 0;
+  if(!fromIndex) { // scan and sort: the heap keeps the records that go first, the last of them on top
+	writeLog(msg.sender, "no index for field " + to_string(field) + ", sorting a scan");
+	typedef pair<int, long long> ENTRY; // value, record
+	auto before = [descending](const ENTRY &a, const ENTRY &b) {
+	  return descending ? a > b : a < b;
+	};
+	vector<ENTRY> heap;
+	size_t keep = (size_t)skip + want;
+	static int lines[PACK_CHUNK * STORE_COLS], vals[PACK_CHUNK];
+	static long long nums[PACK_CHUNK];
+	PICKFN pick = schemaPicker<SCHEMA>(field); // the field's column, out of each chunk
+	scanEnter();
+	for(long long j=0; j < snap.count; j += PACK_CHUNK) {
+	  int got = mvccRead(&snap, j, PACK_CHUNK, lines);
+	  if(got <= 0) break;
+	  got = pick(lines, got, j, vals, nums);
+	  for(int k=0; k < got; k++) {
+		ENTRY e(vals[k], nums[k]);
+		if(heap.size() < keep) {
+		  heap.push_back(e);
+		  push_heap(heap.begin(), heap.end(), before);
+		} else if(before(e, heap.front())) {
+		  pop_heap(heap.begin(), heap.end(), before);
+		  heap.back() = e;
+		  push_heap(heap.begin(), heap.end(), before);
+		}
+	  }
+	  scanYield();
+	}
+	scanLeave();
+	sort_heap(heap.begin(), heap.end(), before);
+	n = 0;
+	for(size_t i=skip; i < heap.size(); i++)
+	  recs[n++] = heap[i].second;
+  }
+
+  // rows as of the snapshot, the same rows the index was sorted by
+  int sent = 0;
+  for(int i=0; i < n; i++) {
+	int *row = rows + sent * STORE_COLS;
+	if(recs[i] < snap.count && mvccRead(&snap, recs[i], 1, row) == 1
+	   && row[0] != STORE_TOMBSTONE)
+	  recs[sent++] = recs[i];
+  }
+  mvccEnd(&snap);
+
+  msg.request = sent;
+  msg.buffer[1] = fromIndex;
+  msg.gen = snap.gen;
+  sendMessage(msg);
+  for(int i=0; i < sent; i++) {
+	memcpy(msg.buffer, rows + i * STORE_COLS, STORE_ROW);
+	msg.rec = recs[i] + 1;
+	sendMessage(msg);
+  }
+  writeLog(msg.sender, "sent " + to_string(sent) + " sorted records"
+		   + (fromIndex ? " from the index" : ""));
+}
+
+
+/**
+ * @brief sends each field's count, sum, minimum and maximum (request 41): a
+ * MESSAGE with STORE_COLS in request, the records counted in buffer[0-1]
+ * and those a check scan counted in buffer[2-3] (-1 without one, see
+ * msgPut64), then one per
+ * field with the field in buffer[0], the sum's low and high words in
+ * buffer[1-2], minimum and maximum in buffer[3-4] and the scan's in
+ * buffer[5-8]. The totals are kept up to date by every write. A minimum or
+ * maximum that was deleted or overwritten is worked out here: from the
+ * field's index, else from a scan, tried twice while writers carry on and
+ * then with their commits held back.
+ * @param msg message from the client, buffer[0] = 1 to check by a scan
+ */
+void sendStats(MESSAGE msg) {
+  bool verify = msg.buffer[0] == 1;
+  auto stale = [](const AGGREGATE &a, int f) { return a.minStale[f] || a.maxStale[f]; };
+  AGGREGATE a = aggGet(), scanned;
+  scanned.count = -1;
+
+  // stale indexed fields: the ends of the index, while no commit can publish
+  bool any = false;
+  for(int f=0; f < STORE_COLS; f++)
+	any |= stale(a, f) && indexed(f);
+  if(any) {
+	COMMIT c;
+	mvccReserve(&c);
+	mvccTurn(&c);
+	for(int f=0, lo, hi; f < STORE_COLS; f++)
+	  if(stale(a, f) && indexBounds(f, mvccGen(), &lo, &hi))
+		aggSettle(f, c.seq, lo, hi);
+	mvccPublish(&c);
+	a = aggGet();
+  }
+
+  for(int tries=0; true; tries++) {
+	any = verify && scanned.count < 0;
+	for(int f=0; f < STORE_COLS; f++)
+	  any |= stale(a, f);
+	if(!any)
+	  break;
+	// a check must match the totals exactly, so it always holds commits back
+	bool hold = verify || tries >= 2;
+	SNAPSHOT snap = mvccBegin();
+	scanEnter(); // before the turn: scans waiting for a slot hold none
+	COMMIT c;
+	if(hold) {
+	  mvccReserve(&c);
+	  mvccTurn(&c);
+	}
+	// holding commits back only helps if none was published since the snapshot
+	if(!hold || snap.seq + 1 == c.seq) {
+	  AGGREGATE s = scanTotals(&snap, !hold);
+	  if(hold)
+		a = aggGet(); // as of the snapshot, nothing else got in
+	  for(int f=0; f < STORE_COLS; f++)
+		if(stale(a, f))
+		  aggSettle(f, snap.seq, s.min[f], s.max[f]);
+	  if(hold) {
+		a = aggGet(); // the check compares only what was kept up to date
+		scanned = s;
+	  }
+	}
+	if(hold)
+	  mvccPublish(&c);
+	scanLeave();
+	mvccEnd(&snap);
+	if(!hold)
+	  a = aggGet();
+  }
+
+  msg.request = STORE_COLS;
+  msgPut64(msg.buffer, 0, a.count);
+  msgPut64(msg.buffer, 2, verify ? scanned.count : -1);
+  msg.gen = mvccGen();
+  sendMessage(msg);
+  for(int f=0; f < STORE_COLS; f++) {
+	MESSAGE m = clearMsg();
+	m.request = 41;
+	m.buffer[0] = f;
+	msgPut64(m.buffer, 1, a.sum[f]);
+	m.buffer[3] = a.min[f];
+	m.buffer[4] = a.max[f];
+	if(verify) {
+	  msgPut64(m.buffer, 5, scanned.sum[f]);
+	  m.buffer[7] = scanned.min[f];
+	  m.buffer[8] = scanned.max[f];
+	}
+	sendMessage(m);
+  }
+  writeLog(msg.sender, "sent statistics of " + to_string(a.count) + " records"
+		   + (verify ? ", checked against a scan" : ""));
+}
+
+
+/**
+ * @brief count, sum, minimum and maximum of the live records in a snapshot
+ * @param yield let other scans have the slot between chunks (not while
+ * holding commits back)
+ */
+AGGREGATE scanTotals(SNAPSHOT *snap, bool yield) {
+  AGGREGATE a;
+  memset(&a, 0, sizeof(a));
+  for(int f=0; f < STORE_COLS; f++) {
+	a.min[f] = INT_MAX;
+	a.max[f] = INT_MIN;
+  }
+  static int lines[PACK_CHUNK * STORE_COLS];
+  for(long long j=0; j < snap->count; j += PACK_CHUNK) {
+	int got = mvccRead(snap, j, PACK_CHUNK, lines);
+	if(got <= 0) break;
+	schemaTotals<SCHEMA>(lines, got, &a.count, a.sum, a.min, a.max);
+	if(yield)
+	  scanYield();
+  }
+  return a;
+}
+
+
+/** 
+ * @brief name of the file mapping generation gen - 1's record indexes to gen's
+*/
+string remapName(uint32_t gen) {
+  return string(storePath()) + ".remap." + to_string(gen);
+}
+
+
+/** 
+ * @brief maps a record index from the generation a client numbered it in
+ * to generation to, through the maps each compaction leaves behind
+ * @param from client's generation, 0 for the current one
+ * @return the index in generation to, -1 if the record was deleted or the
+ * maps are gone
+*/
+long long remapRecord(int from, long long rec, uint32_t to) {
+  if(from == 0 || (uint32_t)from == to)
+	return rec;
+  if((uint32_t)from > to)
+	return -1;
+  for(uint32_t g = from + 1; g <= to && rec >= 0; g++) {
+	int fd = open(remapName(g).c_str(), O_RDONLY);
+	long long next = -1;
+	if(fd < 0 || pread(fd, &next, sizeof(next), rec * sizeof(next)) != sizeof(next))
+	  next = -1;
+	if(fd >= 0) close(fd);
+	rec = next;
+  }
+  return rec;
+}
+
+
+/** 
+ * @brief works on a named dataset (request 50): the name is in buffer, NUL
+ * terminated. From then on this connection's requests go to that dataset.
+ * Answers with buffer[1] its index in the catalog and buffer[0] 0 if this
+ * connection now works on it, -1 if there is no such dataset, it could not
+ * be opened or the connection already has one.
+ * @param msg message from the client
+*/
+void openDataset(MESSAGE msg) {
+  char name[DATASET_NAME];
+  memcpy(name, msg.buffer, DATASET_NAME - 1);
+  name[DATASET_NAME - 1] = '\0';
+  int d = datasetFind(name);
+  writeLog(msg.sender, "opening dataset " + string(name));
+  msg = clearMsg();
+  msg.request = 50;
+  msg.buffer[0] = -1;
+  msg.buffer[1] = d;
+  if(d >= 0 && !switched && (switched = useDataset(d)) != NULL) {
+	dataSwitch(switched); // holds the server's own data until serveClient ends
+	msg.buffer[0] = 0;
+  }
+  sendMessage(msg);
+  if(d < 0)
+	writeLog(msg.sender, "no dataset called " + string(name));
+  else if(msg.buffer[0] < 0)
+	writeLog(msg.sender, "dataset " + string(name) + " could not be opened");
+}
+
+
+/**
+ * @brief counts this connection as working on dataset i, having the opener
+ * open it first if it is not open
+ * @return the dataset's handle, attached, NULL if it could not be opened
+*/
+DATAHANDLE *useDataset(int i) {
+  DATASET *d = datasetAt(i);
+  for(int tries=0; tries < 3; tries++) { // it may close between the two
+	int opens = __atomic_load_n(&d->opens, __ATOMIC_SEQ_CST);
+	if(datasetUse(i, opens, true))
+	  return attachDataset(i, opens);
+	if(!datasetWant(i, helperPid[HELPER_OPENER], DATASET_WAIT_MS))
+	  return NULL;
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief the handle of dataset i for this process, attached to the opening
+ * opens, which this process is counted as working on (datasetUse). Lets go
+ * of the one it had if that was an earlier opening.
+ * @return NULL, and no longer counted, if it cannot be attached
+*/
+DATAHANDLE *attachDataset(int i, int opens) {
+  DATAHANDLE *h = handles[i] ? handles[i] : (handles[i] = newHandle());
+  if(h->opens == opens)
+	return h;
+  dataSwitch(h);
+  if(h->opens > 0)
+	closeData();
+  bool ok = attachData(datasetAt(i));
+  if(!ok)
+	closeData();
+  dataSwitch(h);
+  h->opens = ok ? opens : 0;
+  if(!ok)
+	datasetLeave();
+  return ok ? h : NULL;
+}
+
+
+/**
+ * @brief lets go of the datasets this process holds that were closed, or
+ * closed and opened again, since it attached to them
+*/
+void dropStale() {
+  for(int i=0; i < datasetCount(); i++) {
+	DATASET *d = datasetAt(i);
+	DATAHANDLE *h = handles[i];
+	if(h && h->opens > 0 && (h->opens != __atomic_load_n(&d->opens, __ATOMIC_SEQ_CST)
+							 || __atomic_load_n(&d->state, __ATOMIC_SEQ_CST) != DATASET_OPEN)) {
+	  dataSwitch(h);
+	  closeData();
+	  dataSwitch(h);
+	  h->opens = 0;
+	}
+  }
+}
+
+
+/**
+ * @brief in the compactor or log packer: runs work on each open dataset in
+ * turn, switched to it. It counts as working on the dataset meanwhile, so
+ * the opener does not close it underneath.
+*/
+void eachDataset(void (*work)()) {
+  dropStale();
+  for(int i=0; i < datasetCount(); i++) {
+	DATASET *d = datasetAt(i);
+	int opens = __atomic_load_n(&d->opens, __ATOMIC_SEQ_CST);
+	if(!datasetUse(i, opens, false))
+	  continue;
+	DATAHANDLE *h = attachDataset(i, opens);
+	if(h == NULL)
+	  continue;
+	dataSwitch(h);
+	work();
+	dataSwitch(h);
+	datasetLeave();
+  }
+}
+
+
+/**
+ * @brief a handle for a dataset that is not open yet
+*/
+DATAHANDLE *newHandle() {
+  DATAHANDLE *h = new DATAHANDLE;
+  h->store = storeState();
+  h->mvcc = mvccState();
+  h->index = indexState();
+  h->agg = aggState();
+  h->journal = journalState();
+  h->seg = segState();
+  h->sem = h->stripes = -1;
+  h->opens = 0;
+  return h;
+}
+
+
+/**
+ * @brief exchanges the data in use, with its locks, with the one held by
+ * h: calling it twice with the same handle switches back
+*/
+void dataSwitch(DATAHANDLE *h) {
+  storeSwitch(h->store);
+  mvccSwitch(h->mvcc);
+  indexSwitch(h->index);
+  aggSwitch(h->agg);
+  journalSwitch(h->journal);
+  segSwitch(h->seg);
+  swap(sem, h->sem);
+  swap(stripes, h->stripes);
+}
+
+
+/**
+ * @brief the ids other processes attach to the data in use by (see
+ * attachData)
+ * @param ids output, DATASET_IDS of them
+*/
+void dataIds(int *ids) {
+  storeIds(&ids[ID_STORE], &ids[ID_STORELOCKS]);
+  ids[ID_MVCC] = mvccId();
+  ids[ID_INDEX] = indexId();
+  ids[ID_AGG] = aggId();
+  ids[ID_SEG] = segId();
+  ids[ID_SEM] = sem;
+  ids[ID_STRIPES] = stripes;
+}
+
+
+/**
+ * @brief attaches this process to an open dataset, by the ids the opener
+ * published, as the data in use. The snapshot state and log segments come
+ * first, so the files opened after them are no older than they say.
+ * @return false on error, with what was attached left for closeData
+*/
+bool attachData(const DATASET *d) {
+  const int *ids = d->ids;
+  sem = ids[ID_SEM]; // lock sets are attached on first use
+  stripes = ids[ID_STRIPES];
+  string journal = "CSC552p3." + string(d->name) + ".journal";
+  return mvccAttach(ids[ID_MVCC]) && segAttach(ids[ID_SEG])
+	&& storeAttach(ids[ID_STORE], ids[ID_STORELOCKS], backend)
+	&& journalAttach(journal.c_str()) && indexAttach(ids[ID_INDEX])
+	&& aggAttach(ids[ID_AGG]);
+}
+
+
+/**
+ * @brief closes the data in use (a dataset's, switched to) in this process
+*/
+void closeData() {
+  segClose();
+  aggClose();
+  indexClose();
+  mvccClose();
+  journalClose();
+  storeClose();
+  if(sem >= 0)
+	lockDetach(sem);
+  if(stripes >= 0)
+	lockDetach(stripes);
+  sem = stripes = -1;
+}
+
+
+/**
+ * @brief bytes of shared memory behind ids: the data's segments (snapshot
+ * state and version arena, indexes, totals, log and store state) and lock
+ * sets
+*/
+long long sharedBytes(const int *ids) {
+  long long bytes = 0;
+  struct shmid_ds ds;
+  for(int i=0; i < DATASET_IDS; i++)
+	if(ids[i] >= 0 && shmctl(ids[i], IPC_STAT, &ds) == 0)
+	  bytes += ds.shm_segsz;
+  return bytes;
+}
+
+
+/**
+ * @brief forks the opener: the process that opens the catalog's datasets
+ * when connections ask for them and closes them while they take more than
+ * the budget. It stays attached to every open dataset, so the processes
+ * serving connections can attach to it whenever they were forked.
+ * @return its pid, 0 if it could not be forked
+*/
+pid_t startOpener() {
+  pid_t p = fork();
+  if(p < 0) {
+	perror("fork error");
+	return 0;
+  } else if(p > 0) {
+	return p;
+  }
+  pid = 0;
+  prctl(PR_SET_PDEATHSIG, SIGKILL); // don't outlive the server
+  signal(SIGINT, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+  close(sockfd);
+  close(unixfd);
+  struct sigaction wake; // connections asking for a dataset wake us
+  memset(&wake, 0, sizeof(wake));
+  wake.sa_handler = wakeCatcher; // no SA_RESTART: the nap ends
+  sigaction(SIGUSR1, &wake, NULL);
+  while(true) {
+	serveDatasets();
+	usleep(DATASET_TICK_MS * 1000);
+  }
+}
+
+
+/**
+ * @brief in the opener: opens the datasets connections asked for and
+ * publishes their ids, then closes datasets while they take more than the
+ * budget
+*/
+void serveDatasets() {
+  for(int i; (i = datasetWanted()) >= 0; ) {
+	DATASET *d = datasetAt(i);
+	DATAHANDLE *h = handles[i] ? handles[i] : (handles[i] = newHandle());
+	dataSwitch(h);
+	bool ok = openData(d->path, "." + string(d->name)) && createLocks(IPC_PRIVATE);
+	if(sem >= 0)
+	  lockRemove(sem); // private: goes with the last process that has it
+	if(stripes >= 0)
+	  lockRemove(stripes);
+	long long bytes = 0;
+	if(ok) {
+	  dataIds(d->ids);
+	  bytes = sharedBytes(d->ids);
+	} else
+	  closeData();
+	dataSwitch(h);
+	datasetOpened(i, ok, bytes);
+	h->opens = ok ? d->opens : 0;
+	writeLog(0, "dataset " + string(d->name) + (ok ? " opened, "
+	  + to_string(bytes >> 20) + " MB" : " could not be opened"));
+  }
+  for(int i; (i = datasetEvict()) >= 0; ) {
+	DATASET *d = datasetAt(i);
+	dataSwitch(handles[i]);
+	closeData();
+	dataSwitch(handles[i]);
+	handles[i]->opens = 0;
+	datasetClosed(i);
+	writeLog(0, "dataset " + string(d->name) + " closed, over the memory budget");
+  }
+}
+
+
+/** 
+ * @brief forks the process that compacts the data file once enough of it
+ * is deleted records, and those of the open datasets
+ * @return its pid, 0 if it could not be forked
+*/
+pid_t startCompactor() {
+  pid_t p = fork();
+  if(p < 0) {
+	perror("fork error");
+	return 0;
+  } else if(p > 0) {
+	return p;
+  }
+  pid = 0;
+  prctl(PR_SET_PDEATHSIG, SIGKILL); // don't outlive the server
+  signal(SIGINT, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+  close(sockfd);
+  close(unixfd);
+  while(true) {
+	sleep(COMPACT_SEC);
+	compactDue();
+	eachDataset(compactDue);
+  }
+}
+
+
+/**
+ * @brief compacts the data in use if enough of it is deleted records
+*/
+void compactDue() {
+  long long count = mvccCount(), dead = count - mvccRecords();
+  if(dead >= COMPACT_MIN && dead * 100 >= count * compactPct)
+	compactData();
+}
+
+
+/** 
+ * @brief forks the process that compresses closed log segments (see
+ * p3seg.hpp), the server's and those of the open datasets
+ * @return its pid, 0 if it could not be forked
+*/
+pid_t startPacker() {
+  pid_t p = fork();
+  if(p < 0) {
+	perror("fork error");
+	return 0;
+  } else if(p > 0) {
+	return p;
+  }
+  pid = 0;
+  prctl(PR_SET_PDEATHSIG, SIGKILL); // don't outlive the server
+  signal(SIGINT, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL); // segPack waits for gzip itself
+  close(sockfd);
+  close(unixfd);
+  while(true) {
+	while(segPack());
+	eachDataset(packAll);
+	sleep(SEG_TICK_SEC);
+  }
+}
+
+
+/**
+ * @brief compresses every closed log segment of the data in use
+*/
+void packAll() {
+  while(segPack());
+}
+
+
+/** 
+ * @brief rewrites the data file without deleted records and swaps it in.
+ * Writers wait meanwhile, readers don't. Leaves a map from the old record
+ * indexes to the new ones so clients' record numbers keep working, and
+ * journals the compaction so replicas do the same at the same point.
+ * @return false on error (the data file is left as it was)
+*/
+bool compactData() {
+  uint32_t gen = mvccGate();
+  long long count = mvccCount(), n = 0;
+  string name = remapName(gen + 1);
+  FILE *f = fopen(name.c_str(), "w");
+  STORENEW data;
+  bool ok = f != NULL && storeNew(&data);
+  static int rows[COMPACT_CHUNK * STORE_COLS];
+  static long long remap[COMPACT_CHUNK];
+  for(long long j=0; ok && j < count; j += COMPACT_CHUNK) { // a chunk at a time
+	int want = (int)min(count - j, (long long)COMPACT_CHUNK), kept = 0;
+	ok = storeRead(j, want, rows) == want;
+	for(int i=0; ok && i < want; i++) {
+	  int *row = rows + (size_t)i * STORE_COLS;
+	  if(row[0] == STORE_TOMBSTONE) {
+		remap[i] = -1;
+		continue;
+	  }
+	  if(kept != i)
+		memcpy(rows + (size_t)kept * STORE_COLS, row, STORE_ROW);
+	  kept++;
+	  remap[i] = n++;
+	}
+	ok = ok && fwrite(remap, sizeof(long long), want, f) == (size_t)want
+	  && storeAdd(&data, rows, kept);
+  }
+  if(f && fclose(f) != 0) ok = false;
+  if(ok)
+	ok = storeInstall(&data, gen + 1);
+  else if(f)
+	storeDiscard(&data);
+  if(ok) {
+	int none[STORE_COLS] = {0};
+	journalAppend(REPL_COMPACT, 0, none); // writers are out, so this is in commit order
+	indexRebuild(n, mvccSwap(n)); // requests fall back to scans until then
+	if(gen + 1 > REMAP_KEEP)
+	  unlink(remapName(gen + 1 - REMAP_KEEP).c_str());
+  } else {
+	unlink(name.c_str());
+  }
+  mvccUngate();
+
+  writeLog(getpid(), ok ? "compacted data file from " + to_string(count) + " to "
+		   + to_string(n) + " records, generation " + to_string(gen + 1)
+		   : string("compaction failed"));
+  return ok;
+}
+
+
+/** 
+ * @brief sends logs to client through multiple transmissions: the number
+ * of lines in request, then one LOGMSG per line. Only the segments holding
+ * the lines asked for are read (see p3seg.hpp).
+ * @param msg message from client, the last buffer[0] lines wanted (0 for
+ * every line kept)
+*/
+void showLog(MESSAGE msg) {
+  long long want = max(0, msg.buffer[0]);
+  static SEGREAD plan[SEG_MAX + 1];
+
+  scanEnter(); // the whole log is a scan too
+  PR(sem, L_WRITER); // other log views read along, writeLog waits
+  long long lineCount;
+  int n = segPlan(want, plan, &lineCount); // from the index, no line counting
+  VR(sem, L_WRITER); // the segments are open, writers may go on
+  cout << "sending " + to_string(lineCount) + " log messages" << endl;
+
+  msg.request = (int)lineCount;
+  sendMessage(msg); // tell client how many LOGMSG to expect
+  segRead(plan, n, sendLogLine, &msg);
+  scanLeave();
+  
+  writeLog(msg.sender, "sent " + to_string(lineCount) + " log messages");
+}
+
+
+/** 
+ * @brief sends one line of the log to the client as a LOGMSG
+ * @param line the line, without its newline
+ * @param arg the client's request
+*/
+void sendLogLine(const char *line, void *arg) {
+  LOGMSG log;
+  log.msg_type = ((MESSAGE *)arg)->sender;
+  memset(log.buffer, 0, LOGSIZE);
+  strncpy(log.buffer, line, LOGSIZE - 1);
+  sendMessage(log);
+}
+
+
+/** 
+ * @brief writes server status to a logfile (appending)
+ * @param client the client's PID
+ * @param request information about the operation performed
+*/
+void writeLog(pid_t client, string request) {
+  string line = "Client PID: " + to_string(client) + " | Operation: " + request + "\n";
+  P(sem, L_WRITER); // wait
+
+  segAppend(line.c_str(), line.length()); // rotates the log when it is due
+
+  V(sem, L_WRITER); // signal
+}
+
+/** 
+ * @brief handles when a child disconnects from the parent: only reaps it.
+ * Logging takes the log lock, which the parent may hold when the signal
+ * comes, so logReaped does it once the handler has returned.
+ * @param sig signal
 */
 void childCatcher(int sig) {
   pid_t pid;
   int stat;
-  while((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-	childCount--;
-	cout << "Server: Child " << pid << " terminated" << endl;
-	writeLog(pid, "client disconnected");
-	return;
+  int saved = errno;
+  while((pid = waitpid(-1, &stat, WNOHANG)) > 0) { // signals merge, reap them all
+	bool helper = false;
+	for(int i=0; i < HELPERS; i++)
+	  helper |= pid == helperPid[i];
+	if(!helper)
+	  __atomic_sub_fetch(&childCount, 1, __ATOMIC_SEQ_CST);
+	unsigned in = __atomic_load_n(&reapedIn, __ATOMIC_SEQ_CST);
+	if(in - __atomic_load_n(&reapedOut, __ATOMIC_SEQ_CST) < REAPED) {
+	  reaped[in % REAPED] = helper ? -pid : pid; // logged apart from clients
+	  __atomic_store_n(&reapedIn, in + 1, __ATOMIC_SEQ_CST);
+	} else
+	  __atomic_add_fetch(&reapedLost, 1, __ATOMIC_SEQ_CST);
   } //end while
+  errno = saved;
 
 } //end childCatcher
 
+/** 
+ * @brief logs the children childCatcher reaped since the last call.
+ * Parent only, outside signal handlers.
+*/
+void logReaped() {
+  unsigned in = __atomic_load_n(&reapedIn, __ATOMIC_SEQ_CST);
+  int lost = __atomic_exchange_n(&reapedLost, 0, __ATOMIC_SEQ_CST);
+  if(in == reapedOut && lost == 0)
+	return;
+  for(; reapedOut != in; __atomic_add_fetch(&reapedOut, 1, __ATOMIC_SEQ_CST)) {
+	pid_t pid = reaped[reapedOut % REAPED];
+	if(pid < 0) {
+	  writeLog(-pid, "background process exited");
+	  continue;
+	}
+	cout << "Server: Child " << pid << " terminated" << endl;
+	writeLog(pid, "client disconnected");
+  }
+  if(lost > 0)
+	writeLog(0, to_string(lost) + " more clients disconnected");
+}
+
+/** 
+ * @brief wakes the opener from its nap when a connection asks for a
+ * dataset; serveDatasets does the work
+ * @param sig signal
+*/
+void wakeCatcher(int sig) {
+}
+
 /** 
  * @brief handles interrupt signals
  * @param sig signal
@@ -478,7 +2570,7 @@ void intCatcher(int sig) {
 	closeHandler(-1);
 	exit(0);
 	
-  } else if(childCount == 0) { // parent server, no clients connected
+  } else if(countClients() == 0) { // parent server, no clients connected
 	string input;
 	cout << "No clients connected. Are you sure you want to quit? (y/n): ";
 	cin >> input;
@@ -489,7 +2581,7 @@ void intCatcher(int sig) {
 	}
 	
   } else { // parent, clients are connected
-	cout << "There are " << childCount << " clients connected. SIGINT ignored" << endl;
+	cout << "There are " << countClients() << " clients connected. SIGINT ignored" << endl;
   }
 
 } //end childCatcher
@@ -505,6 +2597,8 @@ MESSAGE clearMsg() {
   msg.sender = cliPID;
   msg.msg_type = 1;
   msg.request = -1;
+  msg.rec = 0;
+  msg.gen = 0;
   return msg;
 }
 
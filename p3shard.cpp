@@ -0,0 +1,127 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3shard.cpp
+ * @brief      shard map file handling
+ */
+#include "p3shard.hpp"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+/** inode and mtime of the map last read by shardRefresh */
+static struct stat loaded;
+
+bool shardLoad(const char *path, SHARDMAP *map) {
+  FILE *f = fopen(path, "r");
+  if(f == NULL) return false;
+
+  memset(map, 0, sizeof(SHARDMAP));
+  char line[128];
+  bool ok = true;
+  while(ok && fgets(line, sizeof(line), f)) {
+	SHARD s;
+	if(line[0] == '#' || line[0] == '\n')
+	  continue;
+	if(sscanf(line, "version %d", &map->version) == 1)
+	  continue;
+	if(map->num == MAX_SHARDS
+	   || sscanf(line, "%lld %lld %15s %d", &s.lo, &s.hi, s.host, &s.port) != 4)
+	  ok = false;
+	else
+	  map->shard[map->num++] = s;
+  }
+  fclose(f);
+  return ok && map->num > 0;
+}
+
+bool shardRefresh(const char *path, SHARDMAP *map) {
+  struct stat st;
+  if(stat(path, &st) < 0)
+	return false;
+  if(map->num > 0 && st.st_ino == loaded.st_ino
+	 && st.st_mtim.tv_sec == loaded.st_mtim.tv_sec
+	 && st.st_mtim.tv_nsec == loaded.st_mtim.tv_nsec)
+	return true; // unchanged
+  if(!shardLoad(path, map))
+	return false;
+  loaded = st;
+  return true;
+}
+
+bool shardSave(const char *path, const SHARDMAP *map) {
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  FILE *f = fopen(tmp, "w");
+  if(f == NULL) return false;
+
+  fprintf(f, "# first last host port (last -1 = open, first 0 = spare)\n");
+  fprintf(f, "version %d\n", map->version);
+  for(int i=0; i < map->num; i++)
+	fprintf(f, "%lld %lld %s %d\n", map->shard[i].lo, map->shard[i].hi,
+			map->shard[i].host, map->shard[i].port);
+  bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if(!ok || rename(tmp, path) < 0) {
+	unlink(tmp);
+	return false;
+  }
+  return true;
+}
+
+int shardFind(const SHARDMAP *map, long long rec) {
+  for(int i=0; i < map->num; i++) {
+	const SHARD *s = &map->shard[i];
+	if(s->lo > 0 && rec >= s->lo && (s->hi == -1 || rec <= s->hi))
+	  return i;
+  }
+  return -1;
+}
+
+int shardOpen(const SHARDMAP *map) {
+  for(int i=0; i < map->num; i++)
+	if(map->shard[i].lo > 0 && map->shard[i].hi == -1)
+	  return i;
+  return -1;
+}
+
+int shardSelf(const SHARDMAP *map, int port) {
+  for(int i=0; i < map->num; i++)
+	if(map->shard[i].port == port)
+	  return i;
+  return -1;
+}
+
+bool shardSeal(const char *path, int port, long long count) {
+  // serialize writers on a lock file, the map itself is replaced by rename
+  char lockPath[256];
+  snprintf(lockPath, sizeof(lockPath), "%s.lock", path);
+  int lock = open(lockPath, O_RDWR | O_CREAT, 0644);
+  if(lock < 0 || flock(lock, LOCK_EX) < 0) {
+	if(lock >= 0) close(lock);
+	return false;
+  }
+
+  SHARDMAP map;
+  bool ok = shardLoad(path, &map);
+  int self = ok ? shardSelf(&map, port) : -1, spare = -1;
+  for(int i=0; i < map.num && self >= 0; i++)
+	if(map.shard[i].lo == 0) {
+	  spare = i;
+	  break;
+	}
+  ok = self >= 0 && spare >= 0 && map.shard[self].hi == -1;
+  if(ok) {
+	map.shard[self].hi = map.shard[self].lo + count - 1;
+	map.shard[spare].lo = map.shard[self].hi + 1;
+	map.shard[spare].hi = -1;
+	map.version++;
+	ok = shardSave(path, &map);
+  }
+
+  flock(lock, LOCK_UN);
+  close(lock);
+  return ok;
+}
@@ -0,0 +1,92 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3shard.hpp
+ * @brief      shard map: which server instance owns which record numbers
+ *
+ * The map file is plain text:
+ *
+ *     version 3
+ *     1 5000 127.0.0.1 15003
+ *     5001 -1 127.0.0.1 15004
+ *     0 0 127.0.0.1 15005
+ *
+ * Each line is "first last host port" with 1-based record numbers. last = -1
+ * marks the open shard that takes new records, first = 0 a spare that is not
+ * in use yet. Lines never move, so a shard's index in the map is stable.
+ */
+#ifndef P3SHARDHEADER
+#define P3SHARDHEADER
+
+/** most shards in one map */
+#define MAX_SHARDS 16
+
+/**
+ * one server instance and the records it owns
+ */
+typedef struct {
+  /** first record number owned, 0 for a spare */
+  long long lo;
+  /** last record number owned, -1 if open ended */
+  long long hi;
+  /** server port */
+  int port;
+  /** server IPv4 address */
+  char host[16];
+} SHARD;
+
+/**
+ * the whole map
+ */
+typedef struct {
+  /** bumped on every change */
+  int version;
+  /** number of shards (including spares) */
+  int num;
+  /** shards in file order */
+  SHARD shard[MAX_SHARDS];
+} SHARDMAP;
+
+/**
+ * @brief reads a map file
+ * @return false if it cannot be read or is malformed
+ */
+bool shardLoad(const char *path, SHARDMAP *map);
+
+/**
+ * @brief reads a map file again if it has changed since the last call
+ * (the file is replaced by rename, so its inode changes)
+ * @return false if it cannot be read
+ */
+bool shardRefresh(const char *path, SHARDMAP *map);
+
+/**
+ * @brief writes a map file through a temporary file and rename()
+ * @return false on error
+ */
+bool shardSave(const char *path, const SHARDMAP *map);
+
+/**
+ * @brief index of the shard owning 1-based record number rec
+ * @return -1 if no shard owns it
+ */
+int shardFind(const SHARDMAP *map, long long rec);
+
+/**
+ * @brief index of the open shard, -1 if there is none
+ */
+int shardOpen(const SHARDMAP *map);
+
+/**
+ * @brief index of the shard listening on port, -1 if not in the map
+ */
+int shardSelf(const SHARDMAP *map, int port);
+
+/**
+ * @brief splits the open range: the shard on port keeps records up to its
+ * count and the first spare takes the rest. Only the open shard may call this.
+ * @param count records the shard on port holds
+ * @return false if the shard is not open or there is no spare
+ */
+bool shardSeal(const char *path, int port, long long count);
+
+#endif
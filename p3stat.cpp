@@ -0,0 +1,76 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3stat.cpp
+ * @brief      prints every field's statistics as the server keeps them
+ *             (request 41), and checks them against a full scan
+ *
+ * Usage: ./p3stat [-v] [-a server IP] [-p port] [-d dataset]
+ *
+ * With -v the server also scans the whole file while writes wait; every
+ * field whose kept count, sum, minimum or maximum differs from the scan's
+ * is listed, and the exit status is 1 if there was one.
+ */
+#include "p3.hpp"
+#include "p3client.hpp"
+
+/** @brief main function */
+int main(int argc, char **argv) {
+  int opt, port = PORT;
+  bool verify = false;
+  const char *addr = SERVER_ADDR, *dataset = NULL;
+  while((opt = getopt(argc, argv, "va:p:d:")) != -1) {
+	if(opt == 'v') verify = true;
+	else if(opt == 'a') addr = optarg;
+	else if(opt == 'p') port = atoi(optarg);
+	else if(opt == 'd') dataset = optarg;
+	else {
+	  cout << "Usage: " << argv[0] << " [-v] [-a server IP] [-p port] [-d dataset]" << endl;
+	  return -1;
+	}
+  }
+
+  string error;
+  P3OPTIONS o = p3Options(addr, port);
+  o.dataset = dataset;
+  P3CLIENT *cl = p3Open(o, &error);
+  if(cl == NULL) {
+	cout << error << endl;
+	return -1;
+  }
+  P3RESULT r = p3Stats(cl, verify).get();
+  p3Close(cl);
+  if(r.status != P3_OK) {
+	cout << "statistics: " << (r.status == P3_BUSY ? "server busy" : r.error) << endl;
+	return -1;
+  }
+
+  cout << r.count << " records" << endl
+	   << left << setw(10) << "field" << right << setw(16) << "sum" << setw(14) << "mean"
+	   << setw(12) << "min" << setw(12) << "max" << endl;
+  for(int f=0; f < PACK_COLS; f++) {
+	const P3STAT &s = r.stats[f];
+	cout << left << setw(10) << schemaName(f) << right << setw(16) << s.sum << setw(14) << fixed
+		 << setprecision(2) << (r.count > 0 ? (double)s.sum / r.count : 0.0);
+	if(r.count > 0)
+	  cout << setw(12) << s.min << setw(12) << s.max;
+	cout << endl;
+  }
+  if(!verify)
+	return 0;
+
+  int bad = 0;
+  if(r.scannedCount != r.count) {
+	cout << "count: kept " << r.count << ", scanned " << r.scannedCount << endl;
+	bad++;
+  }
+  for(int f=0; f < PACK_COLS; f++) {
+	const P3STAT &s = r.stats[f], &t = r.scanned[f];
+	if(s.sum == t.sum && s.min == t.min && s.max == t.max)
+	  continue;
+	cout << schemaName(f) << ": kept sum " << s.sum << " min " << s.min << " max " << s.max
+		 << ", scanned sum " << t.sum << " min " << t.min << " max " << t.max << endl;
+	bad++;
+  }
+  cout << (bad ? "MISMATCH" : "OK: kept statistics match a full scan") << endl;
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,791 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3store.cpp
+ * @brief      pread/pwrite and io_uring storage backends
+ *
+ * The io_uring backend talks to the kernel directly (no liburing). Each
+ * process gets its own ring, created on first use, with the data file and
+ * log file registered as fixed files 0 and 1 and one registered buffer that
+ * all transfers go through. Multi-record reads are split into slices and
+ * submitted together with a single io_uring_enter. If the kernel refuses
+ * any part of the setup, the process falls back to pread/pwrite.
+ *
+ * The data file starts with a STOREHDR and then holds the records in 4 KB
+ * blocks, each ending with the CRC32C of the block. A write takes the lock
+ * of each block it touches (a p3lock, shared by the server's processes and
+ * given back if its holder dies mid-write), reads the block, puts its rows in and writes them, the rest of the block
+ * and the new checksum in one pwrite. Two writers in one block cannot leave
+ * the checksum of only the first write behind, and a crash cannot leave a
+ * row written without its checksum. Reads do not check checksums;
+ * storeVerify checks the whole file at startup.
+ */
+#include "p3store.hpp"
+#include "p3trace.hpp"
+#include "p3crc.hpp"
+#include "p3lock.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+#endif
+
+using namespace std;
+
+/** ring size (submission queue entries) */
+#define URING_DEPTH 32
+/** bytes per slice of a batched read, whole blocks so a slice that starts
+ * at a record never ends inside one */
+#define URING_SLICE (8 * STORE_BLOCK)
+/** size of the registered buffer */
+#define URING_BUF (URING_DEPTH * URING_SLICE)
+/** fixed file index of the data file */
+#define FIXED_DATA 0
+/** fixed file index of the log file */
+#define FIXED_LOG 1
+/** block locks, block b uses lock b % STORE_LOCKS; the header's is the
+ * one after them */
+#define STORE_LOCKS 1024
+/** blocks read at once by storeVerify */
+#define VERIFY_BATCH 64
+
+/**
+ * in memory shared by the server and its children (made by storeOpen)
+ */
+typedef struct {
+  /** the data file's header as last written */
+  STOREHDR hdr;
+  /** the data file and log, for storeAttach */
+  char data[256], log[256];
+} STORESHARED;
+
+/** data file descriptor */
+static int dataFd = -1;
+/** data file path, for storeReplace and storeReopen */
+static char dataPath[256];
+/** log file descriptor (O_APPEND) */
+static int logFd = -1;
+/** backend requested at startup */
+static int wanted = STORE_PREAD;
+/** backend in use by this process */
+static int active = STORE_PREAD;
+/** pid that set up the backend, a forked child redoes the setup */
+static pid_t setupPid = -1;
+/** the header as last written */
+static STORESHARED *shared = NULL;
+/** shared memory id of shared */
+static int sharedId = -1;
+/** lock set of the blocks and the header, held across their I/O */
+static int locks = -1;
+
+#ifdef HAVE_URING
+/**
+ * one io_uring instance with its mmapped rings
+ */
+typedef struct {
+  /** ring file descriptor */
+  int fd;
+  /** number of SQEs */
+  unsigned entries;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  /** mmapped ring areas, for teardown */
+  void *sqPtr, *cqPtr;
+  size_t sqLen, cqLen, sqesLen;
+  /** registered buffer */
+  char *buf;
+} RING;
+
+/** this process' ring */
+static RING ring = {-1};
+
+/**
+ * one read or write in a batch
+ */
+typedef struct {
+  /** IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED */
+  int op;
+  /** FIXED_DATA or FIXED_LOG */
+  int file;
+  /** file offset */
+  long long off;
+  /** bytes to transfer */
+  unsigned len;
+  /** offset inside the registered buffer */
+  unsigned bufOff;
+  /** result: bytes transferred or -errno */
+  int res;
+} IOREQ;
+
+/**
+ * @brief unmaps and closes the ring (also used for one inherited via fork)
+ */
+static void ringTeardown() {
+  if(ring.fd < 0) return;
+  if(ring.sqes) munmap(ring.sqes, ring.sqesLen);
+  if(ring.cqPtr && ring.cqPtr != ring.sqPtr) munmap(ring.cqPtr, ring.cqLen);
+  if(ring.sqPtr) munmap(ring.sqPtr, ring.sqLen);
+  if(ring.buf) munmap(ring.buf, URING_BUF);
+  close(ring.fd);
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+/**
+ * @brief creates the ring and registers both files and the buffer
+ * @return false if the kernel refuses io_uring
+ */
+static bool ringSetup() {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(&ring, 0, sizeof(ring));
+  if((ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) < 0) {
+	ring.fd = -1;
+	return false;
+  }
+  ring.entries = p.sq_entries;
+
+  ring.sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if(single)
+	ring.sqLen = ring.cqLen = max(ring.sqLen, ring.cqLen);
+
+  ring.sqPtr = mmap(0, ring.sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring.fd, IORING_OFF_SQ_RING);
+  if(ring.sqPtr == MAP_FAILED) { ring.sqPtr = NULL; ringTeardown(); return false; }
+  if(single)
+	ring.cqPtr = ring.sqPtr;
+  else {
+	ring.cqPtr = mmap(0, ring.cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  ring.fd, IORING_OFF_CQ_RING);
+	if(ring.cqPtr == MAP_FAILED) { ring.cqPtr = NULL; ringTeardown(); return false; }
+  }
+  ring.sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+  ring.sqes = (io_uring_sqe *)mmap(0, ring.sqesLen, PROT_READ | PROT_WRITE,
+								   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if(ring.sqes == MAP_FAILED) { ring.sqes = NULL; ringTeardown(); return false; }
+
+  char *sq = (char *)ring.sqPtr, *cq = (char *)ring.cqPtr;
+  ring.sqHead = (unsigned *)(sq + p.sq_off.head);
+  ring.sqTail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sqArray = (unsigned *)(sq + p.sq_off.array);
+  ring.cqHead = (unsigned *)(cq + p.cq_off.head);
+  ring.cqTail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  int fds[2] = {dataFd, logFd};
+  if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+	ringTeardown();
+	return false;
+  }
+  ring.buf = (char *)mmap(0, URING_BUF, PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ring.buf == MAP_FAILED) { ring.buf = NULL; ringTeardown(); return false; }
+  struct iovec iov = {ring.buf, URING_BUF};
+  if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+	ringTeardown();
+	return false;
+  }
+  return true;
+}
+
+/**
+ * @brief submits n requests with one io_uring_enter and waits for all of them
+ * @param reqs the requests, n <= ring.entries. res is filled in.
+ * @return false if the ring failed
+ */
+static bool ringRun(IOREQ *reqs, int n) {
+  unsigned tail = *ring.sqTail;
+  for(int i=0; i < n; i++, tail++) {
+	unsigned idx = tail & *ring.sqMask;
+	io_uring_sqe *sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = reqs[i].op;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = reqs[i].file;
+	sqe->off = reqs[i].off;
+	sqe->addr = (unsigned long)(ring.buf + reqs[i].bufOff);
+	sqe->len = reqs[i].len;
+	sqe->buf_index = 0;
+	sqe->user_data = i;
+	ring.sqArray[idx] = idx;
+  }
+  __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+
+  int submit = n, done = 0;
+  while(done < n) {
+	int r = syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	if(r < 0 && errno != EINTR) return false;
+	if(r > 0) submit -= r;
+
+	unsigned head = *ring.cqHead;
+	unsigned ctail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+	for(; head != ctail; head++, done++) {
+	  io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+	  reqs[cqe->user_data].res = cqe->res;
+	}
+	__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+#endif
+
+/**
+ * @brief sets up the requested backend once per process
+ */
+static void storeSetup() {
+  if(setupPid == getpid()) return;
+  setupPid = getpid();
+  active = STORE_PREAD;
+#ifdef HAVE_URING
+  ringTeardown(); // inherited from the parent, not ours to use
+  if(wanted == STORE_URING) {
+	if(ringSetup())
+	  active = STORE_URING;
+	else
+	  perror("io_uring unavailable, using pread/pwrite");
+  }
+#endif
+}
+
+/**
+ * @brief pread until len bytes are read or EOF
+ * @return bytes read, -1 on error
+ */
+static long long preadFull(int fd, char *buf, long long len, long long off) {
+  long long got = 0;
+  while(got < len) {
+	ssize_t n = pread(fd, buf + got, len - got, off + got);
+	if(n < 0 && errno == EINTR) continue;
+	if(n < 0) return -1;
+	if(n == 0) break; // EOF
+	got += n;
+  }
+  return got;
+}
+
+/**
+ * @brief pwrite all len bytes
+ * @return false on error
+ */
+static bool pwriteFull(int fd, const char *buf, long long len, long long off) {
+  while(len > 0) {
+	ssize_t n = pwrite(fd, buf, len, off);
+	if(n < 0 && errno == EINTR) continue;
+	if(n <= 0) return false;
+	buf += n;
+	len -= n;
+	off += n;
+  }
+  return true;
+}
+
+/**
+ * @brief file offset of record rec
+ */
+static long long rowOff(long long rec) {
+  return STORE_HEADER + rec / STORE_BLOCK_ROWS * STORE_BLOCK + rec % STORE_BLOCK_ROWS * STORE_ROW;
+}
+
+/**
+ * @brief copies the records out of len raw bytes read at file offset off,
+ * leaving out the end of each block
+ * @return bytes of records copied
+ */
+static long long unblock(char *out, const char *raw, long long off, long long len) {
+  long long copied = 0;
+  while(len > 0) {
+	long long in = (off - STORE_HEADER) % STORE_BLOCK, run;
+	long long rowBytes = STORE_BLOCK_ROWS * STORE_ROW;
+	if(in >= rowBytes) // padding and checksum
+	  run = min(len, STORE_BLOCK - in);
+	else {
+	  run = min(len, rowBytes - in);
+	  memcpy(out + copied, raw, run);
+	  copied += run;
+	}
+	raw += run;
+	off += run;
+	len -= run;
+  }
+  return copied;
+}
+
+/**
+ * @brief rewrites a data file without a header (records back to back, the
+ * layout before format version 1) in the current layout. A torn record at
+ * the end is dropped.
+ * @return false on error
+ */
+static bool upgrade() {
+  struct stat st;
+  if(fstat(dataFd, &st) < 0)
+	return false;
+  long long n = st.st_size / STORE_ROW, torn = st.st_size % STORE_ROW;
+  vector<int> rows(n * STORE_COLS + 1);
+  if(preadFull(dataFd, (char *)rows.data(), n * STORE_ROW, 0) != (long long)(n * STORE_ROW))
+	return false;
+  cout << "Upgrading " << dataPath << " to format version " << STORE_VERSION
+	   << " (" << n << " records)" << endl;
+  if(torn)
+	cout << "Dropping a torn record at the end (" << torn << " bytes)" << endl;
+  return storeReplace(rows.data(), n, 1);
+}
+
+bool storeOpen(const char *data, const char *log, int backend) {
+  if((dataFd = open(data, O_RDWR)) < 0)
+	return false;
+  snprintf(dataPath, sizeof(dataPath), "%s", data);
+  if((logFd = open(log, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+	return false;
+  if((sharedId = shmget(IPC_PRIVATE, sizeof(STORESHARED), IPC_CREAT | 0600)) < 0)
+	return false;
+  shared = (STORESHARED *)shmat(sharedId, 0, 0);
+  shmctl(sharedId, IPC_RMID, 0); // goes away with the last process
+  if(shared == (void *)-1) {
+	shared = NULL;
+	return false;
+  }
+  snprintf(shared->data, sizeof(shared->data), "%s", data);
+  snprintf(shared->log, sizeof(shared->log), "%s", log);
+  if((locks = lockGet(IPC_PRIVATE, STORE_LOCKS + 1, IPC_CREAT | 0600)) < 0)
+	return false;
+  lockRemove(locks); // goes with the last process that has it
+  for(int i=0; i <= STORE_LOCKS; i++)
+	lockGive(locks, i);
+
+  // O(1) checks: the header and the size it implies; blocks are storeVerify's
+  STOREHDR h;
+  struct stat st;
+  if(pread(dataFd, &h, sizeof(h), 0) != sizeof(h) || h.magic != STORE_MAGIC) {
+	if(!upgrade())
+	  return false;
+  } else if(h.version != STORE_VERSION || h.rowSize != STORE_ROW
+			|| h.blockRows != STORE_BLOCK_ROWS) {
+	cout << data << ": unknown format version " << h.version << endl;
+	return false;
+  } else if(h.crc != storeHeaderCrc(&h) || h.count < 0) {
+	cout << data << ": header checksum mismatch" << endl;
+	return false;
+  } else if(fstat(dataFd, &st) < 0 || st.st_size < storeFileSize(h.count)) {
+	cout << data << ": " << st.st_size << " bytes, too short for its "
+		 << h.count << " records" << endl;
+	return false;
+  } else
+	shared->hdr = h;
+
+  wanted = backend;
+  setupPid = -1;
+  storeSetup();
+  return true;
+}
+
+bool storeAttach(int id, int lockId, int backend) {
+  shared = (STORESHARED *)shmat(id, 0, 0);
+  if(shared == (void *)-1) {
+	shared = NULL;
+	return false;
+  }
+  sharedId = id;
+  locks = lockId;
+  snprintf(dataPath, sizeof(dataPath), "%s", shared->data);
+  if((dataFd = open(dataPath, O_RDWR)) < 0
+	 || (logFd = open(shared->log, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+	return false;
+  wanted = backend;
+  setupPid = -1;
+  storeSetup();
+  return true;
+}
+
+void storeIds(int *id, int *lockId) {
+  *id = sharedId;
+  *lockId = locks;
+}
+
+void storeClose() {
+#ifdef HAVE_URING
+  ringTeardown();
+#endif
+  close(dataFd);
+  close(logFd);
+  dataFd = logFd = -1;
+  if(shared)
+	shmdt(shared);
+  shared = NULL;
+  sharedId = -1;
+  if(locks >= 0)
+	lockDetach(locks);
+  locks = -1;
+}
+
+/**
+ * the statics above, for a dataset that is not in use
+ */
+struct STORESTATE {
+  int dataFd;
+  char dataPath[256];
+  int logFd, wanted, active;
+  pid_t setupPid;
+  STORESHARED *shared;
+  int sharedId, locks;
+#ifdef HAVE_URING
+  RING ring;
+#endif
+};
+
+STORESTATE *storeState() {
+  STORESTATE *s = new STORESTATE();
+  s->dataFd = s->logFd = -1;
+  s->wanted = s->active = STORE_PREAD;
+  s->setupPid = -1;
+  s->sharedId = s->locks = -1;
+#ifdef HAVE_URING
+  s->ring.fd = -1;
+#endif
+  return s;
+}
+
+void storeSwitch(STORESTATE *s) {
+  swap(dataFd, s->dataFd);
+  swap(dataPath, s->dataPath);
+  swap(logFd, s->logFd);
+  swap(wanted, s->wanted);
+  swap(active, s->active);
+  swap(setupPid, s->setupPid);
+  swap(shared, s->shared);
+  swap(sharedId, s->sharedId);
+  swap(locks, s->locks);
+#ifdef HAVE_URING
+  swap(ring, s->ring);
+#endif
+}
+
+int storeBackend() {
+  storeSetup();
+  return active;
+}
+
+const char *storeBackendName(int backend) {
+  return backend == STORE_URING ? "io_uring" : "pread";
+}
+
+long long storeCount() {
+  return __atomic_load_n(&shared->hdr.count, __ATOMIC_SEQ_CST);
+}
+
+uint32_t storeGen() {
+  return shared->hdr.gen;
+}
+
+/**
+ * @brief storeRead without the tracing
+ */
+static int readRows(long long first, int n, int *rows) {
+  storeSetup();
+  if(n <= 0) return 0;
+  long long off = rowOff(first), len = rowOff(first + n - 1) + STORE_ROW - off;
+  char *out = (char *)rows;
+  long long got = 0;
+#ifdef HAVE_URING
+  if(active == STORE_URING) {
+	IOREQ reqs[URING_DEPTH];
+	long long done = 0;
+	while(done < len) {
+	  // fill the whole registered buffer with one batch of slices
+	  int cnt = 0;
+	  long long batch = 0;
+	  while(cnt < URING_DEPTH && done + batch < len) {
+		long long l = min((long long)URING_SLICE, len - done - batch);
+		IOREQ r = {IORING_OP_READ_FIXED, FIXED_DATA, off + done + batch,
+				   (unsigned)l, (unsigned)(cnt * URING_SLICE), 0};
+		reqs[cnt++] = r;
+		batch += l;
+	  }
+	  if(!ringRun(reqs, cnt)) return -1;
+	  for(int i=0; i < cnt; i++) {
+		if(reqs[i].res < 0) return -1;
+		got += unblock(out + got, ring.buf + reqs[i].bufOff, reqs[i].off, reqs[i].res);
+		done += reqs[i].res;
+		if((unsigned)reqs[i].res < reqs[i].len) // EOF
+		  return got / STORE_ROW;
+	  }
+	}
+	return got / STORE_ROW;
+  }
+#endif
+  static char raw[URING_SLICE];
+  for(long long done = 0; done < len; ) {
+	long long l = min((long long)sizeof(raw), len - done);
+	long long r = preadFull(dataFd, raw, l, off + done);
+	if(r < 0) return -1;
+	got += unblock(out + got, raw, off + done, r);
+	done += r;
+	if(r < l) break; // EOF
+  }
+  return got / STORE_ROW;
+}
+
+int storeRead(long long first, int n, int *rows) {
+  long long t = traceStart(); // a traced request times its reads (p3trace.hpp)
+  n = readRows(first, n, rows);
+  traceSpan(TRACE_READ, t);
+  return n;
+}
+
+/**
+ * @brief storeWriteAt without the tracing
+ */
+static bool writeAt(int file, const char *buf, size_t len, long long off) {
+  storeSetup();
+#ifdef HAVE_URING
+  if(active == STORE_URING) {
+	while(len > 0) {
+	  unsigned l = min(len, (size_t)URING_BUF);
+	  memcpy(ring.buf, buf, l);
+	  IOREQ r = {IORING_OP_WRITE_FIXED, file, off, l, 0, 0};
+	  if(!ringRun(&r, 1) || r.res <= 0) return false;
+	  buf += r.res;
+	  len -= r.res;
+	  off += r.res;
+	}
+	return true;
+  }
+#endif
+  if(file == FIXED_LOG) // O_APPEND, offset is ignored
+	return pwriteFull(logFd, buf, len, 0);
+  return pwriteFull(dataFd, buf, len, off);
+}
+
+/**
+ * @brief writes len bytes at off in the given file
+ * @param file FIXED_DATA or FIXED_LOG
+ * @return false on error
+ */
+static bool storeWriteAt(int file, const char *buf, size_t len, long long off) {
+  long long t = traceStart();
+  bool ok = writeAt(file, buf, len, off);
+  traceSpan(TRACE_WRITE, t);
+  return ok;
+}
+
+/**
+ * @brief writes k rows from first on, all in one block, with the block's
+ * checksum. Under the block's lock, the block is read, the rows are put in
+ * and everything from the first row to the end of the block, checksum
+ * included, goes out in one write.
+ * @param rows the rows, NULL to only recompute the checksum of the block
+ * first is in from what it holds
+ * @return false on error
+ */
+static bool writeBlock(long long first, long long k, const char *rows) {
+  char data[STORE_BLOCK];
+  long long block = first / STORE_BLOCK_ROWS;
+  long long off = STORE_HEADER + block * STORE_BLOCK;
+  long long at = rows ? rowOff(first) - off : STORE_BLOCK_DATA;
+  int l = block % STORE_LOCKS;
+  lockTake(locks, l);
+  long long got = preadFull(dataFd, data, STORE_BLOCK_DATA, off);
+  if(got >= 0) // rows past the end of the file read as zeros, as they will
+	memset(data + got, 0, STORE_BLOCK_DATA - got);
+  if(rows)
+	memcpy(data + at, rows, k * STORE_ROW);
+  uint32_t crc = crc32c(0, data, STORE_BLOCK_DATA);
+  memcpy(data + STORE_BLOCK_DATA, &crc, sizeof(crc));
+  bool ok = got >= 0 && storeWriteAt(FIXED_DATA, data + at, STORE_BLOCK - at, off + at);
+  lockGive(locks, l);
+  return ok;
+}
+
+/**
+ * @brief writes n records from first on with their blocks' checksums and,
+ * if the file grew, the header
+ * @return false on error
+ */
+static bool writeRows(long long first, long long n, const char *rows) {
+  long long end = first + n;
+  while(n > 0) {
+	long long k = min(n, STORE_BLOCK_ROWS - first % STORE_BLOCK_ROWS);
+	if(!writeBlock(first, k, rows))
+	  return false;
+	first += k;
+	n -= k;
+	rows += k * STORE_ROW;
+  }
+  bool ok = true;
+  lockTake(locks, STORE_LOCKS);
+  if(end > shared->hdr.count) {
+	STOREHDR h = storeHeader(end, shared->hdr.gen);
+	ok = storeWriteAt(FIXED_DATA, (const char *)&h, sizeof(h), 0);
+	__atomic_store_n(&shared->hdr.count, end, __ATOMIC_SEQ_CST);
+	shared->hdr.crc = h.crc;
+  }
+  lockGive(locks, STORE_LOCKS);
+  return ok;
+}
+
+bool storeWrite(long long rec, const int *row) {
+  return writeRows(rec, 1, (const char *)row);
+}
+
+bool storeAppend(const int *row) {
+  return writeRows(storeCount(), 1, (const char *)row);
+}
+
+bool storeNew(STORENEW *f) {
+  snprintf(f->path, sizeof(f->path), "%s.%d", dataPath, getpid());
+  f->n = 0;
+  memset(f->block, 0, STORE_BLOCK);
+  f->fd = open(f->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  return f->fd >= 0;
+}
+
+/**
+ * @brief writes the block of a new data file being filled, with its
+ * checksum, and starts the next one
+ */
+static bool flushNew(STORENEW *f) {
+  uint32_t crc = crc32c(0, f->block, STORE_BLOCK_DATA);
+  memcpy(f->block + STORE_BLOCK_DATA, &crc, sizeof(crc));
+  long long first = (f->n - 1) / STORE_BLOCK_ROWS * STORE_BLOCK_ROWS;
+  bool ok = pwriteFull(f->fd, f->block, STORE_BLOCK, rowOff(first));
+  memset(f->block, 0, STORE_BLOCK);
+  return ok;
+}
+
+bool storeAdd(STORENEW *f, const int *rows, long long n) {
+  const char *src = (const char *)rows;
+  while(n > 0) {
+	long long at = f->n % STORE_BLOCK_ROWS, k = min(n, STORE_BLOCK_ROWS - at);
+	memcpy(f->block + at * STORE_ROW, src, k * STORE_ROW);
+	f->n += k;
+	src += k * STORE_ROW;
+	n -= k;
+	if(f->n % STORE_BLOCK_ROWS == 0 && !flushNew(f))
+	  return false;
+  }
+  return true;
+}
+
+bool storeInstall(STORENEW *f, uint32_t gen) {
+  char head[STORE_HEADER] = {0};
+  STOREHDR h = storeHeader(f->n, gen);
+  memcpy(head, &h, sizeof(h));
+  bool ok = (f->n % STORE_BLOCK_ROWS == 0 || flushNew(f))
+	&& pwriteFull(f->fd, head, STORE_HEADER, 0)
+	&& ftruncate(f->fd, storeFileSize(f->n)) == 0 && fsync(f->fd) == 0;
+  close(f->fd);
+  f->fd = -1;
+  if(!ok || rename(f->path, dataPath) < 0) {
+	unlink(f->path);
+	return false;
+  }
+  memcpy(&shared->hdr, &h, sizeof(STOREHDR));
+  return storeReopen();
+}
+
+void storeDiscard(STORENEW *f) {
+  if(f->fd < 0)
+	return;
+  close(f->fd);
+  unlink(f->path);
+  f->fd = -1;
+}
+
+bool storeReplace(const int *rows, long long n, uint32_t gen) {
+  STORENEW f;
+  if(!storeNew(&f))
+	return false;
+  if(!storeAdd(&f, rows, n)) {
+	storeDiscard(&f);
+	return false;
+  }
+  return storeInstall(&f, gen);
+}
+
+bool storeReopen() {
+  int fd = open(dataPath, O_RDWR);
+  if(fd < 0)
+	return false;
+  dup2(fd, dataFd); // same descriptor number, nothing else to update
+  close(fd);
+  setupPid = -1; // the ring registered the old file
+  return true;
+}
+
+const char *storePath() {
+  return dataPath;
+}
+
+bool storeLogAppend(const char *line, size_t len) {
+  return storeWriteAt(FIXED_LOG, line, len, 0);
+}
+
+bool storeLogReopen(const char *path) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if(fd < 0)
+	return false;
+  dup2(fd, logFd); // same descriptor number, like storeReopen
+  close(fd);
+  setupPid = -1; // the ring registered the old file
+  return true;
+}
+
+bool storeReseal(long long block) {
+  return writeBlock(block * STORE_BLOCK_ROWS, 0, NULL);
+}
+
+long long storeVerify(int threads, long long *bad, int maxBad) {
+  long long blocks = (storeCount() + STORE_BLOCK_ROWS - 1) / STORE_BLOCK_ROWS;
+  threads = max(1, (int)min((long long)threads, blocks));
+  vector<vector<long long>> found(threads); // the first maxBad of each stretch
+  long long total = 0;
+  atomic<long long> count(0);
+  vector<thread> pool;
+  for(int t=0; t < threads; t++)
+	pool.emplace_back([&, t]() { // each thread checks one stretch of blocks
+	  vector<char> buf(VERIFY_BATCH * STORE_BLOCK);
+	  long long end = blocks * (t + 1) / threads;
+	  for(long long b = blocks * t / threads; b < end; ) {
+		long long k = min((long long)VERIFY_BATCH, end - b);
+		long long got = preadFull(dataFd, buf.data(), k * STORE_BLOCK, STORE_HEADER + b * STORE_BLOCK);
+		for(long long i=0; i < k; i++, b++) {
+		  const char *block = buf.data() + i * STORE_BLOCK;
+		  uint32_t crc;
+		  memcpy(&crc, block + STORE_BLOCK_DATA, sizeof(crc));
+		  if(got < (i + 1) * STORE_BLOCK || crc32c(0, block, STORE_BLOCK_DATA) != crc) {
+			count++;
+			if((long long)found[t].size() < maxBad) found[t].push_back(b);
+		  }
+		}
+	  }
+	});
+  for(thread &t : pool)
+	t.join();
+  for(int t=0; t < threads; t++) // stretches are in block order
+	for(size_t i=0; i < found[t].size() && total < maxBad; i++)
+	  bad[total++] = found[t][i];
+  return count;
+}
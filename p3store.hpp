@@ -0,0 +1,281 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3store.hpp
+ * @brief      storage backends for the server's data and log files
+ *
+ * Data file layout (format version 1):
+ *
+ *   0      STOREHDR, padded to STORE_HEADER bytes
+ *   4096   block 0: records 0-112, zero padding, CRC32C of the rest of the block
+ *   8192   block 1: records 113-225, ...
+ *
+ * The record count comes from the header, not the file size, so a torn
+ * append cannot shift it. A file without a header (records back to back,
+ * as the server used to write it) is rewritten in this layout when opened.
+ */
+#ifndef P3STOREHEADER
+#define P3STOREHEADER
+
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include "p3schema.hpp"
+#include "p3crc.hpp"
+
+/** pread / pwrite, one syscall per operation */
+#define STORE_PREAD 0
+/** io_uring with registered files and buffers, batched submissions */
+#define STORE_URING 1
+
+/** ints per record in the data file (see p3schema.hpp) */
+#define STORE_COLS SCHEMA_COLS
+/** bytes per record in the data file */
+#define STORE_ROW (sizeof(int) * STORE_COLS)
+/** Year of a deleted record (tombstone), its slot may be reused */
+#define STORE_TOMBSTONE SCHEMA_TOMBSTONE
+
+/** first 4 bytes of a data file with a header ("P3DB") */
+#define STORE_MAGIC 0x42443350
+/** data file format version */
+#define STORE_VERSION 1
+/** bytes before the first block */
+#define STORE_HEADER 4096
+/** bytes per block, the checksum in its last 4 */
+#define STORE_BLOCK 4096
+/** bytes of a block the checksum covers */
+#define STORE_BLOCK_DATA (STORE_BLOCK - 4)
+/** records per block */
+#define STORE_BLOCK_ROWS ((long long)(STORE_BLOCK_DATA / STORE_ROW))
+
+/**
+ * start of the data file
+ */
+typedef struct {
+  /** STORE_MAGIC */
+  uint32_t magic;
+  /** STORE_VERSION */
+  uint32_t version;
+  /** STORE_ROW the file was written with */
+  uint32_t rowSize;
+  /** STORE_BLOCK_ROWS the file was written with */
+  uint32_t blockRows;
+  /** records in the file, deleted ones included */
+  int64_t count;
+  /** generation, starting at 1 and counting up with each compaction */
+  uint32_t gen;
+  /** CRC32C of the fields above */
+  uint32_t crc;
+} STOREHDR;
+
+/**
+ * @brief checksum of a header, over every field before crc
+ */
+inline uint32_t storeHeaderCrc(const STOREHDR *h) {
+  return crc32c(0, h, offsetof(STOREHDR, crc));
+}
+
+/**
+ * @brief a header for n records
+ */
+inline STOREHDR storeHeader(long long n, uint32_t gen) {
+  STOREHDR h;
+  memset(&h, 0, sizeof(h));
+  h.magic = STORE_MAGIC;
+  h.version = STORE_VERSION;
+  h.rowSize = STORE_ROW;
+  h.blockRows = STORE_BLOCK_ROWS;
+  h.count = n;
+  h.gen = gen;
+  h.crc = storeHeaderCrc(&h);
+  return h;
+}
+
+/**
+ * @brief bytes of a data file holding n records
+ */
+inline long long storeFileSize(long long n) {
+  return STORE_HEADER + (n + STORE_BLOCK_ROWS - 1) / STORE_BLOCK_ROWS * STORE_BLOCK;
+}
+
+/**
+ * @brief opens the data file and log file. Checks the header and the file
+ * size (not the blocks, see storeVerify), and upgrades a file without a
+ * header. Call once in the server before forking.
+ * @param data path of the binary data file (must exist)
+ * @param log path of the log file (created if needed)
+ * @param backend STORE_PREAD or STORE_URING
+ * @return false if a file cannot be opened
+ */
+bool storeOpen(const char *data, const char *log, int backend);
+
+/**
+ * @brief opens, in another process, the store storeOpen set up: its files
+ * by the names storeOpen was given, and its shared header and locks
+ * @param id shared header and lockId lock set, from storeIds
+ * @return false on error
+ */
+bool storeAttach(int id, int lockId, int backend);
+
+/**
+ * @brief ids of the shared header (shared memory) and the block locks
+ * (p3lock set), for storeAttach
+ */
+void storeIds(int *id, int *lockId);
+
+/**
+ * @brief closes both files, tears down this process' ring and lets go of
+ * the shared header and block locks
+ */
+void storeClose();
+
+/**
+ * a process' store: its files, ring and shared header. A server holding
+ * several datasets keeps one per dataset (see p3dset.hpp).
+ */
+typedef struct STORESTATE STORESTATE;
+
+/**
+ * @brief a store that is not open, for storeSwitch
+ */
+STORESTATE *storeState();
+
+/**
+ * @brief switches this process to the store s holds: every store call from
+ * then on works on it, and s keeps the one that was in use
+ */
+void storeSwitch(STORESTATE *s);
+
+/**
+ * @brief backend actually in use. STORE_URING falls back to STORE_PREAD
+ * when the kernel refuses io_uring, so this may differ from storeOpen's.
+ * The ring is per process and set up on first use after a fork().
+ */
+int storeBackend();
+
+/**
+ * @brief name of a backend, for printing
+ */
+const char *storeBackendName(int backend);
+
+/**
+ * @brief records in the data file, from its header
+ */
+long long storeCount();
+
+/**
+ * @brief generation recorded in the data file's header
+ */
+uint32_t storeGen();
+
+/**
+ * @brief reads n consecutive records starting at record index first (0-based)
+ * @param rows output, n * STORE_COLS ints
+ * @return number of whole records read, -1 on error
+ */
+int storeRead(long long first, int n, int *rows);
+
+/**
+ * @brief overwrites the record at index rec (0-based)
+ * @return false on error
+ */
+bool storeWrite(long long rec, const int *row);
+
+/**
+ * @brief appends a record to the end of the data file.
+ * Callers must hold the data file lock.
+ * @return false on error
+ */
+bool storeAppend(const int *row);
+
+/**
+ * a new data file, written a chunk of records at a time next to the data
+ * file and then renamed over it, so replacing a file never holds it whole
+ */
+typedef struct {
+  /** the new file, -1 once installed or discarded */
+  int fd;
+  /** its name, the data file's with this process' pid after it */
+  char path[280];
+  /** records added */
+  long long n;
+  /** the block being filled */
+  char block[STORE_BLOCK];
+} STORENEW;
+
+/**
+ * @brief starts a new data file
+ * @return false if it cannot be created
+ */
+bool storeNew(STORENEW *f);
+
+/**
+ * @brief adds n records to the end of a new data file
+ * @return false on error (storeDiscard it)
+ */
+bool storeAdd(STORENEW *f, const int *rows, long long n);
+
+/**
+ * @brief writes a new data file's last block and header, renames it over
+ * the data file and reopens it. Processes that still have the old file
+ * open keep reading the old contents until they call storeReopen.
+ * @param gen generation to record in the header
+ * @return false on error (the data file is left as it was, the new one
+ * is gone)
+ */
+bool storeInstall(STORENEW *f, uint32_t gen);
+
+/**
+ * @brief deletes a new data file that is not to be installed
+ */
+void storeDiscard(STORENEW *f);
+
+/**
+ * @brief writes n records to a new file and renames it over the data file,
+ * then reopens it (storeNew, storeAdd and storeInstall at once)
+ * @param gen generation to record in the header
+ * @return false on error (the data file is left as it was)
+ */
+bool storeReplace(const int *rows, long long n, uint32_t gen);
+
+/**
+ * @brief opens the data file again by name, after another process
+ * replaced it
+ * @return false on error
+ */
+bool storeReopen();
+
+/**
+ * @brief path of the data file
+ */
+const char *storePath();
+
+/**
+ * @brief appends one line (with its newline) to the log file
+ * @return false on error
+ */
+bool storeLogAppend(const char *line, size_t len);
+
+/**
+ * @brief opens the log file again by name (creating it), after it was
+ * renamed away by a rotation (see p3seg.hpp)
+ * @return false on error
+ */
+bool storeLogReopen(const char *path);
+
+/**
+ * @brief checks every block's checksum, split over threads
+ * @param bad output, the first maxBad corrupt block numbers in order
+ * (block b holds records b * STORE_BLOCK_ROWS on)
+ * @return number of corrupt blocks
+ */
+long long storeVerify(int threads, long long *bad, int maxBad);
+
+/**
+ * @brief recomputes a block's checksum from the rows it holds, accepting
+ * them as they are (server -F, after storeVerify found the block corrupt)
+ * @return false on error
+ */
+bool storeReseal(long long block);
+
+#endif
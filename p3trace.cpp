@@ -0,0 +1,177 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3trace.cpp
+ * @brief      sampling, event bookkeeping and the trace file
+ */
+#include "p3trace.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+bool tracing = false;
+
+/** trace file (O_APPEND, shared by all children), -1 if tracing is off */
+static int traceFd = -1;
+/** requests traced per 100000 */
+static uint32_t rate = 0;
+/** file header, names filled in by traceName */
+static TRACEHDR hdr;
+/** semaphore set and number behind each name */
+static struct { int semid, num; } named[TRACE_LOCKS];
+/** the request being traced and its events, written out together */
+static struct {
+  TRACEREQ req;
+  TRACEEVENT event[TRACE_EVENTS];
+} rec;
+/** traceClock() when the request was received */
+static long long began;
+/** semaphores held by the request, for the hold times */
+static struct { int semid, num; long long at; } held[TRACE_EVENTS];
+static int numHeld;
+/** sampling state, reseeded in each child */
+static uint64_t seed;
+static pid_t seeded = -1;
+
+long long traceClock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void traceName(int semid, int num, const char *name) {
+  if(hdr.locks == 0) // index 0 collects semaphores nobody named
+	strcpy(hdr.name[hdr.locks++], "other");
+  if(hdr.locks == TRACE_LOCKS)
+	return;
+  named[hdr.locks].semid = semid;
+  named[hdr.locks].num = num;
+  strncpy(hdr.name[hdr.locks], name, sizeof(hdr.name[0]) - 1);
+  hdr.locks++;
+}
+
+bool traceOpen(const char *path, double percent) {
+  if((traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0)
+	return false;
+  if(hdr.locks == 0)
+	strcpy(hdr.name[hdr.locks++], "other");
+  rate = (uint32_t)(percent * 1000);
+  hdr.magic = TRACE_MAGIC;
+  hdr.version = TRACE_VERSION;
+  hdr.rate = rate;
+  return write(traceFd, &hdr, sizeof(hdr)) == sizeof(hdr);
+}
+
+void traceBegin(const MESSAGE &msg) {
+  tracing = false;
+  if(rate == 0)
+	return;
+  if(seeded != getpid()) { // forked children would all pick the same requests
+	seeded = getpid();
+	seed = (traceClock() ^ ((uint64_t)seeded << 32)) | 1;
+  }
+  seed ^= seed << 13; // xorshift64
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  if(seed % 100000 >= rate)
+	return;
+
+  tracing = true;
+  numHeld = 0;
+  memset(&rec.req, 0, sizeof(TRACEREQ));
+  rec.req.request = msg.request;
+  rec.req.arg = msg.buffer[0];
+  rec.req.client = msg.sender;
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  rec.req.start = t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+  began = traceClock();
+}
+
+void traceEnd() {
+  if(!tracing)
+	return;
+  tracing = false;
+  rec.req.total = traceClock() - began;
+  rec.req.pid = getpid();
+  // one write, so records of different children never interleave
+  size_t len = sizeof(TRACEREQ) + rec.req.events * sizeof(TRACEEVENT);
+  if(write(traceFd, &rec, len) != (ssize_t)len)
+	rate = 0; // disk full or similar, stop tracing in this child
+}
+
+/**
+ * @brief adds an event from start to end, merged into the last one if it
+ * is the same kind on the same semaphore
+ */
+static void addEvent(int kind, int lock, int num, long long start, long long end) {
+  long long len = end - start;
+  rec.req.spent[kind] += len;
+  TRACEEVENT *last = rec.req.events > 0 ? &rec.event[rec.req.events - 1] : NULL;
+  if(last && last->kind == kind && last->lock == lock && last->num == num) {
+	last->count++;
+	last->len = len + last->len > UINT32_MAX ? UINT32_MAX : len + last->len;
+	return;
+  }
+  if(rec.req.events == TRACE_EVENTS) {
+	rec.req.dropped++;
+	return;
+  }
+  TRACEEVENT *e = &rec.event[rec.req.events++];
+  e->kind = kind;
+  e->lock = lock;
+  e->num = num;
+  e->count = 1;
+  e->pad = 0;
+  e->at = (start - began) / 1000;
+  e->len = len > UINT32_MAX ? UINT32_MAX : len;
+}
+
+/**
+ * @brief name index of a semaphore, 0 if it was not named
+ */
+static int lockIndex(int semid, int num) {
+  for(uint32_t i=1; i < hdr.locks; i++)
+	if(named[i].semid == semid && (named[i].num == -1 || named[i].num == num))
+	  return i;
+  return 0;
+}
+
+void traceWait(int semid, int num, long long start) {
+  if(tracing)
+	addEvent(TRACE_WAIT, lockIndex(semid, num), num, start, traceClock());
+}
+
+void traceLock(int semid, int num, long long start) {
+  if(!tracing)
+	return;
+  long long t = traceClock();
+  addEvent(TRACE_WAIT, lockIndex(semid, num), num, start, t);
+  if(numHeld < TRACE_EVENTS) {
+	held[numHeld].semid = semid;
+	held[numHeld].num = num;
+	held[numHeld++].at = t;
+  }
+}
+
+void traceUnlock(int semid, int num) {
+  if(!tracing)
+	return;
+  for(int i=numHeld-1; i >= 0; i--)
+	if(held[i].semid == semid && held[i].num == num) {
+	  addEvent(TRACE_HOLD, lockIndex(semid, num), num, held[i].at, traceClock());
+	  held[i] = held[--numHeld];
+	  return;
+	}
+  // released without a traced P(), e.g. taken before the request began
+}
+
+void traceSem(key_t semid, int num, const struct timespec *waited) {
+  if(waited)
+	traceLock(semid, num, waited->tv_sec * 1000000000LL + waited->tv_nsec);
+  else
+	traceUnlock(semid, num);
+}
+
+void traceEvent(int kind, long long start) {
+  addEvent(kind, 0, 0, start, traceClock());
+}
@@ -0,0 +1,189 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3trace.hpp
+ * @brief      sampled per-request tracing: lock waits and holds, file I/O
+ *             and sends, written to a binary trace file
+ *
+ * With tracing on (server -T percent) a child decides for each request it
+ * receives whether to trace it. For a traced request it notes every wait in
+ * P() and the time until the matching V(), every read and write of the data
+ * and log files and every write to the client, each as an offset from when
+ * the request was received. When the request is done the whole record is
+ * appended to the trace file with one write. Requests that are not traced
+ * cost one random number and a few flag checks, so a low rate can stay on.
+ *
+ * The file starts with a TRACEHDR naming the semaphores, followed by one
+ * TRACEREQ per traced request, each followed by its TRACEEVENTs. p3report
+ * summarizes it.
+ */
+#ifndef P3TRACEHEADER
+#define P3TRACEHEADER
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "p3msg.hpp"
+
+/** "P3TR" */
+#define TRACE_MAGIC 0x52543350
+#define TRACE_VERSION 1
+/** semaphores that can be named */
+#define TRACE_LOCKS 16
+/** events kept per request, later ones are only counted */
+#define TRACE_EVENTS 64
+
+/** not a semaphore: a commit waiting for its turn to publish (p3mvcc.hpp) */
+#define TRACE_TURN -2
+
+/** waiting in P() */
+#define TRACE_WAIT 1
+/** holding a semaphore, from P() returning to V() */
+#define TRACE_HOLD 2
+/** reading the data file */
+#define TRACE_READ 3
+/** writing the data or log file */
+#define TRACE_WRITE 4
+/** writing to the client */
+#define TRACE_SEND 5
+/** number of event kinds, plus one */
+#define TRACE_KINDS 6
+
+/**
+ * start of the trace file
+ */
+typedef struct {
+  /** TRACE_MAGIC */
+  uint32_t magic;
+  /** TRACE_VERSION */
+  uint32_t version;
+  /** percent of requests traced, times 1000 */
+  uint32_t rate;
+  /** names in use */
+  uint32_t locks;
+  /** semaphore names, index 0 is for semaphores nobody named */
+  char name[TRACE_LOCKS][16];
+} TRACEHDR;
+
+/**
+ * one traced request, followed by its TRACEEVENTs
+ */
+typedef struct {
+  /** request number from the MESSAGE */
+  int32_t request;
+  /** its buffer[0] (record number of a display, -999 for a dump) */
+  int32_t arg;
+  /** the server process that handled it */
+  int32_t pid;
+  /** the client's pid */
+  int32_t client;
+  /** when it was received (microseconds since the epoch) */
+  int64_t start;
+  /** nanoseconds from receiving it to being done with it */
+  uint64_t total;
+  /** nanoseconds spent in each kind of event, dropped events included */
+  uint64_t spent[TRACE_KINDS];
+  /** TRACEEVENTs that follow */
+  uint16_t events;
+  /** events that did not fit */
+  uint16_t dropped;
+  /** keeps the size a multiple of 8 */
+  uint32_t pad;
+} TRACEREQ;
+
+/**
+ * one phase of a request. Back-to-back events of the same kind on the same
+ * semaphore (e.g. the sends of a dump) are merged into one.
+ */
+typedef struct {
+  /** TRACE_WAIT ... TRACE_SEND */
+  uint8_t kind;
+  /** semaphore name index for waits and holds, 0 otherwise */
+  uint8_t lock;
+  /** semaphore number within its set */
+  uint16_t num;
+  /** events merged into this one */
+  uint16_t count;
+  /** keeps events at 16 bytes */
+  uint16_t pad;
+  /** microseconds from receiving the request to the first one starting */
+  uint32_t at;
+  /** nanoseconds they took together (at most 2^32-1) */
+  uint32_t len;
+} TRACEEVENT;
+
+/** true while the current request is being traced */
+extern bool tracing;
+
+/**
+ * @brief names a semaphore for the trace. Call before traceOpen.
+ * @param semid semaphore set
+ * @param num semaphore in the set, -1 for all of them
+ */
+void traceName(int semid, int num, const char *name);
+
+/**
+ * @brief starts a trace file, replacing an old one. Call before forking.
+ * @param percent requests to trace, 0-100
+ * @return false on error
+ */
+bool traceOpen(const char *path, double percent);
+
+/**
+ * @brief decides whether to trace a request just received
+ */
+void traceBegin(const MESSAGE &msg);
+
+/**
+ * @brief writes out the request being traced, if any
+ */
+void traceEnd();
+
+/**
+ * @brief monotonic clock in nanoseconds
+ */
+long long traceClock();
+
+/**
+ * @brief notes a wait that is not followed by a hold
+ * @param start traceClock() when waiting began
+ */
+void traceWait(int semid, int num, long long start);
+
+/**
+ * @brief notes that a semaphore was acquired
+ * @param start traceClock() when waiting for it began
+ */
+void traceLock(int semid, int num, long long start);
+
+/**
+ * @brief notes that a semaphore was released
+ */
+void traceUnlock(int semid, int num);
+
+/**
+ * @brief for P() and V() in p3.hpp (semTrace)
+ * @param waited when P() started waiting, NULL for V()
+ */
+void traceSem(key_t semid, int num, const struct timespec *waited);
+
+/**
+ * @brief notes a read, write or send that began at start
+ */
+void traceEvent(int kind, long long start);
+
+/**
+ * @brief start time for a span, 0 if the request is not traced
+ */
+inline long long traceStart() {
+  return tracing ? traceClock() : 0;
+}
+
+/**
+ * @brief ends a span begun with traceStart()
+ */
+inline void traceSpan(int kind, long long start) {
+  if(tracing)
+	traceEvent(kind, start);
+}
+
+#endif
@@ -0,0 +1,475 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3xport.cpp
+ * @brief      TCP / unix domain socket / shared-memory ring transports
+ *
+ * The shared-memory link is two SPSC byte rings in a SysV segment. Readers
+ * and writers spin briefly, then sleep on the other side's counter with a
+ * futex. The waiting flags let the other side skip the wake syscall when
+ * nobody sleeps. Sleeps time out so a dead peer is noticed.
+ *
+ * A queued connection (xportQueue) keeps what the peer has not taken yet in
+ * a buffer of its own, sent with MSG_DONTWAIT (or copied into whatever room
+ * the ring has) at each write, and in full before each read.
+ */
+#include "p3xport.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+
+/** spins before sleeping on a futex */
+#define XPORT_SPIN 4000
+/** futex sleep before checking on the peer (ms) */
+#define XPORT_NAP 100
+
+/**
+ * @brief how long to spin before sleeping. Spinning only helps when the
+ * peer can run at the same time, so not at all on a single cpu.
+ */
+static int spinLimit() {
+  static int spins = -1;
+  if(spins < 0)
+	spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? XPORT_SPIN : 0;
+  return spins;
+}
+
+const char *xportUnixPath(int port) {
+  static char path[64];
+  snprintf(path, sizeof(path), "/tmp/p3.%d.sock", port);
+  return path;
+}
+
+bool xportIsLocal(const char *host) {
+  in_addr_t addr = inet_addr(host);
+  if((ntohl(addr) >> 24) == 127) return true; // loopback
+
+  struct ifaddrs *ifs, *i;
+  if(getifaddrs(&ifs) < 0) return false;
+  bool local = false;
+  for(i = ifs; i != NULL && !local; i = i->ifa_next)
+	if(i->ifa_addr && i->ifa_addr->sa_family == AF_INET)
+	  local = ((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr == addr;
+  freeifaddrs(ifs);
+  return local;
+}
+
+bool xportConnect(XPORT *x, const char *host, int port, int type) {
+  memset(x, 0, sizeof(XPORT));
+  x->shmid = -1;
+  const char *path = xportUnixPath(port);
+  if(type == XPORT_AUTO)
+	type = xportIsLocal(host) && access(path, F_OK) == 0 ? XPORT_UNIX : XPORT_TCP;
+
+  if(type == XPORT_TCP) {
+	struct sockaddr_in server = {AF_INET, htons(port), inet_addr(host)};
+	if((x->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	  return false;
+	if(connect(x->fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+	  close(x->fd);
+	  return false;
+	}
+  } else { // unix socket, also the control channel of a shm link
+	struct sockaddr_un server;
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strncpy(server.sun_path, path, sizeof(server.sun_path) - 1);
+	if((x->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	  return false;
+	if(connect(x->fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+	  close(x->fd);
+	  return false;
+	}
+	type = XPORT_UNIX; // XPORT_SHM starts after the handshake
+  }
+  x->type = type;
+  return true;
+}
+
+void xportTimeout(XPORT *x, int ms) {
+  x->timeout = ms;
+  struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+  setsockopt(x->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(x->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void xportAccept(XPORT *x, int fd, int type) {
+  memset(x, 0, sizeof(XPORT));
+  x->type = type;
+  x->fd = fd;
+  x->shmid = -1;
+  x->server = true;
+}
+
+int xportShmCreate(XPORT *x, pid_t clientPID) {
+  struct ucred peer;
+  socklen_t len = sizeof(peer);
+  if(getsockopt(x->fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) < 0)
+	return -1;
+  if((x->shmid = shmget(IPC_PRIVATE, sizeof(SHMLINK), IPC_CREAT | 0600)) < 0)
+	return -1;
+  // the socket is open to every user, so the segment goes to the one connected;
+  // as its creator the server keeps access, nobody else gets any
+  struct shmid_ds ds;
+  if(shmctl(x->shmid, IPC_STAT, &ds) == 0) {
+	ds.shm_perm.uid = peer.uid;
+	ds.shm_perm.gid = peer.gid;
+	shmctl(x->shmid, IPC_SET, &ds);
+  }
+  if((x->link = (SHMLINK *)shmat(x->shmid, 0, 0)) == (void *)-1) {
+	shmctl(x->shmid, IPC_RMID, 0);
+	x->link = NULL;
+	return x->shmid = -1;
+  }
+  memset(x->link, 0, sizeof(SHMLINK));
+  x->link->clientPID = peer.pid > 0 ? peer.pid : clientPID;
+  x->link->serverPID = getpid();
+  return x->shmid;
+}
+
+bool xportShmAttach(XPORT *x, int shmid) {
+  SHMLINK *link = (SHMLINK *)shmat(shmid, 0, 0);
+  if(link == (void *)-1)
+	return false;
+  x->link = link;
+  return true;
+}
+
+void xportShmStart(XPORT *x) {
+  xportFlush(x); // what is queued belongs on the socket
+  x->type = XPORT_SHM;
+  if(x->server && x->shmid >= 0) { // both attached, segment goes when both detach
+	shmctl(x->shmid, IPC_RMID, 0);
+	x->shmid = -1;
+  }
+}
+
+void xportShmDrop(XPORT *x) {
+  if(x->link) shmdt(x->link);
+  if(x->shmid >= 0) shmctl(x->shmid, IPC_RMID, 0);
+  x->link = NULL;
+  x->shmid = -1;
+}
+
+/**
+ * @brief sleeps until *word changes from val, the timeout runs out,
+ * or the peer goes away
+ * @return false if the link is dead
+ */
+static bool shmWait(XPORT *x, uint32_t *word, uint32_t val) {
+  struct timespec nap = {0, XPORT_NAP * 1000000L};
+  syscall(SYS_futex, word, FUTEX_WAIT, val, &nap, NULL, 0);
+  if(__atomic_load_n(&x->link->closed, __ATOMIC_ACQUIRE))
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE) != val; // drain what is left
+  pid_t peer = x->server ? x->link->clientPID : x->link->serverPID;
+  if(peer > 0 && kill(peer, 0) < 0 && errno == ESRCH)
+	return false;
+  return true;
+}
+
+/**
+ * @brief monotonic clock in ms, for shared-memory timeouts
+ */
+static long long nowMs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+/**
+ * @brief true (with errno ETIMEDOUT) once a wait that began at start has
+ * gone on longer than the connection's timeout
+ */
+static bool timedOut(XPORT *x, long long start) {
+  if(x->timeout <= 0 || nowMs() - start < x->timeout)
+	return false;
+  errno = ETIMEDOUT;
+  return true;
+}
+
+/**
+ * @brief wakes the other side if it is asleep on word
+ */
+static void shmWake(uint32_t *waiting, uint32_t *word) {
+  if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief copies as much of len bytes into a ring as it has room for
+ * @return bytes copied
+ */
+static size_t shmPut(SPSC *r, const char *buf, size_t len) {
+  uint32_t tail = r->tail;
+  size_t n = XPORT_RING - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+  if(n > len) n = len;
+  if(n == 0) return 0;
+  size_t at = tail % XPORT_RING, first = XPORT_RING - at < n ? XPORT_RING - at : n;
+  memcpy(r->data + at, buf, first);
+  memcpy(r->data, buf + first, n - first); // wrapped part
+  __atomic_store_n(&r->tail, tail + (uint32_t)n, __ATOMIC_SEQ_CST);
+  shmWake(&r->readerWaiting, &r->tail);
+  return n;
+}
+
+/**
+ * @brief copies len bytes into a ring, blocking while it is full
+ */
+static bool shmWrite(XPORT *x, SPSC *r, const char *buf, size_t len) {
+  long long start = x->timeout > 0 ? nowMs() : 0;
+  while(len > 0) {
+	uint32_t tail = r->tail;
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	for(int i=0; tail - head == XPORT_RING && i < spinLimit(); i++) {
+	  __builtin_ia32_pause();
+	  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	}
+	if(tail - head == XPORT_RING) { // full, sleep until the reader frees space
+	  __atomic_store_n(&r->writerWaiting, 1, __ATOMIC_SEQ_CST);
+	  if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == head
+		 && !shmWait(x, &r->head, head)) {
+		__atomic_store_n(&r->writerWaiting, 0, __ATOMIC_SEQ_CST);
+		return false;
+	  }
+	  __atomic_store_n(&r->writerWaiting, 0, __ATOMIC_SEQ_CST);
+	  if(__atomic_load_n(&x->link->closed, __ATOMIC_ACQUIRE) || timedOut(x, start))
+		return false;
+	  continue;
+	}
+
+	size_t n = shmPut(r, buf, len);
+	buf += n;
+	len -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief copies len bytes out of a ring, blocking while it is empty
+ */
+static bool shmRead(XPORT *x, SPSC *r, char *buf, size_t len) {
+  long long start = x->timeout > 0 ? nowMs() : 0;
+  while(len > 0) {
+	uint32_t head = r->head;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	for(int i=0; tail == head && i < spinLimit(); i++) {
+	  __builtin_ia32_pause();
+	  tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	}
+	if(tail == head) { // empty, sleep until the writer produces
+	  __atomic_store_n(&r->readerWaiting, 1, __ATOMIC_SEQ_CST);
+	  bool alive = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != head
+		|| shmWait(x, &r->tail, head);
+	  __atomic_store_n(&r->readerWaiting, 0, __ATOMIC_SEQ_CST);
+	  if(!alive || timedOut(x, start)) return false;
+	  continue;
+	}
+
+	size_t n = tail - head;
+	if(n > len) n = len;
+	size_t at = head % XPORT_RING, first = XPORT_RING - at < n ? XPORT_RING - at : n;
+	memcpy(buf, r->data + at, first);
+	memcpy(buf + first, r->data, n - first); // wrapped part
+	__atomic_store_n(&r->head, head + (uint32_t)n, __ATOMIC_SEQ_CST);
+	shmWake(&r->writerWaiting, &r->head);
+	buf += n;
+	len -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief hands the peer as much of len bytes as it takes without waiting
+ * @return bytes sent, -1 on error
+ */
+static ssize_t putNow(XPORT *x, const char *buf, size_t len) {
+  if(x->type == XPORT_SHM) {
+	if(__atomic_load_n(&x->link->closed, __ATOMIC_ACQUIRE)) {
+	  errno = EPIPE;
+	  return -1;
+	}
+	return shmPut(x->server ? &x->link->toClient : &x->link->toServer, buf, len);
+  }
+  while(true) {
+	ssize_t n = send(x->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(n < 0 && errno == EINTR) continue;
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	return n;
+  }
+}
+
+/**
+ * @brief waits up to ms (-1: a while) for the peer to make room. Errors
+ * show at the next putNow.
+ * @return false if the peer is gone
+ */
+static bool waitRoom(XPORT *x, int ms) {
+  if(x->type != XPORT_SHM) {
+	struct pollfd p = {x->fd, POLLOUT, 0};
+	poll(&p, 1, ms);
+	return true;
+  }
+  SPSC *r = x->server ? &x->link->toClient : &x->link->toServer;
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if(r->tail - head < XPORT_RING)
+	return true;
+  __atomic_store_n(&r->writerWaiting, 1, __ATOMIC_SEQ_CST);
+  bool alive = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != head || shmWait(x, &r->head, head);
+  __atomic_store_n(&r->writerWaiting, 0, __ATOMIC_SEQ_CST);
+  return alive;
+}
+
+/**
+ * @brief sends queued bytes until at most keep are left, giving up with
+ * ENOBUFS once the peer has taken nothing for XPORT_STALL_MS
+ * @return false on error
+ */
+static bool drain(XPORT *x, size_t keep) {
+  long long last = nowMs();
+  while(x->outTail - x->outHead > keep) {
+	ssize_t n = putNow(x, x->out + x->outHead, x->outTail - x->outHead);
+	if(n < 0)
+	  return false;
+	if(n > 0) {
+	  x->outHead += n;
+	  last = nowMs();
+	  continue;
+	}
+	long long left = XPORT_STALL_MS - (nowMs() - last);
+	if(left <= 0) {
+	  errno = ENOBUFS;
+	  return false;
+	}
+	if(!waitRoom(x, (int)left)) {
+	  errno = EPIPE;
+	  return false;
+	}
+  }
+  if(x->outHead == x->outTail)
+	x->outHead = x->outTail = 0;
+  return true;
+}
+
+/**
+ * @brief xportWrite on a queued connection
+ */
+static bool queueWrite(XPORT *x, const char *buf, size_t len) {
+  if(x->outHead == x->outTail) { // nothing ahead of it, the peer may take it all
+	ssize_t n = putNow(x, buf, len);
+	if(n < 0)
+	  return false;
+	buf += n;
+	len -= n;
+	if(len == 0)
+	  return true;
+  }
+  size_t room = x->outCap > len ? x->outCap - len : 0; // a larger write waits for an empty queue
+  if(x->outTail - x->outHead > room && !drain(x, room))
+	return false;
+
+  if(x->outTail + len > x->outSize) {
+	memmove(x->out, x->out + x->outHead, x->outTail - x->outHead);
+	x->outTail -= x->outHead;
+	x->outHead = 0;
+  }
+  if(x->outTail + len > x->outSize) {
+	size_t size = std::max(x->outTail + len, std::min(std::max(x->outSize * 2, (size_t)XPORT_RING), x->outCap));
+	char *out = (char *)realloc(x->out, size);
+	if(out == NULL) {
+	  errno = ENOMEM;
+	  return false;
+	}
+	x->out = out;
+	x->outSize = size;
+  }
+  memcpy(x->out + x->outTail, buf, len);
+  x->outTail += len;
+  return true;
+}
+
+void xportQueue(XPORT *x, size_t cap) {
+  x->outCap = cap;
+}
+
+bool xportFlush(XPORT *x) {
+  return drain(x, 0);
+}
+
+bool xportRead(XPORT *x, void *buf, size_t len) {
+  if(x->outTail > x->outHead && !drain(x, 0)) // the peer may be waiting for it
+	return false;
+  if(x->type == XPORT_SHM)
+	return shmRead(x, x->server ? &x->link->toServer : &x->link->toClient,
+				   (char *)buf, len);
+
+  char *p = (char *)buf;
+  while(len > 0) {
+	ssize_t n = read(x->fd, p, len);
+	if(n < 0 && errno == EINTR) continue;
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ETIMEDOUT; // SO_RCVTIMEO
+	if(n <= 0) return false;
+	p += n;
+	len -= n;
+  }
+  return true;
+}
+
+bool xportWrite(XPORT *x, const void *buf, size_t len) {
+  if(x->outCap > 0)
+	return queueWrite(x, (const char *)buf, len);
+  if(x->type == XPORT_SHM)
+	return shmWrite(x, x->server ? &x->link->toClient : &x->link->toServer,
+					(const char *)buf, len);
+
+  const char *p = (const char *)buf;
+  while(len > 0) {
+	ssize_t n = send(x->fd, p, len, MSG_NOSIGNAL); // a closed peer is an error, not SIGPIPE
+	if(n < 0 && errno == EINTR) continue;
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ETIMEDOUT; // SO_SNDTIMEO
+	if(n <= 0) return false;
+	p += n;
+	len -= n;
+  }
+  return true;
+}
+
+void xportClose(XPORT *x) {
+  if(x->link) {
+	__atomic_store_n(&x->link->closed, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &x->link->toServer.tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+	syscall(SYS_futex, &x->link->toClient.tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+	shmdt(x->link);
+	x->link = NULL;
+  }
+  if(x->shmid >= 0)
+	shmctl(x->shmid, IPC_RMID, 0);
+  if(x->fd >= 0)
+	close(x->fd);
+  x->fd = x->shmid = -1;
+  free(x->out);
+  x->out = NULL;
+  x->outHead = x->outTail = x->outSize = 0;
+}
+
+const char *xportName(int type) {
+  switch(type) {
+  case XPORT_TCP: return "tcp";
+  case XPORT_UNIX: return "unix";
+  case XPORT_SHM: return "shm";
+  }
+  return "auto";
+}
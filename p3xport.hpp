@@ -0,0 +1,188 @@
+/**
+ * @author     Chloe Kelly
+ * @file       p3xport.hpp
+ * @brief      byte transports between client and server: TCP, unix domain
+ *             socket, and a shared-memory ring for clients on the server's host
+ */
+#ifndef P3XPORTHEADER
+#define P3XPORTHEADER
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/** TCP socket */
+#define XPORT_TCP 0
+/** unix domain socket, server on the same host */
+#define XPORT_UNIX 1
+/** shared-memory SPSC rings, set up over a unix domain socket */
+#define XPORT_SHM 2
+/** pick unix if the server is on this host, TCP otherwise */
+#define XPORT_AUTO -1
+
+/** bytes in each direction of a shared-memory link */
+#define XPORT_RING 65536
+/** output queue of a server connection unless told otherwise (server -O, MB) */
+#define XPORT_QUEUE_MB 4
+/** ms a peer may take nothing from a full output queue before it is given up */
+#define XPORT_STALL_MS 5000
+
+/**
+ * single-producer single-consumer byte ring. head and tail count bytes
+ * (wrapping) and double as futex words.
+ */
+typedef struct {
+  /** bytes consumed */
+  uint32_t head;
+  /** bytes produced */
+  uint32_t tail;
+  /** consumer is (about to be) asleep on tail */
+  uint32_t readerWaiting;
+  /** producer is (about to be) asleep on head */
+  uint32_t writerWaiting;
+  /** ring data */
+  char data[XPORT_RING];
+} SPSC;
+
+/**
+ * shared memory segment holding both directions of one connection
+ */
+typedef struct {
+  /** client -> server */
+  SPSC toServer;
+  /** server -> client */
+  SPSC toClient;
+  /** client pid, used to notice a dead peer */
+  pid_t clientPID;
+  /** server (child) pid */
+  pid_t serverPID;
+  /** set by the side that closes first */
+  uint32_t closed;
+} SHMLINK;
+
+/**
+ * one client/server connection
+ */
+typedef struct {
+  /** XPORT_TCP, XPORT_UNIX or XPORT_SHM */
+  int type;
+  /** socket, still open for XPORT_SHM */
+  int fd;
+  /** shared-memory link for XPORT_SHM */
+  SHMLINK *link;
+  /** id of the link's segment until it is removed */
+  int shmid;
+  /** true on the server side of the link */
+  bool server;
+  /** ms a read or write may wait, 0 forever */
+  int timeout;
+  /** output queue (see xportQueue), bytes waiting are out[outHead, outTail) */
+  char *out;
+  size_t outHead, outTail, outSize;
+  /** most bytes the output queue holds, 0 if writes are not queued */
+  size_t outCap;
+} XPORT;
+
+/**
+ * @brief path of the server's unix domain socket for a port
+ */
+const char *xportUnixPath(int port);
+
+/**
+ * @brief true if host is one of this machine's addresses
+ */
+bool xportIsLocal(const char *host);
+
+/**
+ * @brief connects to a server
+ * @param type XPORT_TCP, XPORT_UNIX or XPORT_AUTO (XPORT_SHM starts as unix,
+ *        the caller then upgrades with xportShmAttach)
+ * @return false on error
+ */
+bool xportConnect(XPORT *x, const char *host, int port, int type);
+
+/**
+ * @brief limits how long each read or write may wait for the peer. A read
+ * or write that runs out of time fails with errno ETIMEDOUT, after which
+ * the connection should be closed.
+ * @param ms milliseconds, 0 to wait forever
+ */
+void xportTimeout(XPORT *x, int ms);
+
+/**
+ * @brief wraps an accepted socket
+ */
+void xportAccept(XPORT *x, int fd, int type);
+
+/**
+ * @brief server side: creates a shared-memory link for this connection, a
+ * unix socket. The segment is given to the user at the other end of the
+ * socket (SO_PEERCRED), mode 0600: clients of any user can attach to their
+ * own link, and only to theirs.
+ * @param clientPID pid of the client, to detect when it dies, if the
+ * socket does not tell
+ * @return shm id to give the client, -1 on error
+ */
+int xportShmCreate(XPORT *x, pid_t clientPID);
+
+/**
+ * @brief client side: attaches to the link created by the server
+ * @return false on error
+ */
+bool xportShmAttach(XPORT *x, int shmid);
+
+/**
+ * @brief switches a connection to its shared-memory link. Both sides call
+ * it once the handshake over the socket is done. The server also removes
+ * the segment id (it stays mapped until both sides detach).
+ */
+void xportShmStart(XPORT *x);
+
+/**
+ * @brief abandons a shared-memory link that was never started,
+ * the connection stays on its socket
+ */
+void xportShmDrop(XPORT *x);
+
+/**
+ * @brief reads exactly len bytes
+ * @return false on error or if the peer closed the connection
+ */
+bool xportRead(XPORT *x, void *buf, size_t len);
+
+/**
+ * @brief writes exactly len bytes
+ * @return false on error
+ */
+bool xportWrite(XPORT *x, const void *buf, size_t len);
+
+/**
+ * @brief queues the connection's writes from now on. xportWrite copies into
+ * an output queue of up to cap bytes and hands the peer what it takes
+ * without waiting, so a reply is built while locks or snapshots are held
+ * and goes out after they are let go. A write that does not fit waits for
+ * the peer to make room, but fails with errno ENOBUFS once the peer has
+ * taken nothing for XPORT_STALL_MS: a client that stops reading costs only
+ * its own connection. xportRead and xportFlush send what is left, with the
+ * same limit.
+ */
+void xportQueue(XPORT *x, size_t cap);
+
+/**
+ * @brief sends everything queued, waiting while the peer takes some of it
+ * @return false on error (errno ENOBUFS if the peer took nothing for
+ * XPORT_STALL_MS)
+ */
+bool xportFlush(XPORT *x);
+
+/**
+ * @brief closes the connection, dropping anything still queued
+ */
+void xportClose(XPORT *x);
+
+/**
+ * @brief name of a transport, for printing
+ */
+const char *xportName(int type);
+
+#endif